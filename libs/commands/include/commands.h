@@ -34,6 +34,10 @@ class CLI
     std::optional<std::string> getAppOption() const;
     std::optional<std::string> getTargetOption() const;
     std::string                detectDefaultAppName() const;
+    int                        pushPackages(const std::string& pattern, const std::string& remote);
+    // The command line with `--storage` set to the local server's store unless one was given,
+    // for the server subcommands that open a store.
+    std::vector<std::string>   serverArgs() const;
 
     int build();
     int compile();
@@ -645,8 +645,7 @@ int CLI::upload()
         remote = "leaf-server";
     if (pattern.empty())
         pattern = fs::current_path().filename().string();
-    std::vector<std::string> conanArgs = {"conan", "upload", pattern, "-r", remote, "-c"};
-    if (EasyProc::ProcessHandler::runExternalProcess(conanArgs, !isVerboseMode(), isVerboseMode()) != 0)
+    if (pushPackages(pattern, remote) != 0)
     {
         Leaf::Logger::error("Upload failed.");
         fmt::println("{}", EasyProc::ProcessHandler::getLog());
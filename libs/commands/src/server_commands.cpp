@@ -1,5 +1,5 @@
 //
-// Server commands: init, start, push, add
+// Server commands: init, start, sync, push, prefetch, add
 // Provides a built-in Conan V2 compatible package server.
 // No JFrog, no conan_server, no pip installs — just Leaf standalone binary.
 //
@@ -11,10 +11,13 @@
 #include <utils.h>
 
 #include <algorithm>
+#include <chrono>
 #include <cstdlib>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <optional>
+#include <sstream>
 #include <string>
 #include <vector>
 
@@ -33,8 +36,212 @@ std::filesystem::path getServerDir()
     return std::filesystem::path(sago::getConfigHome()) / ".leaf" / "server";
 }
 
+// The local server's store. start serves it and sync and prefetch fill it unless --storage names
+// another one, so what they bring in is what start serves and its store lock guards them.
+std::filesystem::path getDataDir()
+{
+    return getServerDir() / "data";
+}
+
+// Value of `--storage <dir>` in args, or the local server's store.
+std::filesystem::path getStorage(const std::vector<std::string>& args)
+{
+    const auto it = std::find(args.begin(), args.end(), "--storage");
+    return it != args.end() && std::next(it) != args.end() ? std::filesystem::path(*std::next(it))
+                                                           : getDataDir();
+}
+
+// URL of a configured Conan remote, from lines like "name: http://host:9300 [Verify SSL: ...]".
+std::optional<std::string> getRemoteUrl(const std::string& remote)
+{
+    if (EasyProc::ProcessHandler::runExternalProcess({"conan", "remote", "list"}) != 0)
+    {
+        return std::nullopt;
+    }
+    std::istringstream lines(EasyProc::ProcessHandler::getLog());
+    const std::string  prefix = remote + ": ";
+    for (std::string line; std::getline(lines, line);)
+    {
+        if (line.starts_with(prefix))
+        {
+            const auto url = line.substr(prefix.size());
+            return url.substr(0, url.find(' '));
+        }
+    }
+    return std::nullopt;
+}
+
+// How far pushMissingContent() got. Only a push that sent nothing may be retried with
+// 'conan upload', which would send every listed revision again.
+enum class PushOutcome
+{
+    Pushed,
+    NothingSent,
+    Incomplete
+};
+
+// Uploads only the content a leaf-server does not hold yet. Conan works out which revisions the
+// remote is missing and compresses them (`--dry-run`), writing the package list to a file of its
+// own, then server::push probes the server and sends the missing files in parallel. The remote
+// may not be able to take that path, e.g. because it is not a leaf-server or no credentials are
+// set in CONAN_LOGIN_USERNAME and CONAN_PASSWORD; the reason is logged.
+PushOutcome pushMissingContent(const std::string& pattern, const std::string& remote)
+{
+    namespace fs   = std::filesystem;
+    const auto url = getRemoteUrl(remote);
+    if (!url)
+    {
+        Leaf::Logger::warn(fmt::format("Remote '{}' is not configured.", remote));
+        return PushOutcome::NothingSent;
+    }
+
+    const auto list =
+        fs::temp_directory_path() /
+        fmt::format("leaf-push-{}.json",
+                    std::chrono::steady_clock::now().time_since_epoch().count());
+    if (EasyProc::ProcessHandler::runExternalProcess({"conan",
+                                                      "upload",
+                                                      pattern,
+                                                      "-r",
+                                                      remote,
+                                                      "-c",
+                                                      "--dry-run",
+                                                      "--format=json",
+                                                      "--out-file",
+                                                      list.string()}) != 0)
+    {
+        Leaf::Logger::warn("'conan upload --dry-run' failed:");
+        fmt::println("{}", EasyProc::ProcessHandler::getLog());
+        std::error_code ec;
+        fs::remove(list, ec);
+        return PushOutcome::NothingSent;
+    }
+
+    std::vector<std::string> args = {"leaf", "push", "--to", *url, "--list", list.string()};
+    std::vector<char*>       argv;
+    std::for_each(args.begin(),
+                  args.end(),
+                  [&argv](std::string& arg) { argv.push_back(arg.data()); });
+    argv.push_back(nullptr);
+    const int result = server::push(static_cast<int>(args.size()), argv.data());
+
+    std::error_code ec;
+    fs::remove(list, ec);
+    if (result == 0)
+    {
+        return PushOutcome::Pushed;
+    }
+    if (result == 2)
+    {
+        Leaf::Logger::error(
+            fmt::format("The push to '{}' failed after files were sent; run it again to send "
+                        "what is still missing.",
+                        remote));
+        return PushOutcome::Incomplete;
+    }
+    Leaf::Logger::warn(fmt::format("'{}' did not accept a direct push, see above.", remote));
+    return PushOutcome::NothingSent;
+}
+
+// Fills storage with every revision a dependency set needs, fetched from a remote leaf-server with
+// one bundle request per revision. Without references the set is the current project's graph as
+// `conan graph info` computes it; with references the remote resolves their closure itself for
+// the default Leaf profile, in a single request. from is the remote's URL, or empty to look up
+// the URL of the Conan remote.
+int prefetchDependencies(const std::vector<std::string>& references,
+                         const std::string&              remote,
+                         const std::string&              from,
+                         const std::filesystem::path&    storage,
+                         const std::string&              jobs)
+{
+    namespace fs   = std::filesystem;
+    const auto url = from.empty() ? getRemoteUrl(remote) : std::optional<std::string>(from);
+    if (!url)
+    {
+        Leaf::Logger::error(fmt::format("Remote '{}' is not configured.", remote));
+        return 1;
+    }
+
+    std::vector<std::string> args = {
+        "leaf", "prefetch", "--from", *url, "--storage", storage.string()};
+    if (!jobs.empty())
+    {
+        args.insert(args.end(), {"--jobs", jobs});
+    }
+    fs::path graph;
+    if (references.empty())
+    {
+        graph = fs::temp_directory_path() /
+                fmt::format("leaf-graph-{}.json",
+                            std::chrono::steady_clock::now().time_since_epoch().count());
+        if (EasyProc::ProcessHandler::runExternalProcess({"conan",
+                                                          "graph",
+                                                          "info",
+                                                          ".",
+                                                          "-r",
+                                                          remote,
+                                                          "--format=json",
+                                                          "--out-file",
+                                                          graph.string()}) != 0)
+        {
+            Leaf::Logger::error("Failed to compute the dependency graph:");
+            fmt::println("{}", EasyProc::ProcessHandler::getLog());
+            std::error_code ec;
+            fs::remove(graph, ec);
+            return 1;
+        }
+        args.insert(args.end(), {"--graph", graph.string()});
+    }
+    else
+    {
+        for (const auto& reference : references)
+        {
+            args.insert(args.end(), {"--require", reference});
+        }
+        if (fs::exists(Utils::getOSProfilePath()))
+        {
+            args.insert(args.end(), {"--profile", Utils::getOSProfilePath()});
+        }
+    }
+    std::vector<char*> argv;
+    std::for_each(args.begin(),
+                  args.end(),
+                  [&argv](std::string& arg) { argv.push_back(arg.data()); });
+    argv.push_back(nullptr);
+    const int result = server::prefetch(static_cast<int>(args.size()), argv.data());
+
+    if (!graph.empty())
+    {
+        std::error_code ec;
+        fs::remove(graph, ec);
+    }
+    return result;
+}
+
 } // namespace
 
+std::vector<std::string> CLI::serverArgs() const
+{
+    std::vector<std::string> args = _args;
+    if (std::find(args.begin(), args.end(), "--storage") == args.end())
+    {
+        args.insert(args.end(), {"--storage", getDataDir().string()});
+    }
+    return args;
+}
+
+int CLI::pushPackages(const std::string& pattern, const std::string& remote)
+{
+    const auto outcome = pushMissingContent(pattern, remote);
+    if (outcome != PushOutcome::NothingSent)
+    {
+        return outcome == PushOutcome::Pushed ? 0 : 1;
+    }
+    Leaf::Logger::info("Falling back to 'conan upload'.");
+    return EasyProc::ProcessHandler::runExternalProcess(
+        {"conan", "upload", pattern, "-r", remote, "-c"}, !isVerboseMode(), isVerboseMode());
+}
+
 int CLI::server()
 {
     const auto& positionals = _commands->getPositionals();
@@ -51,8 +258,18 @@ int CLI::server()
                    
         std::vector<std::pair<std::string, std::string>> subcommands = {
             {"init", "Initialize the server data directory in the user config home."},
-            {"start [port]", "Start the package server daemon (default port: 9300)."},
-            {"push <pattern>", "Upload compiled packages to a remote Leaf server."},
+            {"start [port]",
+             "Start the package server daemon (default port: 9300).\n"
+             "                     --upstream <url> caches a Conan v2 remote, --mirror <url>\n"
+             "                     replicates another Leaf server on a schedule."},
+            {"sync --from <url>", "Copy what is missing from another Leaf server into this one."},
+            {"push <pattern>",
+             "Upload compiled packages to a remote Leaf server, skipping content it\n"
+             "                     already holds."},
+            {"prefetch [<ref>...]",
+             "Fetch this project's whole dependency set, or the closure of the given\n"
+             "                     references, from a remote Leaf server (-r <remote> or\n"
+             "                     --from <url>) into the local one."},
             {"add <name> <url>", "Add a remote Leaf server to your Conan configuration."}
         };
 
@@ -79,7 +296,7 @@ int CLI::server()
 
     if (subcmd == "init")
     {
-        fs::create_directories(server_dir / "data");
+        fs::create_directories(getDataDir());
         Leaf::Logger::success("Server initialized at: " + server_dir.string());
         Leaf::Logger::info("Run 'leaf server start' to launch the server.");
         return 0;
@@ -87,27 +304,31 @@ int CLI::server()
 
     if (subcmd == "start")
     {
-
-        auto data_path = server_dir / "data";
-
-        // Parse port: `leaf server start 9300` or `leaf server start --port 9300`
-        std::string port = "9300";
-        if (auto port_opt = _commands->getOptionValue("port"); port_opt.has_value())
+        // Port: `leaf server start 9300` or `leaf server start --port 9300`
+        auto args = serverArgs();
+        if (!_commands->getOptionValue("port").has_value() && positionals.size() > 1)
         {
-            port = *port_opt;
+            args.insert(args.end(), {"--port", positionals[1]});
         }
-        else if (positionals.size() > 1)
-        {
-            port = positionals[1];
-        }
-        auto               argc = _args.size();
         std::vector<char*> argv;
-        std::for_each(_args.begin(),
-                      _args.end(),
-                      [&argv](const std::string& arg)
-                      { argv.push_back(const_cast<char*>(arg.c_str())); });
+        std::for_each(args.begin(),
+                      args.end(),
+                      [&argv](std::string& arg) { argv.push_back(arg.data()); });
         argv.push_back(nullptr);
-        return server::run(argc, argv.data());
+        return server::run(static_cast<int>(args.size()), argv.data());
+    }
+
+    if (subcmd == "sync")
+    {
+        // Replicates into the local data directory, which server::sync refuses to do while the
+        // local server holds it; start the server with --mirror <url> to replicate from within.
+        auto               args = serverArgs();
+        std::vector<char*> argv;
+        std::for_each(args.begin(),
+                      args.end(),
+                      [&argv](std::string& arg) { argv.push_back(arg.data()); });
+        argv.push_back(nullptr);
+        return server::sync(static_cast<int>(args.size()), argv.data());
     }
 
     if (subcmd == "push")
@@ -132,10 +353,7 @@ int CLI::server()
         }
 
         Leaf::Logger::info(fmt::format("Uploading '{}' to remote '{}'...", pattern, remote));
-        int result = EasyProc::ProcessHandler::runExternalProcess(
-            {"conan", "upload", pattern, "-r", remote, "-c"}, false, true);
-
-        if (result != 0)
+        if (pushPackages(pattern, remote) != 0)
         {
             Leaf::Logger::error("Upload failed.");
             Leaf::Logger::info("Make sure the server is running and the remote is configured:");
@@ -147,6 +365,40 @@ int CLI::server()
         return 0;
     }
 
+    if (subcmd == "prefetch")
+    {
+        // Writes into the local data directory, which server::prefetch refuses to do while the
+        // local server holds it.
+        std::string remote = "leaf-server";
+        std::string from;
+        std::string jobs;
+        for (size_t i = 0; i < _args.size(); ++i)
+        {
+            if ((_args[i] == "-r" || _args[i] == "--remote") && i + 1 < _args.size())
+            {
+                remote = _args[i + 1];
+            }
+            if (_args[i] == "--from" && i + 1 < _args.size())
+            {
+                remote = from = _args[i + 1];
+            }
+            if (_args[i] == "--jobs" && i + 1 < _args.size())
+            {
+                jobs = _args[i + 1];
+            }
+        }
+
+        const std::vector<std::string> references(positionals.begin() + 1, positionals.end());
+        Leaf::Logger::info(fmt::format("Prefetching dependencies from remote '{}'...", remote));
+        if (prefetchDependencies(references, remote, from, getStorage(_args), jobs) != 0)
+        {
+            Leaf::Logger::error("Prefetch failed.");
+            return 1;
+        }
+        Leaf::Logger::success("Dependencies prefetched.");
+        return 0;
+    }
+
     // ─── add ───
     if (subcmd == "add")
     {
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+
+namespace server
+{
+
+enum class LogLevel
+{
+    Debug,
+    Info,
+    Warning,
+    Error,
+    Off,
+};
+
+std::optional<LogLevel> parse_log_level(std::string_view text);
+std::string_view        log_level_name(LogLevel level);
+
+// Line logger that never blocks the calling thread on I/O. Producers push onto a lock-free
+// intrusive stack; a single writer thread detaches the whole stack at once, restores arrival
+// order and writes it as one batch, rotating the file to <path>.1 .. <path>.N once it exceeds the
+// size limit. When the writer falls behind by more than kMaxPending lines, new lines are dropped
+// and counted instead of queued without bound.
+class AsyncLog
+{
+  public:
+    static constexpr std::uint64_t kMaxPending = 65536;
+
+    AsyncLog() = default;
+    ~AsyncLog();
+
+    AsyncLog(const AsyncLog&)            = delete;
+    AsyncLog& operator=(const AsyncLog&) = delete;
+
+    // Starts the writer. Lines logged before open() or after close() are discarded.
+    void open(std::filesystem::path path,
+              LogLevel              level,
+              std::uint64_t         max_bytes = 10ULL * 1024ULL * 1024ULL,
+              unsigned              max_files = 3);
+
+    // Drains everything queued so far and stops the writer.
+    void close();
+
+    [[nodiscard]] bool enabled(LogLevel level) const
+    {
+        return level >= level_.load(std::memory_order_relaxed);
+    }
+
+    void write(LogLevel level, std::string line);
+
+    [[nodiscard]] std::uint64_t dropped() const
+    {
+        return dropped_.load(std::memory_order_relaxed);
+    }
+
+  private:
+    struct Node
+    {
+        std::string line;
+        Node*       next = nullptr;
+    };
+
+    void run();
+    void rotate();
+
+    std::filesystem::path path_;
+    std::uint64_t         max_bytes_ = 0;
+    unsigned              max_files_ = 0;
+
+    std::atomic<LogLevel>      level_{LogLevel::Off};
+    std::atomic<Node*>         head_{nullptr};
+    std::atomic<std::uint64_t> pending_{0};
+    std::atomic<std::uint64_t> dropped_{0};
+    std::atomic<std::uint64_t> signal_{0};
+    std::atomic<bool>          stopping_{false};
+    std::thread                writer_;
+};
+
+// The server's debug log, opened by the server for its lifetime. The storage and the remote
+// clients log through append_debug_log(), which is a no-op while it is closed.
+extern AsyncLog g_debug_log;
+
+void append_debug_log(LogLevel level, std::string line);
+
+} // namespace server
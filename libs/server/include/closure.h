@@ -0,0 +1,30 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "package_storage.h"
+
+namespace server
+{
+
+// Settings and options a closure is resolved for, as in a Conan profile. "pattern:key" entries
+// apply to the references the glob pattern matches and win over plain keys. Plain settings apply
+// to every package, plain options only to the roots, which is how Conan reads a profile.
+struct ClosureProfile
+{
+    std::map<std::string, std::string> settings;
+    std::map<std::string, std::string> options;
+};
+
+// Resolves the transitive closure of roots for profile from the packages in the store, walking
+// the [requires] of each chosen package's conaninfo.txt breadth first. The first resolution of a
+// recipe wins, so a root pins the version its dependencies would otherwise pick. Every package
+// comes with the paths it can be downloaded from, relative to the server; whatever could not be
+// resolved is listed under "missing" and the walk continues past it.
+std::string closure_json(const PackageStorage&           storage,
+                         const std::vector<std::string>& roots,
+                         const ClosureProfile&           profile);
+
+} // namespace server
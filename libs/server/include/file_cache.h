@@ -0,0 +1,96 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+namespace server
+{
+
+// In-memory contents of small stored files, which Conan clients fetch on nearly every install
+// (conanfile.py, conanmanifest.txt, conaninfo.txt). Entries live in size-bounded LRU lists
+// striped across independently locked shards, like SessionStore. Each entry carries the SHA-256
+// the caller validated it with and is only returned for that checksum, so an entry that
+// outlived its file can cost a miss but never serve stale bytes. erase() and erase_prefix()
+// release entries as soon as files are replaced or deleted.
+class FileCache
+{
+  public:
+    using Contents = std::shared_ptr<const std::string>;
+
+    struct Stats
+    {
+        std::uint64_t hits      = 0;
+        std::uint64_t misses    = 0;
+        std::uint64_t evictions = 0;
+        std::size_t   entries   = 0;
+        std::size_t   bytes     = 0;
+    };
+
+    // capacity bytes are split evenly across the shards; files over max_entry bytes, or over a
+    // shard's share, are never cached.
+    FileCache(std::size_t capacity, std::size_t max_entry);
+
+    FileCache(const FileCache&)            = delete;
+    FileCache& operator=(const FileCache&) = delete;
+
+    // True when a file of size bytes is small enough to be cached.
+    [[nodiscard]] bool accepts(std::uint64_t size) const
+    {
+        return size <= max_entry_;
+    }
+
+    // Contents stored for key under sha256, or null. Counts a hit or a miss.
+    [[nodiscard]] Contents find(const std::string& key, std::string_view sha256);
+
+    // Stores contents for key, replacing any previous entry and evicting the least recently
+    // used entries of the shard until it is back within its share of the capacity.
+    void insert(const std::string& key, std::string sha256, Contents contents);
+
+    void erase(const std::string& key);
+
+    // Drops every entry whose key starts with prefix, e.g. the files of a deleted revision. Keys
+    // are spread over all shards, so this visits every entry; deletes are rare.
+    void erase_prefix(std::string_view prefix);
+
+    [[nodiscard]] Stats stats() const;
+
+  private:
+    static constexpr std::size_t kShardCount = 16;
+
+    struct Entry
+    {
+        std::string key;
+        std::string sha256;
+        Contents    contents;
+    };
+
+    struct Shard
+    {
+        mutable std::mutex                                          mutex;
+        std::list<Entry>                                            lru; // most recent first
+        std::unordered_map<std::string, std::list<Entry>::iterator> entries;
+        std::size_t                                                 bytes = 0;
+    };
+
+    [[nodiscard]] Shard& shard_for(const std::string& key);
+
+    // Caller holds the shard lock.
+    static void remove(Shard& shard, std::list<Entry>::iterator entry);
+
+    const std::size_t              shard_capacity_;
+    const std::size_t              max_entry_;
+    std::array<Shard, kShardCount> shards_;
+    std::atomic<std::uint64_t>     hits_{0};
+    std::atomic<std::uint64_t>     misses_{0};
+    std::atomic<std::uint64_t>     evictions_{0};
+};
+
+} // namespace server
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace server
+{
+
+// Case-insensitive glob as accepted by `conan search`: '*' matches any run of characters, '?'
+// matches exactly one, everything else is literal. The pattern is compiled once into the literal
+// segments between stars; matching places each segment at its leftmost fit and never backtracks,
+// so the cost is bounded by the text length times the longest segment.
+class Glob
+{
+  public:
+    explicit Glob(std::string_view pattern);
+
+    [[nodiscard]] bool matches(std::string_view text) const;
+
+    // Lower-cased characters before the first wildcard; every match starts with it.
+    [[nodiscard]] const std::string& literal_prefix() const
+    {
+        return prefix_;
+    }
+
+    static std::string fold(std::string_view text);
+
+  private:
+    std::vector<std::string> segments_;
+    std::string              prefix_;
+    bool                     has_star_ = false;
+};
+
+} // namespace server
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+namespace server
+{
+
+// Appends value to out with JSON string escaping (no surrounding quotes). Input is scanned eight
+// bytes at a time and runs that need no escaping are copied in one append.
+void append_json_escaped(std::string& out, std::string_view value);
+
+// Builds JSON text directly into one growing buffer, inserting commas between members itself.
+// With a sink attached, the buffer is handed to the sink whenever it grows past the flush
+// threshold, so arbitrarily long listings stream in bounded memory.
+class JsonWriter
+{
+  public:
+    using Sink = std::function<bool(std::string_view)>;
+
+    explicit JsonWriter(std::size_t reserve = 4096);
+    JsonWriter(Sink sink, std::size_t flush_threshold);
+
+    JsonWriter& begin_object();
+    JsonWriter& end_object();
+    JsonWriter& begin_array();
+    JsonWriter& end_array();
+
+    JsonWriter& key(std::string_view name);
+
+    JsonWriter& value(std::string_view text);
+    JsonWriter& value(const char* text)
+    {
+        return value(std::string_view(text));
+    }
+    JsonWriter& value(const std::string& text)
+    {
+        return value(std::string_view(text));
+    }
+    JsonWriter& value(bool flag);
+    template <std::integral T>
+        requires(!std::same_as<T, bool>)
+    JsonWriter& value(T number)
+    {
+        if constexpr (std::is_signed_v<T>)
+        {
+            return integer(static_cast<std::int64_t>(number));
+        }
+        else
+        {
+            return integer(static_cast<std::uint64_t>(number));
+        }
+    }
+    JsonWriter& value(double number, int precision);
+    JsonWriter& null();
+
+    // Inserts an already serialized JSON value verbatim.
+    JsonWriter& raw(std::string_view json);
+
+    // Hands any buffered output to the sink. Returns false once the sink has refused data.
+    bool flush();
+
+    [[nodiscard]] const std::string& str() const
+    {
+        return buffer_;
+    }
+    [[nodiscard]] std::string take()
+    {
+        return std::move(buffer_);
+    }
+
+  private:
+    JsonWriter& integer(std::int64_t number);
+    JsonWriter& integer(std::uint64_t number);
+    void        separate();
+    void maybe_flush();
+
+    std::string       buffer_;
+    std::vector<bool> has_members_;
+    bool              after_key_       = false;
+    Sink              sink_;
+    std::size_t       flush_threshold_ = 0;
+    bool              sink_ok_         = true;
+};
+
+} // namespace server
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <string>
+#include <vector>
+
+namespace server
+{
+
+// Append-only record log that replaces per-directory metadata files with one sequentially
+// written file. A record is a list of text fields stored as one line with a trailing checksum,
+// so a last line torn by a crash is detected and cut off on the next open; a bad line anywhere
+// else fails the open instead. The first line carries the
+// number of live records written by the last rewrite, which is what should_compact() measures
+// growth against.
+class MetadataLog
+{
+  public:
+    using Record   = std::vector<std::string>;
+    using Emit     = std::function<void(const Record&)>;
+    using Snapshot = std::function<void(const Emit&)>;
+
+    // Appended records beyond this many (or beyond the live count, if larger) trigger compaction.
+    static constexpr std::uint64_t kCompactSlack = 4096;
+
+    MetadataLog() = default;
+    ~MetadataLog();
+
+    MetadataLog(const MetadataLog&)            = delete;
+    MetadataLog& operator=(const MetadataLog&) = delete;
+
+    // Replays every intact record of path through apply and leaves the log open for appends. A
+    // missing or empty file is created holding the records seed emits, in one atomic step.
+    [[nodiscard]] bool
+    open(const std::filesystem::path& path, const Emit& apply, const Snapshot& seed = {});
+    void close();
+
+    // Why the last open() failed, or empty.
+    [[nodiscard]] const std::string& error() const
+    {
+        return error_;
+    }
+
+    // Writes one record through to the OS. Durability is up to a later sync().
+    [[nodiscard]] bool append(const Record& record);
+
+    // Flushes everything appended so far to stable storage. Concurrent callers share one fsync.
+    [[nodiscard]] bool sync();
+
+    // Replaces the log with the records that snapshot emits, via a synced temporary file and a
+    // rename, so a crash leaves either the old or the new log in place.
+    [[nodiscard]] bool rewrite(const Snapshot& snapshot);
+
+    [[nodiscard]] bool should_compact() const;
+
+    [[nodiscard]] std::uint64_t records() const
+    {
+        return records_.load(std::memory_order_relaxed);
+    }
+
+  private:
+    [[nodiscard]] bool write_line(std::FILE* file, const Record& record);
+
+    // Writes snapshot to a temporary file and renames it over path_. Returns the record count.
+    [[nodiscard]] std::optional<std::uint64_t> replace(const Snapshot& snapshot);
+
+    std::filesystem::path path_;
+    std::mutex            append_mutex_; // orders appends and rewrites
+    std::shared_mutex     file_mutex_;   // shared by sync(), exclusive while the file is swapped
+    std::FILE*            file_ = nullptr;
+    std::string           error_;
+
+    std::atomic<std::uint64_t> records_{0};
+    std::atomic<std::uint64_t> live_{0};
+    std::atomic<std::uint64_t> written_{0};
+    std::atomic<std::uint64_t> synced_{0};
+};
+
+} // namespace server
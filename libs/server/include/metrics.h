@@ -0,0 +1,107 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace server
+{
+
+// Request counters and latency histograms in the Prometheus text exposition format. Every
+// worker thread records into its own slab of relaxed atomics, so request_finished() never
+// contends with other workers; render() sums the slabs when /metrics is scraped.
+class Metrics
+{
+  public:
+    // Upper bounds of the latency buckets, in seconds.
+    static constexpr std::array<double, 12> kLatencyBuckets = {
+        0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1.0, 5.0};
+
+    // Extra gauges appended by render(), e.g. sizes owned by other components.
+    using Gauges = std::vector<std::pair<std::string, double>>;
+
+    // Extra counters appended by render(), kept by other components; names end in _total.
+    using Counters = std::vector<std::pair<std::string, std::uint64_t>>;
+
+    // Most route labels one instance tracks; see route().
+    static constexpr std::size_t kMaxRoutes = 32;
+
+    explicit Metrics(const std::vector<std::string>& routes = {});
+
+    Metrics(const Metrics&)            = delete;
+    Metrics& operator=(const Metrics&) = delete;
+
+    void request_started()
+    {
+        in_flight_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Id of a route label for request_finished(), added on first use. Labels are the fixed names
+    // routes are registered with; beyond kMaxRoutes of them the id is one that is not recorded.
+    [[nodiscard]] std::size_t route(std::string_view label);
+
+    // Ends the in-flight count of a request that will never be recorded, e.g. because its client
+    // disconnected before a response was written.
+    void request_abandoned()
+    {
+        in_flight_.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    // Records a completed request and ends the in-flight count started by request_started().
+    void request_finished(std::size_t route, int status, std::chrono::nanoseconds latency);
+
+    void add_uploaded_bytes(std::uint64_t bytes)
+    {
+        uploaded_bytes_.fetch_add(bytes, std::memory_order_relaxed);
+    }
+    void add_downloaded_bytes(std::uint64_t bytes)
+    {
+        downloaded_bytes_.fetch_add(bytes, std::memory_order_relaxed);
+    }
+    void add_auth_failure()
+    {
+        auth_failures_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    [[nodiscard]] std::string render(const Gauges&   gauges   = {},
+                                     const Counters& counters = {}) const;
+
+  private:
+    static constexpr std::size_t kStatusClasses = 5; // 1xx .. 5xx
+
+    struct RouteCells
+    {
+        std::array<std::atomic<std::uint64_t>, kStatusClasses>             requests{};
+        std::array<std::atomic<std::uint64_t>, kLatencyBuckets.size() + 1> buckets{};
+        std::atomic<std::uint64_t>                                         latency_ns{0};
+    };
+
+    struct Slab
+    {
+        std::array<RouteCells, kMaxRoutes> cells;
+    };
+
+    Slab& local_slab();
+
+    const std::uint64_t id_;
+
+    mutable std::mutex                slabs_mutex_; // guards slabs_ and routes_
+    std::deque<std::unique_ptr<Slab>> slabs_;
+    std::vector<std::string>          routes_;
+
+    std::atomic<std::int64_t>  in_flight_{0};
+    std::atomic<std::uint64_t> uploaded_bytes_{0};
+    std::atomic<std::uint64_t> downloaded_bytes_{0};
+    std::atomic<std::uint64_t> auth_failures_{0};
+};
+
+} // namespace server
@@ -0,0 +1,465 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "file_cache.h"
+#include "glob.h"
+#include "metadata_log.h"
+#include "sha256.h"
+#include "trash_bin.h"
+
+namespace server
+{
+
+struct RevisionInfo
+{
+    std::string           revision;
+    std::string           time;
+    std::filesystem::path path;
+};
+
+struct RecipeRef
+{
+    std::string name;
+    std::string version;
+    std::string user;
+    std::string channel;
+
+    auto operator<=>(const RecipeRef&) const = default;
+};
+
+std::string ref_string(const RecipeRef& ref);
+
+// "name/version" or "name/version@user/channel"; user and channel default to "_".
+std::optional<RecipeRef> parse_reference(std::string_view reference);
+
+bool is_safe_path_segment(std::string_view value);
+
+std::string trim(std::string value);
+
+std::tm to_utc(std::time_t time);
+
+std::string random_token(std::size_t length);
+
+std::filesystem::path platform_fs_path(const std::filesystem::path& input);
+
+// True for the temporary name StagedFile writes an upload under, "<file>.upload-<token>".
+// A stored file may still be named like one, e.g. "notes.upload-v2.txt".
+bool is_upload_temp_file(const std::string& file_name);
+
+// Exclusive claim on a storage root. `leaf server start`, `sync` and `prefetch` all append to
+// the store's metadata.log, so only one of them may have it open at a time. The claim is an OS
+// lock on an open file rather than the file's existence, so it ends with the holding process
+// and a crash never leaves a stale one behind.
+class StoreLock
+{
+  public:
+    StoreLock() = default;
+
+    ~StoreLock();
+
+    StoreLock(const StoreLock&)            = delete;
+    StoreLock& operator=(const StoreLock&) = delete;
+
+    // False when another process (or another PackageStorage in this one) holds the lock.
+    [[nodiscard]] bool acquire(const std::filesystem::path& file);
+
+    void release();
+
+    [[nodiscard]] bool held() const;
+
+  private:
+    int fd_ = -1;
+};
+
+bool ensure_parent_dir(const std::filesystem::path& file);
+
+// An upload target that is written under a temporary name and only renamed into place by
+// commit(), after the data has been fsynced. Readers therefore never observe a partially written
+// artifact, and an aborted upload leaves nothing behind. The temporary file lives next to its
+// destination unless the caller names another directory on the same filesystem.
+class StagedFile
+{
+  public:
+    explicit StagedFile(std::filesystem::path destination);
+
+    StagedFile(std::filesystem::path destination, const std::filesystem::path& temp_dir);
+
+    StagedFile(const StagedFile&)            = delete;
+    StagedFile& operator=(const StagedFile&) = delete;
+
+    ~StagedFile();
+
+    [[nodiscard]] bool open();
+
+    [[nodiscard]] bool write(const char* data, std::size_t length);
+
+    // Flushes and closes the temp file. Safe to call more than once; commit() calls it too, but
+    // callers that take locks before publishing should finish() first to keep fsync outside them.
+    [[nodiscard]] bool finish();
+
+    [[nodiscard]] bool commit();
+
+    [[nodiscard]] bool commit_as(const std::filesystem::path& target);
+
+    [[nodiscard]] const std::filesystem::path& destination() const;
+
+    [[nodiscard]] std::uint64_t size() const;
+
+    [[nodiscard]] const std::string& sha256();
+
+  private:
+    void discard();
+
+    std::filesystem::path destination_;
+    std::filesystem::path temp_;
+    std::FILE*            file_ = nullptr;
+    Sha256                hasher_;
+    std::string           digest_;
+    std::uint64_t         size_      = 0;
+    bool                  finished_  = false;
+    bool                  committed_ = false;
+};
+
+struct FileChecksum
+{
+    std::string   sha256;
+    std::uint64_t size     = 0;
+    std::int64_t  modified = 0; // unix seconds of the upload that produced this content
+};
+
+using ChecksumMap = std::map<std::string, FileChecksum>;
+
+// Hashes a file that predates checksum bookkeeping so it can still be served with an ETag.
+std::optional<FileChecksum> checksum_existing_file(const std::filesystem::path& file);
+
+struct DedupStats
+{
+    bool          enabled       = false;
+    std::uint64_t blobs         = 0;
+    std::uint64_t stored_bytes  = 0;
+    std::uint64_t logical_bytes = 0;
+};
+
+struct IndexStats
+{
+    std::size_t recipes           = 0;
+    std::size_t recipe_revisions  = 0;
+    std::size_t packages          = 0;
+    std::size_t package_revisions = 0;
+    // Sum of the recorded sizes of every stored file, before deduplication.
+    std::uint64_t bytes = 0;
+};
+
+struct RecipeSummary
+{
+    RecipeRef                   ref;
+    std::string                 reference;
+    std::size_t                 revisions = 0;
+    std::optional<RevisionInfo> latest;
+    std::uint64_t               bytes = 0;
+};
+
+class BlobStore;
+class StorageIndex;
+
+class PackageStorage
+{
+  public:
+    explicit PackageStorage(std::filesystem::path root);
+
+    ~PackageStorage();
+
+    void set_dedup(bool enabled);
+
+    // Keeps small files in memory for handle_file_get(); see FileCache. Call before serving.
+    void set_file_cache(std::size_t capacity, std::size_t max_entry);
+
+    [[nodiscard]] FileCache* file_cache() const;
+
+    // Rendered package_search_json() fragments keyed by package revision directory and validated
+    // against the conaninfo.txt checksum in the index, so a re-upload misses without touching the
+    // filesystem. Bounded like the file cache; removals drop the entries of their revisions.
+    [[nodiscard]] FileCache& search_cache();
+
+    [[nodiscard]] std::filesystem::path root() const;
+    [[nodiscard]] std::filesystem::path config_path() const;
+
+    [[nodiscard]] std::filesystem::path recipe_base(const RecipeRef& ref) const;
+
+    [[nodiscard]] std::filesystem::path
+    recipe_revision_path(const RecipeRef& ref, std::string_view revision) const;
+
+    [[nodiscard]] std::filesystem::path
+    recipe_files_path(const RecipeRef& ref, std::string_view revision) const;
+
+    [[nodiscard]] std::filesystem::path
+    package_revision_path(const RecipeRef& ref,
+                          std::string_view recipe_revision,
+                          std::string_view package_id,
+                          std::string_view package_revision) const;
+
+    [[nodiscard]] std::filesystem::path package_files_path(const RecipeRef& ref,
+                                                           std::string_view recipe_revision,
+                                                           std::string_view package_id,
+                                                           std::string_view package_revision) const;
+
+    void ensure_layout() const;
+
+    [[nodiscard]] std::filesystem::path metadata_log_path() const;
+
+    // Why load_index() failed, when metadata.log was the reason.
+    [[nodiscard]] const std::string& load_error() const;
+
+    // Claims the store for this process until it is destroyed; see StoreLock. load_index() takes
+    // the claim as well, so calling this first only serves to report a busy store on its own.
+    [[nodiscard]] bool lock();
+
+    // Replaces the in-memory index with the contents of metadata.log. A store that predates the
+    // log is imported once instead: its recipes/ tree is walked in the baseline layout, with
+    // upload times from each revision.json and checksums hashed from the files themselves, and
+    // the result written out as the initial log. revision.json is not read again after that.
+    [[nodiscard]] bool load_index();
+
+    // Where uploads in progress keep their temporary files. It is apart from every revision and
+    // staging directory, so a staging area can be renamed into place while other files are still
+    // being received.
+    [[nodiscard]] std::filesystem::path incoming_path() const;
+
+    // Files of a revision that is not published yet go to a staging area of its own under
+    // staging/. Once that holds the manifest files a Conan client uploads last, the area is
+    // renamed to <revision>/files and the revision is indexed with all of its files in a single
+    // metadata.log record, so listings and downloads never see part of a revision. Files sent to
+    // a published revision replace their predecessors one by one, as before.
+    bool store_recipe_file(const RecipeRef&                  ref,
+                           const std::string&                revision,
+                           const std::string&                file_name,
+                           StagedFile&                       staged,
+                           const std::optional<std::string>& time = std::nullopt);
+
+    bool store_package_file(const RecipeRef&                  ref,
+                            const std::string&                recipe_revision,
+                            const std::string&                package_id,
+                            const std::string&                package_revision,
+                            const std::string&                file_name,
+                            StagedFile&                       staged,
+                            const std::optional<std::string>& time = std::nullopt);
+
+    // Publishes whatever is staged for a revision, for callers that know they stored all of its
+    // files. True when the revision is published afterwards.
+    bool publish_recipe_revision(const RecipeRef& ref, const std::string& revision);
+
+    bool publish_package_revision(const RecipeRef&   ref,
+                                  const std::string& recipe_revision,
+                                  const std::string& package_id,
+                                  const std::string& package_revision);
+
+    // Checksum of a stored file as recorded at upload time. A file that appeared on disk without
+    // an upload since startup is hashed once on first request and recorded from then on.
+    [[nodiscard]] std::optional<FileChecksum> recipe_file_checksum(const RecipeRef&   ref,
+                                                                   const std::string& revision,
+                                                                   const std::string& file_name);
+
+    [[nodiscard]] std::optional<FileChecksum>
+    package_file_checksum(const RecipeRef&   ref,
+                          const std::string& recipe_revision,
+                          const std::string& package_id,
+                          const std::string& package_revision,
+                          const std::string& file_name);
+
+    bool remove_recipe_revision(const RecipeRef& ref, const std::string& revision);
+
+    bool remove_package_revision(const RecipeRef&   ref,
+                                 const std::string& recipe_revision,
+                                 const std::string& package_id,
+                                 const std::string& package_revision);
+
+    // Removes every recipe revision beyond the newest keep_recipe_revisions of each reference, and
+    // every package revision older than package_max_age_days except the latest of its package.
+    // Returns the number of revisions removed; their files go to the trash like any delete.
+    std::size_t
+    apply_retention(std::size_t keep_recipe_revisions, std::uint64_t package_max_age_days);
+
+    // Drops unpublished revisions that have not received a file for max_idle, e.g. uploads the
+    // client gave up on, so neither their pending entry nor their staging area outlives them.
+    // Returns the number of revisions dropped; their files go to the trash like any delete.
+    std::size_t discard_stale_staging(std::chrono::seconds max_idle);
+
+    // Deletes trashed revisions; see TrashBin::reclaim().
+    std::size_t reclaim_trash(std::size_t files_per_second, const TrashBin::Pause& pause);
+
+    [[nodiscard]] std::size_t trash_pending() const;
+
+    [[nodiscard]] DedupStats dedup_stats() const;
+
+    [[nodiscard]] IndexStats index_stats() const;
+
+    // Every revision and file record, in metadata.log field order.
+    void manifest(const MetadataLog::Emit& emit) const;
+
+    // Path of a published file whose content has the given sha256, if the store holds one.
+    [[nodiscard]] std::optional<std::filesystem::path>
+    content_path(const std::string& sha256) const;
+
+    [[nodiscard]] std::uint64_t recipe_bytes(const RecipeRef& ref) const;
+
+    [[nodiscard]] bool has_recipe_revision(const RecipeRef& ref, const std::string& revision) const;
+
+    [[nodiscard]] bool has_package_revision(const RecipeRef&   ref,
+                                            const std::string& recipe_revision,
+                                            const std::string& package_id,
+                                            const std::string& package_revision) const;
+
+    [[nodiscard]] std::vector<RevisionInfo> list_recipe_revisions(const RecipeRef& ref) const;
+
+    [[nodiscard]] std::optional<RevisionInfo> latest_recipe_revision(const RecipeRef& ref) const;
+
+    [[nodiscard]] std::optional<RevisionInfo>
+    latest_package_revision(const RecipeRef&   ref,
+                            const std::string& recipe_revision,
+                            const std::string& package_id) const;
+
+    [[nodiscard]] std::vector<std::string>
+    list_package_ids(const RecipeRef& ref, const std::string& recipe_revision) const;
+
+    [[nodiscard]] std::vector<RevisionInfo>
+    list_package_revisions(const RecipeRef&   ref,
+                           const std::string& recipe_revision,
+                           const std::string& package_id) const;
+
+    [[nodiscard]] std::vector<std::string> list_files(const std::filesystem::path& files_dir) const;
+
+    [[nodiscard]] std::vector<RecipeRef> list_recipe_refs() const;
+
+    [[nodiscard]] std::vector<RecipeRef> list_recipe_versions(const std::string& name) const;
+
+    [[nodiscard]] std::vector<std::string> search_recipe_refs(const Glob& glob) const;
+
+    [[nodiscard]] std::vector<RecipeSummary>
+    recipes_by_name(const std::string& needle, const std::string& after, std::size_t limit) const;
+
+    [[nodiscard]] std::vector<RecipeSummary>
+    recipes_by_update(const std::string&                         needle,
+                      const std::pair<std::string, std::string>& after,
+                      std::size_t                                limit) const;
+
+    [[nodiscard]] ChecksumMap
+    recipe_file_list(const RecipeRef& ref, const std::string& revision) const;
+
+    [[nodiscard]] ChecksumMap package_file_list(const RecipeRef&   ref,
+                                                const std::string& recipe_revision,
+                                                const std::string& package_id,
+                                                const std::string& package_revision) const;
+
+  private:
+    // Files a Conan client uploads last; a revision is published once its staging area has them.
+    static constexpr std::array<std::string_view, 2> kRecipeManifestFiles = {"conanfile.py",
+                                                                           "conanmanifest.txt"};
+    static constexpr std::array<std::string_view, 3> kPackageManifestFiles = {
+        "conan_package.tgz", "conaninfo.txt", "conanmanifest.txt"};
+    // A search fragment is a few hundred bytes of settings and options per package revision.
+    static constexpr std::size_t kSearchCacheBytes    = 8 * 1024 * 1024;
+    static constexpr std::size_t kSearchCacheMaxEntry = 64 * 1024;
+
+    struct PendingRevision
+    {
+        std::filesystem::path                 dir; // staging/<token>, holding the files so far
+        ChecksumMap                           files;
+        std::optional<std::string>            time;
+        std::chrono::steady_clock::time_point touched; // when a file last arrived
+    };
+
+    // Drop cached contents of a replaced file, or of every file of a removed revision.
+    void forget_cached_file(const std::filesystem::path& file);
+
+    void forget_cached_revision(const std::filesystem::path& revision_dir);
+
+    // Serializes replacing a file within one revision directory without a storage-wide lock.
+    std::mutex& revision_lock(const std::filesystem::path& revision_dir);
+
+    // Publishes staged at target and hands its checksum to record. The caller holds the revision
+    // lock, so the indexed previous version is the one actually being replaced.
+    template <typename Find, typename Record>
+    bool store_file(const std::filesystem::path& target,
+                    StagedFile&                  staged,
+                    Find                         find_previous,
+                    Record                       record);
+
+    // Adds staged to the staging area of an unpublished revision. Caller holds the revision lock,
+    // which is the only thing that touches a pending entry besides the map itself.
+    bool stage_file(const std::filesystem::path&      revision_dir,
+                    const std::string&                file_name,
+                    StagedFile&                       staged,
+                    const std::optional<std::string>& time);
+
+    [[nodiscard]] bool staging_holds(const std::filesystem::path&      revision_dir,
+                                     std::span<const std::string_view> file_names);
+
+    // Renames the staging area of revision_dir to <revision_dir>/files and hands back what it
+    // held. Caller holds the revision lock.
+    std::optional<PendingRevision> take_staged(const std::filesystem::path& revision_dir);
+
+    bool publish_staged_recipe(const RecipeRef& ref, const std::string& revision);
+
+    bool publish_staged_package(const RecipeRef&   ref,
+                                const std::string& recipe_revision,
+                                const std::string& package_id,
+                                const std::string& package_revision);
+
+    std::optional<FileChecksum>
+    backfill_checksum(const std::filesystem::path& revision_dir, const std::string& file_name);
+
+    // Makes journaled index changes durable before the caller acknowledges them, and compacts
+    // the log once it has grown past its live size.
+    bool persist();
+
+    // Hashes every file of a revision imported from a store that predates metadata.log.
+    [[nodiscard]] ChecksumMap import_checksums(const std::filesystem::path& revision_dir) const;
+
+    [[nodiscard]] std::vector<FileChecksum>
+    linked_blobs(const std::filesystem::path& revision_dir, const ChecksumMap& files) const;
+
+    void release_blobs(const std::vector<FileChecksum>& linked);
+
+    void load_recipe_into_index(const RecipeRef& ref);
+
+    std::filesystem::path                            root_;
+    StoreLock                                        lock_; // declared early so it is released last
+    std::unique_ptr<StorageIndex>                    index_;
+    std::unique_ptr<BlobStore>                       blobs_;
+    TrashBin                                         trash_;
+    MetadataLog                                      journal_;
+    std::mutex                                       compact_mutex_;
+    bool                                             dedup_ = false;
+    std::array<std::mutex, 64>                       revision_locks_;
+    std::mutex                                       pending_mutex_;
+    // Unpublished revisions by revision dir.
+    std::map<std::filesystem::path, PendingRevision> pending_;
+    std::unique_ptr<FileCache>                       file_cache_;
+    FileCache                                        search_cache_;
+};
+
+std::optional<std::string> read_small_file(const std::filesystem::path& file);
+
+std::map<std::string, std::map<std::string, std::string>>
+parse_ini_sections(const std::string& content);
+
+// Fills staged with a copy of a file the store already holds.
+bool copy_into(const std::filesystem::path& source, StagedFile& staged);
+
+} // namespace server
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "package_storage.h"
+#include "upstream.h"
+
+namespace server
+{
+
+struct PrefetchStats
+{
+    std::size_t   revisions = 0; // revisions fetched and published
+    std::size_t   held      = 0; // revisions the store already had
+    std::uint64_t bytes     = 0; // file bytes received
+    std::size_t   failed    = 0; // revisions left missing
+};
+
+// A revision a dependency graph needs: a recipe revision, and the package revision of it when a
+// binary is expected to exist.
+struct PrefetchTarget
+{
+    RecipeRef   ref;
+    std::string revision;
+    std::string package_id; // empty when only the recipe is needed
+    std::string package_revision;
+};
+
+// Fills a store with a whole dependency set from a leaf-server, one /api/bundle request per
+// revision instead of one per file. Targets are fetched by a bounded number of workers; the
+// targets of one recipe revision go to the same worker, so its recipe files arrive once and the
+// recipe is published before any of its packages. Each bundle is staged in full and checked
+// against its bundle.json before anything is stored.
+class Prefetcher
+{
+  public:
+    // Largest bundle.json accepted; a listing of a few thousand files stays far below it.
+    static constexpr std::size_t kMaxBundleManifest = 16 * 1024 * 1024;
+
+    Prefetcher(PackageStorage&    storage,
+               const std::string& url,
+               std::string        user,
+               std::string        password,
+               std::size_t        jobs);
+
+    // Asks the server for the closure of request (see /api/closure). Nothing on failure.
+    [[nodiscard]] std::optional<std::string> closure(const std::string& request) const;
+
+    PrefetchStats prefetch(const std::vector<PrefetchTarget>& targets);
+
+  private:
+    struct BundleFile
+    {
+        std::string                 name;
+        bool                        recipe = true;
+        std::unique_ptr<StagedFile> staged;
+    };
+
+    [[nodiscard]] httplib::Client connect() const;
+
+    [[nodiscard]] bool held(const PrefetchTarget& target) const;
+
+    bool fetch(httplib::Client& client, const PrefetchTarget& target, PrefetchStats& result);
+
+    PackageStorage& storage_;
+    Upstream        source_;
+    std::string     user_;
+    std::string     password_;
+    std::size_t     jobs_;
+};
+
+// Revisions a dependency graph needs, read from the file `conan graph info --format=json
+// --out-file` writes. Nodes without a recipe revision, such as the consumer conanfile, are left
+// out; a node without a package revision contributes its recipe only. Returns nothing when text
+// is not a graph.
+std::optional<std::vector<PrefetchTarget>> parse_graph(std::string_view text);
+
+// Revisions to prefetch from a closure_json() response, and the requirements it could not resolve.
+std::optional<std::pair<std::vector<PrefetchTarget>, std::vector<std::string>>>
+parse_closure(std::string_view text);
+
+} // namespace server
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <future>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <string>
+
+#include "package_storage.h"
+#include "upstream.h"
+
+namespace server
+{
+
+// Pull-through cache mode. A revision missing locally is copied from the upstream remote in full,
+// stored exactly like an upload with the upstream revision time, and then served by the regular
+// local routes; anything already present is never re-fetched. Concurrent misses for the same
+// revision wait for the one fetch in flight instead of each going upstream.
+class PullThrough
+{
+  public:
+    PullThrough(PackageStorage& storage, const std::string& url);
+
+    // Upstream answer for a listing the store has nothing for, passed through without storing.
+    [[nodiscard]] std::optional<std::string> listing(const std::string& path);
+
+    bool latest_recipe(const RecipeRef& ref);
+
+    bool recipe_revision(const RecipeRef& ref, const std::string& revision);
+
+    bool latest_package(const RecipeRef&   ref,
+                        const std::string& recipe_revision,
+                        const std::string& package_id);
+
+    bool package_revision(const RecipeRef&   ref,
+                          const std::string& recipe_revision,
+                          const std::string& package_id,
+                          const std::string& package_revision);
+
+  private:
+    static std::string recipe_path(const RecipeRef& ref);
+
+    static std::string package_path(const RecipeRef&   ref,
+                                    const std::string& recipe_revision,
+                                    const std::string& package_id);
+
+    template <typename Fetch>
+    bool coalesce(const std::string& key, Fetch fetch);
+
+    std::optional<std::string> latest_revision(const std::string& path);
+
+    // Downloads every file of base/revisions/<revision> into staged files first, so nothing is
+    // published unless the whole revision arrived, then stores them with the upstream time.
+    template <typename Destination, typename Store>
+    bool copy_revision(const std::string& base,
+                       const std::string& revision,
+                       Destination        destination,
+                       Store              store);
+
+    PackageStorage&                                 storage_;
+    Upstream                                        upstream_;
+    std::mutex                                      mutex_;
+    std::map<std::string, std::shared_future<bool>> inflight_;
+};
+
+// Resolves "latest" or an explicit recipe revision, copying it from the upstream remote first
+// when the store does not hold it.
+std::optional<RevisionInfo> resolve_recipe_revision(PackageStorage&    storage,
+                                                    PullThrough*       upstream,
+                                                    const RecipeRef&   ref,
+                                                    const std::string& revision);
+
+std::optional<RevisionInfo> resolve_package_revision(PackageStorage&    storage,
+                                                     PullThrough*       upstream,
+                                                     const RecipeRef&   ref,
+                                                     const std::string& recipe_revision,
+                                                     const std::string& package_id,
+                                                     const std::string& revision);
+
+} // namespace server
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "package_storage.h"
+#include "upstream.h"
+
+namespace server
+{
+
+struct PushStats
+{
+    std::size_t   revisions = 0; // revisions whose files all reached the server
+    std::size_t   uploaded  = 0; // files sent in full
+    std::size_t   deployed  = 0; // files the server already held, deployed by checksum
+    std::uint64_t bytes     = 0; // bytes sent
+    std::size_t   failed    = 0; // revisions left incomplete
+};
+
+// One revision of the local Conan cache, with the local path of each file it is uploaded as.
+struct PushRevision
+{
+    RecipeRef                                    ref;
+    std::string                                  revision;
+    std::string                                  package_id; // empty for a recipe revision
+    std::string                                  package_revision;
+    std::map<std::string, std::filesystem::path> files;
+};
+
+// Uploads revisions to a leaf-server, sending only content the server does not hold yet. Every
+// file is hashed locally and the digests are sent to /api/sync/probe in batches; files whose
+// content the server already has, or that this push already sent, are deployed by checksum and
+// the rest are streamed in full.
+// Revisions are uploaded by a bounded number of workers, recipe revisions before package
+// revisions, and each revision's conanmanifest.txt goes last so the server publishes it complete.
+class Pusher
+{
+  public:
+    static constexpr std::size_t kProbeBatch = 1000;
+
+    Pusher(const std::string& url, std::string user, std::string password, std::size_t jobs);
+
+    // Returns nothing when the server could not be probed.
+    std::optional<PushStats> push(const std::vector<PushRevision>& revisions);
+
+  private:
+    [[nodiscard]] httplib::Client connect() const;
+
+    // Runs work(client, index) for every index below count on up to jobs_ threads, each with its
+    // own connection.
+    template <typename Work>
+    void parallel(std::size_t count, Work work);
+
+    bool upload(httplib::Client& client, const PushRevision& revision, PushStats& result);
+
+    [[nodiscard]] bool held(const std::string& sha256);
+
+    Upstream                                                     remote_;
+    std::string                                                  user_;
+    std::string                                                  password_;
+    std::size_t                                                  jobs_;
+    // Filled before the workers run.
+    std::map<std::filesystem::path, std::optional<FileChecksum>> checksums_;
+    std::mutex                                                   held_mutex_;
+    // Probed or uploaded by this push.
+    std::set<std::string>                                        held_;
+};
+
+// Revisions to push, read from the package list `conan upload --dry-run --format=json` writes.
+// Revisions conan found on the remote already are left out, and so are files whose names cannot
+// be stored. Returns nothing when text is not a package list.
+std::optional<std::vector<PushRevision>> parse_package_list(std::string_view text);
+
+} // namespace server
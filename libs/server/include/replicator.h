@@ -0,0 +1,86 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "metadata_log.h"
+#include "package_storage.h"
+#include "upstream.h"
+
+namespace server
+{
+
+struct SyncStats
+{
+    std::size_t   revisions  = 0; // revisions that received at least one file
+    std::size_t   downloaded = 0; // files fetched from the source
+    std::size_t   copied     = 0; // files whose content was already held locally
+    std::uint64_t bytes      = 0; // bytes fetched from the source
+    std::size_t   failed     = 0; // revisions left incomplete, retried by the next pass
+};
+
+// Replicates another leaf-server into this store. Each pass diffs the source's manifest against
+// the local one and transfers only the files that are missing or differ; content the store
+// already holds under some other revision is copied locally instead of downloaded. Revisions are
+// transferred in parallel by a bounded number of workers, recipe revisions before package
+// revisions, and each one is staged in full before any of its files is stored. Nothing local is
+// ever deleted.
+class Replicator
+{
+  public:
+    Replicator(PackageStorage& storage, const std::string& url, std::size_t jobs);
+
+    // Runs one pass. Returns nothing when the source manifest could not be fetched.
+    std::optional<SyncStats> pass();
+
+  private:
+    struct ManifestFile
+    {
+        RecipeRef    ref;
+        std::string  revision;
+        std::string  package_id; // empty for a recipe file
+        std::string  package_revision;
+        std::string  name;
+        FileChecksum checksum;
+        std::string  key; // record fields up to and including the file name
+    };
+
+    struct Transfer
+    {
+        RecipeRef                                         ref;
+        std::string                                       revision;
+        std::string                                       package_id;
+        std::string                                       package_revision;
+        std::optional<std::string>                        time;
+        std::vector<std::pair<std::string, FileChecksum>> files;
+    };
+
+    static MetadataLog::Record split_fields(std::string_view line);
+
+    static std::string join_fields(std::span<const std::string> fields);
+
+    // An rfile/pfile record whose names are all safe to use as paths, otherwise nothing.
+    static std::optional<ManifestFile> parse_file(const MetadataLog::Record& record);
+
+    [[nodiscard]] std::filesystem::path files_dir(const RecipeRef&   ref,
+                                                  const std::string& revision,
+                                                  const std::string& package_id,
+                                                  const std::string& package_revision) const;
+
+    void run_batch(const std::vector<Transfer*>& batch, SyncStats& stats);
+
+    bool transfer(httplib::Client& client, const Transfer& transfer, SyncStats& result);
+
+    PackageStorage& storage_;
+    Upstream        source_;
+    std::size_t     jobs_;
+};
+
+} // namespace server
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace server
+{
+
+// Segment trie for a family of request paths. A pattern is a '/'-separated list of literal
+// segments and "*" placeholders, each of which captures one non-empty segment. match() splits
+// the path once and walks the trie a segment at a time, so the cost follows the path length
+// rather than the number of routes. A literal child is tried before the placeholder at the same
+// depth, and the placeholder only when the literal branch dead-ends.
+class RouteTrie
+{
+  public:
+    static constexpr std::size_t kMaxSegments = 16;
+
+    struct Match
+    {
+        std::size_t                                route = 0; // id returned by add()
+        std::size_t                                count = 0; // number of captures
+        std::array<std::string_view, kMaxSegments> captures;
+        bool                                       safe = true; // every capture is a safe segment
+
+        [[nodiscard]] std::string_view operator[](std::size_t index) const
+        {
+            return captures[index];
+        }
+    };
+
+    // Adds pattern and returns its route id; ids count up from 0 in the order routes are added.
+    // Adding a pattern twice returns the id it already has.
+    std::size_t add(std::string_view pattern);
+
+    // The route path matches, with the captured segments. A capture that could escape a storage
+    // directory ("..", '\\') still matches, with safe cleared, so callers can answer 400.
+    [[nodiscard]] std::optional<Match> match(std::string_view path) const;
+
+    // Same rule the storage layer applies to every path component it builds from a request.
+    [[nodiscard]] static bool is_safe_segment(std::string_view segment);
+
+  private:
+    static constexpr std::uint32_t kNone = UINT32_MAX;
+
+    using Segments = std::array<std::string_view, kMaxSegments>;
+
+    struct Node
+    {
+        std::vector<std::pair<std::string, std::uint32_t>> literals; // segment, child node
+        std::uint32_t                                       capture = kNone;
+        std::uint32_t                                       route   = kNone;
+    };
+
+    [[nodiscard]] bool walk(std::uint32_t   node,
+                            const Segments& segments,
+                            std::size_t     size,
+                            std::size_t     depth,
+                            Match&          match) const;
+
+    std::vector<Node> nodes_{Node{}};
+    std::size_t       routes_ = 0;
+};
+
+} // namespace server
@@ -1,8 +1,45 @@
 #pragma once
 
+#include <memory>
+#include <string>
+#include <vector>
+
 namespace server
 {
 
 int run(int argc, char** argv);
 
+// A server started in-process with run()'s arguments (`--port 0` picks a free port), serving on
+// a thread of its own until stop() or destruction. Used by the tests.
+class Instance
+{
+  public:
+    explicit Instance(std::vector<std::string> args);
+    ~Instance();
+
+    Instance(const Instance&)            = delete;
+    Instance& operator=(const Instance&) = delete;
+
+    // The port being served, or 0 when the server failed to start or has stopped.
+    [[nodiscard]] int port() const;
+
+    void stop();
+
+  private:
+    struct State;
+    std::unique_ptr<State> state_;
+};
+
+// One replication pass from another leaf-server (`--from <url>`) into a local store.
+int sync(int argc, char** argv);
+
+// Uploads the revisions of a `conan upload --dry-run --format=json` package list (`--list <file>`)
+// to a leaf-server (`--to <url>`), sending only files whose content the server does not hold.
+// Returns 1 when it failed without sending anything and 2 when it failed after sending files.
+int push(int argc, char** argv);
+
+// Fetches every revision of a `conan graph info --format=json` graph (`--graph <file>`) from a
+// leaf-server (`--from <url>`) into a local store, one bundle request per revision.
+int prefetch(int argc, char** argv);
+
 }
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+namespace server
+{
+
+struct Session
+{
+    std::string                           username;
+    std::string                           token;
+    std::chrono::system_clock::time_point expires_at;
+};
+
+// Bearer sessions striped across independently locked shards, so logins and authenticated
+// requests from the worker pool only contend when their tokens hash to the same shard. Expired
+// sessions are never returned and are reclaimed by sweep(), which the optional background
+// sweeper runs periodically.
+class SessionStore
+{
+  public:
+    using Clock = std::chrono::system_clock;
+
+    SessionStore() = default;
+    ~SessionStore();
+
+    SessionStore(const SessionStore&)            = delete;
+    SessionStore& operator=(const SessionStore&) = delete;
+
+    void insert(Session session);
+
+    // Username owning token, or nullopt when unknown or expired at now.
+    [[nodiscard]] std::optional<std::string> find(const std::string& token,
+                                                  Clock::time_point  now = Clock::now()) const;
+
+    // Removes every session expired at now and returns how many were dropped.
+    std::size_t sweep(Clock::time_point now = Clock::now());
+
+    [[nodiscard]] std::size_t size() const;
+
+    void start_sweeper(std::chrono::milliseconds interval);
+    void stop_sweeper();
+
+  private:
+    static constexpr std::size_t kShardCount = 16;
+
+    struct Shard
+    {
+        mutable std::shared_mutex                mutex;
+        std::unordered_map<std::string, Session> sessions;
+    };
+
+    [[nodiscard]] const Shard& shard_for(const std::string& token) const;
+    [[nodiscard]] Shard&       shard_for(const std::string& token);
+
+    std::array<Shard, kShardCount> shards_;
+
+    std::mutex              sweeper_mutex_;
+    std::condition_variable sweeper_wake_;
+    bool                    sweeper_stop_ = false;
+    std::thread             sweeper_;
+};
+
+} // namespace server
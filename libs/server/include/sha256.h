@@ -0,0 +1,34 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+namespace server
+{
+
+// Incremental SHA-256 (FIPS 180-4). Used to content-address stored artifacts so identical files
+// can share one blob and so downloads can carry a stable ETag.
+class Sha256
+{
+  public:
+    Sha256();
+
+    void        update(const void* data, std::size_t length);
+    void        update(std::string_view data);
+    std::string hex_digest();
+
+    static std::string hex(std::string_view data);
+
+  private:
+    void transform(const unsigned char* block);
+
+    std::array<std::uint32_t, 8>  state_{};
+    std::array<unsigned char, 64> buffer_{};
+    std::uint64_t                 total_length_ = 0;
+    std::size_t                   buffered_     = 0;
+};
+
+} // namespace server
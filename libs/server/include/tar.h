@@ -0,0 +1,64 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <string>
+#include <string_view>
+
+namespace server
+{
+
+// Streaming ustar (POSIX.1-1988) support for package bundles. Only regular files are written;
+// sizes past the 8 GiB octal limit use the GNU base-256 form, which both sides understand.
+class Tar
+{
+  public:
+    static constexpr std::size_t kBlock = 512;
+    // Two zero blocks close an archive.
+    static constexpr std::size_t kTrailer = 2 * kBlock;
+
+    // Header block for a regular file, or nothing when name does not fit the ustar name and
+    // prefix fields.
+    [[nodiscard]] static std::optional<std::string>
+    header(std::string_view name, std::uint64_t size, std::int64_t mtime);
+
+    // Zero bytes that follow size bytes of content to complete the last block.
+    [[nodiscard]] static std::size_t padding(std::uint64_t size);
+};
+
+// Incremental tar parser. feed() accepts an archive in chunks of any size and reports each
+// regular file through begin/data/end; directories, links and extended headers are skipped.
+class TarReader
+{
+  public:
+    using Begin = std::function<bool(const std::string& name, std::uint64_t size)>;
+    using Data  = std::function<bool(const char* data, std::size_t length)>;
+    using End   = std::function<bool()>;
+
+    TarReader(Begin begin, Data data, End end);
+
+    // Returns false on a malformed or corrupt header, or once a callback returned false.
+    [[nodiscard]] bool feed(const char* data, std::size_t length);
+
+    // True once the end-of-archive marker has been read.
+    [[nodiscard]] bool finished() const
+    {
+        return finished_;
+    }
+
+  private:
+    [[nodiscard]] bool parse_header();
+
+    Begin         begin_;
+    Data          data_;
+    End           end_;
+    std::string   header_;        // bytes of the header block read so far
+    std::uint64_t remaining_ = 0; // content bytes left in the current entry
+    std::uint64_t padding_   = 0; // padding bytes left after them
+    bool          regular_   = false;
+    bool          finished_  = false;
+};
+
+} // namespace server
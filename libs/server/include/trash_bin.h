@@ -0,0 +1,57 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <deque>
+#include <filesystem>
+#include <functional>
+#include <mutex>
+
+namespace server
+{
+
+// Deferred deletion. discard() renames a directory into the trash, a single metadata operation
+// on the same filesystem, so the caller never waits on a recursive delete and readers that
+// already opened a file keep reading it. reclaim() deletes the queued trees later, at a bounded
+// number of files per second, from whichever background thread owns the maintenance work.
+class TrashBin
+{
+  public:
+    using Release = std::function<void()>;
+    // Sleeps for the given time; returning false abandons the current reclaim() pass.
+    using Pause = std::function<bool(std::chrono::milliseconds)>;
+
+    explicit TrashBin(std::filesystem::path root);
+
+    TrashBin(const TrashBin&)            = delete;
+    TrashBin& operator=(const TrashBin&) = delete;
+
+    // Moves dir out of the way. release runs once its contents are deleted, or right away when
+    // dir does not exist.
+    [[nodiscard]] bool discard(const std::filesystem::path& dir, Release release = {});
+
+    // Queues whatever a previous process left in the trash. release runs once all of it is
+    // deleted, e.g. to sweep what those entries still referenced; not at all if nothing was left.
+    void recover(Release release = {});
+
+    // Deletes queued entries, pausing as needed to stay under files_per_second (0 means no
+    // limit). An entry interrupted by pause stays queued. Returns the number of files deleted.
+    std::size_t reclaim(std::size_t files_per_second, const Pause& pause);
+
+    [[nodiscard]] std::size_t pending() const;
+
+  private:
+    struct Entry
+    {
+        std::filesystem::path path;
+        Release               release;
+    };
+
+    std::filesystem::path    root_;
+    mutable std::mutex       mutex_;
+    std::deque<Entry>        queue_;
+    std::atomic<std::size_t> sequence_{0};
+};
+
+} // namespace server
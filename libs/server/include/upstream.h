@@ -0,0 +1,39 @@
+#pragma once
+
+#include <httplib.h>
+
+#include <optional>
+#include <string>
+
+#include "package_storage.h"
+
+namespace server
+{
+
+// Client side of a remote Conan v2 server: the --upstream remote, a replication source or a push
+// target. Every fetch opens its own client, so misses for different artifacts are fetched in
+// parallel.
+class Upstream
+{
+  public:
+    explicit Upstream(const std::string& url);
+
+    [[nodiscard]] httplib::Client client() const;
+
+    // Request target for path, relative to the remote URL.
+    [[nodiscard]] std::string target(const std::string& path) const;
+
+    // Body of a 200 response to path (relative to the remote URL), otherwise nothing.
+    [[nodiscard]] std::optional<std::string>
+    get(httplib::Client& client, const std::string& path) const;
+
+    // Streams a 200 response to path into staged.
+    [[nodiscard]] bool
+    download(httplib::Client& client, const std::string& path, StagedFile& staged) const;
+
+  private:
+    std::string origin_;
+    std::string prefix_;
+};
+
+} // namespace server
@@ -0,0 +1,210 @@
+#include "async_log.h"
+
+#include <cstdio>
+#include <system_error>
+#include <utility>
+
+namespace server
+{
+
+std::optional<LogLevel> parse_log_level(std::string_view text)
+{
+    if (text == "debug")
+    {
+        return LogLevel::Debug;
+    }
+    if (text == "info")
+    {
+        return LogLevel::Info;
+    }
+    if (text == "warning" || text == "warn")
+    {
+        return LogLevel::Warning;
+    }
+    if (text == "error")
+    {
+        return LogLevel::Error;
+    }
+    if (text == "off")
+    {
+        return LogLevel::Off;
+    }
+    return std::nullopt;
+}
+
+std::string_view log_level_name(LogLevel level)
+{
+    switch (level)
+    {
+    case LogLevel::Debug:
+        return "debug";
+    case LogLevel::Info:
+        return "info";
+    case LogLevel::Warning:
+        return "warning";
+    case LogLevel::Error:
+        return "error";
+    case LogLevel::Off:
+        break;
+    }
+    return "off";
+}
+
+AsyncLog g_debug_log;
+
+void append_debug_log(LogLevel level, std::string line)
+{
+    g_debug_log.write(level, std::move(line));
+}
+
+AsyncLog::~AsyncLog()
+{
+    close();
+}
+
+void AsyncLog::open(std::filesystem::path path,
+                    LogLevel              level,
+                    std::uint64_t         max_bytes,
+                    unsigned              max_files)
+{
+    close();
+    path_      = std::move(path);
+    max_bytes_ = max_bytes;
+    max_files_ = max_files;
+    stopping_.store(false);
+    writer_ = std::thread([this] { run(); });
+    level_.store(level);
+}
+
+void AsyncLog::close()
+{
+    if (!writer_.joinable())
+    {
+        return;
+    }
+    level_.store(LogLevel::Off);
+    stopping_.store(true);
+    signal_.fetch_add(1);
+    signal_.notify_one();
+    writer_.join();
+
+    // A producer that passed the level check just before close() may still have pushed a line.
+    for (Node* node = head_.exchange(nullptr); node != nullptr;)
+    {
+        Node* next = node->next;
+        delete node;
+        node = next;
+    }
+    pending_.store(0);
+}
+
+void AsyncLog::write(LogLevel level, std::string line)
+{
+    if (!enabled(level) || level == LogLevel::Off)
+    {
+        return;
+    }
+    if (pending_.fetch_add(1, std::memory_order_relaxed) >= kMaxPending)
+    {
+        pending_.fetch_sub(1, std::memory_order_relaxed);
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    auto* node = new Node{std::move(line)};
+    node->next = head_.load(std::memory_order_relaxed);
+    while (!head_.compare_exchange_weak(
+        node->next, node, std::memory_order_release, std::memory_order_relaxed))
+    {
+    }
+    signal_.fetch_add(1, std::memory_order_release);
+    signal_.notify_one();
+}
+
+void AsyncLog::run()
+{
+    std::FILE*    file = std::fopen(path_.string().c_str(), "ab");
+    std::uint64_t size = 0;
+    if (file != nullptr)
+    {
+        std::fseek(file, 0, SEEK_END);
+        size = static_cast<std::uint64_t>(std::ftell(file));
+    }
+    std::uint64_t seen = signal_.load(std::memory_order_acquire);
+    for (;;)
+    {
+        Node* batch = head_.exchange(nullptr, std::memory_order_acquire);
+        if (batch == nullptr)
+        {
+            if (stopping_.load())
+            {
+                break;
+            }
+            signal_.wait(seen, std::memory_order_acquire);
+            seen = signal_.load(std::memory_order_acquire);
+            continue;
+        }
+
+        Node* ordered = nullptr;
+        while (batch != nullptr)
+        {
+            Node* next  = batch->next;
+            batch->next = ordered;
+            ordered     = batch;
+            batch       = next;
+        }
+        std::uint64_t count = 0;
+        while (ordered != nullptr)
+        {
+            if (file != nullptr)
+            {
+                ordered->line.push_back('\n');
+                std::fwrite(ordered->line.data(), 1, ordered->line.size(), file);
+                size += ordered->line.size();
+            }
+            Node* next = ordered->next;
+            delete ordered;
+            ordered = next;
+            ++count;
+        }
+        pending_.fetch_sub(count, std::memory_order_relaxed);
+        if (file != nullptr)
+        {
+            std::fflush(file);
+            if (max_bytes_ != 0 && size >= max_bytes_)
+            {
+                std::fclose(file);
+                rotate();
+                file = std::fopen(path_.string().c_str(), "ab");
+                size = 0;
+            }
+        }
+    }
+    if (file != nullptr)
+    {
+        std::fclose(file);
+    }
+}
+
+void AsyncLog::rotate()
+{
+    std::error_code ec;
+    if (max_files_ == 0)
+    {
+        std::filesystem::remove(path_, ec);
+        return;
+    }
+    auto numbered = [this](unsigned index)
+    {
+        auto rotated = path_;
+        rotated += "." + std::to_string(index);
+        return rotated;
+    };
+    std::filesystem::remove(numbered(max_files_), ec);
+    for (unsigned index = max_files_; index > 1; --index)
+    {
+        std::filesystem::rename(numbered(index - 1), numbered(index), ec);
+    }
+    std::filesystem::rename(path_, numbered(1), ec);
+}
+
+} // namespace server
@@ -0,0 +1,361 @@
+#include "closure.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <deque>
+#include <filesystem>
+#include <optional>
+#include <set>
+#include <sstream>
+#include <string_view>
+#include <tuple>
+#include <utility>
+
+#include "glob.h"
+#include "json_writer.h"
+
+namespace server
+{
+namespace
+{
+
+namespace fs = std::filesystem;
+
+// A requirement as conaninfo.txt lists it under [requires], or as a closure root:
+// name/version[@user/channel][#revision][:package_id[#package_revision]]. Conan's semver
+// package_id modes write versions such as 1.2.Z or 1.Y.Z; every component from the first
+// placeholder on matches anything.
+struct Requirement
+{
+    RecipeRef   ref;
+    std::string revision;   // empty for the latest
+    std::string package_id; // empty to pick the package matching the profile
+    std::string package_revision;
+};
+
+std::optional<Requirement> parse_requirement(std::string_view text)
+{
+    Requirement requirement;
+    if (const auto colon = text.find(':'); colon != std::string_view::npos)
+    {
+        const auto package = text.substr(colon + 1);
+        const auto hash    = package.find('#');
+        requirement.package_id = package.substr(0, hash);
+        if (hash != std::string_view::npos)
+        {
+            requirement.package_revision = package.substr(hash + 1);
+        }
+        text = text.substr(0, colon);
+    }
+    if (const auto hash = text.find('#'); hash != std::string_view::npos)
+    {
+        requirement.revision = text.substr(hash + 1);
+        text                 = text.substr(0, hash);
+    }
+    const auto ref = parse_reference(text);
+    if (!ref)
+    {
+        return std::nullopt;
+    }
+    requirement.ref = *ref;
+    for (const auto* part :
+         {&requirement.revision, &requirement.package_id, &requirement.package_revision})
+    {
+        if (!part->empty() && !is_safe_path_segment(*part))
+        {
+            return std::nullopt;
+        }
+    }
+    return requirement;
+}
+
+std::vector<std::string_view> version_parts(std::string_view version)
+{
+    std::vector<std::string_view> parts;
+    for (std::size_t start = 0; start <= version.size();)
+    {
+        const auto dot = std::min(version.find('.', start), version.size());
+        parts.push_back(version.substr(start, dot - start));
+        start = dot + 1;
+    }
+    return parts;
+}
+
+bool version_matches(std::string_view pattern, std::string_view version)
+{
+    const auto wanted = version_parts(pattern);
+    const auto actual = version_parts(version);
+    for (std::size_t i = 0; i < wanted.size(); ++i)
+    {
+        if (wanted[i] == "X" || wanted[i] == "Y" || wanted[i] == "Z")
+        {
+            return true;
+        }
+        if (i >= actual.size() || wanted[i] != actual[i])
+        {
+            return false;
+        }
+    }
+    return wanted.size() == actual.size();
+}
+
+// Orders versions component by component, numerically where both components are numbers.
+bool version_less(std::string_view left, std::string_view right)
+{
+    const auto is_number = [](std::string_view part)
+    { return !part.empty() && std::all_of(part.begin(), part.end(), ::isdigit); };
+    const auto a = version_parts(left);
+    const auto b = version_parts(right);
+    for (std::size_t i = 0; i < std::min(a.size(), b.size()); ++i)
+    {
+        if (a[i] == b[i])
+        {
+            continue;
+        }
+        if (is_number(a[i]) && is_number(b[i]))
+        {
+            const auto x = a[i].substr(std::min(a[i].find_first_not_of('0'), a[i].size() - 1));
+            const auto y = b[i].substr(std::min(b[i].find_first_not_of('0'), b[i].size() - 1));
+            if (x != y)
+            {
+                return x.size() != y.size() ? x.size() < y.size() : x < y;
+            }
+            continue;
+        }
+        return a[i] < b[i];
+    }
+    return a.size() < b.size();
+}
+
+// Lines of one section of an ini-style file, including those without '=' such as the
+// references under [requires].
+std::vector<std::string> ini_section_lines(const std::string& content, std::string_view section)
+{
+    std::vector<std::string> lines;
+    bool                     inside = false;
+    std::istringstream       input(content);
+    for (std::string line; std::getline(input, line);)
+    {
+        line = trim(line);
+        if (line.empty() || line.starts_with('#') || line.starts_with(';'))
+        {
+            continue;
+        }
+        if (line.front() == '[' && line.back() == ']')
+        {
+            inside = std::string_view(line).substr(1, line.size() - 2) == section;
+        }
+        else if (inside)
+        {
+            lines.push_back(line);
+        }
+    }
+    return lines;
+}
+
+std::optional<std::string> profile_value(const std::map<std::string, std::string>& entries,
+                                         const RecipeRef&                          ref,
+                                         const std::string&                        key,
+                                         bool                                      plain)
+{
+    std::optional<std::string> value;
+    if (const auto entry = entries.find(key); plain && entry != entries.end())
+    {
+        value = entry->second;
+    }
+    const auto name_version = ref.name + '/' + ref.version;
+    for (const auto& [entry, entry_value] : entries)
+    {
+        const auto colon = entry.rfind(':');
+        if (colon == std::string::npos || entry.compare(colon + 1, std::string::npos, key) != 0)
+        {
+            continue;
+        }
+        const Glob pattern(std::string_view(entry).substr(0, colon));
+        if (pattern.matches(name_version) || pattern.matches(ref.name))
+        {
+            value = entry_value;
+        }
+    }
+    return value;
+}
+
+// Whether a package built with the settings and options of info suits profile. Settings and
+// options the package does not record do not matter to it.
+bool matches_profile(const std::map<std::string, std::map<std::string, std::string>>& info,
+                     const ClosureProfile&                                            profile,
+                     const RecipeRef&                                                 ref,
+                     bool                                                             root)
+{
+    for (const auto& [section, entries, plain] :
+         {std::tuple{"settings", &profile.settings, true},
+          std::tuple{"options", &profile.options, root}})
+    {
+        const auto recorded = info.find(section);
+        if (recorded == info.end())
+        {
+            continue;
+        }
+        for (const auto& [key, value] : recorded->second)
+        {
+            const auto wanted = profile_value(*entries, ref, key, plain);
+            if (wanted && *wanted != value)
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+} // namespace
+
+std::string closure_json(const PackageStorage&           storage,
+                         const std::vector<std::string>& roots,
+                         const ClosureProfile&           profile)
+{
+    JsonWriter out;
+    JsonWriter missing;
+    out.begin_object().key("packages").begin_array();
+    missing.begin_array();
+    const auto report = [&](const std::string& requirement, const char* reason)
+    {
+        missing.begin_object()
+            .key("requirement").value(requirement)
+            .key("reason").value(reason)
+            .end_object();
+    };
+
+    std::deque<std::pair<std::string, bool>> pending;
+    for (const auto& root : roots)
+    {
+        pending.emplace_back(root, true);
+    }
+    std::set<std::tuple<std::string, std::string, std::string>> resolved;
+    while (!pending.empty())
+    {
+        const auto [text, root] = pending.front();
+        pending.pop_front();
+        const auto requirement = parse_requirement(text);
+        if (!requirement)
+        {
+            report(text, "invalid reference");
+            continue;
+        }
+        const auto& wanted = requirement->ref;
+        if (!resolved.emplace(wanted.name, wanted.user, wanted.channel).second)
+        {
+            continue;
+        }
+
+        std::optional<RecipeRef> ref;
+        for (const auto& candidate : storage.list_recipe_versions(wanted.name))
+        {
+            if (candidate.user == wanted.user && candidate.channel == wanted.channel &&
+                version_matches(wanted.version, candidate.version) &&
+                (!ref || version_less(ref->version, candidate.version)))
+            {
+                ref = candidate;
+            }
+        }
+        std::optional<std::string> revision;
+        if (ref && requirement->revision.empty())
+        {
+            if (const auto latest = storage.latest_recipe_revision(*ref))
+            {
+                revision = latest->revision;
+            }
+        }
+        else if (ref && storage.has_recipe_revision(*ref, requirement->revision))
+        {
+            revision = requirement->revision;
+        }
+        if (!revision)
+        {
+            report(text, "no matching recipe revision");
+            continue;
+        }
+
+        // An explicit package id is taken as is; otherwise the first package whose latest
+        // revision was built for the profile.
+        std::optional<std::pair<std::string, std::string>> package;
+        std::string                                        info;
+        for (const auto& package_id : requirement->package_id.empty()
+                                          ? storage.list_package_ids(*ref, *revision)
+                                          : std::vector<std::string>{requirement->package_id})
+        {
+            std::optional<std::string> package_revision;
+            if (requirement->package_revision.empty())
+            {
+                if (const auto latest =
+                        storage.latest_package_revision(*ref, *revision, package_id))
+                {
+                    package_revision = latest->revision;
+                }
+            }
+            else if (storage.has_package_revision(
+                         *ref, *revision, package_id, requirement->package_revision))
+            {
+                package_revision = requirement->package_revision;
+            }
+            if (!package_revision)
+            {
+                continue;
+            }
+            info = read_small_file(storage.package_files_path(
+                                       *ref, *revision, package_id, *package_revision) /
+                                   "conaninfo.txt")
+                       .value_or("");
+            if (!requirement->package_id.empty() ||
+                matches_profile(parse_ini_sections(info), profile, *ref, root))
+            {
+                package.emplace(package_id, *package_revision);
+                break;
+            }
+        }
+
+        const auto recipe_path = "/v2/conans/" + ref->name + '/' + ref->version + '/' + ref->user +
+                                 '/' + ref->channel + "/revisions/" + *revision;
+        auto bundle_path = "/api/bundle/" + ref->name + '/' + ref->version + '/' + ref->user + '/' +
+                           ref->channel + "/revisions/" + *revision;
+        out.begin_object()
+            .key("reference").value(ref_string(*ref))
+            .key("revision").value(*revision);
+        out.key("recipe_files").begin_object();
+        for (const auto& [name, checksum] : storage.recipe_file_list(*ref, *revision))
+        {
+            out.key(name).value(recipe_path + "/files/" + name);
+        }
+        out.end_object();
+        if (package)
+        {
+            const auto& [package_id, package_revision] = *package;
+            const auto package_path =
+                recipe_path + "/packages/" + package_id + "/revisions/" + package_revision;
+            bundle_path += "/packages/" + package_id + "/revisions/" + package_revision;
+            out.key("package_id").value(package_id)
+                .key("package_revision").value(package_revision);
+            out.key("package_files").begin_object();
+            for (const auto& [name, checksum] :
+                 storage.package_file_list(*ref, *revision, package_id, package_revision))
+            {
+                out.key(name).value(package_path + "/files/" + name);
+            }
+            out.end_object();
+            for (const auto& dependency : ini_section_lines(info, "requires"))
+            {
+                pending.emplace_back(dependency, false);
+            }
+        }
+        else
+        {
+            report(text, "no package matching the profile");
+        }
+        out.key("bundle_url").value(bundle_path).end_object();
+    }
+    missing.end_array();
+    out.end_array().key("missing").raw(missing.take()).end_object();
+    return out.take();
+}
+
+} // namespace server
@@ -0,0 +1,106 @@
+#include "file_cache.h"
+
+#include <algorithm>
+#include <functional>
+#include <utility>
+
+namespace server
+{
+
+FileCache::FileCache(std::size_t capacity, std::size_t max_entry)
+    : shard_capacity_(capacity / kShardCount), max_entry_(std::min(max_entry, shard_capacity_))
+{
+}
+
+FileCache::Contents FileCache::find(const std::string& key, std::string_view sha256)
+{
+    auto&           shard = shard_for(key);
+    std::lock_guard lock(shard.mutex);
+    const auto      it = shard.entries.find(key);
+    if (it == shard.entries.end() || it->second->sha256 != sha256)
+    {
+        misses_.fetch_add(1, std::memory_order_relaxed);
+        return nullptr;
+    }
+    shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+    hits_.fetch_add(1, std::memory_order_relaxed);
+    return it->second->contents;
+}
+
+void FileCache::insert(const std::string& key, std::string sha256, Contents contents)
+{
+    if (!contents || !accepts(contents->size()))
+    {
+        return;
+    }
+    auto&           shard = shard_for(key);
+    std::lock_guard lock(shard.mutex);
+    if (const auto it = shard.entries.find(key); it != shard.entries.end())
+    {
+        remove(shard, it->second);
+    }
+    shard.bytes += contents->size();
+    shard.lru.push_front(Entry{key, std::move(sha256), std::move(contents)});
+    shard.entries.emplace(key, shard.lru.begin());
+    while (shard.bytes > shard_capacity_)
+    {
+        remove(shard, std::prev(shard.lru.end()));
+        evictions_.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void FileCache::erase(const std::string& key)
+{
+    auto&           shard = shard_for(key);
+    std::lock_guard lock(shard.mutex);
+    if (const auto it = shard.entries.find(key); it != shard.entries.end())
+    {
+        remove(shard, it->second);
+    }
+}
+
+void FileCache::erase_prefix(std::string_view prefix)
+{
+    for (auto& shard : shards_)
+    {
+        std::lock_guard lock(shard.mutex);
+        for (auto it = shard.lru.begin(); it != shard.lru.end();)
+        {
+            const auto next = std::next(it);
+            if (it->key.starts_with(prefix))
+            {
+                remove(shard, it);
+            }
+            it = next;
+        }
+    }
+}
+
+FileCache::Stats FileCache::stats() const
+{
+    Stats stats;
+    stats.hits      = hits_.load(std::memory_order_relaxed);
+    stats.misses    = misses_.load(std::memory_order_relaxed);
+    stats.evictions = evictions_.load(std::memory_order_relaxed);
+    for (const auto& shard : shards_)
+    {
+        std::lock_guard lock(shard.mutex);
+        stats.entries += shard.entries.size();
+        stats.bytes += shard.bytes;
+    }
+    return stats;
+}
+
+FileCache::Shard& FileCache::shard_for(const std::string& key)
+{
+    return shards_[std::hash<std::string>{}(key) % kShardCount];
+}
+
+void FileCache::remove(Shard& shard, std::list<Entry>::iterator entry)
+{
+    shard.bytes -= entry->contents->size();
+    shard.entries.erase(entry->key);
+    shard.lru.erase(entry);
+}
+
+} // namespace server
@@ -0,0 +1,88 @@
+#include "glob.h"
+
+namespace server
+{
+namespace
+{
+
+char fold_char(char c)
+{
+    return (c >= 'A' && c <= 'Z') ? static_cast<char>(c - 'A' + 'a') : c;
+}
+
+bool segment_at(const std::string& segment, std::string_view text, std::size_t offset)
+{
+    for (std::size_t i = 0; i < segment.size(); ++i)
+    {
+        if (segment[i] != '?' && segment[i] != fold_char(text[offset + i]))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+} // namespace
+
+Glob::Glob(std::string_view pattern)
+{
+    std::string segment;
+    for (const char c : pattern)
+    {
+        if (c == '*')
+        {
+            has_star_ = true;
+            segments_.push_back(std::move(segment));
+            segment.clear();
+            continue;
+        }
+        segment.push_back(fold_char(c));
+    }
+    segments_.push_back(std::move(segment));
+
+    const auto& head = segments_.front();
+    prefix_          = head.substr(0, head.find('?'));
+}
+
+bool Glob::matches(std::string_view text) const
+{
+    const auto& head = segments_.front();
+    if (!has_star_)
+    {
+        return text.size() == head.size() && segment_at(head, text, 0);
+    }
+    const auto& tail = segments_.back();
+    if (text.size() < head.size() + tail.size() || !segment_at(head, text, 0) ||
+        !segment_at(tail, text, text.size() - tail.size()))
+    {
+        return false;
+    }
+    std::size_t       position = head.size();
+    const std::size_t end      = text.size() - tail.size();
+    for (std::size_t i = 1; i + 1 < segments_.size(); ++i)
+    {
+        const auto& segment = segments_[i];
+        while (position + segment.size() <= end && !segment_at(segment, text, position))
+        {
+            ++position;
+        }
+        if (position + segment.size() > end)
+        {
+            return false;
+        }
+        position += segment.size();
+    }
+    return true;
+}
+
+std::string Glob::fold(std::string_view text)
+{
+    std::string folded(text);
+    for (auto& c : folded)
+    {
+        c = fold_char(c);
+    }
+    return folded;
+}
+
+} // namespace server
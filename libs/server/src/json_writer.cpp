@@ -0,0 +1,249 @@
+#include "json_writer.h"
+
+#include <charconv>
+#include <cstring>
+
+namespace server
+{
+namespace
+{
+
+constexpr std::uint64_t kOnes  = 0x0101010101010101ULL;
+constexpr std::uint64_t kHighs = 0x8080808080808080ULL;
+
+// Non-zero when any byte of word is below 0x20, a quote or a backslash (SWAR byte tests).
+std::uint64_t needs_escape(std::uint64_t word)
+{
+    const auto below_space = (word - kOnes * 0x20) & ~word;
+    const auto quote       = word ^ (kOnes * '"');
+    const auto backslash   = word ^ (kOnes * '\\');
+    const auto is_quote    = (quote - kOnes) & ~quote;
+    const auto is_slash    = (backslash - kOnes) & ~backslash;
+    return (below_space | is_quote | is_slash) & kHighs;
+}
+
+bool is_special(char ch)
+{
+    return static_cast<unsigned char>(ch) < 0x20U || ch == '"' || ch == '\\';
+}
+
+void append_escape(std::string& out, char ch)
+{
+    switch (ch)
+    {
+    case '\\':
+        out += "\\\\";
+        break;
+    case '"':
+        out += "\\\"";
+        break;
+    case '\b':
+        out += "\\b";
+        break;
+    case '\f':
+        out += "\\f";
+        break;
+    case '\n':
+        out += "\\n";
+        break;
+    case '\r':
+        out += "\\r";
+        break;
+    case '\t':
+        out += "\\t";
+        break;
+    default:
+    {
+        static constexpr char kHex[] = "0123456789abcdef";
+        const auto            byte   = static_cast<unsigned char>(ch);
+        const char            escaped[] = {'\\', 'u', '0', '0', kHex[byte >> 4], kHex[byte & 0xF]};
+        out.append(escaped, sizeof(escaped));
+        break;
+    }
+    }
+}
+
+} // namespace
+
+void append_json_escaped(std::string& out, std::string_view value)
+{
+    const char*       data  = value.data();
+    const std::size_t size  = value.size();
+    std::size_t       clean = 0; // start of the pending run that needs no escaping
+    std::size_t       i     = 0;
+    while (i < size)
+    {
+        if (i + sizeof(std::uint64_t) <= size)
+        {
+            std::uint64_t word;
+            std::memcpy(&word, data + i, sizeof(word));
+            if (needs_escape(word) == 0)
+            {
+                i += sizeof(word);
+                continue;
+            }
+        }
+        if (!is_special(data[i]))
+        {
+            ++i;
+            continue;
+        }
+        out.append(data + clean, i - clean);
+        append_escape(out, data[i]);
+        clean = ++i;
+    }
+    out.append(data + clean, size - clean);
+}
+
+JsonWriter::JsonWriter(std::size_t reserve)
+{
+    buffer_.reserve(reserve);
+}
+
+JsonWriter::JsonWriter(Sink sink, std::size_t flush_threshold)
+    : sink_(std::move(sink)), flush_threshold_(flush_threshold)
+{
+    buffer_.reserve(flush_threshold + flush_threshold / 4);
+}
+
+void JsonWriter::separate()
+{
+    if (after_key_)
+    {
+        after_key_ = false;
+        return;
+    }
+    if (!has_members_.empty())
+    {
+        if (has_members_.back())
+        {
+            buffer_ += ',';
+        }
+        has_members_.back() = true;
+    }
+}
+
+void JsonWriter::maybe_flush()
+{
+    if (sink_ && buffer_.size() >= flush_threshold_)
+    {
+        flush();
+    }
+}
+
+JsonWriter& JsonWriter::begin_object()
+{
+    separate();
+    buffer_ += '{';
+    has_members_.push_back(false);
+    return *this;
+}
+
+JsonWriter& JsonWriter::end_object()
+{
+    buffer_ += '}';
+    has_members_.pop_back();
+    maybe_flush();
+    return *this;
+}
+
+JsonWriter& JsonWriter::begin_array()
+{
+    separate();
+    buffer_ += '[';
+    has_members_.push_back(false);
+    return *this;
+}
+
+JsonWriter& JsonWriter::end_array()
+{
+    buffer_ += ']';
+    has_members_.pop_back();
+    maybe_flush();
+    return *this;
+}
+
+JsonWriter& JsonWriter::key(std::string_view name)
+{
+    separate();
+    buffer_ += '"';
+    append_json_escaped(buffer_, name);
+    buffer_ += "\":";
+    after_key_ = true;
+    return *this;
+}
+
+JsonWriter& JsonWriter::value(std::string_view text)
+{
+    separate();
+    buffer_ += '"';
+    append_json_escaped(buffer_, text);
+    buffer_ += '"';
+    maybe_flush();
+    return *this;
+}
+
+JsonWriter& JsonWriter::value(bool flag)
+{
+    separate();
+    buffer_ += flag ? "true" : "false";
+    return *this;
+}
+
+JsonWriter& JsonWriter::integer(std::int64_t number)
+{
+    separate();
+    char       digits[24];
+    const auto result = std::to_chars(digits, digits + sizeof(digits), number);
+    buffer_.append(digits, result.ptr);
+    return *this;
+}
+
+JsonWriter& JsonWriter::integer(std::uint64_t number)
+{
+    separate();
+    char       digits[24];
+    const auto result = std::to_chars(digits, digits + sizeof(digits), number);
+    buffer_.append(digits, result.ptr);
+    return *this;
+}
+
+JsonWriter& JsonWriter::value(double number, int precision)
+{
+    separate();
+    char       digits[64];
+    const auto result = std::to_chars(
+        digits, digits + sizeof(digits), number, std::chars_format::fixed, precision);
+    buffer_.append(digits, result.ptr);
+    return *this;
+}
+
+JsonWriter& JsonWriter::null()
+{
+    separate();
+    buffer_ += "null";
+    return *this;
+}
+
+JsonWriter& JsonWriter::raw(std::string_view json)
+{
+    separate();
+    buffer_.append(json);
+    maybe_flush();
+    return *this;
+}
+
+bool JsonWriter::flush()
+{
+    if (sink_ && sink_ok_ && !buffer_.empty())
+    {
+        sink_ok_ = sink_(buffer_);
+    }
+    if (sink_)
+    {
+        buffer_.clear();
+    }
+    return sink_ok_;
+}
+
+} // namespace server
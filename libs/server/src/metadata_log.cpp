@@ -0,0 +1,394 @@
+#include "metadata_log.h"
+
+#include <algorithm>
+#include <charconv>
+#include <fstream>
+#include <iterator>
+#include <optional>
+#include <string_view>
+#include <system_error>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace server
+{
+namespace
+{
+
+constexpr std::string_view kHeader = "leafserver-metadata 1 ";
+
+// Fixed width so rewrite() can patch the live record count in place once it is known.
+constexpr std::size_t kCountDigits = 20;
+
+std::uint32_t line_checksum(std::string_view payload)
+{
+    std::uint32_t hash = 2166136261U;
+    for (const char ch : payload)
+    {
+        hash ^= static_cast<unsigned char>(ch);
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+void append_hex(std::string& out, std::uint32_t value)
+{
+    static constexpr char kHex[] = "0123456789abcdef";
+    for (int shift = 28; shift >= 0; shift -= 4)
+    {
+        out += kHex[(value >> shift) & 0xFU];
+    }
+}
+
+void append_field(std::string& out, std::string_view field)
+{
+    for (const char ch : field)
+    {
+        switch (ch)
+        {
+        case '\\':
+            out += "\\\\";
+            break;
+        case '\t':
+            out += "\\t";
+            break;
+        case '\n':
+            out += "\\n";
+            break;
+        case '\r':
+            out += "\\r";
+            break;
+        default:
+            out += ch;
+            break;
+        }
+    }
+}
+
+char unescape(char ch)
+{
+    switch (ch)
+    {
+    case 't':
+        return '\t';
+    case 'n':
+        return '\n';
+    case 'r':
+        return '\r';
+    default:
+        return ch;
+    }
+}
+
+std::string encode(const MetadataLog::Record& record)
+{
+    std::string line;
+    for (std::size_t i = 0; i < record.size(); ++i)
+    {
+        if (i != 0)
+        {
+            line += '\t';
+        }
+        append_field(line, record[i]);
+    }
+    const auto checksum = line_checksum(line);
+    line += '\t';
+    append_hex(line, checksum);
+    line += '\n';
+    return line;
+}
+
+// Parses one line without its newline. Returns false when the checksum does not match.
+bool decode(std::string_view line, MetadataLog::Record& record)
+{
+    const auto split = line.rfind('\t');
+    if (split == std::string_view::npos || line.size() - split - 1 != 8)
+    {
+        return false;
+    }
+    std::string expected;
+    append_hex(expected, line_checksum(line.substr(0, split)));
+    if (line.substr(split + 1) != expected)
+    {
+        return false;
+    }
+    record.clear();
+    record.emplace_back();
+    for (std::size_t i = 0; i < split; ++i)
+    {
+        const char ch = line[i];
+        if (ch == '\t')
+        {
+            record.emplace_back();
+        }
+        else if (ch == '\\' && i + 1 < split)
+        {
+            record.back() += unescape(line[++i]);
+        }
+        else
+        {
+            record.back() += ch;
+        }
+    }
+    return true;
+}
+
+std::string header_line(std::uint64_t live)
+{
+    std::string digits = std::to_string(live);
+    return std::string(kHeader) + std::string(kCountDigits - digits.size(), '0') + digits + '\n';
+}
+
+bool sync_file(std::FILE* file)
+{
+    if (std::fflush(file) != 0)
+    {
+        return false;
+    }
+#ifdef _WIN32
+    return _commit(_fileno(file)) == 0;
+#else
+    return ::fsync(::fileno(file)) == 0;
+#endif
+}
+
+void sync_directory([[maybe_unused]] const std::filesystem::path& dir)
+{
+#ifndef _WIN32
+    const int fd = ::open(dir.c_str(), O_RDONLY);
+    if (fd >= 0)
+    {
+        ::fsync(fd);
+        ::close(fd);
+    }
+#endif
+}
+
+} // namespace
+
+MetadataLog::~MetadataLog()
+{
+    close();
+}
+
+bool MetadataLog::open(const std::filesystem::path& path, const Emit& apply, const Snapshot& seed)
+{
+    close();
+    path_ = path;
+    error_.clear();
+    records_.store(0);
+    live_.store(0);
+
+    std::string content;
+    if (std::ifstream in(path_, std::ios::binary); in)
+    {
+        content.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+    if (content.empty())
+    {
+        const auto count = replace(seed);
+        if (!count)
+        {
+            error_ = "cannot write " + path_.string();
+            return false;
+        }
+        records_.store(*count);
+        live_.store(*count);
+    }
+    else
+    {
+        const auto header_end = content.find('\n');
+        if (!content.starts_with(kHeader) || header_end != kHeader.size() + kCountDigits)
+        {
+            error_ = "not a metadata log";
+            return false;
+        }
+        std::uint64_t live = 0;
+        std::from_chars(content.data() + kHeader.size(), content.data() + header_end, live);
+        live_.store(live);
+
+        Record      record;
+        std::size_t offset  = header_end + 1;
+        std::size_t records = 0;
+        while (offset < content.size())
+        {
+            const auto end = content.find('\n', offset);
+            if (end == std::string::npos ||
+                !decode(std::string_view(content).substr(offset, end - offset), record))
+            {
+                break;
+            }
+            apply(record);
+            ++records;
+            offset = end + 1;
+        }
+        records_.store(records);
+        if (offset < content.size())
+        {
+            // Only the last line can be torn by an interrupted append. A bad record with valid
+            // ones after it is damage to the file itself, and cutting it there would silently
+            // drop every revision recorded since, so the log is left for an operator to inspect.
+            const auto end = content.find('\n', offset);
+            if (end != std::string::npos && end + 1 < content.size())
+            {
+                error_ = "record " + std::to_string(records + 1) + " is corrupt and not the last one";
+                return false;
+            }
+            std::error_code ec;
+            std::filesystem::resize_file(path_, offset, ec);
+            if (ec)
+            {
+                error_ = "cannot truncate the torn last record: " + ec.message();
+                return false;
+            }
+        }
+    }
+
+    std::lock_guard  append_lock(append_mutex_);
+    std::unique_lock file_lock(file_mutex_);
+    file_ = std::fopen(path_.string().c_str(), "ab");
+    if (file_ == nullptr)
+    {
+        error_ = "cannot append to " + path_.string();
+    }
+    return file_ != nullptr;
+}
+
+void MetadataLog::close()
+{
+    std::lock_guard  append_lock(append_mutex_);
+    std::unique_lock file_lock(file_mutex_);
+    if (file_ != nullptr)
+    {
+        sync_file(file_);
+        std::fclose(file_);
+        file_ = nullptr;
+    }
+}
+
+bool MetadataLog::write_line(std::FILE* file, const Record& record)
+{
+    const auto line = encode(record);
+    return std::fwrite(line.data(), 1, line.size(), file) == line.size();
+}
+
+bool MetadataLog::append(const Record& record)
+{
+    std::lock_guard append_lock(append_mutex_);
+    if (file_ == nullptr)
+    {
+        return false;
+    }
+    if (!write_line(file_, record) || std::fflush(file_) != 0)
+    {
+        // A partial line may now end the file; refuse further appends rather than write records
+        // that replay would never reach.
+        std::unique_lock file_lock(file_mutex_);
+        std::fclose(file_);
+        file_ = nullptr;
+        return false;
+    }
+    records_.fetch_add(1, std::memory_order_relaxed);
+    written_.fetch_add(1);
+    return true;
+}
+
+bool MetadataLog::sync()
+{
+    std::shared_lock file_lock(file_mutex_);
+    if (file_ == nullptr)
+    {
+        return false;
+    }
+    const auto target = written_.load();
+    if (synced_.load() >= target)
+    {
+        return true;
+    }
+#ifdef _WIN32
+    const bool ok = _commit(_fileno(file_)) == 0;
+#else
+    const bool ok = ::fsync(::fileno(file_)) == 0;
+#endif
+    if (!ok)
+    {
+        return false;
+    }
+    auto synced = synced_.load();
+    while (synced < target && !synced_.compare_exchange_weak(synced, target))
+    {
+    }
+    return true;
+}
+
+std::optional<std::uint64_t> MetadataLog::replace(const Snapshot& snapshot)
+{
+    const auto temp = path_.string() + ".compact";
+    std::FILE* out  = std::fopen(temp.c_str(), "wb");
+    if (out == nullptr)
+    {
+        return std::nullopt;
+    }
+    std::uint64_t count  = 0;
+    auto          header = header_line(0);
+    bool          ok     = std::fwrite(header.data(), 1, header.size(), out) == header.size();
+    if (snapshot)
+    {
+        snapshot(
+            [&](const Record& record)
+            {
+                ok = ok && write_line(out, record);
+                ++count;
+            });
+    }
+    header = header_line(count);
+    ok     = ok && std::fseek(out, 0, SEEK_SET) == 0 &&
+         std::fwrite(header.data(), 1, header.size(), out) == header.size() && sync_file(out);
+    std::fclose(out);
+    std::error_code ec;
+    if (ok)
+    {
+        std::filesystem::rename(temp, path_, ec);
+    }
+    if (!ok || ec)
+    {
+        std::filesystem::remove(temp, ec);
+        return std::nullopt;
+    }
+    sync_directory(path_.parent_path());
+    return count;
+}
+
+bool MetadataLog::rewrite(const Snapshot& snapshot)
+{
+    std::lock_guard append_lock(append_mutex_);
+    if (file_ == nullptr)
+    {
+        return false;
+    }
+    const auto count = replace(snapshot);
+    if (!count)
+    {
+        return false;
+    }
+    std::unique_lock file_lock(file_mutex_);
+    std::fclose(file_);
+    file_ = std::fopen(path_.string().c_str(), "ab");
+    records_.store(*count);
+    live_.store(*count);
+    synced_.store(written_.load());
+    return file_ != nullptr;
+}
+
+bool MetadataLog::should_compact() const
+{
+    const auto live = live_.load(std::memory_order_relaxed);
+    return records() - std::min(records(), live) > std::max(live, kCompactSlack);
+}
+
+} // namespace server
@@ -0,0 +1,188 @@
+#include "metrics.h"
+
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <numeric>
+#include <sstream>
+
+namespace server
+{
+namespace
+{
+
+std::atomic<std::uint64_t> g_next_metrics_id{1};
+
+// Sample values are doubles. Integral ones print as integers and the rest in the shortest form
+// that parses back to the same double; a stream's default six significant digits would round
+// byte counts and latency sums.
+std::string format_value(double value)
+{
+    constexpr double kExactIntegers = 9007199254740992.0; // 2^53
+    if (std::trunc(value) == value && std::abs(value) < kExactIntegers)
+    {
+        return std::to_string(static_cast<std::int64_t>(value));
+    }
+    std::array<char, 32> buffer{};
+    const auto result = std::to_chars(buffer.data(), buffer.data() + buffer.size(), value);
+    return std::string(buffer.data(), result.ptr);
+}
+
+} // namespace
+
+Metrics::Metrics(const std::vector<std::string>& routes) : id_(g_next_metrics_id.fetch_add(1))
+{
+    for (const auto& label : routes)
+    {
+        static_cast<void>(route(label));
+    }
+}
+
+std::size_t Metrics::route(std::string_view label)
+{
+    std::lock_guard lock(slabs_mutex_);
+    const auto      it = std::find(routes_.begin(), routes_.end(), label);
+    if (it != routes_.end())
+    {
+        return static_cast<std::size_t>(it - routes_.begin());
+    }
+    if (routes_.size() == kMaxRoutes)
+    {
+        return kMaxRoutes;
+    }
+    routes_.emplace_back(label);
+    return routes_.size() - 1;
+}
+
+Metrics::Slab& Metrics::local_slab()
+{
+    // Keyed by instance id rather than address so a slab is never reused by a later instance.
+    thread_local std::vector<std::pair<std::uint64_t, Slab*>> slabs;
+    for (const auto& [id, slab] : slabs)
+    {
+        if (id == id_)
+        {
+            return *slab;
+        }
+    }
+    std::lock_guard lock(slabs_mutex_);
+    auto&           slab = *slabs_.emplace_back(std::make_unique<Slab>());
+    slabs.emplace_back(id_, &slab);
+    return slab;
+}
+
+void Metrics::request_finished(std::size_t route, int status, std::chrono::nanoseconds latency)
+{
+    in_flight_.fetch_sub(1, std::memory_order_relaxed);
+    if (route >= kMaxRoutes)
+    {
+        return;
+    }
+    auto&             cells        = local_slab().cells[route];
+    const std::size_t status_class = static_cast<std::size_t>(std::clamp(status / 100, 1, 5)) - 1;
+    cells.requests[status_class].fetch_add(1, std::memory_order_relaxed);
+
+    const double seconds = std::chrono::duration<double>(latency).count();
+    const auto   bucket =
+        std::lower_bound(kLatencyBuckets.begin(), kLatencyBuckets.end(), seconds) -
+        kLatencyBuckets.begin();
+    cells.buckets[static_cast<std::size_t>(bucket)].fetch_add(1, std::memory_order_relaxed);
+    cells.latency_ns.fetch_add(static_cast<std::uint64_t>(latency.count()),
+                               std::memory_order_relaxed);
+}
+
+std::string Metrics::render(const Gauges& gauges, const Counters& counters) const
+{
+    struct Totals
+    {
+        std::array<std::uint64_t, kStatusClasses>             requests{};
+        std::array<std::uint64_t, kLatencyBuckets.size() + 1> buckets{};
+        std::uint64_t                                         latency_ns = 0;
+    };
+    std::vector<std::string> routes;
+    std::vector<Totals>      totals;
+    {
+        std::lock_guard lock(slabs_mutex_);
+        routes = routes_;
+        totals.resize(routes.size());
+        for (const auto& slab : slabs_)
+        {
+            for (std::size_t route = 0; route < routes.size(); ++route)
+            {
+                const auto& cells = slab->cells[route];
+                for (std::size_t i = 0; i < kStatusClasses; ++i)
+                {
+                    totals[route].requests[i] += cells.requests[i].load(std::memory_order_relaxed);
+                }
+                for (std::size_t i = 0; i < cells.buckets.size(); ++i)
+                {
+                    totals[route].buckets[i] += cells.buckets[i].load(std::memory_order_relaxed);
+                }
+                totals[route].latency_ns += cells.latency_ns.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    std::ostringstream out;
+    out << "# HELP leafserver_requests_total Completed HTTP requests by route and status class.\n"
+        << "# TYPE leafserver_requests_total counter\n";
+    for (std::size_t route = 0; route < routes.size(); ++route)
+    {
+        for (std::size_t i = 0; i < kStatusClasses; ++i)
+        {
+            if (totals[route].requests[i] != 0)
+            {
+                out << "leafserver_requests_total{route=\"" << routes[route] << "\",status=\""
+                    << i + 1 << "xx\"} " << totals[route].requests[i] << '\n';
+            }
+        }
+    }
+
+    out << "# HELP leafserver_request_duration_seconds Request latency by route.\n"
+        << "# TYPE leafserver_request_duration_seconds histogram\n";
+    for (std::size_t route = 0; route < routes.size(); ++route)
+    {
+        const auto& total = totals[route];
+        if (std::accumulate(total.buckets.begin(), total.buckets.end(), std::uint64_t{0}) == 0)
+        {
+            continue;
+        }
+        std::uint64_t cumulative = 0;
+        for (std::size_t i = 0; i < kLatencyBuckets.size(); ++i)
+        {
+            cumulative += total.buckets[i];
+            out << "leafserver_request_duration_seconds_bucket{route=\"" << routes[route]
+                << "\",le=\"" << format_value(kLatencyBuckets[i]) << "\"} " << cumulative << '\n';
+        }
+        cumulative += total.buckets.back();
+        out << "leafserver_request_duration_seconds_bucket{route=\"" << routes[route]
+            << "\",le=\"+Inf\"} " << cumulative << '\n'
+            << "leafserver_request_duration_seconds_sum{route=\"" << routes[route] << "\"} "
+            << format_value(static_cast<double>(total.latency_ns) / 1e9) << '\n'
+            << "leafserver_request_duration_seconds_count{route=\"" << routes[route] << "\"} "
+            << cumulative << '\n';
+    }
+
+    out << "# TYPE leafserver_requests_in_flight gauge\n"
+        << "leafserver_requests_in_flight " << in_flight_.load(std::memory_order_relaxed) << '\n'
+        << "# TYPE leafserver_uploaded_bytes_total counter\n"
+        << "leafserver_uploaded_bytes_total " << uploaded_bytes_.load(std::memory_order_relaxed)
+        << '\n'
+        << "# TYPE leafserver_downloaded_bytes_total counter\n"
+        << "leafserver_downloaded_bytes_total "
+        << downloaded_bytes_.load(std::memory_order_relaxed) << '\n'
+        << "# TYPE leafserver_auth_failures_total counter\n"
+        << "leafserver_auth_failures_total " << auth_failures_.load(std::memory_order_relaxed)
+        << '\n';
+    for (const auto& [name, value] : counters)
+    {
+        out << "# TYPE " << name << " counter\n" << name << ' ' << value << '\n';
+    }
+    for (const auto& [name, value] : gauges)
+    {
+        out << "# TYPE " << name << " gauge\n" << name << ' ' << format_value(value) << '\n';
+    }
+    return out.str();
+}
+
+} // namespace server
@@ -0,0 +1,2419 @@
+#include "package_storage.h"
+
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <chrono>
+#include <fstream>
+#include <initializer_list>
+#include <iomanip>
+#include <random>
+#include <shared_mutex>
+#include <sstream>
+#include <system_error>
+
+#include "async_log.h"
+#include "route_trie.h"
+
+#ifdef _WIN32
+#include <io.h>
+#include <share.h>
+#include <sys/stat.h>
+#else
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+#endif
+
+namespace server
+{
+namespace
+{
+
+namespace fs = std::filesystem;
+
+std::string iso8601_now()
+{
+    const auto now  = std::chrono::system_clock::now();
+    const auto time = std::chrono::system_clock::to_time_t(now);
+    const auto ms =
+        std::chrono::duration_cast<std::chrono::milliseconds>(now.time_since_epoch()) % 1000;
+    const std::tm      utc = to_utc(time);
+    std::ostringstream out;
+    out << std::put_time(&utc, "%Y-%m-%dT%H:%M:%S") << '.' << std::setw(3) << std::setfill('0')
+        << ms.count() << "+0000";
+    return out.str();
+}
+
+// "YYYY-MM-DDTHH:MM:SS" prefix of iso8601_now() for time, comparable as a string with the first
+// 19 characters of any revision time.
+std::string iso8601_seconds(std::time_t time)
+{
+    const std::tm      utc = to_utc(time);
+    std::ostringstream out;
+    out << std::put_time(&utc, "%Y-%m-%dT%H:%M:%S");
+    return out.str();
+}
+
+std::int64_t unix_now()
+{
+    return std::chrono::duration_cast<std::chrono::seconds>(
+               std::chrono::system_clock::now().time_since_epoch())
+        .count();
+}
+
+std::vector<std::string> list_subdirectories(const fs::path& dir)
+{
+    std::vector<std::string> names;
+    std::error_code          ec;
+    for (fs::directory_iterator it(dir, ec), end; !ec && it != end; it.increment(ec))
+    {
+        if (it->is_directory(ec))
+        {
+            names.push_back(it->path().filename().string());
+        }
+    }
+    return names;
+}
+
+// In-flight uploads are written as "<file>.upload-<token>" next to their destination, token being
+// kUploadTempTokenLength characters of random_token().
+constexpr std::string_view kUploadTempMarker      = ".upload-";
+constexpr std::size_t      kUploadTempTokenLength = 12;
+
+bool sync_file(std::FILE* file)
+{
+    if (std::fflush(file) != 0)
+    {
+        return false;
+    }
+#ifdef _WIN32
+    return _commit(_fileno(file)) == 0;
+#else
+    return ::fsync(::fileno(file)) == 0;
+#endif
+}
+
+void sync_directory([[maybe_unused]] const fs::path& dir)
+{
+#ifndef _WIN32
+    const int fd = ::open(dir.c_str(), O_RDONLY);
+    if (fd >= 0)
+    {
+        ::fsync(fd);
+        ::close(fd);
+    }
+#endif
+}
+
+// Revisions of a store that predates metadata.log, oldest first. Each revision directory holds a
+// revision.json whose first line is its upload time; a revision without one sorts as uploaded now.
+std::vector<RevisionInfo> import_revisions(const fs::path& revisions_dir)
+{
+    std::vector<RevisionInfo> revisions;
+    for (const auto& name : list_subdirectories(revisions_dir))
+    {
+        const fs::path revision_dir = revisions_dir / name;
+        std::string    time         = iso8601_now();
+        if (std::ifstream in(platform_fs_path(revision_dir / "revision.json")); in)
+        {
+            std::string line;
+            std::getline(in, line);
+            if (!trim(line).empty())
+            {
+                time = trim(line);
+            }
+        }
+        revisions.push_back({name, std::move(time), revision_dir});
+    }
+    std::stable_sort(revisions.begin(),
+                     revisions.end(),
+                     [](const RevisionInfo& lhs, const RevisionInfo& rhs)
+                     { return lhs.time < rhs.time; });
+    return revisions;
+}
+
+// Orders (time, reference) pairs newest first, then by reference.
+struct NewestFirst
+{
+    bool operator()(const std::pair<std::string, std::string>& lhs,
+                    const std::pair<std::string, std::string>& rhs) const
+    {
+        return lhs.first != rhs.first ? lhs.first > rhs.first : lhs.second < rhs.second;
+    }
+};
+
+using UpdateOrder = std::map<std::pair<std::string, std::string>, RecipeRef, NewestFirst>;
+
+// One indexed file. package_id and package_revision are empty for a recipe file.
+struct ContentLocation
+{
+    RecipeRef   ref;
+    std::string revision;
+    std::string package_id;
+    std::string package_revision;
+    std::string name;
+
+    bool operator==(const ContentLocation&) const = default;
+};
+
+// Revisions of one recipe or package ID in commit order, oldest first, so the latest revision is
+// always order.back() and listings never need to re-sort by time.
+template <typename Node>
+struct RevisionList
+{
+    std::map<std::string, Node> nodes;
+    std::vector<std::string>    order;
+
+    // Returns false when the revision is already known; its original time is kept.
+    bool insert(const std::string& revision, const std::string& time)
+    {
+        if (nodes.contains(revision))
+        {
+            return false;
+        }
+        nodes[revision].time = time;
+        const auto position  = std::upper_bound(order.begin(),
+                                               order.end(),
+                                               time,
+                                               [this](const std::string& value, const auto& other)
+                                               { return value < nodes.at(other).time; });
+        order.insert(position, revision);
+        return true;
+    }
+
+    bool erase(const std::string& revision)
+    {
+        if (nodes.erase(revision) == 0)
+        {
+            return false;
+        }
+        order.erase(std::find(order.begin(), order.end(), revision));
+        return true;
+    }
+
+    [[nodiscard]] const Node* find(const std::string& revision) const
+    {
+        const auto node = nodes.find(revision);
+        return node == nodes.end() ? nullptr : &node->second;
+    }
+
+    [[nodiscard]] Node* find(const std::string& revision)
+    {
+        const auto node = nodes.find(revision);
+        return node == nodes.end() ? nullptr : &node->second;
+    }
+
+    [[nodiscard]] std::vector<RevisionInfo> newest_first() const
+    {
+        std::vector<RevisionInfo> revisions;
+        revisions.reserve(order.size());
+        for (auto it = order.rbegin(); it != order.rend(); ++it)
+        {
+            revisions.push_back({*it, nodes.at(*it).time, {}});
+        }
+        return revisions;
+    }
+
+    [[nodiscard]] std::optional<RevisionInfo> latest() const
+    {
+        if (order.empty())
+        {
+            return std::nullopt;
+        }
+        return RevisionInfo{order.back(), nodes.at(order.back()).time, {}};
+    }
+
+    [[nodiscard]] bool empty() const
+    {
+        return order.empty();
+    }
+};
+
+} // namespace
+
+std::string ref_string(const RecipeRef& ref)
+{
+    return ref.name + "/" + ref.version + "@" + ref.user + "/" + ref.channel;
+}
+
+std::optional<RecipeRef> parse_reference(std::string_view reference)
+{
+    const auto at           = reference.find('@');
+    const auto name_version = reference.substr(0, at);
+    const auto slash        = name_version.find('/');
+    if (slash == std::string_view::npos)
+    {
+        return std::nullopt;
+    }
+    RecipeRef ref{std::string(name_version.substr(0, slash)),
+                  std::string(name_version.substr(slash + 1)),
+                  "_",
+                  "_"};
+    if (at != std::string_view::npos)
+    {
+        const auto user_channel = reference.substr(at + 1);
+        const auto separator    = user_channel.find('/');
+        ref.user                = user_channel.substr(0, separator);
+        if (separator != std::string_view::npos)
+        {
+            ref.channel = user_channel.substr(separator + 1);
+        }
+    }
+    if (!is_safe_path_segment(ref.name) || !is_safe_path_segment(ref.version) ||
+        !is_safe_path_segment(ref.user) || !is_safe_path_segment(ref.channel))
+    {
+        return std::nullopt;
+    }
+    return ref;
+}
+
+bool is_safe_path_segment(std::string_view value)
+{
+    return RouteTrie::is_safe_segment(value);
+}
+
+std::string trim(std::string value)
+{
+    auto not_space = [](unsigned char ch) { return !std::isspace(ch); };
+    value.erase(value.begin(), std::find_if(value.begin(), value.end(), not_space));
+    value.erase(std::find_if(value.rbegin(), value.rend(), not_space).base(), value.end());
+    return value;
+}
+
+std::tm to_utc(std::time_t time)
+{
+    std::tm utc{};
+#ifdef _WIN32
+    gmtime_s(&utc, &time);
+#else
+    gmtime_r(&time, &utc);
+#endif
+    return utc;
+}
+
+std::string random_token(std::size_t length)
+{
+    static constexpr char kAlphabet[] =
+        "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ";
+    std::random_device                         rd;
+    std::mt19937                               gen(rd());
+    std::uniform_int_distribution<std::size_t> dist(0, sizeof(kAlphabet) - 2);
+    std::string                                token;
+    token.reserve(length);
+    for (std::size_t i = 0; i < length; ++i)
+    {
+        token.push_back(kAlphabet[dist(gen)]);
+    }
+    return token;
+}
+
+fs::path platform_fs_path(const fs::path& input)
+{
+#ifdef _WIN32
+    fs::path           absolute = fs::absolute(input);
+    const std::wstring value    = absolute.native();
+    if (value.rfind(L"\\\\?\\", 0) == 0)
+    {
+        return absolute;
+    }
+    if (value.rfind(L"\\\\", 0) == 0)
+    {
+        return fs::path(L"\\\\?\\UNC\\" + value.substr(2));
+    }
+    return fs::path(L"\\\\?\\" + value);
+#else
+    return input;
+#endif
+}
+
+bool is_upload_temp_file(const std::string& file_name)
+{
+    const auto suffix = kUploadTempMarker.size() + kUploadTempTokenLength;
+    if (file_name.size() <= suffix)
+    {
+        return false;
+    }
+    const auto marker = file_name.size() - suffix;
+    return file_name.compare(marker, kUploadTempMarker.size(), kUploadTempMarker) == 0 &&
+           std::all_of(file_name.end() - static_cast<std::ptrdiff_t>(kUploadTempTokenLength),
+                       file_name.end(),
+                       [](unsigned char c) { return std::isalnum(c) != 0; });
+}
+
+bool ensure_parent_dir(const fs::path& file)
+{
+    std::error_code ec;
+    fs::create_directories(platform_fs_path(file).parent_path(), ec);
+    return !ec;
+}
+
+StoreLock::~StoreLock()
+{
+    release();
+}
+
+bool StoreLock::acquire(const fs::path& file)
+{
+    release();
+#ifdef _WIN32
+    // A deny-all share mode makes the open itself exclusive.
+    if (_wsopen_s(&fd_,
+                  platform_fs_path(file).c_str(),
+                  _O_RDWR | _O_CREAT | _O_NOINHERIT,
+                  _SH_DENYRW,
+                  _S_IREAD | _S_IWRITE) != 0)
+    {
+        fd_ = -1;
+    }
+#else
+    fd_ = ::open(file.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd_ >= 0 && ::flock(fd_, LOCK_EX | LOCK_NB) != 0)
+    {
+        release();
+    }
+#endif
+    return held();
+}
+
+void StoreLock::release()
+{
+    if (fd_ >= 0)
+    {
+#ifdef _WIN32
+        _close(fd_);
+#else
+        ::close(fd_);
+#endif
+        fd_ = -1;
+    }
+}
+
+bool StoreLock::held() const
+{
+    return fd_ >= 0;
+}
+
+StagedFile::StagedFile(fs::path destination) : StagedFile(destination, destination.parent_path())
+{
+}
+
+StagedFile::StagedFile(fs::path destination, const fs::path& temp_dir)
+    : destination_(platform_fs_path(destination)),
+      temp_(platform_fs_path(temp_dir) /
+            (destination_.filename().string() + std::string(kUploadTempMarker) +
+             random_token(kUploadTempTokenLength)))
+{
+}
+
+StagedFile::~StagedFile()
+{
+    discard();
+}
+
+bool StagedFile::open()
+{
+#ifdef _WIN32
+    file_ = _wfopen(temp_.c_str(), L"wb");
+#else
+    file_ = std::fopen(temp_.c_str(), "wb");
+#endif
+    return file_ != nullptr;
+}
+
+bool StagedFile::write(const char* data, std::size_t length)
+{
+    if (file_ == nullptr || std::fwrite(data, 1, length, file_) != length)
+    {
+        return false;
+    }
+    hasher_.update(data, length);
+    size_ += length;
+    return true;
+}
+
+bool StagedFile::finish()
+{
+    if (file_ == nullptr)
+    {
+        return finished_;
+    }
+    const bool synced = sync_file(file_);
+    const bool closed = std::fclose(file_) == 0;
+    file_             = nullptr;
+    finished_         = synced && closed;
+    return finished_;
+}
+
+bool StagedFile::commit()
+{
+    return commit_as(destination_);
+}
+
+bool StagedFile::commit_as(const fs::path& target)
+{
+    if (!finish())
+    {
+        return false;
+    }
+    std::error_code ec;
+    fs::rename(temp_, target, ec);
+    if (ec)
+    {
+        return false;
+    }
+    committed_ = true;
+    sync_directory(target.parent_path());
+    return true;
+}
+
+const fs::path& StagedFile::destination() const
+{
+    return destination_;
+}
+
+std::uint64_t StagedFile::size() const
+{
+    return size_;
+}
+
+const std::string& StagedFile::sha256()
+{
+    if (digest_.empty())
+    {
+        digest_ = hasher_.hex_digest();
+    }
+    return digest_;
+}
+
+void StagedFile::discard()
+{
+    if (file_ != nullptr)
+    {
+        std::fclose(file_);
+        file_ = nullptr;
+    }
+    if (!committed_)
+    {
+        std::error_code ec;
+        fs::remove(temp_, ec);
+    }
+}
+
+std::optional<FileChecksum> checksum_existing_file(const fs::path& file)
+{
+    std::ifstream in(platform_fs_path(file), std::ios::binary);
+    if (!in)
+    {
+        return std::nullopt;
+    }
+    Sha256            hasher;
+    FileChecksum      checksum;
+    std::vector<char> buffer(64 * 1024);
+    while (in.read(buffer.data(), static_cast<std::streamsize>(buffer.size())) || in.gcount() > 0)
+    {
+        hasher.update(buffer.data(), static_cast<std::size_t>(in.gcount()));
+        checksum.size += static_cast<std::uint64_t>(in.gcount());
+    }
+    checksum.sha256   = hasher.hex_digest();
+    checksum.modified = unix_now();
+    return checksum;
+}
+
+// Content-addressed store under <storage>/blobs/<aa>/<sha256>. In dedup mode every uploaded file
+// is moved here and revision files/ entries become hard links to it, so byte-identical artifacts
+// shared by many revisions occupy one inode on disk and one copy in the page cache.
+class BlobStore
+{
+  public:
+    explicit BlobStore(fs::path root) : root_(std::move(root))
+    {
+    }
+
+    // Rebuilds the counters from the blobs on disk and drops blobs no revision links to anymore.
+    void scan()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        blobs_         = 0;
+        stored_bytes_  = 0;
+        logical_bytes_ = 0;
+        for (const auto& prefix : list_subdirectories(root_))
+        {
+            std::error_code ec;
+            for (fs::directory_iterator it(root_ / prefix, ec), end; !ec && it != end;
+                 it.increment(ec))
+            {
+                std::error_code stat_ec;
+                const auto      links = fs::hard_link_count(it->path(), stat_ec);
+                const auto      size  = fs::file_size(it->path(), stat_ec);
+                if (stat_ec)
+                {
+                    continue;
+                }
+                if (links <= 1)
+                {
+                    fs::remove(it->path(), stat_ec);
+                    continue;
+                }
+                ++blobs_;
+                stored_bytes_ += size;
+                logical_bytes_ += size * (links - 1);
+            }
+        }
+    }
+
+    [[nodiscard]] fs::path blob_path(const std::string& sha256) const
+    {
+        return root_ / sha256.substr(0, 2) / sha256;
+    }
+
+    // Moves a finished upload into the store, or discards it when an identical blob already
+    // exists, and then links the blob at destination.
+    [[nodiscard]] bool publish(StagedFile& staged, const fs::path& destination)
+    {
+        if (!staged.finish())
+        {
+            return false;
+        }
+        const fs::path              blob = blob_path(staged.sha256());
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::error_code             ec;
+        if (!fs::exists(blob, ec))
+        {
+            fs::create_directories(blob.parent_path(), ec);
+            if (ec || !staged.commit_as(blob))
+            {
+                return false;
+            }
+            ++blobs_;
+            stored_bytes_ += staged.size();
+        }
+
+        const fs::path link = destination.parent_path() /
+                              (destination.filename().string() + std::string(kUploadTempMarker) +
+                               random_token(kUploadTempTokenLength));
+        bool linked = true;
+        fs::create_hard_link(blob, link, ec);
+        if (ec)
+        {
+            linked = false;
+            ec.clear();
+            fs::copy_file(blob, link, fs::copy_options::overwrite_existing, ec);
+        }
+        if (!ec)
+        {
+            fs::rename(link, destination, ec);
+        }
+        if (ec)
+        {
+            fs::remove(link, ec);
+            return false;
+        }
+        if (linked)
+        {
+            logical_bytes_ += staged.size();
+        }
+        return true;
+    }
+
+    // Must be checked before `file` is removed or replaced: only hard links into the store hold a
+    // reference that release() has to give back.
+    [[nodiscard]] bool is_linked(const fs::path& file, const std::string& sha256) const
+    {
+        std::error_code ec;
+        return fs::equivalent(file, blob_path(sha256), ec) && !ec;
+    }
+
+    void release(const std::string& sha256, std::uint64_t size)
+    {
+        const fs::path              blob = blob_path(sha256);
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::error_code             ec;
+        const auto                  links = fs::hard_link_count(blob, ec);
+        if (ec)
+        {
+            return;
+        }
+        logical_bytes_ -= std::min(logical_bytes_, size);
+        if (links <= 1 && fs::remove(blob, ec))
+        {
+            --blobs_;
+            stored_bytes_ -= std::min(stored_bytes_, size);
+        }
+    }
+
+    [[nodiscard]] DedupStats stats() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return {false, blobs_, stored_bytes_, logical_bytes_};
+    }
+
+  private:
+    fs::path           root_;
+    mutable std::mutex mutex_;
+    std::uint64_t      blobs_         = 0;
+    std::uint64_t      stored_bytes_  = 0;
+    std::uint64_t      logical_bytes_ = 0;
+};
+
+// Resident mirror of recipes/<name>/<version>/<user>/<channel>. It is rebuilt from metadata.log at
+// startup and then kept current by the upload and delete handlers, so the read routes answer
+// listings and file metadata lookups from memory instead of stat()-ing the store on every request.
+// Once a journal is attached every mutation is appended to it under the index lock, so the log
+// replays in exactly the order the index changed.
+class StorageIndex
+{
+  public:
+    void set_journal(MetadataLog* journal)
+    {
+        std::unique_lock lock(mutex_);
+        journal_ = journal;
+    }
+
+    // Applies one metadata.log record; unknown or malformed records are skipped.
+    void replay(const MetadataLog::Record& record)
+    {
+        if (record.size() < 5)
+        {
+            return;
+        }
+        const std::string& kind = record[0];
+        const RecipeRef    ref{record[1], record[2], record[3], record[4]};
+        const auto         args = std::span(record).subspan(5);
+        if (kind == "rrev" && args.size() == 2)
+        {
+            add_recipe_revision(ref, args[0], args[1]);
+        }
+        else if (kind == "prev" && args.size() == 4)
+        {
+            add_package_revision(ref, args[0], args[1], args[2], args[3]);
+        }
+        else if (kind == "rfile" && args.size() == 5)
+        {
+            if (const auto checksum = parse_checksum(args.subspan(2)))
+            {
+                set_recipe_file(ref, args[0], args[1], *checksum);
+            }
+        }
+        else if (kind == "pfile" && args.size() == 7)
+        {
+            if (const auto checksum = parse_checksum(args.subspan(4)))
+            {
+                set_package_file(ref, args[0], args[1], args[2], args[3], *checksum);
+            }
+        }
+        else if (kind == "rpub" && args.size() >= 2 && (args.size() - 2) % 4 == 0)
+        {
+            if (const auto files = parse_files(args.subspan(2)))
+            {
+                publish_recipe_revision(ref, args[0], args[1], *files);
+            }
+        }
+        else if (kind == "ppub" && args.size() >= 4 && (args.size() - 4) % 4 == 0)
+        {
+            if (const auto files = parse_files(args.subspan(4)))
+            {
+                publish_package_revision(ref, args[0], args[1], args[2], args[3], *files);
+            }
+        }
+        else if (kind == "rdel" && args.size() == 1)
+        {
+            remove_recipe_revision(ref, args[0]);
+        }
+        else if (kind == "pdel" && args.size() == 3)
+        {
+            remove_package_revision(ref, args[0], args[1], args[2]);
+        }
+    }
+
+    // Emits the minimal record set that replays to the current contents.
+    void snapshot(const MetadataLog::Emit& emit) const
+    {
+        std::shared_lock lock(mutex_);
+        emit_records(emit);
+    }
+
+    // Rewrites journal from a snapshot. The index lock is held throughout, so no mutation can land
+    // between the snapshot and the swap.
+    bool compact(MetadataLog& journal) const
+    {
+        std::shared_lock lock(mutex_);
+        return journal.rewrite([this](const MetadataLog::Emit& emit) { emit_records(emit); });
+    }
+
+    void clear()
+    {
+        std::unique_lock lock(mutex_);
+        recipes_.clear();
+        search_keys_.clear();
+        update_order_.clear();
+        recipe_bytes_.clear();
+        content_.clear();
+        stats_ = {};
+    }
+
+    // Returns false when the revision was already indexed.
+    bool add_recipe_revision(const RecipeRef&   ref,
+                             const std::string& revision,
+                             const std::string& time)
+    {
+        std::unique_lock lock(mutex_);
+        if (!insert_recipe_revision(ref, revision, time))
+        {
+            return false;
+        }
+        ++stats_.recipe_revisions;
+        journal(make_record("rrev", ref, {revision, time}));
+        return true;
+    }
+
+    bool add_package_revision(const RecipeRef&   ref,
+                              const std::string& recipe_revision,
+                              const std::string& package_id,
+                              const std::string& package_revision,
+                              const std::string& time)
+    {
+        std::unique_lock lock(mutex_);
+        if (insert_recipe_revision(ref, recipe_revision, time))
+        {
+            ++stats_.recipe_revisions;
+        }
+        auto& packages                = recipe_node(ref).find(recipe_revision)->packages;
+        const auto [package, created] = packages.try_emplace(package_id);
+        if (created)
+        {
+            ++stats_.packages;
+        }
+        if (!package->second.insert(package_revision, time))
+        {
+            return false;
+        }
+        ++stats_.package_revisions;
+        journal(make_record("prev", ref, {recipe_revision, package_id, package_revision, time}));
+        return true;
+    }
+
+    // Indexes a revision together with all of its files and journals them as a single record, so
+    // a replay after a crash sees either the whole revision or none of it. Returns false when the
+    // revision was already indexed.
+    bool publish_recipe_revision(const RecipeRef&   ref,
+                                 const std::string& revision,
+                                 const std::string& time,
+                                 const ChecksumMap& files)
+    {
+        std::unique_lock lock(mutex_);
+        if (!insert_recipe_revision(ref, revision, time))
+        {
+            return false;
+        }
+        ++stats_.recipe_revisions;
+        auto& node = *recipe_node(ref).find(revision);
+        for (const auto& [name, checksum] : files)
+        {
+            replace_file({ref, revision, {}, {}, name}, node.files, checksum);
+        }
+        journal(files_record("rpub", ref, {revision, time}, files));
+        return true;
+    }
+
+    // Also indexes the recipe revision, empty, if it is not there yet.
+    bool publish_package_revision(const RecipeRef&   ref,
+                                  const std::string& recipe_revision,
+                                  const std::string& package_id,
+                                  const std::string& package_revision,
+                                  const std::string& time,
+                                  const ChecksumMap& files)
+    {
+        std::unique_lock lock(mutex_);
+        if (insert_recipe_revision(ref, recipe_revision, time))
+        {
+            ++stats_.recipe_revisions;
+        }
+        auto& packages                = recipe_node(ref).find(recipe_revision)->packages;
+        const auto [package, created] = packages.try_emplace(package_id);
+        if (created)
+        {
+            ++stats_.packages;
+        }
+        if (!package->second.insert(package_revision, time))
+        {
+            return false;
+        }
+        ++stats_.package_revisions;
+        auto& node = *package->second.find(package_revision);
+        for (const auto& [name, checksum] : files)
+        {
+            replace_file({ref, recipe_revision, package_id, package_revision, name},
+                         node.files,
+                         checksum);
+        }
+        journal(files_record(
+            "ppub", ref, {recipe_revision, package_id, package_revision, time}, files));
+        return true;
+    }
+
+    // Bulk replacement used while walking a store that has no metadata.log yet; not journaled.
+    void set_recipe_files(const RecipeRef& ref, const std::string& revision, ChecksumMap files)
+    {
+        std::unique_lock lock(mutex_);
+        if (auto* node = find_recipe_revision(ref, revision))
+        {
+            const ContentLocation owner{ref, revision, {}, {}, {}};
+            account(ref, files_bytes(files), files_bytes(node->files));
+            unindex_files(owner, node->files);
+            index_files(owner, files);
+            node->files = std::move(files);
+        }
+    }
+
+    void set_package_files(const RecipeRef&   ref,
+                           const std::string& recipe_revision,
+                           const std::string& package_id,
+                           const std::string& package_revision,
+                           ChecksumMap        files)
+    {
+        std::unique_lock lock(mutex_);
+        if (auto* node =
+                find_package_revision(ref, recipe_revision, package_id, package_revision))
+        {
+            const ContentLocation owner{ref, recipe_revision, package_id, package_revision, {}};
+            account(ref, files_bytes(files), files_bytes(node->files));
+            unindex_files(owner, node->files);
+            index_files(owner, files);
+            node->files = std::move(files);
+        }
+    }
+
+    void set_recipe_file(const RecipeRef&    ref,
+                         const std::string&  revision,
+                         const std::string&  file_name,
+                         const FileChecksum& checksum)
+    {
+        std::unique_lock lock(mutex_);
+        if (auto* node = find_recipe_revision(ref, revision))
+        {
+            replace_file({ref, revision, {}, {}, file_name}, node->files, checksum);
+            journal(file_record("rfile", ref, {revision, file_name}, checksum));
+        }
+    }
+
+    void set_package_file(const RecipeRef&    ref,
+                          const std::string&  recipe_revision,
+                          const std::string&  package_id,
+                          const std::string&  package_revision,
+                          const std::string&  file_name,
+                          const FileChecksum& checksum)
+    {
+        std::unique_lock lock(mutex_);
+        if (auto* node =
+                find_package_revision(ref, recipe_revision, package_id, package_revision))
+        {
+            replace_file({ref, recipe_revision, package_id, package_revision, file_name},
+                         node->files,
+                         checksum);
+            journal(file_record("pfile",
+                                ref,
+                                {recipe_revision, package_id, package_revision, file_name},
+                                checksum));
+        }
+    }
+
+    bool remove_recipe_revision(const RecipeRef& ref, const std::string& revision)
+    {
+        std::unique_lock lock(mutex_);
+        const auto       recipe = recipes_.find(ref);
+        if (recipe == recipes_.end())
+        {
+            return false;
+        }
+        const auto* node = recipe->second.find(revision);
+        if (node == nullptr)
+        {
+            return false;
+        }
+        std::uint64_t bytes = files_bytes(node->files);
+        unindex_files({ref, revision, {}, {}, {}}, node->files);
+        stats_.packages -= node->packages.size();
+        for (const auto& [package_id, package] : node->packages)
+        {
+            stats_.package_revisions -= package.order.size();
+            for (const auto& [package_revision, package_node] : package.nodes)
+            {
+                bytes += files_bytes(package_node.files);
+                unindex_files({ref, revision, package_id, package_revision, {}},
+                              package_node.files);
+            }
+        }
+        account(ref, 0, bytes);
+        const auto latest = recipe->second.latest();
+        recipe->second.erase(revision);
+        reorder(ref, latest, recipe->second.latest());
+        --stats_.recipe_revisions;
+        journal(make_record("rdel", ref, {revision}));
+        if (recipe->second.empty())
+        {
+            const auto display = ref_string(ref);
+            search_keys_.erase({Glob::fold(display), display});
+            recipe_bytes_.erase(ref);
+            recipes_.erase(recipe);
+        }
+        return true;
+    }
+
+    bool remove_package_revision(const RecipeRef&   ref,
+                                 const std::string& recipe_revision,
+                                 const std::string& package_id,
+                                 const std::string& package_revision)
+    {
+        std::unique_lock lock(mutex_);
+        auto*            revision = find_recipe_revision(ref, recipe_revision);
+        if (revision == nullptr)
+        {
+            return false;
+        }
+        const auto package = revision->packages.find(package_id);
+        if (package == revision->packages.end())
+        {
+            return false;
+        }
+        const auto* node = package->second.find(package_revision);
+        if (node == nullptr)
+        {
+            return false;
+        }
+        account(ref, 0, files_bytes(node->files));
+        unindex_files({ref, recipe_revision, package_id, package_revision, {}}, node->files);
+        package->second.erase(package_revision);
+        --stats_.package_revisions;
+        journal(make_record("pdel", ref, {recipe_revision, package_id, package_revision}));
+        if (package->second.empty())
+        {
+            revision->packages.erase(package);
+            --stats_.packages;
+        }
+        return true;
+    }
+
+    // Counts kept current by every add and remove, so reading them is O(1).
+    [[nodiscard]] IndexStats stats() const
+    {
+        std::shared_lock lock(mutex_);
+        auto             stats = stats_;
+        stats.recipes          = recipes_.size();
+        return stats;
+    }
+
+    [[nodiscard]] std::uint64_t recipe_bytes(const RecipeRef& ref) const
+    {
+        std::shared_lock lock(mutex_);
+        const auto       bytes = recipe_bytes_.find(ref);
+        return bytes == recipe_bytes_.end() ? 0 : bytes->second;
+    }
+
+    [[nodiscard]] std::vector<RecipeRef> refs() const
+    {
+        std::shared_lock       lock(mutex_);
+        std::vector<RecipeRef> refs;
+        refs.reserve(recipes_.size());
+        for (const auto& [ref, revisions] : recipes_)
+        {
+            refs.push_back(ref);
+        }
+        return refs;
+    }
+
+    // Every reference of the recipe called name, whatever its version, user and channel.
+    [[nodiscard]] std::vector<RecipeRef> refs_named(const std::string& name) const
+    {
+        std::shared_lock       lock(mutex_);
+        std::vector<RecipeRef> refs;
+        for (auto it = recipes_.lower_bound(RecipeRef{name, {}, {}, {}});
+             it != recipes_.end() && it->first.name == name;
+             ++it)
+        {
+            refs.push_back(it->first);
+        }
+        return refs;
+    }
+
+    // Reference strings matching glob, in case-insensitive order. Only the slice of the sorted
+    // key set that shares the pattern's literal prefix is visited.
+    [[nodiscard]] std::vector<std::string> search_refs(const Glob& glob) const
+    {
+        const auto&              prefix = glob.literal_prefix();
+        std::shared_lock         lock(mutex_);
+        std::vector<std::string> matches;
+        for (auto it = search_keys_.lower_bound({prefix, std::string()});
+             it != search_keys_.end() && it->first.first.starts_with(prefix);
+             ++it)
+        {
+            if (glob.matches(it->first.first))
+            {
+                matches.push_back(it->first.second);
+            }
+        }
+        return matches;
+    }
+
+    // Up to limit recipes whose folded reference contains needle (already folded; empty matches
+    // every recipe) in case-insensitive reference order, starting after the reference `after`
+    // (empty for the first page).
+    [[nodiscard]] std::vector<RecipeSummary>
+    recipes_by_name(const std::string& needle, const std::string& after, std::size_t limit) const
+    {
+        std::shared_lock           lock(mutex_);
+        std::vector<RecipeSummary> page;
+        auto it = after.empty() ? search_keys_.begin()
+                                : search_keys_.upper_bound({Glob::fold(after), after});
+        for (; it != search_keys_.end() && page.size() < limit; ++it)
+        {
+            if (it->first.first.find(needle) != std::string::npos)
+            {
+                page.push_back(summarize(it->second));
+            }
+        }
+        return page;
+    }
+
+    // Up to limit recipes whose folded reference contains needle, most recently updated first,
+    // starting after the entry whose (latest time, reference) pair is `after`. Walks
+    // update_order_ from the cursor like recipes_by_name() walks the name order.
+    [[nodiscard]] std::vector<RecipeSummary>
+    recipes_by_update(const std::string&                         needle,
+                      const std::pair<std::string, std::string>& after,
+                      std::size_t                                limit) const
+    {
+        std::shared_lock           lock(mutex_);
+        std::vector<RecipeSummary> page;
+        auto it = after.second.empty() ? update_order_.begin() : update_order_.upper_bound(after);
+        for (; it != update_order_.end() && page.size() < limit; ++it)
+        {
+            if (Glob::fold(it->first.second).find(needle) != std::string::npos)
+            {
+                page.push_back(summarize(it->second));
+            }
+        }
+        return page;
+    }
+
+    [[nodiscard]] ChecksumMap recipe_files(const RecipeRef& ref, const std::string& revision) const
+    {
+        std::shared_lock lock(mutex_);
+        const auto*      node = find_recipe_revision(ref, revision);
+        return node == nullptr ? ChecksumMap{} : node->files;
+    }
+
+    [[nodiscard]] ChecksumMap package_files(const RecipeRef&   ref,
+                                            const std::string& recipe_revision,
+                                            const std::string& package_id,
+                                            const std::string& package_revision) const
+    {
+        std::shared_lock lock(mutex_);
+        const auto*      node =
+            find_package_revision(ref, recipe_revision, package_id, package_revision);
+        return node == nullptr ? ChecksumMap{} : node->files;
+    }
+
+    [[nodiscard]] std::vector<RevisionInfo> recipe_revisions(const RecipeRef& ref) const
+    {
+        std::shared_lock lock(mutex_);
+        const auto       recipe = recipes_.find(ref);
+        return recipe == recipes_.end() ? std::vector<RevisionInfo>{}
+                                        : recipe->second.newest_first();
+    }
+
+    [[nodiscard]] std::optional<RevisionInfo> latest_recipe_revision(const RecipeRef& ref) const
+    {
+        std::shared_lock lock(mutex_);
+        const auto       recipe = recipes_.find(ref);
+        return recipe == recipes_.end() ? std::nullopt : recipe->second.latest();
+    }
+
+    [[nodiscard]] std::vector<std::string> package_ids(const RecipeRef&   ref,
+                                                       const std::string& recipe_revision) const
+    {
+        std::shared_lock         lock(mutex_);
+        std::vector<std::string> ids;
+        if (const auto* revision = find_recipe_revision(ref, recipe_revision))
+        {
+            for (const auto& [package_id, revisions] : revision->packages)
+            {
+                ids.push_back(package_id);
+            }
+        }
+        return ids;
+    }
+
+    [[nodiscard]] std::vector<RevisionInfo> package_revisions(const RecipeRef&   ref,
+                                                              const std::string& recipe_revision,
+                                                              const std::string& package_id) const
+    {
+        std::shared_lock lock(mutex_);
+        const auto*      package = find_package(ref, recipe_revision, package_id);
+        return package == nullptr ? std::vector<RevisionInfo>{} : package->newest_first();
+    }
+
+    [[nodiscard]] std::optional<RevisionInfo>
+    latest_package_revision(const RecipeRef&   ref,
+                            const std::string& recipe_revision,
+                            const std::string& package_id) const
+    {
+        std::shared_lock lock(mutex_);
+        const auto*      package = find_package(ref, recipe_revision, package_id);
+        return package == nullptr ? std::nullopt : package->latest();
+    }
+
+    [[nodiscard]] bool has_recipe_revision(const RecipeRef& ref, const std::string& revision) const
+    {
+        std::shared_lock lock(mutex_);
+        return find_recipe_revision(ref, revision) != nullptr;
+    }
+
+    [[nodiscard]] bool has_package_revision(const RecipeRef&   ref,
+                                            const std::string& recipe_revision,
+                                            const std::string& package_id,
+                                            const std::string& package_revision) const
+    {
+        std::shared_lock lock(mutex_);
+        return find_package_revision(ref, recipe_revision, package_id, package_revision) !=
+               nullptr;
+    }
+
+    [[nodiscard]] std::optional<FileChecksum> recipe_file(const RecipeRef&   ref,
+                                                          const std::string& revision,
+                                                          const std::string& file_name) const
+    {
+        std::shared_lock lock(mutex_);
+        return find_file(find_recipe_revision(ref, revision), file_name);
+    }
+
+    [[nodiscard]] std::optional<FileChecksum> package_file(const RecipeRef&   ref,
+                                                           const std::string& recipe_revision,
+                                                           const std::string& package_id,
+                                                           const std::string& package_revision,
+                                                           const std::string& file_name) const
+    {
+        std::shared_lock lock(mutex_);
+        return find_file(
+            find_package_revision(ref, recipe_revision, package_id, package_revision), file_name);
+    }
+
+    // Some indexed file whose content has the given sha256, if any does.
+    [[nodiscard]] std::optional<ContentLocation> find_content(const std::string& sha256) const
+    {
+        std::shared_lock lock(mutex_);
+        const auto       found = content_.find(sha256);
+        return found == content_.end() ? std::nullopt
+                                       : std::optional<ContentLocation>(found->second);
+    }
+
+  private:
+    struct PackageRevisionNode
+    {
+        std::string time;
+        ChecksumMap files;
+    };
+
+    using PackageNode = RevisionList<PackageRevisionNode>;
+
+    struct RevisionNode
+    {
+        std::string                        time;
+        ChecksumMap                        files;
+        std::map<std::string, PackageNode> packages;
+    };
+
+    template <typename Node>
+    static std::optional<FileChecksum> find_file(const Node* node, const std::string& file_name)
+    {
+        if (node == nullptr)
+        {
+            return std::nullopt;
+        }
+        const auto file = node->files.find(file_name);
+        if (file == node->files.end())
+        {
+            return std::nullopt;
+        }
+        return file->second;
+    }
+
+    [[nodiscard]] const RevisionNode* find_recipe_revision(const RecipeRef&   ref,
+                                                           const std::string& revision) const
+    {
+        const auto recipe = recipes_.find(ref);
+        return recipe == recipes_.end() ? nullptr : recipe->second.find(revision);
+    }
+
+    [[nodiscard]] RevisionNode* find_recipe_revision(const RecipeRef&   ref,
+                                                     const std::string& revision)
+    {
+        return const_cast<RevisionNode*>(std::as_const(*this).find_recipe_revision(ref, revision));
+    }
+
+    [[nodiscard]] const PackageNode* find_package(const RecipeRef&   ref,
+                                                  const std::string& recipe_revision,
+                                                  const std::string& package_id) const
+    {
+        const auto* revision = find_recipe_revision(ref, recipe_revision);
+        if (revision == nullptr)
+        {
+            return nullptr;
+        }
+        const auto package = revision->packages.find(package_id);
+        return package == revision->packages.end() ? nullptr : &package->second;
+    }
+
+    [[nodiscard]] const PackageRevisionNode*
+    find_package_revision(const RecipeRef&   ref,
+                          const std::string& recipe_revision,
+                          const std::string& package_id,
+                          const std::string& package_revision) const
+    {
+        const auto* package = find_package(ref, recipe_revision, package_id);
+        return package == nullptr ? nullptr : package->find(package_revision);
+    }
+
+    [[nodiscard]] PackageRevisionNode* find_package_revision(const RecipeRef&   ref,
+                                                             const std::string& recipe_revision,
+                                                             const std::string& package_id,
+                                                             const std::string& package_revision)
+    {
+        return const_cast<PackageRevisionNode*>(std::as_const(*this).find_package_revision(
+            ref, recipe_revision, package_id, package_revision));
+    }
+
+    void emit_records(const MetadataLog::Emit& emit) const
+    {
+        for (const auto& [ref, recipe] : recipes_)
+        {
+            for (const auto& revision : recipe.order)
+            {
+                const auto& node = recipe.nodes.at(revision);
+                emit(make_record("rrev", ref, {revision, node.time}));
+                for (const auto& [name, checksum] : node.files)
+                {
+                    emit(file_record("rfile", ref, {revision, name}, checksum));
+                }
+                for (const auto& [package_id, package] : node.packages)
+                {
+                    for (const auto& package_revision : package.order)
+                    {
+                        const auto& package_node = package.nodes.at(package_revision);
+                        emit(make_record(
+                            "prev",
+                            ref,
+                            {revision, package_id, package_revision, package_node.time}));
+                        for (const auto& [name, checksum] : package_node.files)
+                        {
+                            emit(file_record("pfile",
+                                             ref,
+                                             {revision, package_id, package_revision, name},
+                                             checksum));
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    static MetadataLog::Record make_record(std::string_view                   kind,
+                                          const RecipeRef&                   ref,
+                                          std::initializer_list<std::string> fields)
+    {
+        MetadataLog::Record record{
+            std::string(kind), ref.name, ref.version, ref.user, ref.channel};
+        record.insert(record.end(), fields.begin(), fields.end());
+        return record;
+    }
+
+    static MetadataLog::Record file_record(std::string_view                   kind,
+                                           const RecipeRef&                   ref,
+                                           std::initializer_list<std::string> fields,
+                                           const FileChecksum&                checksum)
+    {
+        auto record = make_record(kind, ref, fields);
+        record.push_back(checksum.sha256);
+        record.push_back(std::to_string(checksum.size));
+        record.push_back(std::to_string(checksum.modified));
+        return record;
+    }
+
+    // Record followed by "<name> <sha256> <size> <modified>" for each file, as in rpub/ppub.
+    static MetadataLog::Record files_record(std::string_view                   kind,
+                                            const RecipeRef&                   ref,
+                                            std::initializer_list<std::string> fields,
+                                            const ChecksumMap&                 files)
+    {
+        auto record = make_record(kind, ref, fields);
+        for (const auto& [name, checksum] : files)
+        {
+            record.push_back(name);
+            record.push_back(checksum.sha256);
+            record.push_back(std::to_string(checksum.size));
+            record.push_back(std::to_string(checksum.modified));
+        }
+        return record;
+    }
+
+    static std::optional<ChecksumMap> parse_files(std::span<const std::string> fields)
+    {
+        ChecksumMap files;
+        for (std::size_t i = 0; i + 4 <= fields.size(); i += 4)
+        {
+            const auto checksum = parse_checksum(fields.subspan(i + 1, 3));
+            if (!checksum)
+            {
+                return std::nullopt;
+            }
+            files[fields[i]] = *checksum;
+        }
+        return files;
+    }
+
+    // "<sha256> <size> <modified>" fields of an rfile/pfile record.
+    static std::optional<FileChecksum> parse_checksum(std::span<const std::string> fields)
+    {
+        FileChecksum checksum{fields[0], 0, 0};
+        const auto   size     = std::from_chars(
+            fields[1].data(), fields[1].data() + fields[1].size(), checksum.size);
+        const auto   modified = std::from_chars(
+            fields[2].data(), fields[2].data() + fields[2].size(), checksum.modified);
+        if (size.ec != std::errc() || modified.ec != std::errc())
+        {
+            return std::nullopt;
+        }
+        return checksum;
+    }
+
+    // A failed append closes the journal, which the next MetadataLog::sync() reports.
+    void journal(const MetadataLog::Record& record)
+    {
+        if (journal_ != nullptr)
+        {
+            static_cast<void>(journal_->append(record));
+        }
+    }
+
+    static std::uint64_t files_bytes(const ChecksumMap& files)
+    {
+        std::uint64_t bytes = 0;
+        for (const auto& [name, checksum] : files)
+        {
+            bytes += checksum.size;
+        }
+        return bytes;
+    }
+
+    void account(const RecipeRef& ref, std::uint64_t added, std::uint64_t removed)
+    {
+        auto& bytes  = recipe_bytes_[ref];
+        bytes        = bytes + added - std::min(bytes + added, removed);
+        stats_.bytes = stats_.bytes + added - std::min(stats_.bytes + added, removed);
+    }
+
+    void replace_file(const ContentLocation& location,
+                      ChecksumMap&           files,
+                      const FileChecksum&    checksum)
+    {
+        const auto [slot, created] = files.try_emplace(location.name, checksum);
+        std::uint64_t previous     = 0;
+        if (!created)
+        {
+            previous = slot->second.size;
+            unindex_content(slot->second.sha256, location);
+            slot->second = checksum;
+        }
+        content_.emplace(checksum.sha256, location);
+        account(location.ref, checksum.size, previous);
+    }
+
+    void unindex_content(const std::string& sha256, const ContentLocation& location)
+    {
+        auto [it, end] = content_.equal_range(sha256);
+        for (; it != end; ++it)
+        {
+            if (it->second == location)
+            {
+                content_.erase(it);
+                return;
+            }
+        }
+    }
+
+    // owner names the revision; each file's name is filled in from files.
+    void index_files(ContentLocation owner, const ChecksumMap& files)
+    {
+        for (const auto& [name, checksum] : files)
+        {
+            owner.name = name;
+            content_.emplace(checksum.sha256, owner);
+        }
+    }
+
+    void unindex_files(ContentLocation owner, const ChecksumMap& files)
+    {
+        for (const auto& [name, checksum] : files)
+        {
+            owner.name = name;
+            unindex_content(checksum.sha256, owner);
+        }
+    }
+
+    [[nodiscard]] RecipeSummary summarize(const RecipeRef& ref) const
+    {
+        RecipeSummary summary{ref, ref_string(ref), 0, std::nullopt, 0};
+        if (const auto recipe = recipes_.find(ref); recipe != recipes_.end())
+        {
+            summary.revisions = recipe->second.order.size();
+            summary.latest    = recipe->second.latest();
+        }
+        if (const auto bytes = recipe_bytes_.find(ref); bytes != recipe_bytes_.end())
+        {
+            summary.bytes = bytes->second;
+        }
+        return summary;
+    }
+
+    // Adds a recipe revision, moving the recipe in update_order_ if it became the latest.
+    bool insert_recipe_revision(const RecipeRef&   ref,
+                                const std::string& revision,
+                                const std::string& time)
+    {
+        auto&      recipe = recipe_node(ref);
+        const auto latest = recipe.latest();
+        if (!recipe.insert(revision, time))
+        {
+            return false;
+        }
+        reorder(ref, latest, recipe.latest());
+        return true;
+    }
+
+    // Moves ref within update_order_ from the latest time it had to the one it has now.
+    void reorder(const RecipeRef&                   ref,
+                 const std::optional<RevisionInfo>& before,
+                 const std::optional<RevisionInfo>& after)
+    {
+        if (before && after && before->time == after->time)
+        {
+            return;
+        }
+        const auto display = ref_string(ref);
+        if (before)
+        {
+            update_order_.erase({before->time, display});
+        }
+        if (after)
+        {
+            update_order_.emplace(std::pair(after->time, display), ref);
+        }
+    }
+
+    RevisionList<RevisionNode>& recipe_node(const RecipeRef& ref)
+    {
+        const auto [recipe, inserted] = recipes_.try_emplace(ref);
+        if (inserted)
+        {
+            const auto display = ref_string(ref);
+            search_keys_.emplace(std::pair(Glob::fold(display), display), ref);
+        }
+        return recipe->second;
+    }
+
+    mutable std::shared_mutex                                mutex_;
+    std::map<RecipeRef, RevisionList<RevisionNode>>          recipes_;
+    // (lower-cased, original) reference strings backing search_refs() and the recipe pages.
+    std::map<std::pair<std::string, std::string>, RecipeRef> search_keys_;
+    // (latest revision time, reference string) of every recipe, newest first.
+    UpdateOrder                                              update_order_;
+    std::map<RecipeRef, std::uint64_t>                       recipe_bytes_;
+    std::multimap<std::string, ContentLocation>              content_; // sha256 -> file
+    IndexStats                                               stats_;
+    MetadataLog*                                             journal_ = nullptr;
+};
+
+PackageStorage::PackageStorage(fs::path root)
+    : root_(std::move(root)), index_(std::make_unique<StorageIndex>()),
+      blobs_(std::make_unique<BlobStore>(root_ / "blobs")), trash_(root_ / "trash"),
+      search_cache_(kSearchCacheBytes, kSearchCacheMaxEntry)
+{
+    fs::create_directories(root_);
+}
+
+PackageStorage::~PackageStorage() = default;
+
+void PackageStorage::set_dedup(bool enabled)
+{
+    dedup_ = enabled;
+}
+
+void PackageStorage::set_file_cache(std::size_t capacity, std::size_t max_entry)
+{
+    file_cache_ = capacity == 0 ? nullptr : std::make_unique<FileCache>(capacity, max_entry);
+}
+
+FileCache* PackageStorage::file_cache() const
+{
+    return file_cache_.get();
+}
+
+FileCache& PackageStorage::search_cache()
+{
+    return search_cache_;
+}
+
+fs::path PackageStorage::root() const
+{
+    return root_;
+}
+
+fs::path PackageStorage::config_path() const
+{
+    return root_ / "leafserver.conf";
+}
+
+fs::path PackageStorage::recipe_base(const RecipeRef& ref) const
+{
+    return root_ / "recipes" / ref.name / ref.version / ref.user / ref.channel;
+}
+
+fs::path PackageStorage::recipe_revision_path(const RecipeRef& ref, std::string_view revision) const
+{
+    return recipe_base(ref) / "revisions" / std::string(revision);
+}
+
+fs::path PackageStorage::recipe_files_path(const RecipeRef& ref, std::string_view revision) const
+{
+    return recipe_revision_path(ref, revision) / "files";
+}
+
+fs::path PackageStorage::package_revision_path(const RecipeRef& ref,
+                                               std::string_view recipe_revision,
+                                               std::string_view package_id,
+                                               std::string_view package_revision) const
+{
+    return recipe_revision_path(ref, recipe_revision) / "packages" / std::string(package_id) /
+           "revisions" / std::string(package_revision);
+}
+
+fs::path PackageStorage::package_files_path(const RecipeRef& ref,
+                                            std::string_view recipe_revision,
+                                            std::string_view package_id,
+                                            std::string_view package_revision) const
+{
+    return package_revision_path(ref, recipe_revision, package_id, package_revision) / "files";
+}
+
+void PackageStorage::ensure_layout() const
+{
+    fs::create_directories(root_ / "recipes");
+}
+
+fs::path PackageStorage::metadata_log_path() const
+{
+    return root_ / "metadata.log";
+}
+
+const std::string& PackageStorage::load_error() const
+{
+    return journal_.error();
+}
+
+bool PackageStorage::lock()
+{
+    return lock_.held() || lock_.acquire(root_ / "lock");
+}
+
+bool PackageStorage::load_index()
+{
+    if (!lock())
+    {
+        return false;
+    }
+    // Trash left by a previous process may hold the last links to blobs, which its release
+    // callbacks would have given back; sweep the store once it is deleted.
+    trash_.recover([this] { blobs_->scan(); });
+    // Staged revisions are only tracked in memory, so whatever a previous process staged is
+    // unreachable; clients upload unpublished revisions again.
+    for (const auto& leftover : {root_ / "staging", incoming_path()})
+    {
+        std::error_code ec;
+        if (!fs::is_empty(leftover, ec) && !ec && !trash_.discard(leftover))
+        {
+            return false;
+        }
+    }
+    blobs_->scan();
+    index_->set_journal(nullptr);
+    index_->clear();
+    std::error_code ec;
+    const auto      log_size = fs::file_size(metadata_log_path(), ec);
+    const bool      migrate  = ec || log_size == 0;
+    if (migrate)
+    {
+        const fs::path recipes_root = root_ / "recipes";
+        for (const auto& name : list_subdirectories(recipes_root))
+        {
+            for (const auto& version : list_subdirectories(recipes_root / name))
+            {
+                for (const auto& user : list_subdirectories(recipes_root / name / version))
+                {
+                    for (const auto& channel :
+                         list_subdirectories(recipes_root / name / version / user))
+                    {
+                        load_recipe_into_index({name, version, user, channel});
+                    }
+                }
+            }
+        }
+    }
+    if (!journal_.open(
+            metadata_log_path(),
+            [this](const MetadataLog::Record& record) { index_->replay(record); },
+            [this](const MetadataLog::Emit& emit) { index_->snapshot(emit); }))
+    {
+        return false;
+    }
+    if (journal_.should_compact() && !index_->compact(journal_))
+    {
+        return false;
+    }
+    index_->set_journal(&journal_);
+    return true;
+}
+
+fs::path PackageStorage::incoming_path() const
+{
+    return root_ / "incoming";
+}
+
+bool PackageStorage::store_recipe_file(const RecipeRef&                  ref,
+                                       const std::string&                revision,
+                                       const std::string&                file_name,
+                                       StagedFile&                       staged,
+                                       const std::optional<std::string>& time)
+{
+    const fs::path revision_dir = recipe_revision_path(ref, revision);
+    if (!staged.finish())
+    {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(revision_lock(revision_dir));
+    if (!index_->has_recipe_revision(ref, revision))
+    {
+        return stage_file(revision_dir, file_name, staged, time) &&
+               (!staging_holds(revision_dir, kRecipeManifestFiles) ||
+                publish_staged_recipe(ref, revision));
+    }
+    const bool stored = store_file(
+        revision_dir / "files" / file_name,
+        staged,
+        [&] { return index_->recipe_file(ref, revision, file_name); },
+        [&](const FileChecksum& checksum)
+        { index_->set_recipe_file(ref, revision, file_name, checksum); });
+    forget_cached_file(revision_dir / "files" / file_name);
+    return stored && persist();
+}
+
+bool PackageStorage::store_package_file(const RecipeRef&                  ref,
+                                        const std::string&                recipe_revision,
+                                        const std::string&                package_id,
+                                        const std::string&                package_revision,
+                                        const std::string&                file_name,
+                                        StagedFile&                       staged,
+                                        const std::optional<std::string>& time)
+{
+    const fs::path revision_dir =
+        package_revision_path(ref, recipe_revision, package_id, package_revision);
+    if (!staged.finish())
+    {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(revision_lock(revision_dir));
+    if (!index_->has_package_revision(ref, recipe_revision, package_id, package_revision))
+    {
+        return stage_file(revision_dir, file_name, staged, time) &&
+               (!staging_holds(revision_dir, kPackageManifestFiles) ||
+                publish_staged_package(ref, recipe_revision, package_id, package_revision));
+    }
+    const bool stored = store_file(
+        revision_dir / "files" / file_name,
+        staged,
+        [&]
+        {
+            return index_->package_file(
+                ref, recipe_revision, package_id, package_revision, file_name);
+        },
+        [&](const FileChecksum& checksum)
+        {
+            index_->set_package_file(
+                ref, recipe_revision, package_id, package_revision, file_name, checksum);
+        });
+    forget_cached_file(revision_dir / "files" / file_name);
+    return stored && persist();
+}
+
+bool PackageStorage::publish_recipe_revision(const RecipeRef& ref, const std::string& revision)
+{
+    std::lock_guard<std::mutex> lock(revision_lock(recipe_revision_path(ref, revision)));
+    return index_->has_recipe_revision(ref, revision) || publish_staged_recipe(ref, revision);
+}
+
+bool PackageStorage::publish_package_revision(const RecipeRef&   ref,
+                                              const std::string& recipe_revision,
+                                              const std::string& package_id,
+                                              const std::string& package_revision)
+{
+    std::lock_guard<std::mutex> lock(revision_lock(
+        package_revision_path(ref, recipe_revision, package_id, package_revision)));
+    return index_->has_package_revision(ref, recipe_revision, package_id, package_revision) ||
+           publish_staged_package(ref, recipe_revision, package_id, package_revision);
+}
+
+std::optional<FileChecksum> PackageStorage::recipe_file_checksum(const RecipeRef&   ref,
+                                                                 const std::string& revision,
+                                                                 const std::string& file_name)
+{
+    if (auto checksum = index_->recipe_file(ref, revision, file_name))
+    {
+        return checksum;
+    }
+    auto checksum = backfill_checksum(recipe_revision_path(ref, revision), file_name);
+    if (checksum)
+    {
+        index_->set_recipe_file(ref, revision, file_name, *checksum);
+    }
+    return checksum;
+}
+
+std::optional<FileChecksum>
+PackageStorage::package_file_checksum(const RecipeRef&   ref,
+                                      const std::string& recipe_revision,
+                                      const std::string& package_id,
+                                      const std::string& package_revision,
+                                      const std::string& file_name)
+{
+    if (auto checksum = index_->package_file(
+            ref, recipe_revision, package_id, package_revision, file_name))
+    {
+        return checksum;
+    }
+    auto checksum = backfill_checksum(
+        package_revision_path(ref, recipe_revision, package_id, package_revision), file_name);
+    if (checksum)
+    {
+        index_->set_package_file(
+            ref, recipe_revision, package_id, package_revision, file_name, *checksum);
+    }
+    return checksum;
+}
+
+bool PackageStorage::remove_recipe_revision(const RecipeRef& ref, const std::string& revision)
+{
+    const fs::path            revision_dir = recipe_revision_path(ref, revision);
+    std::vector<FileChecksum> linked =
+        linked_blobs(revision_dir, index_->recipe_files(ref, revision));
+    for (const auto& package_id : index_->package_ids(ref, revision))
+    {
+        for (const auto& package_revision :
+             index_->package_revisions(ref, revision, package_id))
+        {
+            const auto package_linked = linked_blobs(
+                package_revision_path(ref, revision, package_id, package_revision.revision),
+                index_->package_files(ref, revision, package_id, package_revision.revision));
+            linked.insert(linked.end(), package_linked.begin(), package_linked.end());
+        }
+    }
+    if (!trash_.discard(revision_dir, [this, linked] { release_blobs(linked); }))
+    {
+        return false;
+    }
+    index_->remove_recipe_revision(ref, revision);
+    forget_cached_revision(revision_dir);
+    return persist();
+}
+
+bool PackageStorage::remove_package_revision(const RecipeRef&   ref,
+                                             const std::string& recipe_revision,
+                                             const std::string& package_id,
+                                             const std::string& package_revision)
+{
+    const fs::path revision_dir =
+        package_revision_path(ref, recipe_revision, package_id, package_revision);
+    const auto linked = linked_blobs(
+        revision_dir,
+        index_->package_files(ref, recipe_revision, package_id, package_revision));
+    if (!trash_.discard(revision_dir, [this, linked] { release_blobs(linked); }))
+    {
+        return false;
+    }
+    index_->remove_package_revision(ref, recipe_revision, package_id, package_revision);
+    forget_cached_revision(revision_dir);
+    return persist();
+}
+
+std::size_t PackageStorage::apply_retention(std::size_t   keep_recipe_revisions,
+                                            std::uint64_t package_max_age_days)
+{
+    const auto cutoff = iso8601_seconds(
+        std::chrono::system_clock::to_time_t(std::chrono::system_clock::now()) -
+        static_cast<std::time_t>(package_max_age_days * 24 * 3600));
+    std::size_t removed = 0;
+    for (const auto& ref : index_->refs())
+    {
+        const auto revisions = index_->recipe_revisions(ref);
+        for (std::size_t i = 0; i < revisions.size(); ++i)
+        {
+            const auto& revision = revisions[i].revision;
+            if (keep_recipe_revisions != 0 && i >= keep_recipe_revisions)
+            {
+                removed += remove_recipe_revision(ref, revision) ? 1 : 0;
+                continue;
+            }
+            if (package_max_age_days == 0)
+            {
+                continue;
+            }
+            for (const auto& package_id : index_->package_ids(ref, revision))
+            {
+                const auto package_revisions = index_->package_revisions(ref, revision, package_id);
+                for (std::size_t j = 1; j < package_revisions.size(); ++j)
+                {
+                    if (package_revisions[j].time.substr(0, cutoff.size()) < cutoff)
+                    {
+                        removed += remove_package_revision(
+                                       ref, revision, package_id, package_revisions[j].revision)
+                                       ? 1
+                                       : 0;
+                    }
+                }
+            }
+        }
+    }
+    return removed;
+}
+
+std::size_t PackageStorage::discard_stale_staging(std::chrono::seconds max_idle)
+{
+    const auto            cutoff = std::chrono::steady_clock::now() - max_idle;
+    std::vector<fs::path> stale;
+    {
+        std::lock_guard<std::mutex> lock(pending_mutex_);
+        for (const auto& [revision_dir, pending] : pending_)
+        {
+            if (pending.touched < cutoff)
+            {
+                stale.push_back(revision_dir);
+            }
+        }
+    }
+    std::size_t discarded = 0;
+    for (const auto& revision_dir : stale)
+    {
+        std::lock_guard<std::mutex>  revision(revision_lock(revision_dir));
+        std::unique_lock<std::mutex> lock(pending_mutex_);
+        const auto                   pending = pending_.find(revision_dir);
+        if (pending == pending_.end() || pending->second.touched >= cutoff)
+        {
+            continue; // published, or written to again, since it was listed
+        }
+        PendingRevision taken = std::move(pending->second);
+        pending_.erase(pending);
+        lock.unlock();
+        std::vector<FileChecksum> linked;
+        for (const auto& [name, checksum] : taken.files)
+        {
+            if (blobs_->is_linked(taken.dir / name, checksum.sha256))
+            {
+                linked.push_back(checksum);
+            }
+        }
+        if (trash_.discard(taken.dir, [this, linked] { release_blobs(linked); }))
+        {
+            ++discarded;
+        }
+    }
+    return discarded;
+}
+
+std::size_t
+PackageStorage::reclaim_trash(std::size_t files_per_second, const TrashBin::Pause& pause)
+{
+    return trash_.reclaim(files_per_second, pause);
+}
+
+std::size_t PackageStorage::trash_pending() const
+{
+    return trash_.pending();
+}
+
+DedupStats PackageStorage::dedup_stats() const
+{
+    auto stats    = blobs_->stats();
+    stats.enabled = dedup_;
+    return stats;
+}
+
+IndexStats PackageStorage::index_stats() const
+{
+    return index_->stats();
+}
+
+void PackageStorage::manifest(const MetadataLog::Emit& emit) const
+{
+    index_->snapshot(emit);
+}
+
+std::optional<fs::path> PackageStorage::content_path(const std::string& sha256) const
+{
+    const auto location = index_->find_content(sha256);
+    if (!location)
+    {
+        return std::nullopt;
+    }
+    const auto files_dir =
+        location->package_id.empty()
+            ? recipe_files_path(location->ref, location->revision)
+            : package_files_path(location->ref,
+                                 location->revision,
+                                 location->package_id,
+                                 location->package_revision);
+    return files_dir / location->name;
+}
+
+std::uint64_t PackageStorage::recipe_bytes(const RecipeRef& ref) const
+{
+    return index_->recipe_bytes(ref);
+}
+
+bool PackageStorage::has_recipe_revision(const RecipeRef& ref, const std::string& revision) const
+{
+    return index_->has_recipe_revision(ref, revision);
+}
+
+bool PackageStorage::has_package_revision(const RecipeRef&   ref,
+                                          const std::string& recipe_revision,
+                                          const std::string& package_id,
+                                          const std::string& package_revision) const
+{
+    return index_->has_package_revision(ref, recipe_revision, package_id, package_revision);
+}
+
+std::vector<RevisionInfo> PackageStorage::list_recipe_revisions(const RecipeRef& ref) const
+{
+    auto revisions = index_->recipe_revisions(ref);
+    for (auto& revision : revisions)
+    {
+        revision.path = recipe_revision_path(ref, revision.revision);
+    }
+    return revisions;
+}
+
+std::optional<RevisionInfo> PackageStorage::latest_recipe_revision(const RecipeRef& ref) const
+{
+    auto latest = index_->latest_recipe_revision(ref);
+    if (latest)
+    {
+        latest->path = recipe_revision_path(ref, latest->revision);
+    }
+    return latest;
+}
+
+std::optional<RevisionInfo>
+PackageStorage::latest_package_revision(const RecipeRef&   ref,
+                                        const std::string& recipe_revision,
+                                        const std::string& package_id) const
+{
+    auto latest = index_->latest_package_revision(ref, recipe_revision, package_id);
+    if (latest)
+    {
+        latest->path = package_revision_path(ref, recipe_revision, package_id, latest->revision);
+    }
+    return latest;
+}
+
+std::vector<std::string>
+PackageStorage::list_package_ids(const RecipeRef& ref, const std::string& recipe_revision) const
+{
+    return index_->package_ids(ref, recipe_revision);
+}
+
+std::vector<RevisionInfo>
+PackageStorage::list_package_revisions(const RecipeRef&   ref,
+                                       const std::string& recipe_revision,
+                                       const std::string& package_id) const
+{
+    auto revisions = index_->package_revisions(ref, recipe_revision, package_id);
+    for (auto& revision : revisions)
+    {
+        revision.path = package_revision_path(ref, recipe_revision, package_id, revision.revision);
+    }
+    return revisions;
+}
+
+std::vector<std::string> PackageStorage::list_files(const fs::path& files_dir) const
+{
+    std::vector<std::string> files;
+    if (!fs::exists(files_dir))
+    {
+        return files;
+    }
+    for (const auto& entry : fs::directory_iterator(files_dir))
+    {
+        if (entry.is_regular_file() && !is_upload_temp_file(entry.path().filename().string()))
+        {
+            files.push_back(entry.path().filename().string());
+        }
+    }
+    std::sort(files.begin(), files.end());
+    return files;
+}
+
+std::vector<RecipeRef> PackageStorage::list_recipe_refs() const
+{
+    return index_->refs();
+}
+
+std::vector<RecipeRef> PackageStorage::list_recipe_versions(const std::string& name) const
+{
+    return index_->refs_named(name);
+}
+
+std::vector<std::string> PackageStorage::search_recipe_refs(const Glob& glob) const
+{
+    return index_->search_refs(glob);
+}
+
+std::vector<RecipeSummary> PackageStorage::recipes_by_name(const std::string& needle,
+                                                           const std::string& after,
+                                                           std::size_t        limit) const
+{
+    return index_->recipes_by_name(needle, after, limit);
+}
+
+std::vector<RecipeSummary>
+PackageStorage::recipes_by_update(const std::string&                         needle,
+                                  const std::pair<std::string, std::string>& after,
+                                  std::size_t                                limit) const
+{
+    return index_->recipes_by_update(needle, after, limit);
+}
+
+ChecksumMap
+PackageStorage::recipe_file_list(const RecipeRef& ref, const std::string& revision) const
+{
+    return index_->recipe_files(ref, revision);
+}
+
+ChecksumMap PackageStorage::package_file_list(const RecipeRef&   ref,
+                                              const std::string& recipe_revision,
+                                              const std::string& package_id,
+                                              const std::string& package_revision) const
+{
+    return index_->package_files(ref, recipe_revision, package_id, package_revision);
+}
+
+void PackageStorage::forget_cached_file(const fs::path& file)
+{
+    if (file_cache_)
+    {
+        file_cache_->erase(file.generic_string());
+    }
+}
+
+void PackageStorage::forget_cached_revision(const fs::path& revision_dir)
+{
+    const std::string prefix = revision_dir.generic_string() + '/';
+    if (file_cache_)
+    {
+        file_cache_->erase_prefix(prefix);
+    }
+    search_cache_.erase_prefix(prefix);
+}
+
+std::mutex& PackageStorage::revision_lock(const fs::path& revision_dir)
+{
+    return revision_locks_[std::hash<std::string>{}(revision_dir.string()) %
+                           revision_locks_.size()];
+}
+
+template <typename Find, typename Record>
+bool PackageStorage::store_file(const fs::path& target,
+                                StagedFile&     staged,
+                                Find            find_previous,
+                                Record          record)
+{
+    std::optional<FileChecksum> replaced;
+    if (const auto previous = find_previous();
+        previous && blobs_->is_linked(target, previous->sha256))
+    {
+        replaced = previous;
+    }
+    if (!ensure_parent_dir(target) ||
+        !(dedup_ ? blobs_->publish(staged, target) : staged.commit_as(target)))
+    {
+        return false;
+    }
+    if (replaced)
+    {
+        blobs_->release(replaced->sha256, replaced->size);
+    }
+    record(FileChecksum{staged.sha256(), staged.size(), unix_now()});
+    return true;
+}
+
+bool PackageStorage::stage_file(const fs::path&                   revision_dir,
+                                const std::string&                file_name,
+                                StagedFile&                       staged,
+                                const std::optional<std::string>& time)
+{
+    PendingRevision* pending = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(pending_mutex_);
+        pending = &pending_[revision_dir];
+    }
+    if (pending->dir.empty())
+    {
+        pending->dir = root_ / "staging" / random_token(16);
+    }
+    pending->touched = std::chrono::steady_clock::now();
+    const bool stored = store_file(
+        pending->dir / file_name,
+        staged,
+        [&]
+        {
+            const auto previous = pending->files.find(file_name);
+            return previous == pending->files.end()
+                       ? std::nullopt
+                       : std::optional<FileChecksum>(previous->second);
+        },
+        [&](const FileChecksum& checksum) { pending->files[file_name] = checksum; });
+    if (stored && time)
+    {
+        pending->time = time;
+    }
+    return stored;
+}
+
+bool PackageStorage::staging_holds(const fs::path&                   revision_dir,
+                                   std::span<const std::string_view> file_names)
+{
+    std::lock_guard<std::mutex> lock(pending_mutex_);
+    const auto                  pending = pending_.find(revision_dir);
+    return pending != pending_.end() &&
+           std::all_of(file_names.begin(),
+                       file_names.end(),
+                       [&](std::string_view name)
+                       { return pending->second.files.contains(std::string(name)); });
+}
+
+std::optional<PackageStorage::PendingRevision>
+PackageStorage::take_staged(const fs::path& revision_dir)
+{
+    std::unique_lock<std::mutex> lock(pending_mutex_);
+    const auto                   pending = pending_.find(revision_dir);
+    if (pending == pending_.end())
+    {
+        return std::nullopt;
+    }
+    lock.unlock();
+    const fs::path  files_dir = revision_dir / "files";
+    std::error_code ec;
+    fs::create_directories(revision_dir, ec);
+    // Anything already there was never indexed, e.g. files left by a crash mid-upload.
+    if (ec || (fs::exists(files_dir, ec) && !trash_.discard(files_dir)))
+    {
+        return std::nullopt;
+    }
+    fs::rename(pending->second.dir, files_dir, ec);
+    if (ec)
+    {
+        return std::nullopt;
+    }
+    sync_directory(revision_dir);
+    lock.lock();
+    PendingRevision taken = std::move(pending->second);
+    pending_.erase(pending);
+    return taken;
+}
+
+bool PackageStorage::publish_staged_recipe(const RecipeRef& ref, const std::string& revision)
+{
+    const auto staged = take_staged(recipe_revision_path(ref, revision));
+    if (!staged)
+    {
+        return false;
+    }
+    index_->publish_recipe_revision(
+        ref, revision, staged->time.value_or(iso8601_now()), staged->files);
+    return persist();
+}
+
+bool PackageStorage::publish_staged_package(const RecipeRef&   ref,
+                                            const std::string& recipe_revision,
+                                            const std::string& package_id,
+                                            const std::string& package_revision)
+{
+    const auto staged = take_staged(
+        package_revision_path(ref, recipe_revision, package_id, package_revision));
+    if (!staged)
+    {
+        return false;
+    }
+    index_->publish_package_revision(ref,
+                                    recipe_revision,
+                                    package_id,
+                                    package_revision,
+                                    staged->time.value_or(iso8601_now()),
+                                    staged->files);
+    return persist();
+}
+
+std::optional<FileChecksum>
+PackageStorage::backfill_checksum(const fs::path& revision_dir, const std::string& file_name)
+{
+    if (is_upload_temp_file(file_name))
+    {
+        return std::nullopt;
+    }
+    return checksum_existing_file(revision_dir / "files" / file_name);
+}
+
+bool PackageStorage::persist()
+{
+    if (!journal_.sync())
+    {
+        append_debug_log(LogLevel::Error, "metadata.log: sync failed");
+        return false;
+    }
+    if (journal_.should_compact())
+    {
+        std::unique_lock lock(compact_mutex_, std::try_to_lock);
+        if (lock.owns_lock() && journal_.should_compact() && !index_->compact(journal_))
+        {
+            append_debug_log(LogLevel::Error, "metadata.log: compaction failed");
+        }
+    }
+    return true;
+}
+
+ChecksumMap PackageStorage::import_checksums(const fs::path& revision_dir) const
+{
+    ChecksumMap checksums;
+    for (const auto& name : list_files(revision_dir / "files"))
+    {
+        if (auto checksum = checksum_existing_file(revision_dir / "files" / name))
+        {
+            checksums[name] = *checksum;
+        }
+    }
+    return checksums;
+}
+
+std::vector<FileChecksum>
+PackageStorage::linked_blobs(const fs::path& revision_dir, const ChecksumMap& files) const
+{
+    std::vector<FileChecksum> linked;
+    for (const auto& [name, checksum] : files)
+    {
+        if (blobs_->is_linked(revision_dir / "files" / name, checksum.sha256))
+        {
+            linked.push_back(checksum);
+        }
+    }
+    return linked;
+}
+
+void PackageStorage::release_blobs(const std::vector<FileChecksum>& linked)
+{
+    for (const auto& checksum : linked)
+    {
+        blobs_->release(checksum.sha256, checksum.size);
+    }
+}
+
+void PackageStorage::load_recipe_into_index(const RecipeRef& ref)
+{
+    for (const auto& revision : import_revisions(recipe_base(ref) / "revisions"))
+    {
+        index_->add_recipe_revision(ref, revision.revision, revision.time);
+        index_->set_recipe_files(ref, revision.revision, import_checksums(revision.path));
+        for (const auto& package_id : list_subdirectories(revision.path / "packages"))
+        {
+            for (const auto& package_revision :
+                 import_revisions(revision.path / "packages" / package_id / "revisions"))
+            {
+                index_->add_package_revision(ref,
+                                            revision.revision,
+                                            package_id,
+                                            package_revision.revision,
+                                            package_revision.time);
+                index_->set_package_files(ref,
+                                         revision.revision,
+                                         package_id,
+                                         package_revision.revision,
+                                         import_checksums(package_revision.path));
+            }
+        }
+    }
+}
+
+std::optional<std::string> read_small_file(const fs::path& file)
+{
+    std::ifstream in(platform_fs_path(file), std::ios::binary);
+    if (!in)
+    {
+        return std::nullopt;
+    }
+    std::ostringstream out;
+    out << in.rdbuf();
+    return out.str();
+}
+
+std::map<std::string, std::map<std::string, std::string>>
+parse_ini_sections(const std::string& content)
+{
+    std::map<std::string, std::map<std::string, std::string>> sections;
+    std::string                                               current = "root";
+    std::istringstream                                        input(content);
+    std::string                                               line;
+    while (std::getline(input, line))
+    {
+        line = trim(line);
+        if (line.empty() || line.starts_with('#') || line.starts_with(';'))
+        {
+            continue;
+        }
+        if (line.front() == '[' && line.back() == ']')
+        {
+            current = line.substr(1, line.size() - 2);
+            continue;
+        }
+        const auto sep = line.find('=');
+        if (sep == std::string::npos)
+        {
+            continue;
+        }
+        sections[current][trim(line.substr(0, sep))] = trim(line.substr(sep + 1));
+    }
+    return sections;
+}
+
+bool copy_into(const fs::path& source, StagedFile& staged)
+{
+    std::ifstream     in(platform_fs_path(source), std::ios::binary);
+    std::vector<char> buffer(1024 * 1024);
+    while (in)
+    {
+        in.read(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+        const auto count = static_cast<std::size_t>(in.gcount());
+        if (count > 0 && !staged.write(buffer.data(), count))
+        {
+            return false;
+        }
+    }
+    return in.eof() && staged.finish();
+}
+
+} // namespace server
@@ -0,0 +1,328 @@
+#include "prefetcher.h"
+
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <set>
+#include <thread>
+
+#include <nlohmann/json.hpp>
+
+#include "async_log.h"
+#include "tar.h"
+
+namespace server
+{
+namespace
+{
+
+namespace fs = std::filesystem;
+
+} // namespace
+
+Prefetcher::Prefetcher(PackageStorage&    storage,
+                       const std::string& url,
+                       std::string        user,
+                       std::string        password,
+                       std::size_t        jobs)
+    : storage_(storage), source_(url), user_(std::move(user)), password_(std::move(password)),
+      jobs_(std::max<std::size_t>(1, jobs))
+{
+}
+
+std::optional<std::string> Prefetcher::closure(const std::string& request) const
+{
+    auto       client = connect();
+    const auto result = client.Post(
+        source_.target("/api/closure"), httplib::Headers(), request, "application/json");
+    if (!result || result->status != 200)
+    {
+        append_debug_log(LogLevel::Warning, "PREFETCH closure failed");
+        return std::nullopt;
+    }
+    return result->body;
+}
+
+PrefetchStats Prefetcher::prefetch(const std::vector<PrefetchTarget>& targets)
+{
+    PrefetchStats                                      stats;
+    std::map<std::string, std::vector<PrefetchTarget>> groups;
+    std::set<std::string>                              seen;
+    for (const auto& target : targets)
+    {
+        const auto recipe_key = ref_string(target.ref) + '#' + target.revision;
+        if (!seen.insert(recipe_key + ':' + target.package_id + '#' + target.package_revision)
+                 .second)
+        {
+            continue;
+        }
+        if (held(target))
+        {
+            ++stats.held;
+            continue;
+        }
+        groups[recipe_key].push_back(target);
+    }
+
+    std::vector<const std::vector<PrefetchTarget>*> batch;
+    for (const auto& [recipe_key, group] : groups)
+    {
+        batch.push_back(&group);
+    }
+    std::atomic<std::size_t> next{0};
+    std::mutex               stats_mutex;
+    std::vector<std::thread> workers;
+    for (std::size_t i = 0; i < std::min(jobs_, batch.size()); ++i)
+    {
+        workers.emplace_back(
+            [&]
+            {
+                auto client = connect();
+                for (auto index = next++; index < batch.size(); index = next++)
+                {
+                    for (const auto& target : *batch[index])
+                    {
+                        PrefetchStats   result;
+                        const bool      ok = held(target) || fetch(client, target, result);
+                        std::lock_guard lock(stats_mutex);
+                        stats.revisions += ok ? 1 : 0;
+                        stats.failed += ok ? 0 : 1;
+                        stats.bytes += result.bytes;
+                    }
+                }
+            });
+    }
+    for (auto& worker : workers)
+    {
+        worker.join();
+    }
+    return stats;
+}
+
+httplib::Client Prefetcher::connect() const
+{
+    auto client = source_.client();
+    if (!user_.empty())
+    {
+        client.set_basic_auth(user_, password_);
+    }
+    return client;
+}
+
+bool Prefetcher::held(const PrefetchTarget& target) const
+{
+    return target.package_id.empty()
+               ? storage_.has_recipe_revision(target.ref, target.revision)
+               : storage_.has_package_revision(
+                     target.ref, target.revision, target.package_id, target.package_revision);
+}
+
+bool Prefetcher::fetch(httplib::Client& client, const PrefetchTarget& target, PrefetchStats& result)
+{
+    const auto& ref  = target.ref;
+    auto        path = "/api/bundle/" + ref.name + '/' + ref.version + '/' + ref.user + '/' +
+                       ref.channel + "/revisions/" + target.revision;
+    if (!target.package_id.empty())
+    {
+        path += "/packages/" + target.package_id + "/revisions/" + target.package_revision;
+    }
+
+    std::string             manifest_text;
+    std::vector<BundleFile> files;
+    bool                    in_manifest = false;
+    TarReader               reader(
+        [&](const std::string& name, std::uint64_t size)
+        {
+            in_manifest = name == "bundle.json";
+            if (in_manifest)
+            {
+                return manifest_text.empty() && size <= kMaxBundleManifest;
+            }
+            const bool recipe = name.starts_with("recipe/");
+            const auto slash  = name.find('/');
+            const auto file   = name.substr(slash == std::string::npos ? 0 : slash + 1);
+            if (!(recipe || name.starts_with("package/")) || !is_safe_path_segment(file) ||
+                (!recipe && target.package_id.empty()))
+            {
+                return false;
+            }
+            const auto destination =
+                recipe ? storage_.recipe_files_path(ref, target.revision) / file
+                       : storage_.package_files_path(
+                             ref, target.revision, target.package_id, target.package_revision) /
+                             file;
+            files.push_back(BundleFile{
+                file,
+                recipe,
+                std::make_unique<StagedFile>(destination, storage_.incoming_path())});
+            return ensure_parent_dir(storage_.incoming_path() / file) &&
+                   files.back().staged->open();
+        },
+        [&](const char* data, std::size_t length)
+        {
+            if (in_manifest)
+            {
+                manifest_text.append(data, length);
+                return true;
+            }
+            return files.back().staged->write(data, length);
+        },
+        [&] { return in_manifest || files.back().staged->finish(); });
+
+    int        status = 0;
+    const auto got    = client.Get(
+        source_.target(path),
+        [&](const httplib::Response& response)
+        {
+            status = response.status;
+            return status == 200;
+        },
+        [&](const char* data, std::size_t length) { return reader.feed(data, length); });
+    append_debug_log(LogLevel::Debug,
+                     "PREFETCH " + path + " status=" + std::to_string(status));
+    if (!got || status != 200 || !reader.finished())
+    {
+        append_debug_log(LogLevel::Warning, "PREFETCH " + path + " failed");
+        return false;
+    }
+
+    // Everything bundle.json lists must have arrived intact, and nothing else.
+    const auto manifest = nlohmann::json::parse(manifest_text, nullptr, false);
+    if (!manifest.is_object() || !manifest.contains("files") ||
+        !manifest["files"].is_object() || manifest["files"].size() != files.size())
+    {
+        append_debug_log(LogLevel::Warning, "PREFETCH " + path + " bad bundle.json");
+        return false;
+    }
+    for (const auto& file : files)
+    {
+        const auto key   = (file.recipe ? "recipe/" : "package/") + file.name;
+        const auto entry = manifest["files"].find(key);
+        if (entry == manifest["files"].end() || !entry->is_object() ||
+            entry->value("sha256", std::string()) != file.staged->sha256() ||
+            entry->value("size", std::uint64_t{0}) != file.staged->size())
+        {
+            append_debug_log(LogLevel::Warning, "PREFETCH " + path + " corrupt " + key);
+            return false;
+        }
+        result.bytes += file.staged->size();
+    }
+
+    const auto time = [&](const char* key) -> std::optional<std::string>
+    {
+        if (manifest.contains(key) && manifest[key].is_string())
+        {
+            return manifest[key].get<std::string>();
+        }
+        return std::nullopt;
+    };
+    const bool recipe_held = storage_.has_recipe_revision(ref, target.revision);
+    for (auto& file : files)
+    {
+        if (file.recipe && recipe_held)
+        {
+            continue;
+        }
+        const bool stored = file.recipe ? storage_.store_recipe_file(ref,
+                                                                     target.revision,
+                                                                     file.name,
+                                                                     *file.staged,
+                                                                     time("time"))
+                                        : storage_.store_package_file(ref,
+                                                                      target.revision,
+                                                                      target.package_id,
+                                                                      target.package_revision,
+                                                                      file.name,
+                                                                      *file.staged,
+                                                                      time("package_time"));
+        if (!stored)
+        {
+            return false;
+        }
+    }
+    if (!recipe_held && !storage_.publish_recipe_revision(ref, target.revision))
+    {
+        return false;
+    }
+    return target.package_id.empty() ||
+           storage_.publish_package_revision(
+               ref, target.revision, target.package_id, target.package_revision);
+}
+
+std::optional<std::vector<PrefetchTarget>> parse_graph(std::string_view text)
+{
+    const auto json = nlohmann::json::parse(text, nullptr, false);
+    if (!json.is_object() || !json.contains("graph") || !json["graph"].is_object() ||
+        !json["graph"].contains("nodes") || !json["graph"]["nodes"].is_object())
+    {
+        return std::nullopt;
+    }
+    std::vector<PrefetchTarget> targets;
+    for (const auto& [id, node] : json["graph"]["nodes"].items())
+    {
+        if (!node.is_object() || !node.contains("ref") || !node["ref"].is_string())
+        {
+            continue;
+        }
+        const auto reference = node["ref"].get<std::string>();
+        const auto hash      = reference.find('#');
+        const auto ref       = parse_reference(std::string_view(reference).substr(0, hash));
+        if (!ref || hash == std::string::npos)
+        {
+            continue;
+        }
+        PrefetchTarget target{*ref, reference.substr(hash + 1), {}, {}};
+        if (!is_safe_path_segment(target.revision))
+        {
+            continue;
+        }
+        const auto package_id       = node.value("package_id", nlohmann::json());
+        const auto package_revision = node.value("prev", nlohmann::json());
+        if (package_id.is_string() && package_revision.is_string() &&
+            is_safe_path_segment(package_id.get<std::string>()) &&
+            is_safe_path_segment(package_revision.get<std::string>()))
+        {
+            target.package_id       = package_id.get<std::string>();
+            target.package_revision = package_revision.get<std::string>();
+        }
+        targets.push_back(std::move(target));
+    }
+    return targets;
+}
+
+std::optional<std::pair<std::vector<PrefetchTarget>, std::vector<std::string>>>
+parse_closure(std::string_view text)
+{
+    const auto json = nlohmann::json::parse(text, nullptr, false);
+    if (!json.is_object() || !json.contains("packages") || !json["packages"].is_array())
+    {
+        return std::nullopt;
+    }
+    std::pair<std::vector<PrefetchTarget>, std::vector<std::string>> closure;
+    for (const auto& node : json["packages"])
+    {
+        const auto ref = parse_reference(node.value("reference", std::string()));
+        PrefetchTarget target{ref.value_or(RecipeRef{}),
+                              node.value("revision", std::string()),
+                              node.value("package_id", std::string()),
+                              node.value("package_revision", std::string())};
+        if (ref && is_safe_path_segment(target.revision) &&
+            (target.package_id.empty() || (is_safe_path_segment(target.package_id) &&
+                                           is_safe_path_segment(target.package_revision))))
+        {
+            closure.first.push_back(std::move(target));
+        }
+    }
+    if (json.contains("missing") && json["missing"].is_array())
+    {
+        for (const auto& entry : json["missing"])
+        {
+            closure.second.push_back(entry.value("requirement", std::string()) + ": " +
+                                     entry.value("reason", std::string()));
+        }
+    }
+    return closure;
+}
+
+} // namespace server
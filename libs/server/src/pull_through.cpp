@@ -0,0 +1,322 @@
+#include "pull_through.h"
+
+#include <algorithm>
+#include <exception>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include <nlohmann/json.hpp>
+
+#include "async_log.h"
+
+namespace server
+{
+namespace
+{
+
+namespace fs = std::filesystem;
+
+std::optional<RevisionInfo> find_revision(std::vector<RevisionInfo> revisions,
+                                          const std::string&        revision)
+{
+    const auto found =
+        std::find_if(revisions.begin(),
+                     revisions.end(),
+                     [&](const RevisionInfo& info) { return info.revision == revision; });
+    if (found == revisions.end())
+    {
+        return std::nullopt;
+    }
+    return std::move(*found);
+}
+
+} // namespace
+
+PullThrough::PullThrough(PackageStorage& storage, const std::string& url)
+    : storage_(storage), upstream_(url)
+{
+}
+
+std::optional<std::string> PullThrough::listing(const std::string& path)
+{
+    auto client = upstream_.client();
+    return upstream_.get(client, path);
+}
+
+bool PullThrough::latest_recipe(const RecipeRef& ref)
+{
+    const auto base = recipe_path(ref);
+    return coalesce(base + "/latest",
+                    [&]
+                    {
+                        if (storage_.latest_recipe_revision(ref))
+                        {
+                            return true;
+                        }
+                        const auto latest = latest_revision(base + "/latest");
+                        return latest && recipe_revision(ref, *latest);
+                    });
+}
+
+bool PullThrough::recipe_revision(const RecipeRef& ref, const std::string& revision)
+{
+    const auto base = recipe_path(ref);
+    return coalesce(
+        base + "/revisions/" + revision,
+        [&]
+        {
+            if (storage_.has_recipe_revision(ref, revision))
+            {
+                return true;
+            }
+            return copy_revision(
+                base,
+                revision,
+                [&](const std::string& file_name)
+                { return storage_.recipe_files_path(ref, revision) / file_name; },
+                [&](const std::string&                file_name,
+                    StagedFile&                       staged,
+                    const std::optional<std::string>& time)
+                {
+                    return storage_.store_recipe_file(
+                        ref, revision, file_name, staged, time);
+                }) && storage_.publish_recipe_revision(ref, revision);
+        });
+}
+
+bool PullThrough::latest_package(const RecipeRef&   ref,
+                                 const std::string& recipe_revision,
+                                 const std::string& package_id)
+{
+    const auto base = package_path(ref, recipe_revision, package_id);
+    return coalesce(base + "/latest",
+                    [&]
+                    {
+                        if (storage_.latest_package_revision(ref, recipe_revision, package_id))
+                        {
+                            return true;
+                        }
+                        const auto latest = latest_revision(base + "/latest");
+                        return latest && package_revision(
+                                             ref, recipe_revision, package_id, *latest);
+                    });
+}
+
+bool PullThrough::package_revision(const RecipeRef&   ref,
+                                   const std::string& recipe_revision,
+                                   const std::string& package_id,
+                                   const std::string& package_revision)
+{
+    // The recipe revision comes first: indexing a package would otherwise create it empty.
+    if (!this->recipe_revision(ref, recipe_revision))
+    {
+        return false;
+    }
+    const auto base = package_path(ref, recipe_revision, package_id);
+    return coalesce(
+        base + "/revisions/" + package_revision,
+        [&]
+        {
+            if (storage_.has_package_revision(ref, recipe_revision, package_id, package_revision))
+            {
+                return true;
+            }
+            return copy_revision(
+                base,
+                package_revision,
+                [&](const std::string& file_name)
+                {
+                    return storage_.package_files_path(
+                               ref, recipe_revision, package_id, package_revision) /
+                           file_name;
+                },
+                [&](const std::string&                file_name,
+                    StagedFile&                       staged,
+                    const std::optional<std::string>& time)
+                {
+                    return storage_.store_package_file(ref,
+                                                       recipe_revision,
+                                                       package_id,
+                                                       package_revision,
+                                                       file_name,
+                                                       staged,
+                                                       time);
+                }) && storage_.publish_package_revision(
+                          ref, recipe_revision, package_id, package_revision);
+        });
+}
+
+std::string PullThrough::recipe_path(const RecipeRef& ref)
+{
+    return "/v2/conans/" + ref.name + '/' + ref.version + '/' + ref.user + '/' + ref.channel;
+}
+
+std::string PullThrough::package_path(const RecipeRef&   ref,
+                                      const std::string& recipe_revision,
+                                      const std::string& package_id)
+{
+    return recipe_path(ref) + "/revisions/" + recipe_revision + "/packages/" + package_id;
+}
+
+template <typename Fetch>
+bool PullThrough::coalesce(const std::string& key, Fetch fetch)
+{
+    std::unique_lock lock(mutex_);
+    if (const auto inflight = inflight_.find(key); inflight != inflight_.end())
+    {
+        const auto pending = inflight->second;
+        lock.unlock();
+        return pending.get();
+    }
+    std::promise<bool> promise;
+    inflight_.emplace(key, promise.get_future().share());
+    lock.unlock();
+
+    bool fetched = false;
+    try
+    {
+        fetched = fetch();
+    }
+    catch (const std::exception& ex)
+    {
+        append_debug_log(LogLevel::Error, "UPSTREAM " + key + " exception=" + ex.what());
+    }
+    lock.lock();
+    inflight_.erase(key);
+    lock.unlock();
+    promise.set_value(fetched);
+    return fetched;
+}
+
+std::optional<std::string> PullThrough::latest_revision(const std::string& path)
+{
+    auto       client = upstream_.client();
+    const auto body   = upstream_.get(client, path);
+    if (!body)
+    {
+        return std::nullopt;
+    }
+    const auto json = nlohmann::json::parse(*body, nullptr, false);
+    if (!json.is_object() || !json.contains("revision") || !json["revision"].is_string())
+    {
+        return std::nullopt;
+    }
+    auto revision = json["revision"].get<std::string>();
+    if (!is_safe_path_segment(revision))
+    {
+        return std::nullopt;
+    }
+    return revision;
+}
+
+template <typename Destination, typename Store>
+bool PullThrough::copy_revision(const std::string& base,
+                                const std::string& revision,
+                                Destination        destination,
+                                Store              store)
+{
+    auto                       client = upstream_.client();
+    std::optional<std::string> time;
+    if (const auto body = upstream_.get(client, base + "/revisions"))
+    {
+        const auto json = nlohmann::json::parse(*body, nullptr, false);
+        if (json.is_object() && json.contains("revisions") && json["revisions"].is_array())
+        {
+            for (const auto& entry : json["revisions"])
+            {
+                if (entry.value("revision", std::string()) == revision &&
+                    entry.contains("time") && entry["time"].is_string())
+                {
+                    time = entry["time"].get<std::string>();
+                }
+            }
+        }
+    }
+    const auto revision_path = base + "/revisions/" + revision;
+    const auto body          = upstream_.get(client, revision_path + "/files");
+    if (!body)
+    {
+        return false;
+    }
+    const auto json = nlohmann::json::parse(*body, nullptr, false);
+    if (!json.is_object() || !json.contains("files") || !json["files"].is_object() ||
+        json["files"].empty())
+    {
+        return false;
+    }
+
+    std::vector<std::pair<std::string, std::unique_ptr<StagedFile>>> files;
+    for (const auto& [file_name, unused] : json["files"].items())
+    {
+        if (!is_safe_path_segment(file_name))
+        {
+            return false;
+        }
+        const fs::path target = destination(file_name);
+        auto staged = std::make_unique<StagedFile>(target, storage_.incoming_path());
+        if (!ensure_parent_dir(storage_.incoming_path() / file_name) || !staged->open() ||
+            !upstream_.download(client, revision_path + "/files/" + file_name, *staged))
+        {
+            return false;
+        }
+        files.emplace_back(file_name, std::move(staged));
+    }
+    for (auto& [file_name, staged] : files)
+    {
+        if (!store(file_name, *staged, time))
+        {
+            return false;
+        }
+    }
+    append_debug_log(LogLevel::Info,
+                     "UPSTREAM stored " + revision_path + " files=" +
+                         std::to_string(files.size()));
+    return true;
+}
+
+std::optional<RevisionInfo> resolve_recipe_revision(PackageStorage&    storage,
+                                                    PullThrough*       upstream,
+                                                    const RecipeRef&   ref,
+                                                    const std::string& revision)
+{
+    if (revision == "latest")
+    {
+        if (upstream != nullptr)
+        {
+            upstream->latest_recipe(ref);
+        }
+        return storage.latest_recipe_revision(ref);
+    }
+    if (upstream != nullptr && !storage.has_recipe_revision(ref, revision))
+    {
+        upstream->recipe_revision(ref, revision);
+    }
+    return find_revision(storage.list_recipe_revisions(ref), revision);
+}
+
+std::optional<RevisionInfo> resolve_package_revision(PackageStorage&    storage,
+                                                     PullThrough*       upstream,
+                                                     const RecipeRef&   ref,
+                                                     const std::string& recipe_revision,
+                                                     const std::string& package_id,
+                                                     const std::string& revision)
+{
+    if (revision == "latest")
+    {
+        if (upstream != nullptr)
+        {
+            upstream->latest_package(ref, recipe_revision, package_id);
+        }
+        return storage.latest_package_revision(ref, recipe_revision, package_id);
+    }
+    if (upstream != nullptr &&
+        !storage.has_package_revision(ref, recipe_revision, package_id, revision))
+    {
+        upstream->package_revision(ref, recipe_revision, package_id, revision);
+    }
+    return find_revision(storage.list_package_revisions(ref, recipe_revision, package_id),
+                         revision);
+}
+
+} // namespace server
@@ -0,0 +1,284 @@
+#include "pusher.h"
+
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <ios>
+#include <sstream>
+#include <thread>
+#include <utility>
+
+#include <nlohmann/json.hpp>
+
+#include "async_log.h"
+#include "sha256.h"
+
+namespace server
+{
+namespace
+{
+
+namespace fs = std::filesystem;
+
+} // namespace
+
+Pusher::Pusher(const std::string& url, std::string user, std::string password, std::size_t jobs)
+    : remote_(url), user_(std::move(user)), password_(std::move(password)),
+      jobs_(std::max<std::size_t>(1, jobs))
+{
+}
+
+std::optional<PushStats> Pusher::push(const std::vector<PushRevision>& revisions)
+{
+    std::vector<fs::path> paths;
+    for (const auto& revision : revisions)
+    {
+        for (const auto& [file_name, path] : revision.files)
+        {
+            if (!checksums_.contains(path))
+            {
+                checksums_.emplace(path, std::nullopt);
+                paths.push_back(path);
+            }
+        }
+    }
+    parallel(paths.size(),
+             [&](httplib::Client&, std::size_t index)
+             { checksums_.at(paths[index]) = checksum_existing_file(paths[index]); });
+
+    std::vector<std::string> digests;
+    for (const auto& [path, checksum] : checksums_)
+    {
+        if (checksum)
+        {
+            digests.push_back(checksum->sha256);
+        }
+    }
+    auto client = connect();
+    for (std::size_t offset = 0; offset < digests.size(); offset += kProbeBatch)
+    {
+        std::string body;
+        for (std::size_t i = offset; i < std::min(offset + kProbeBatch, digests.size()); ++i)
+        {
+            body += digests[i] + '\n';
+        }
+        const auto result = client.Post(
+            remote_.target("/api/sync/probe"), httplib::Headers(), body, "text/plain");
+        if (!result || result->status != 200)
+        {
+            append_debug_log(LogLevel::Warning, "PUSH probe failed");
+            return std::nullopt;
+        }
+        std::istringstream lines(result->body);
+        for (std::string line; std::getline(lines, line);)
+        {
+            held_.insert(line);
+        }
+    }
+
+    PushStats stats;
+    for (const bool recipes : {true, false})
+    {
+        std::vector<const PushRevision*> batch;
+        for (const auto& revision : revisions)
+        {
+            if (revision.package_id.empty() == recipes)
+            {
+                batch.push_back(&revision);
+            }
+        }
+        std::mutex stats_mutex;
+        parallel(batch.size(),
+                 [&](httplib::Client& worker_client, std::size_t index)
+                 {
+                     PushStats       result;
+                     const bool      ok = upload(worker_client, *batch[index], result);
+                     std::lock_guard lock(stats_mutex);
+                     stats.revisions += ok ? 1 : 0;
+                     stats.failed += ok ? 0 : 1;
+                     stats.uploaded += result.uploaded;
+                     stats.deployed += result.deployed;
+                     stats.bytes += result.bytes;
+                 });
+    }
+    return stats;
+}
+
+httplib::Client Pusher::connect() const
+{
+    auto client = remote_.client();
+    if (!user_.empty())
+    {
+        client.set_basic_auth(user_, password_);
+    }
+    return client;
+}
+
+template <typename Work>
+void Pusher::parallel(std::size_t count, Work work)
+{
+    std::atomic<std::size_t> next{0};
+    std::vector<std::thread> workers;
+    for (std::size_t i = 0; i < std::min(jobs_, count); ++i)
+    {
+        workers.emplace_back(
+            [&]
+            {
+                auto client = connect();
+                for (auto index = next++; index < count; index = next++)
+                {
+                    work(client, index);
+                }
+            });
+    }
+    for (auto& worker : workers)
+    {
+        worker.join();
+    }
+}
+
+bool Pusher::upload(httplib::Client& client, const PushRevision& revision, PushStats& result)
+{
+    auto remote_dir = "/v2/conans/" + revision.ref.name + '/' + revision.ref.version + '/' +
+                      revision.ref.user + '/' + revision.ref.channel + "/revisions/" +
+                      revision.revision;
+    if (!revision.package_id.empty())
+    {
+        remote_dir += "/packages/" + revision.package_id + "/revisions/" +
+                      revision.package_revision;
+    }
+    if (revision.files.empty())
+    {
+        append_debug_log(LogLevel::Warning, "PUSH " + remote_dir + " has no files");
+        return false;
+    }
+
+    std::vector<std::pair<std::string, fs::path>> files(revision.files.begin(),
+                                                        revision.files.end());
+    std::stable_partition(files.begin(),
+                          files.end(),
+                          [](const auto& file) { return file.first != "conanmanifest.txt"; });
+    for (const auto& [file_name, path] : files)
+    {
+        const auto& checksum = checksums_.at(path);
+        const auto  target   = remote_.target(remote_dir + "/files/" + file_name);
+        if (!checksum)
+        {
+            append_debug_log(LogLevel::Warning, "PUSH unreadable " + path.string());
+            return false;
+        }
+        if (held(checksum->sha256))
+        {
+            const auto deployed = client.Put(
+                target,
+                httplib::Headers{{"X-Checksum-Deploy", "true"},
+                                 {"X-Checksum-Sha256", checksum->sha256}},
+                std::string(),
+                "application/octet-stream");
+            if (deployed && deployed->status / 100 == 2)
+            {
+                ++result.deployed;
+                continue;
+            }
+        }
+
+        std::ifstream     in(platform_fs_path(path), std::ios::binary);
+        std::vector<char> buffer(1024 * 1024);
+        const auto        sent = client.Put(
+            target,
+            httplib::Headers{{"X-Checksum-Sha256", checksum->sha256}},
+            static_cast<std::size_t>(checksum->size),
+            [&](std::size_t offset, std::size_t length, httplib::DataSink& sink)
+            {
+                in.seekg(static_cast<std::streamoff>(offset));
+                in.read(buffer.data(),
+                        static_cast<std::streamsize>(std::min(length, buffer.size())));
+                return in.gcount() > 0 &&
+                       sink.write(buffer.data(), static_cast<std::size_t>(in.gcount()));
+            },
+            "application/octet-stream");
+        append_debug_log(LogLevel::Debug,
+                         "PUSH " + target + " status=" +
+                             std::to_string(sent ? sent->status : 0));
+        if (!sent || sent->status / 100 != 2)
+        {
+            return false;
+        }
+        ++result.uploaded;
+        result.bytes += checksum->size;
+        std::lock_guard lock(held_mutex_);
+        held_.insert(checksum->sha256);
+    }
+    return true;
+}
+
+bool Pusher::held(const std::string& sha256)
+{
+    std::lock_guard lock(held_mutex_);
+    return held_.contains(sha256);
+}
+
+std::optional<std::vector<PushRevision>> parse_package_list(std::string_view text)
+{
+    const auto json = nlohmann::json::parse(text, nullptr, false);
+    if (!json.is_object())
+    {
+        return std::nullopt;
+    }
+
+    std::vector<PushRevision> revisions;
+    const auto collect = [&](const nlohmann::json& node, PushRevision revision)
+    {
+        if (!node.is_object() || !node.value("upload", false))
+        {
+            return;
+        }
+        if (node.contains("files") && node["files"].is_object())
+        {
+            for (const auto& [file_name, path] : node["files"].items())
+            {
+                if (path.is_string() && is_safe_path_segment(file_name))
+                {
+                    revision.files.emplace(file_name, fs::path(path.get<std::string>()));
+                }
+            }
+        }
+        revisions.push_back(std::move(revision));
+    };
+    static const auto kNone    = nlohmann::json::object();
+    const auto        children = [](const nlohmann::json& node,
+                                    const char*           key) -> const nlohmann::json&
+    { return node.is_object() && node.contains(key) && node[key].is_object() ? node[key] : kNone; };
+    for (const auto& [origin, references] : json.items())
+    {
+        if (!references.is_object())
+        {
+            continue;
+        }
+        for (const auto& [reference, recipe] : references.items())
+        {
+            const auto ref = parse_reference(reference);
+            if (!ref)
+            {
+                continue;
+            }
+            for (const auto& [revision, recipe_node] : children(recipe, "revisions").items())
+            {
+                collect(recipe_node, PushRevision{*ref, revision, {}, {}, {}});
+                for (const auto& [package_id, package] :
+                     children(recipe_node, "packages").items())
+                {
+                    for (const auto& [package_revision, package_node] :
+                         children(package, "revisions").items())
+                    {
+                        collect(package_node,
+                                PushRevision{*ref, revision, package_id, package_revision, {}});
+                    }
+                }
+            }
+        }
+    }
+    return revisions;
+}
+
+} // namespace server
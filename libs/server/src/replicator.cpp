@@ -0,0 +1,273 @@
+#include "replicator.h"
+
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <system_error>
+#include <thread>
+
+#include "async_log.h"
+
+namespace server
+{
+namespace
+{
+
+namespace fs = std::filesystem;
+
+} // namespace
+
+Replicator::Replicator(PackageStorage& storage, const std::string& url, std::size_t jobs)
+    : storage_(storage), source_(url), jobs_(std::max<std::size_t>(1, jobs))
+{
+}
+
+std::optional<SyncStats> Replicator::pass()
+{
+    auto       client = source_.client();
+    const auto body   = source_.get(client, "/api/sync/manifest");
+    if (!body)
+    {
+        return std::nullopt;
+    }
+
+    std::set<std::string> local_files;
+    storage_.manifest(
+        [&](const MetadataLog::Record& record)
+        {
+            if (const auto file = parse_file(record))
+            {
+                local_files.insert(file->key + '\t' + file->checksum.sha256);
+            }
+        });
+
+    std::map<std::string, std::string> times;
+    std::map<std::string, Transfer>    recipes;
+    std::map<std::string, Transfer>    packages;
+    for (std::size_t offset = 0; offset < body->size();)
+    {
+        const auto end = std::min(body->find('\n', offset), body->size());
+        const auto record =
+            split_fields(std::string_view(*body).substr(offset, end - offset));
+        offset = end + 1;
+        if (const auto file = parse_file(record))
+        {
+            if (local_files.contains(file->key + '\t' + file->checksum.sha256))
+            {
+                continue;
+            }
+            const auto revision_key = file->key.substr(0, file->key.rfind('\t'));
+            auto& transfer = (file->package_id.empty() ? recipes : packages)[revision_key];
+            transfer.ref              = file->ref;
+            transfer.revision         = file->revision;
+            transfer.package_id       = file->package_id;
+            transfer.package_revision = file->package_revision;
+            transfer.files.emplace_back(file->name, file->checksum);
+        }
+        else if (record.size() == 7 && record[0] == "rrev")
+        {
+            times[join_fields(std::span(record).subspan(1, 5))] = record[6];
+        }
+        else if (record.size() == 9 && record[0] == "prev")
+        {
+            times[join_fields(std::span(record).subspan(1, 7))] = record[8];
+        }
+    }
+
+    SyncStats stats;
+    for (auto* transfers : {&recipes, &packages})
+    {
+        std::vector<Transfer*> batch;
+        for (auto& [revision_key, transfer] : *transfers)
+        {
+            if (const auto time = times.find(revision_key); time != times.end())
+            {
+                transfer.time = time->second;
+            }
+            batch.push_back(&transfer);
+        }
+        run_batch(batch, stats);
+    }
+    return stats;
+}
+
+MetadataLog::Record Replicator::split_fields(std::string_view line)
+{
+    MetadataLog::Record record;
+    while (!line.empty())
+    {
+        const auto tab = line.find('\t');
+        record.emplace_back(line.substr(0, tab));
+        line = tab == std::string_view::npos ? std::string_view() : line.substr(tab + 1);
+    }
+    return record;
+}
+
+std::string Replicator::join_fields(std::span<const std::string> fields)
+{
+    std::string joined;
+    for (const auto& field : fields)
+    {
+        if (!joined.empty())
+        {
+            joined += '\t';
+        }
+        joined += field;
+    }
+    return joined;
+}
+
+std::optional<Replicator::ManifestFile> Replicator::parse_file(const MetadataLog::Record& record)
+{
+    const bool recipe = record.size() == 10 && record[0] == "rfile";
+    if (!recipe && !(record.size() == 12 && record[0] == "pfile"))
+    {
+        return std::nullopt;
+    }
+    const std::size_t name_index = recipe ? 6 : 8;
+    for (std::size_t i = 1; i <= name_index; ++i)
+    {
+        if (!is_safe_path_segment(record[i]))
+        {
+            return std::nullopt;
+        }
+    }
+    ManifestFile file{RecipeRef{record[1], record[2], record[3], record[4]},
+                      record[5],
+                      recipe ? std::string() : record[6],
+                      recipe ? std::string() : record[7],
+                      record[name_index],
+                      {record[name_index + 1], 0, 0},
+                      join_fields(std::span(record).subspan(1, name_index))};
+    const auto& size = record[name_index + 2];
+    if (file.checksum.sha256.size() != 64 ||
+        std::from_chars(size.data(), size.data() + size.size(), file.checksum.size).ec !=
+            std::errc())
+    {
+        return std::nullopt;
+    }
+    return file;
+}
+
+fs::path Replicator::files_dir(const RecipeRef&   ref,
+                               const std::string& revision,
+                               const std::string& package_id,
+                               const std::string& package_revision) const
+{
+    return package_id.empty()
+               ? storage_.recipe_files_path(ref, revision)
+               : storage_.package_files_path(ref, revision, package_id, package_revision);
+}
+
+void Replicator::run_batch(const std::vector<Transfer*>& batch, SyncStats& stats)
+{
+    std::atomic<std::size_t> next{0};
+    std::mutex               stats_mutex;
+    std::vector<std::thread> workers;
+    for (std::size_t i = 0; i < std::min(jobs_, batch.size()); ++i)
+    {
+        workers.emplace_back(
+            [&]
+            {
+                auto client = source_.client();
+                for (auto index = next++; index < batch.size(); index = next++)
+                {
+                    SyncStats  result;
+                    const bool ok = transfer(client, *batch[index], result);
+                    std::lock_guard lock(stats_mutex);
+                    stats.revisions += ok ? 1 : 0;
+                    stats.failed += ok ? 0 : 1;
+                    stats.downloaded += result.downloaded;
+                    stats.copied += result.copied;
+                    stats.bytes += result.bytes;
+                }
+            });
+    }
+    for (auto& worker : workers)
+    {
+        worker.join();
+    }
+}
+
+bool Replicator::transfer(httplib::Client& client, const Transfer& transfer, SyncStats& result)
+{
+    const bool recipe = transfer.package_id.empty();
+    if (!recipe && !storage_.has_recipe_revision(transfer.ref, transfer.revision))
+    {
+        // Its recipe revision failed in this pass; storing would create it without files.
+        return false;
+    }
+    auto remote_dir = "/v2/conans/" + transfer.ref.name + '/' + transfer.ref.version + '/' +
+                      transfer.ref.user + '/' + transfer.ref.channel + "/revisions/" +
+                      transfer.revision;
+    if (!recipe)
+    {
+        remote_dir += "/packages/" + transfer.package_id + "/revisions/" +
+                      transfer.package_revision;
+    }
+
+    std::vector<std::pair<std::string, std::unique_ptr<StagedFile>>> staged_files;
+    for (const auto& [file_name, checksum] : transfer.files)
+    {
+        const fs::path target = files_dir(transfer.ref,
+                                          transfer.revision,
+                                          transfer.package_id,
+                                          transfer.package_revision) /
+                                file_name;
+        auto staged = std::make_unique<StagedFile>(target, storage_.incoming_path());
+        if (!ensure_parent_dir(storage_.incoming_path() / file_name) || !staged->open())
+        {
+            return false;
+        }
+        bool       fetched = false;
+        const auto local   = storage_.content_path(checksum.sha256);
+        if (local && copy_into(*local, *staged))
+        {
+            ++result.copied;
+            fetched = true;
+        }
+        else if (!local && source_.download(client, remote_dir + "/files/" + file_name, *staged))
+        {
+            ++result.downloaded;
+            result.bytes += staged->size();
+            fetched = true;
+        }
+        if (!fetched || staged->sha256() != checksum.sha256)
+        {
+            append_debug_log(LogLevel::Warning,
+                             "SYNC " + remote_dir + "/files/" + file_name + " failed");
+            return false;
+        }
+        staged_files.emplace_back(file_name, std::move(staged));
+    }
+    for (auto& [file_name, staged] : staged_files)
+    {
+        const bool stored = recipe ? storage_.store_recipe_file(transfer.ref,
+                                                                transfer.revision,
+                                                                file_name,
+                                                                *staged,
+                                                                transfer.time)
+                                   : storage_.store_package_file(transfer.ref,
+                                                                 transfer.revision,
+                                                                 transfer.package_id,
+                                                                 transfer.package_revision,
+                                                                 file_name,
+                                                                 *staged,
+                                                                 transfer.time);
+        if (!stored)
+        {
+            return false;
+        }
+    }
+    return recipe ? storage_.publish_recipe_revision(transfer.ref, transfer.revision)
+                  : storage_.publish_package_revision(transfer.ref,
+                                                      transfer.revision,
+                                                      transfer.package_id,
+                                                      transfer.package_revision);
+}
+
+} // namespace server
@@ -0,0 +1,123 @@
+#include "route_trie.h"
+
+#include <algorithm>
+
+namespace server
+{
+
+std::size_t RouteTrie::add(std::string_view pattern)
+{
+    std::uint32_t node = 0;
+    while (!pattern.empty())
+    {
+        const auto slash   = pattern.find('/', 1);
+        const auto segment = pattern.substr(1, slash == std::string_view::npos ? slash : slash - 1);
+        pattern = slash == std::string_view::npos ? std::string_view() : pattern.substr(slash);
+
+        std::uint32_t next = kNone;
+        if (segment == "*")
+        {
+            next = nodes_[node].capture;
+        }
+        else
+        {
+            const auto& literals = nodes_[node].literals;
+            const auto  found =
+                std::find_if(literals.begin(),
+                             literals.end(),
+                             [&](const auto& child) { return child.first == segment; });
+            next = found == literals.end() ? kNone : found->second;
+        }
+        if (next == kNone)
+        {
+            next = static_cast<std::uint32_t>(nodes_.size());
+            nodes_.emplace_back();
+            if (segment == "*")
+            {
+                nodes_[node].capture = next;
+            }
+            else
+            {
+                nodes_[node].literals.emplace_back(std::string(segment), next);
+            }
+        }
+        node = next;
+    }
+    if (nodes_[node].route == kNone)
+    {
+        nodes_[node].route = static_cast<std::uint32_t>(routes_++);
+    }
+    return nodes_[node].route;
+}
+
+std::optional<RouteTrie::Match> RouteTrie::match(std::string_view path) const
+{
+    if (!path.starts_with('/'))
+    {
+        return std::nullopt;
+    }
+    Segments    segments;
+    std::size_t size = 0;
+    for (std::size_t start = 1; start <= path.size();)
+    {
+        const auto end = std::min(path.find('/', start), path.size());
+        if (size == kMaxSegments)
+        {
+            return std::nullopt;
+        }
+        segments[size++] = path.substr(start, end - start);
+        start            = end + 1;
+    }
+
+    Match match;
+    if (!walk(0, segments, size, 0, match))
+    {
+        return std::nullopt;
+    }
+    match.safe = std::all_of(match.captures.begin(),
+                             match.captures.begin() + static_cast<std::ptrdiff_t>(match.count),
+                             [](std::string_view capture) { return is_safe_segment(capture); });
+    return match;
+}
+
+bool RouteTrie::walk(std::uint32_t   node,
+                     const Segments& segments,
+                     std::size_t     size,
+                     std::size_t     depth,
+                     Match&          match) const
+{
+    const auto& current = nodes_[node];
+    if (depth == size)
+    {
+        match.route = current.route;
+        return current.route != kNone;
+    }
+    const auto segment = segments[depth];
+    for (const auto& [literal, child] : current.literals)
+    {
+        if (literal == segment && walk(child, segments, size, depth + 1, match))
+        {
+            return true;
+        }
+    }
+    if (current.capture == kNone || segment.empty())
+    {
+        return false;
+    }
+    match.captures[match.count++] = segment;
+    if (walk(current.capture, segments, size, depth + 1, match))
+    {
+        return true;
+    }
+    --match.count;
+    return false;
+}
+
+bool RouteTrie::is_safe_segment(std::string_view segment)
+{
+    return !segment.empty() && segment.find("..") == std::string_view::npos &&
+           segment.find('\\') == std::string_view::npos &&
+           segment.find('/') == std::string_view::npos;
+}
+
+} // namespace server
@@ -3,73 +3,188 @@
 #include <WebAssets.h>
 #include <cpp-embedlib-httplib.h>
 #include <httplib.h>
+#include <nlohmann/json.hpp>
 
 #include <algorithm>
+#include <atomic>
+#include <charconv>
 #include <cctype>
 #include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <ctime>
 #include <filesystem>
 #include <fstream>
+#include <functional>
 #include <iomanip>
 #include <iostream>
+#include <locale>
 #include <map>
+#include <memory>
 #include <mutex>
 #include <optional>
-#include <random>
-#include <regex>
-#include <set>
 #include <sstream>
 #include <string>
 #include <string_view>
-#include <unordered_map>
+#include <thread>
 #include <utility>
 #include <vector>
 
+#include "async_log.h"
+#include "closure.h"
+#include "file_cache.h"
+#include "glob.h"
+#include "json_writer.h"
+#include "metadata_log.h"
+#include "metrics.h"
+#include "package_storage.h"
+#include "prefetcher.h"
+#include "pull_through.h"
+#include "pusher.h"
+#include "replicator.h"
+#include "route_trie.h"
+#include "session_store.h"
+#include "sha256.h"
+#include "tar.h"
+
 namespace server
 {
 namespace
 {
 
 namespace fs = std::filesystem;
-std::mutex g_debug_log_mutex;
-fs::path   g_debug_log_path;
 
-void append_debug_log(const std::string& line)
+Metrics g_metrics;
+
+// Caps how many requests of one kind run at once. try_acquire() never waits, so a saturated
+// class is turned away with 503 instead of occupying workers the other classes need.
+class RequestLimiter
 {
-    std::lock_guard<std::mutex> lock(g_debug_log_mutex);
-    if (g_debug_log_path.empty())
+  public:
+    explicit RequestLimiter(std::size_t limit) : limit_(limit)
     {
-        return;
     }
-    std::ofstream log(g_debug_log_path, std::ios::app);
-    log << line << '\n';
-}
 
-struct User
-{
-    std::string username;
-    std::string password;
+    [[nodiscard]] bool try_acquire()
+    {
+        if (limit_ == 0)
+        {
+            return true;
+        }
+        if (active_.fetch_add(1, std::memory_order_acquire) >= limit_)
+        {
+            active_.fetch_sub(1, std::memory_order_release);
+            return false;
+        }
+        return true;
+    }
+
+    void release()
+    {
+        if (limit_ != 0)
+        {
+            active_.fetch_sub(1, std::memory_order_release);
+        }
+    }
+
+  private:
+    const std::size_t        limit_;
+    std::atomic<std::size_t> active_{0};
 };
 
-struct Session
+// Bookkeeping for the request running on this worker thread. Routing, the handler and the logger
+// all run on the same thread, so the logger can close out what the pre-routing handler opened.
+struct RequestContext
 {
-    std::string                           username;
-    std::string                           token;
-    std::chrono::system_clock::time_point expires_at;
+    std::chrono::steady_clock::time_point started;
+    std::size_t                           route = 0;
+    RequestLimiter*                       slot  = nullptr;
 };
 
-struct RevisionInfo
+thread_local std::optional<RequestContext> t_request;
+
+void release_request_slot()
+{
+    if (t_request && t_request->slot != nullptr)
+    {
+        t_request->slot->release();
+        t_request->slot = nullptr;
+    }
+}
+
+// Reads every build issues before fetching binaries: /latest, revision and file listings, and
+// package searches. File downloads and mutations are not included.
+bool is_metadata_read(std::string_view method, std::string_view label)
 {
-    std::string revision;
-    std::string time;
-    fs::path    path;
+    return method == "GET" &&
+           (label == "search" || label.ends_with("_latest") || label.ends_with("_revisions") ||
+            label.ends_with("_files") || label.ends_with("_search"));
+}
+
+// Metrics label of every route, keyed by method and a RouteTrie pattern. Each route is added
+// with its label where it is registered, and the pre-routing handler looks requests up here
+// because it runs before httplib or ConanRouter pick a handler. Labels are fixed names, so the
+// metrics never grow with the number of references in the store. Filled before serving and
+// read-only afterwards.
+class RouteLabels
+{
+  public:
+    struct Route
+    {
+        std::size_t metric        = 0; // id from g_metrics.route()
+        bool        metadata_read = false;
+    };
+
+    RouteLabels()
+        : other_{g_metrics.route("other"), false}, static_{g_metrics.route("static"), false}
+    {
+    }
+
+    void add(std::string_view method, std::string_view pattern, std::string_view label)
+    {
+        auto&      table = tables_[std::string(method)];
+        const auto id    = table.trie.add(pattern);
+        if (id >= table.routes.size())
+        {
+            table.routes.resize(id + 1);
+        }
+        table.routes[id] = Route{g_metrics.route(label), is_metadata_read(method, label)};
+    }
+
+    // HEAD requests are answered by GET routes and labelled like them. A path no route matches
+    // is "other" within the Conan API and "static" elsewhere, where the UI files are served.
+    [[nodiscard]] Route find(const std::string& method, std::string_view path) const
+    {
+        const bool head  = method == "HEAD";
+        const auto table = tables_.find(head ? std::string("GET") : method);
+        if (table != tables_.end())
+        {
+            if (const auto match = table->second.trie.match(path))
+            {
+                Route route = table->second.routes[match->route];
+                route.metadata_read &= !head;
+                return route;
+            }
+        }
+        return path.starts_with("/v2/conans/") ? other_ : static_;
+    }
+
+  private:
+    struct Table
+    {
+        RouteTrie          trie;
+        std::vector<Route> routes; // indexed by route id
+    };
+
+    std::map<std::string, Table> tables_;
+    Route                        other_;
+    Route                        static_;
 };
 
-struct RecipeRef
+struct User
 {
-    std::string name;
-    std::string version;
-    std::string user;
-    std::string channel;
+    std::string username;
+    std::string password;
 };
 
 struct ServerConfig
@@ -78,121 +193,70 @@ struct ServerConfig
     int         port         = 9300;
     fs::path    storage_root = ".leafserver-data";
     std::string admin_user   = "admin";
-    std::string admin_password;
+    std::string   admin_password;
+    bool          dedup         = false;
+    LogLevel      log_level     = LogLevel::Info;
+    std::uint64_t log_max_bytes = 10ULL * 1024ULL * 1024ULL;
+    // Request handling capacity. A concurrency limit of 0 means unlimited.
+    std::size_t worker_threads      = 16;
+    std::size_t max_queued_requests = 256;
+    std::size_t max_uploads         = 8;
+    std::size_t max_metadata_reads  = 0;
+    // Seconds a connection may sit idle mid-request. Staged uploads left idle for
+    // kStagingIdleReadTimeouts of these are dropped by the garbage collector.
+    std::uint64_t read_timeout = 300;
+    // Conan v2 remote to fill local misses from (pull-through cache). Empty disables it.
+    std::string upstream;
+    // leaf-server to replicate every mirror_interval seconds (mirror mode). Empty disables it.
+    std::string   mirror;
+    std::uint64_t mirror_interval = 300;
+    std::size_t   sync_jobs       = 4;
+    // Retention, applied by the garbage collector every gc_interval seconds. 0 keeps everything.
+    std::size_t   keep_recipe_revisions     = 0;
+    std::uint64_t package_max_age_days      = 0;
+    std::uint64_t gc_interval               = 3600;
+    std::size_t   gc_max_deletes_per_second = 500;
+    // Memory for the contents of small, frequently downloaded files. 0 disables the cache.
+    std::size_t file_cache_bytes = 64ULL * 1024ULL * 1024ULL;
 };
 
-std::string trim(std::string value)
-{
-    auto not_space = [](unsigned char ch) { return !std::isspace(ch); };
-    value.erase(value.begin(), std::find_if(value.begin(), value.end(), not_space));
-    value.erase(std::find_if(value.rbegin(), value.rend(), not_space).base(), value.end());
-    return value;
-}
+// How many read timeouts an unpublished revision may go without receiving a file before it is
+// treated as abandoned. Conan uploads the files of a revision back to back, so this is generous.
+constexpr std::uint64_t kStagingIdleReadTimeouts = 4;
 
 std::string json_escape(std::string_view value)
 {
     std::string out;
     out.reserve(value.size() + 16);
-    for (const char ch : value)
-    {
-        switch (ch)
-        {
-        case '\\':
-            out += "\\\\";
-            break;
-        case '"':
-            out += "\\\"";
-            break;
-        case '\b':
-            out += "\\b";
-            break;
-        case '\f':
-            out += "\\f";
-            break;
-        case '\n':
-            out += "\\n";
-            break;
-        case '\r':
-            out += "\\r";
-            break;
-        case '\t':
-            out += "\\t";
-            break;
-        default:
-            if (static_cast<unsigned char>(ch) < 0x20U)
-            {
-                std::ostringstream hex;
-                hex << "\\u" << std::hex << std::setw(4) << std::setfill('0')
-                    << static_cast<int>(static_cast<unsigned char>(ch));
-                out += hex.str();
-            }
-            else
-            {
-                out += ch;
-            }
-            break;
-        }
-    }
+    append_json_escaped(out, value);
     return out;
 }
 
-std::string iso8601_now()
-{
-    const auto now  = std::chrono::system_clock::now();
-    const auto time = std::chrono::system_clock::to_time_t(now);
-    const auto ms =
-        std::chrono::duration_cast<std::chrono::milliseconds>(now.time_since_epoch()) % 1000;
-    std::tm utc{};
-#ifdef _WIN32
-    gmtime_s(&utc, &time);
-#else
-    gmtime_r(&time, &utc);
-#endif
+// IMF-fixdate as used by Last-Modified and If-Modified-Since, e.g. "Sun, 06 Nov 1994 08:49:37 GMT".
+std::string http_date(std::int64_t unix_seconds)
+{
+    const std::tm      utc = to_utc(static_cast<std::time_t>(unix_seconds));
     std::ostringstream out;
-    out << std::put_time(&utc, "%Y-%m-%dT%H:%M:%S") << '.' << std::setw(3) << std::setfill('0')
-        << ms.count() << "+0000";
+    out.imbue(std::locale::classic());
+    out << std::put_time(&utc, "%a, %d %b %Y %H:%M:%S GMT");
     return out.str();
 }
 
-std::string random_token(std::size_t length)
-{
-    static constexpr char kAlphabet[] =
-        "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ";
-    std::random_device                         rd;
-    std::mt19937                               gen(rd());
-    std::uniform_int_distribution<std::size_t> dist(0, sizeof(kAlphabet) - 2);
-    std::string                                token;
-    token.reserve(length);
-    for (std::size_t i = 0; i < length; ++i)
-    {
-        token.push_back(kAlphabet[dist(gen)]);
-    }
-    return token;
-}
-
-fs::path platform_fs_path(const fs::path& input)
+std::optional<std::int64_t> parse_http_date(const std::string& value)
 {
-#ifdef _WIN32
-    fs::path           absolute = fs::absolute(input);
-    const std::wstring value    = absolute.native();
-    if (value.rfind(L"\\\\?\\", 0) == 0)
-    {
-        return absolute;
-    }
-    if (value.rfind(L"\\\\", 0) == 0)
+    std::tm            utc{};
+    std::istringstream in(value);
+    in.imbue(std::locale::classic());
+    in >> std::get_time(&utc, "%a, %d %b %Y %H:%M:%S");
+    if (in.fail())
     {
-        return fs::path(L"\\\\?\\UNC\\" + value.substr(2));
+        return std::nullopt;
     }
-    return fs::path(L"\\\\?\\" + value);
-#else
-    return input;
-#endif
-}
-
-bool is_safe_path_segment(std::string_view value)
-{
-    return !value.empty() && value.find("..") == std::string_view::npos &&
-           value.find('\\') == std::string_view::npos && value.find('/') == std::string_view::npos;
+    const std::chrono::sys_days day{std::chrono::year{utc.tm_year + 1900} /
+                                    std::chrono::month{static_cast<unsigned>(utc.tm_mon + 1)} /
+                                    std::chrono::day{static_cast<unsigned>(utc.tm_mday)}};
+    return std::chrono::duration_cast<std::chrono::seconds>(day.time_since_epoch()).count() +
+           utc.tm_hour * 3600 + utc.tm_min * 60 + utc.tm_sec;
 }
 
 std::string base64_decode(std::string_view input)
@@ -271,178 +335,108 @@ std::optional<std::string> parse_bearer_header(std::string_view header)
     return std::string(header.substr(prefix.size()));
 }
 
-class PackageStorage
+std::string load_failure(const PackageStorage& storage)
 {
-  public:
-    explicit PackageStorage(fs::path root) : root_(std::move(root))
-    {
-        fs::create_directories(root_);
-    }
-
-    [[nodiscard]] fs::path root() const
-    {
-        return root_;
-    }
-    [[nodiscard]] fs::path config_path() const
-    {
-        return root_ / "leafserver.conf";
-    }
-
-    [[nodiscard]] fs::path recipe_base(const RecipeRef& ref) const
-    {
-        return root_ / "recipes" / ref.name / ref.version / ref.user / ref.channel;
-    }
-
-    [[nodiscard]] fs::path recipe_revision_path(const RecipeRef& ref,
-                                                std::string_view revision) const
-    {
-        return recipe_base(ref) / "revisions" / std::string(revision);
-    }
-
-    [[nodiscard]] fs::path recipe_files_path(const RecipeRef& ref, std::string_view revision) const
-    {
-        return recipe_revision_path(ref, revision) / "files";
-    }
-
-    [[nodiscard]] fs::path package_revision_path(const RecipeRef& ref,
-                                                 std::string_view recipe_revision,
-                                                 std::string_view package_id,
-                                                 std::string_view package_revision) const
-    {
-        return recipe_revision_path(ref, recipe_revision) / "packages" / std::string(package_id) /
-               "revisions" / std::string(package_revision);
-    }
+    const auto& reason = storage.load_error();
+    return "Failed to load " + storage.metadata_log_path().string() +
+           (reason.empty() ? std::string() : ": " + reason);
+}
 
-    [[nodiscard]] fs::path package_files_path(const RecipeRef& ref,
-                                              std::string_view recipe_revision,
-                                              std::string_view package_id,
-                                              std::string_view package_revision) const
+// Background storage maintenance. Trashed revisions are deleted within about a second of being
+// removed, throttled to a file rate so a large delete does not starve request I/O, and the
+// retention policy is applied at startup and then every interval. Uploads abandoned before their
+// revision was published are dropped once stale. Request workers only ever rename directories
+// into the trash.
+class GarbageCollector
+{
+  public:
+    GarbageCollector(PackageStorage& storage, const ServerConfig& config)
+        : storage_(storage),
+          keep_recipe_revisions_(config.keep_recipe_revisions),
+          package_max_age_days_(config.package_max_age_days),
+          interval_(std::chrono::seconds(std::max<std::uint64_t>(1, config.gc_interval))),
+          deletes_per_second_(config.gc_max_deletes_per_second),
+          staging_max_idle_(config.read_timeout * kStagingIdleReadTimeouts)
     {
-        return package_revision_path(ref, recipe_revision, package_id, package_revision) / "files";
     }
 
-    void ensure_layout() const
+    ~GarbageCollector()
     {
-        fs::create_directories(root_ / "recipes");
+        stop();
     }
 
-    [[nodiscard]] std::vector<RevisionInfo> list_recipe_revisions(const RecipeRef& ref) const
-    {
-        return list_revisions(recipe_base(ref) / "revisions");
-    }
+    GarbageCollector(const GarbageCollector&)            = delete;
+    GarbageCollector& operator=(const GarbageCollector&) = delete;
 
-    [[nodiscard]] std::vector<RevisionInfo>
-    list_package_revisions(const RecipeRef& ref,
-                           std::string_view recipe_revision,
-                           std::string_view package_id) const
+    void start()
     {
-        return list_revisions(recipe_revision_path(ref, recipe_revision) / "packages" /
-                              std::string(package_id) / "revisions");
+        stop();
+        stop_   = false;
+        thread_ = std::thread([this] { loop(); });
     }
 
-    [[nodiscard]] std::vector<std::string> list_files(const fs::path& files_dir) const
+    void stop()
     {
-        std::vector<std::string> files;
-        if (!fs::exists(files_dir))
+        if (!thread_.joinable())
         {
-            return files;
+            return;
         }
-        for (const auto& entry : fs::directory_iterator(files_dir))
         {
-            if (entry.is_regular_file())
-            {
-                files.push_back(entry.path().filename().string());
-            }
+            std::lock_guard lock(mutex_);
+            stop_ = true;
         }
-        std::sort(files.begin(), files.end());
-        return files;
+        wake_.notify_all();
+        thread_.join();
     }
 
-    [[nodiscard]] std::vector<RecipeRef> list_recipe_refs() const
+  private:
+    // Sleeps for duration; false once stop() was called.
+    bool pause(std::chrono::milliseconds duration)
     {
-        std::vector<RecipeRef> refs;
-        const fs::path         recipes_root = root_ / "recipes";
-        if (!fs::exists(recipes_root))
-        {
-            return refs;
-        }
-        for (const auto& name_dir : fs::directory_iterator(recipes_root))
-        {
-            if (!name_dir.is_directory())
-            {
-                continue;
-            }
-            for (const auto& version_dir : fs::directory_iterator(name_dir.path()))
-            {
-                if (!version_dir.is_directory())
-                {
-                    continue;
-                }
-                for (const auto& user_dir : fs::directory_iterator(version_dir.path()))
-                {
-                    if (!user_dir.is_directory())
-                    {
-                        continue;
-                    }
-                    for (const auto& channel_dir : fs::directory_iterator(user_dir.path()))
-                    {
-                        if (!channel_dir.is_directory())
-                        {
-                            continue;
-                        }
-                        refs.push_back({name_dir.path().filename().string(),
-                                        version_dir.path().filename().string(),
-                                        user_dir.path().filename().string(),
-                                        channel_dir.path().filename().string()});
-                    }
-                }
-            }
-        }
-        std::sort(refs.begin(),
-                  refs.end(),
-                  [](const RecipeRef& lhs, const RecipeRef& rhs)
-                  {
-                      return std::tie(lhs.name, lhs.version, lhs.user, lhs.channel) <
-                             std::tie(rhs.name, rhs.version, rhs.user, rhs.channel);
-                  });
-        return refs;
+        std::unique_lock lock(mutex_);
+        return !wake_.wait_for(lock, duration, [this] { return stop_; });
     }
 
-  private:
-    [[nodiscard]] std::vector<RevisionInfo> list_revisions(const fs::path& revisions_dir) const
+    void loop()
     {
-        std::vector<RevisionInfo> revisions;
-        if (!fs::exists(revisions_dir))
-        {
-            return revisions;
-        }
-        for (const auto& entry : fs::directory_iterator(revisions_dir))
+        const bool retention = keep_recipe_revisions_ != 0 || package_max_age_days_ != 0;
+        auto       next_retention = std::chrono::steady_clock::now();
+        do
         {
-            if (!entry.is_directory())
+            if (retention && std::chrono::steady_clock::now() >= next_retention)
             {
-                continue;
+                const auto removed =
+                    storage_.apply_retention(keep_recipe_revisions_, package_max_age_days_);
+                append_debug_log(LogLevel::Info,
+                                 "GC retention removed " + std::to_string(removed) + " revisions");
+                next_retention = std::chrono::steady_clock::now() + interval_;
             }
-            const fs::path info_path = entry.path() / "revision.json";
-            std::string    time      = iso8601_now();
-            if (std::ifstream in(info_path); in)
+            if (const auto dropped = storage_.discard_stale_staging(staging_max_idle_))
             {
-                std::string line;
-                std::getline(in, line);
-                if (!trim(line).empty())
-                {
-                    time = trim(line);
-                }
+                append_debug_log(LogLevel::Info,
+                                 "GC dropped " + std::to_string(dropped) + " stale uploads");
             }
-            revisions.push_back({entry.path().filename().string(), time, entry.path()});
-        }
-        std::sort(revisions.begin(),
-                  revisions.end(),
-                  [](const RevisionInfo& lhs, const RevisionInfo& rhs)
-                  { return lhs.time > rhs.time; });
-        return revisions;
+            if (storage_.trash_pending() != 0)
+            {
+                const auto deleted = storage_.reclaim_trash(
+                    deletes_per_second_,
+                    [this](std::chrono::milliseconds duration) { return pause(duration); });
+                append_debug_log(LogLevel::Debug,
+                                 "GC reclaimed " + std::to_string(deleted) + " files");
+            }
+        } while (pause(std::chrono::seconds(1)));
     }
 
-    fs::path root_;
+    PackageStorage&         storage_;
+    std::size_t             keep_recipe_revisions_;
+    std::uint64_t           package_max_age_days_;
+    std::chrono::seconds    interval_;
+    std::size_t             deletes_per_second_;
+    std::chrono::seconds    staging_max_idle_;
+    std::mutex              mutex_;
+    std::condition_variable wake_;
+    bool                    stop_ = false;
+    std::thread             thread_;
 };
 
 class AuthManager
@@ -450,6 +444,7 @@ class AuthManager
   public:
     explicit AuthManager(User admin) : admin_(std::move(admin))
     {
+        sessions_.start_sweeper(std::chrono::minutes(10));
     }
 
     [[nodiscard]] bool valid_basic(const std::string& username, const std::string& password) const
@@ -469,13 +464,12 @@ class AuthManager
             }
             if (const auto bearer = parse_bearer_header(authorization))
             {
-                const auto it = sessions_.find(*bearer);
-                if (it != sessions_.end() &&
-                    it->second.expires_at > std::chrono::system_clock::now())
+                if (auto username = sessions_.find(*bearer))
                 {
-                    return it->second.username;
+                    return username;
                 }
             }
+            g_metrics.add_auth_failure();
         }
         return std::nullopt;
     }
@@ -484,13 +478,14 @@ class AuthManager
     {
         Session session{
             username, random_token(40), std::chrono::system_clock::now() + std::chrono::hours(24)};
-        sessions_[session.token] = session;
-        return session.token;
+        auto token = session.token;
+        sessions_.insert(std::move(session));
+        return token;
     }
 
   private:
-    User                                     admin_;
-    std::unordered_map<std::string, Session> sessions_;
+    User         admin_;
+    SessionStore sessions_;
 };
 
 std::string load_or_generate_password(const fs::path& config_path)
@@ -553,6 +548,74 @@ ServerConfig load_config(const fs::path& storage_root)
             {
                 config.admin_password = value;
             }
+            else if (key == "dedup" && !value.empty())
+            {
+                config.dedup = value == "true" || value == "1";
+            }
+            else if (key == "log_level" && !value.empty())
+            {
+                config.log_level = parse_log_level(value).value_or(config.log_level);
+            }
+            else if (key == "log_max_bytes" && !value.empty())
+            {
+                config.log_max_bytes = std::stoull(value);
+            }
+            else if (key == "worker_threads" && !value.empty())
+            {
+                config.worker_threads = std::stoul(value);
+            }
+            else if (key == "max_queued_requests" && !value.empty())
+            {
+                config.max_queued_requests = std::stoul(value);
+            }
+            else if (key == "max_concurrent_uploads" && !value.empty())
+            {
+                config.max_uploads = std::stoul(value);
+            }
+            else if (key == "max_concurrent_metadata_reads" && !value.empty())
+            {
+                config.max_metadata_reads = std::stoul(value);
+            }
+            else if (key == "upstream")
+            {
+                config.upstream = value;
+            }
+            else if (key == "mirror")
+            {
+                config.mirror = value;
+            }
+            else if (key == "mirror_interval" && !value.empty())
+            {
+                config.mirror_interval = std::stoull(value);
+            }
+            else if (key == "sync_jobs" && !value.empty())
+            {
+                config.sync_jobs = std::stoul(value);
+            }
+            else if (key == "keep_recipe_revisions" && !value.empty())
+            {
+                config.keep_recipe_revisions = std::stoul(value);
+            }
+            else if (key == "package_revision_max_age_days" && !value.empty())
+            {
+                config.package_max_age_days = std::stoull(value);
+            }
+            else if (key == "gc_interval" && !value.empty())
+            {
+                config.gc_interval = std::stoull(value);
+            }
+            else if (key == "gc_max_deletes_per_second" && !value.empty())
+            {
+                config.gc_max_deletes_per_second = std::stoul(value);
+            }
+            else if (key == "file_cache_bytes" && !value.empty())
+            {
+                config.file_cache_bytes = std::stoull(value);
+            }
+            else if (key == "read_timeout" && !value.empty())
+            {
+                config.read_timeout = std::max<std::uint64_t>(1, std::stoull(value));
+            }
         }
     }
     else
@@ -562,6 +625,23 @@ ServerConfig load_config(const fs::path& storage_root)
         out << "port=" << config.port << '\n';
         out << "admin_user=" << config.admin_user << '\n';
         out << "admin_password=" << config.admin_password << '\n';
+        out << "dedup=" << (config.dedup ? "true" : "false") << '\n';
+        out << "log_level=" << log_level_name(config.log_level) << '\n';
+        out << "log_max_bytes=" << config.log_max_bytes << '\n';
+        out << "worker_threads=" << config.worker_threads << '\n';
+        out << "max_queued_requests=" << config.max_queued_requests << '\n';
+        out << "max_concurrent_uploads=" << config.max_uploads << '\n';
+        out << "max_concurrent_metadata_reads=" << config.max_metadata_reads << '\n';
+        out << "upstream=" << config.upstream << '\n';
+        out << "mirror=" << config.mirror << '\n';
+        out << "mirror_interval=" << config.mirror_interval << '\n';
+        out << "sync_jobs=" << config.sync_jobs << '\n';
+        out << "keep_recipe_revisions=" << config.keep_recipe_revisions << '\n';
+        out << "package_revision_max_age_days=" << config.package_max_age_days << '\n';
+        out << "gc_interval=" << config.gc_interval << '\n';
+        out << "gc_max_deletes_per_second=" << config.gc_max_deletes_per_second << '\n';
+        out << "file_cache_bytes=" << config.file_cache_bytes << '\n';
+        out << "read_timeout=" << config.read_timeout << '\n';
     }
 
     return config;
@@ -585,192 +665,291 @@ std::optional<RecipeRef> make_ref(const httplib::Match& matches, std::size_t off
     return ref;
 }
 
-std::optional<std::string> read_small_file(const fs::path& file)
-{
-    std::ifstream in(platform_fs_path(file), std::ios::binary);
-    if (!in)
-    {
-        return std::nullopt;
-    }
-    std::ostringstream out;
-    out << in.rdbuf();
-    return out.str();
-}
-
-std::map<std::string, std::map<std::string, std::string>>
-parse_ini_sections(const std::string& content)
+std::string package_search_json(const fs::path& conaninfo_file)
 {
-    std::map<std::string, std::map<std::string, std::string>> sections;
-    std::string                                               current = "root";
-    std::istringstream                                        input(content);
-    std::string                                               line;
-    while (std::getline(input, line))
+    const auto info   = read_small_file(conaninfo_file).value_or("");
+    const auto parsed = parse_ini_sections(info);
+    JsonWriter out(512);
+    out.begin_object();
+    for (const char* label : {"settings", "options", "requires", "recipe_hash"})
     {
-        line = trim(line);
-        if (line.empty() || line.starts_with('#') || line.starts_with(';'))
-        {
-            continue;
-        }
-        if (line.front() == '[' && line.back() == ']')
+        const auto section = parsed.find(label);
+        if (section == parsed.end())
         {
-            current = line.substr(1, line.size() - 2);
             continue;
         }
-        const auto sep = line.find('=');
-        if (sep == std::string::npos)
+        out.key(label).begin_object();
+        for (const auto& [key, value] : section->second)
         {
-            continue;
+            out.key(key).value(value);
         }
-        sections[current][trim(line.substr(0, sep))] = trim(line.substr(sep + 1));
+        out.end_object();
     }
-    return sections;
+    out.end_object();
+    return out.take();
 }
 
-std::string package_search_json(const fs::path& conaninfo_file)
+void write_packages_search(JsonWriter&        out,
+                           PackageStorage&    storage,
+                           const RecipeRef&   ref,
+                           const std::string& recipe_revision)
 {
-    const auto         info   = read_small_file(conaninfo_file).value_or("");
-    const auto         parsed = parse_ini_sections(info);
-    std::ostringstream out;
-    out << '{';
-    bool first_section = true;
-    auto append_object =
-        [&](const std::string& label, const std::map<std::string, std::string>& values)
+    out.begin_object();
+    for (const auto& package_id : storage.list_package_ids(ref, recipe_revision))
     {
-        if (!first_section)
+        const auto package_revision =
+            storage.latest_package_revision(ref, recipe_revision, package_id);
+        if (!package_revision)
         {
-            out << ',';
+            continue;
         }
-        first_section = false;
-        out << '"' << json_escape(label) << "\":{";
-        bool first = true;
-        for (const auto& [key, value] : values)
+        const fs::path conaninfo = package_revision->path / "files" / "conaninfo.txt";
+        const auto     checksum  = storage.package_file_checksum(
+            ref, recipe_revision, package_id, package_revision->revision, "conaninfo.txt");
+        out.key(package_id);
+        if (checksum)
         {
-            if (!first)
+            const std::string key    = package_revision->path.generic_string() + '/';
+            auto              cached = storage.search_cache().find(key, checksum->sha256);
+            if (!cached)
             {
-                out << ',';
+                cached = std::make_shared<const std::string>(package_search_json(conaninfo));
+                storage.search_cache().insert(key, checksum->sha256, cached);
             }
-            first = false;
-            out << '"' << json_escape(key) << "\":\"" << json_escape(value) << '"';
+            out.raw(*cached);
+        }
+        else
+        {
+            out.raw(package_search_json(conaninfo));
         }
-        out << '}';
+    }
+    out.end_object();
+}
+
+std::string packages_search_json(PackageStorage&    storage,
+                                 const RecipeRef&   ref,
+                                 const std::string& recipe_revision)
+{
+    JsonWriter out;
+    write_packages_search(out, storage, ref, recipe_revision);
+    return out.take();
+}
+
+std::string summary_json(const PackageStorage& storage)
+{
+    const auto   index = storage.index_stats();
+    const auto   dedup = storage.dedup_stats();
+    const double ratio = dedup.stored_bytes == 0 ? 1.0
+                                                 : static_cast<double>(dedup.logical_bytes) /
+                                                       static_cast<double>(dedup.stored_bytes);
+    const std::uint64_t saved =
+        dedup.logical_bytes - std::min(dedup.logical_bytes, dedup.stored_bytes);
+    JsonWriter out(512);
+    out.begin_object()
+        .key("recipes").value(index.recipes)
+        .key("recipe_revisions").value(index.recipe_revisions)
+        .key("packages").value(index.packages)
+        .key("package_revisions").value(index.package_revisions)
+        .key("bytes").value(index.bytes)
+        .key("disk_bytes").value(index.bytes - std::min(index.bytes, saved))
+        .key("storage").value(storage.root().string());
+    out.key("dedup")
+        .begin_object()
+        .key("enabled").value(dedup.enabled)
+        .key("blobs").value(dedup.blobs)
+        .key("stored_bytes").value(dedup.stored_bytes)
+        .key("logical_bytes").value(dedup.logical_bytes)
+        .key("saved_bytes").value(saved)
+        .key("ratio").value(ratio, 2)
+        .end_object();
+    out.end_object();
+    return out.take();
+}
+
+std::string metrics_text(const PackageStorage& storage)
+{
+    const auto index = storage.index_stats();
+    const auto dedup = storage.dedup_stats();
+    const auto files =
+        storage.file_cache() != nullptr ? storage.file_cache()->stats() : FileCache::Stats{};
+    const Metrics::Gauges gauges = {
+        {"leafserver_index_recipes", static_cast<double>(index.recipes)},
+        {"leafserver_index_recipe_revisions", static_cast<double>(index.recipe_revisions)},
+        {"leafserver_index_packages", static_cast<double>(index.packages)},
+        {"leafserver_index_package_revisions", static_cast<double>(index.package_revisions)},
+        {"leafserver_index_bytes", static_cast<double>(index.bytes)},
+        {"leafserver_blobs", static_cast<double>(dedup.blobs)},
+        {"leafserver_blob_stored_bytes", static_cast<double>(dedup.stored_bytes)},
+        {"leafserver_trash_entries", static_cast<double>(storage.trash_pending())},
+        {"leafserver_file_cache_entries", static_cast<double>(files.entries)},
+        {"leafserver_file_cache_bytes", static_cast<double>(files.bytes)},
     };
-    const auto settings         = parsed.find("settings");
-    const auto options          = parsed.find("options");
-    const auto requires_section = parsed.find("requires");
-    const auto recipe_hash      = parsed.find("recipe_hash");
-    if (settings != parsed.end())
+    const Metrics::Counters counters = {
+        {"leafserver_log_dropped_lines_total", g_debug_log.dropped()},
+        {"leafserver_file_cache_hits_total", files.hits},
+        {"leafserver_file_cache_misses_total", files.misses},
+        {"leafserver_file_cache_evictions_total", files.evictions},
+    };
+    return g_metrics.render(gauges, counters);
+}
+
+constexpr std::size_t kRecipePageDefault = 50;
+constexpr std::size_t kRecipePageMax     = 500;
+
+void write_recipe_summary(JsonWriter& out, const RecipeSummary& recipe)
+{
+    out.begin_object()
+        .key("reference").value(recipe.reference)
+        .key("name").value(recipe.ref.name)
+        .key("version").value(recipe.ref.version)
+        .key("user").value(recipe.ref.user)
+        .key("channel").value(recipe.ref.channel)
+        .key("bytes").value(recipe.bytes)
+        .key("revision_count").value(recipe.revisions)
+        .key("latest");
+    if (recipe.latest)
     {
-        append_object("settings", settings->second);
+        out.begin_object()
+            .key("revision").value(recipe.latest->revision)
+            .key("time").value(recipe.latest->time)
+            .end_object();
     }
-    if (options != parsed.end())
+    else
     {
-        append_object("options", options->second);
+        out.null();
     }
-    if (requires_section != parsed.end())
+    out.end_object();
+}
+
+// One page of the dashboard recipe table. q filters by case-insensitive substring of the
+// reference, sort is "name" (default) or "updated", and cursor is the next_cursor of the
+// previous page. Everything is answered from the storage index.
+std::string recipes_page_json(const PackageStorage& storage, const httplib::Request& req)
+{
+    std::size_t limit       = kRecipePageDefault;
+    const auto  limit_param = req.get_param_value("limit");
+    std::from_chars(limit_param.data(), limit_param.data() + limit_param.size(), limit);
+    limit = std::clamp<std::size_t>(limit, 1, kRecipePageMax);
+
+    const std::string cursor    = req.get_param_value("cursor");
+    const bool        by_update = req.get_param_value("sort") == "updated";
+    const std::string needle    = Glob::fold(req.get_param_value("q"));
+
+    std::vector<RecipeSummary> page;
+    if (by_update)
     {
-        append_object("requires", requires_section->second);
+        // Cursor is "<latest time> <reference>"; times never contain spaces.
+        const auto separator = cursor.find(' ');
+        const auto after     = separator == std::string::npos
+                                   ? std::pair<std::string, std::string>()
+                                   : std::pair(cursor.substr(0, separator),
+                                               cursor.substr(separator + 1));
+        page = storage.recipes_by_update(needle, after, limit + 1);
     }
-    if (recipe_hash != parsed.end())
+    else
     {
-        append_object("recipe_hash", recipe_hash->second);
+        page = storage.recipes_by_name(needle, cursor, limit + 1);
     }
-    out << '}';
-    return out.str();
+    const bool more = page.size() > limit;
+    page.resize(std::min(page.size(), limit));
+
+    JsonWriter out(256 * (page.size() + 1));
+    out.begin_object().key("recipes").begin_array();
+    for (const auto& recipe : page)
+    {
+        write_recipe_summary(out, recipe);
+    }
+    out.end_array().key("next_cursor");
+    if (more)
+    {
+        const auto& last = page.back();
+        out.value(by_update ? (last.latest ? last.latest->time : std::string()) + ' ' +
+                                  last.reference
+                            : last.reference);
+    }
+    else
+    {
+        out.null();
+    }
+    out.end_object();
+    return out.take();
 }
 
-std::string summary_json(const PackageStorage& storage)
+// Everything the dashboard shows when a recipe row is expanded: each revision with its files
+// and the search fragments of its packages.
+std::string recipe_detail_json(PackageStorage& storage, const RecipeRef& ref)
 {
-    const auto  refs            = storage.list_recipe_refs();
-    std::size_t total_revisions = 0;
-    std::size_t total_packages  = 0;
-    for (const auto& ref : refs)
+    JsonWriter out;
+    out.begin_object()
+        .key("reference").value(ref_string(ref))
+        .key("bytes").value(storage.recipe_bytes(ref))
+        .key("revisions").begin_array();
+    for (const auto& revision : storage.list_recipe_revisions(ref))
     {
-        const auto revisions = storage.list_recipe_revisions(ref);
-        total_revisions += revisions.size();
-        for (const auto& revision : revisions)
+        out.begin_object()
+            .key("revision").value(revision.revision)
+            .key("time").value(revision.time)
+            .key("files").begin_object();
+        for (const auto& [name, checksum] : storage.recipe_file_list(ref, revision.revision))
         {
-            const fs::path packages_dir = revision.path / "packages";
-            if (!fs::exists(packages_dir))
-            {
-                continue;
-            }
-            for (const auto& package_dir : fs::directory_iterator(packages_dir))
-            {
-                if (package_dir.is_directory())
-                {
-                    ++total_packages;
-                }
-            }
+            out.key(name).value(checksum.size);
         }
+        out.end_object().key("packages");
+        write_packages_search(out, storage, ref, revision.revision);
+        out.end_object();
     }
-    std::ostringstream out;
-    out << "{"
-        << "\"recipes\":" << refs.size() << ',' << "\"recipe_revisions\":" << total_revisions << ','
-        << "\"packages\":" << total_packages << ',' << "\"storage\":\""
-        << json_escape(storage.root().string()) << "\"}";
-    return out.str();
+    out.end_array().end_object();
+    return out.take();
 }
 
-std::string recipes_json(const PackageStorage& storage)
+// Replication manifest: one tab-separated rrev/rfile/prev/pfile record per line, fields as in
+// metadata.log. Names never contain tabs or newlines, since they are validated path segments.
+std::string manifest_text(const PackageStorage& storage)
 {
-    const auto         refs = storage.list_recipe_refs();
-    std::ostringstream out;
-    out << "{\"recipes\":[";
-    bool first_ref = true;
-    for (const auto& ref : refs)
-    {
-        if (!first_ref)
-        {
-            out << ',';
-        }
-        first_ref            = false;
-        const auto revisions = storage.list_recipe_revisions(ref);
-        out << '{';
-        out << "\"reference\":\""
-            << json_escape(ref.name + "/" + ref.version + "@" + ref.user + "/" + ref.channel)
-            << "\",";
-        out << "\"name\":\"" << json_escape(ref.name) << "\",";
-        out << "\"version\":\"" << json_escape(ref.version) << "\",";
-        out << "\"user\":\"" << json_escape(ref.user) << "\",";
-        out << "\"channel\":\"" << json_escape(ref.channel) << "\",";
-        out << "\"revisions\":[";
-        bool first_revision = true;
-        for (const auto& revision : revisions)
-        {
-            if (!first_revision)
-            {
-                out << ',';
-            }
-            first_revision = false;
-            out << '{';
-            out << "\"revision\":\"" << json_escape(revision.revision) << "\",";
-            out << "\"time\":\"" << json_escape(revision.time) << "\",";
-            out << "\"files\":" << storage.list_files(revision.path / "files").size() << ',';
-            std::size_t    package_refs = 0;
-            const fs::path packages_dir = revision.path / "packages";
-            if (fs::exists(packages_dir))
-            {
-                for (const auto& entry : fs::directory_iterator(packages_dir))
+    std::string out;
+    storage.manifest(
+        [&](const MetadataLog::Record& record)
+        {
+            for (std::size_t i = 0; i < record.size(); ++i)
+            {
+                if (i != 0)
                 {
-                    if (entry.is_directory())
-                    {
-                        ++package_refs;
-                    }
+                    out += '\t';
                 }
+                out += record[i];
             }
-            out << "\"package_refs\":" << package_refs;
-            out << '}';
-        }
-        out << "]}";
-    }
-    out << "]}";
-    return out.str();
+            out += '\n';
+        });
+    return out;
 }
 
-void add_capability_headers(httplib::Response& res)
+// Answer to a dedup probe: of the sha256 digests in body, one per line, those the store holds.
+// Clients skip sending these and deploy them by checksum instead.
+std::string probe_text(const PackageStorage& storage, std::string_view body)
 {
-    res.set_header("X-Conan-Server-Capabilities", "revisions");
-    res.set_header("Server", "LeafConan/0.1");
+    std::string out;
+    for (std::size_t offset = 0; offset < body.size();)
+    {
+        const auto end    = std::min(body.find('\n', offset), body.size());
+        auto       sha256 = body.substr(offset, end - offset);
+        offset            = end + 1;
+        if (sha256.ends_with('\r'))
+        {
+            sha256.remove_suffix(1);
+        }
+        if (sha256.size() == 64 && storage.content_path(std::string(sha256)))
+        {
+            out.append(sha256);
+            out += '\n';
+        }
+    }
+    return out;
+}
+
+void add_capability_headers(httplib::Response& res)
+{
+    res.set_header("X-Conan-Server-Capabilities", "revisions");
+    res.set_header("Server", "LeafConan/0.1");
 }
 
 void set_json(httplib::Response& res, const std::string& body, int status = 200)
@@ -825,112 +1004,660 @@ void allow_anonymous_or_auth(AuthManager&            auth,
     allow_anonymous_or_auth(auth, std::forward<Handler>(handler), req);
 }
 
-bool ensure_parent_dir(const fs::path& file)
+std::vector<std::string> file_names(const ChecksumMap& files)
 {
-    std::error_code ec;
-    fs::create_directories(platform_fs_path(file).parent_path(), ec);
-    return !ec;
+    std::vector<std::string> names;
+    names.reserve(files.size());
+    for (const auto& [name, checksum] : files)
+    {
+        names.push_back(name);
+    }
+    return names;
 }
 
-void write_revision_info(const fs::path& revision_dir)
+std::string file_listing_json(const std::vector<std::string>& files)
 {
-    std::ofstream out(revision_dir / "revision.json", std::ios::trunc);
-    out << iso8601_now() << '\n';
+    JsonWriter out(64 * (files.size() + 1));
+    out.begin_object().key("files").begin_object();
+    for (const auto& file : files)
+    {
+        out.key(file).begin_object().end_object();
+    }
+    out.end_object().end_object();
+    return out.take();
 }
 
-std::string file_listing_json(const std::vector<std::string>& files)
+std::string revision_json(const RevisionInfo& revision)
 {
-    std::ostringstream out;
-    out << "{\"files\":{";
-    bool first = true;
-    for (const auto& file : files)
+    JsonWriter out(128);
+    out.begin_object()
+        .key("revision").value(revision.revision)
+        .key("time").value(revision.time)
+        .end_object();
+    return out.take();
+}
+
+std::string revisions_json(std::string_view reference, const std::vector<RevisionInfo>& revisions)
+{
+    JsonWriter out(128 * (revisions.size() + 1));
+    out.begin_object().key("reference").value(reference).key("revisions").begin_array();
+    for (const auto& revision : revisions)
+    {
+        out.begin_object()
+            .key("revision").value(revision.revision)
+            .key("time").value(revision.time)
+            .end_object();
+    }
+    out.end_array().end_object();
+    return out.take();
+}
+
+// Artifacts are streamed straight from disk through a fixed-size buffer, so a download costs the
+// same resident memory whether the file is a 2 KB conanfile.py or a 500 MB conan_package.tgz.
+// Files up to kFileCacheMaxEntry are the exception: they are served from the FileCache.
+constexpr std::size_t kDownloadChunkSize = 64 * 1024;
+constexpr std::size_t kFileCacheMaxEntry = 256 * 1024;
+constexpr int         kRetryAfterSeconds = 2;
+constexpr std::size_t kJsonChunkSize     = 64 * 1024;
+
+struct FileStream
+{
+    std::ifstream     in;
+    std::vector<char> buffer;
+};
+
+bool etag_list_matches(const std::string& header, const std::string& etag)
+{
+    std::istringstream candidates(header);
+    std::string        candidate;
+    while (std::getline(candidates, candidate, ','))
     {
-        if (!first)
+        candidate = trim(candidate);
+        if (candidate.starts_with("W/"))
         {
-            out << ',';
+            candidate.erase(0, 2);
+        }
+        if (candidate == "*" || candidate == etag)
+        {
+            return true;
         }
-        first = false;
-        out << '"' << json_escape(file) << "\":{}";
     }
-    out << "}}";
-    return out.str();
+    return false;
+}
+
+bool is_not_modified(const httplib::Request& req, const std::string& etag, std::int64_t modified)
+{
+    if (req.has_header("If-None-Match"))
+    {
+        return etag_list_matches(req.get_header_value("If-None-Match"), etag);
+    }
+    if (req.has_header("If-Modified-Since"))
+    {
+        const auto since = parse_http_date(req.get_header_value("If-Modified-Since"));
+        return since && modified <= *since;
+    }
+    return false;
 }
 
-void handle_file_get(const fs::path& file_path, httplib::Response& res)
+// Serves a stored artifact with a strong ETag (its SHA-256) and Last-Modified, answering
+// conditional requests with 304. Byte ranges are honoured unless an If-Range validator no longer
+// matches; httplib slices the content provider and emits Content-Range for 206 responses. With a
+// cache, small files with a known checksum are answered from memory without touching the disk.
+void handle_file_get(FileCache*                         cache,
+                     const fs::path&                    file_path,
+                     const std::optional<FileChecksum>& checksum,
+                     const httplib::Request&            req,
+                     httplib::Response&                 res)
 {
-    std::ifstream in(platform_fs_path(file_path), std::ios::binary);
-    if (!in)
+    const bool cacheable = cache != nullptr && checksum && cache->accepts(checksum->size);
+    const auto key       = cacheable ? file_path.generic_string() : std::string();
+    auto       cached    = cacheable ? cache->find(key, checksum->sha256) : nullptr;
+
+    const fs::path  native = platform_fs_path(file_path);
+    std::error_code ec;
+    const auto      size = cached ? cached->size() : fs::file_size(native, ec);
+    if (ec || is_upload_temp_file(file_path.filename().string()))
+    {
+        set_plain(res, "Not Found", 404);
+        return;
+    }
+
+    add_capability_headers(res);
+    res.set_header("Accept-Ranges", "bytes");
+    bool partial = !req.ranges.empty();
+    if (checksum)
+    {
+        const std::string etag          = '"' + checksum->sha256 + '"';
+        const std::string last_modified = http_date(checksum->modified);
+        res.set_header("ETag", etag);
+        res.set_header("Last-Modified", last_modified);
+        if (is_not_modified(req, etag, checksum->modified))
+        {
+            res.status = 304;
+            return;
+        }
+        if (req.has_header("If-Range"))
+        {
+            const std::string validator = req.get_header_value("If-Range");
+            partial = partial && (validator == etag || validator == last_modified);
+        }
+    }
+    else if (req.has_header("If-Range"))
+    {
+        partial = false;
+    }
+
+    if (!cached && cacheable && size == checksum->size)
+    {
+        if (auto contents = read_small_file(file_path); contents && contents->size() == size)
+        {
+            cached = std::make_shared<const std::string>(std::move(*contents));
+            cache->insert(key, checksum->sha256, cached);
+        }
+    }
+    if (cached)
+    {
+        res.status = partial ? 206 : 200;
+        res.set_content_provider(
+            cached->size(),
+            "application/octet-stream",
+            [cached](std::size_t offset, std::size_t length, httplib::DataSink& sink)
+            {
+                if (!sink.write(cached->data() + offset, length))
+                {
+                    return false;
+                }
+                g_metrics.add_downloaded_bytes(length);
+                return true;
+            });
+        return;
+    }
+
+    auto stream = std::make_shared<FileStream>();
+    stream->in.open(native, std::ios::binary);
+    if (!stream->in)
     {
         set_plain(res, "Not Found", 404);
         return;
     }
-    std::ostringstream buffer;
-    buffer << in.rdbuf();
+    stream->buffer.resize(
+        static_cast<std::size_t>(std::min<std::uintmax_t>(size, kDownloadChunkSize)));
+    res.status = partial ? 206 : 200;
+    res.set_content_provider(
+        static_cast<std::size_t>(size),
+        "application/octet-stream",
+        [stream](std::size_t offset, std::size_t length, httplib::DataSink& sink)
+        {
+            stream->in.clear();
+            stream->in.seekg(static_cast<std::streamoff>(offset));
+            const auto chunk = std::min(length, stream->buffer.size());
+            stream->in.read(stream->buffer.data(), static_cast<std::streamsize>(chunk));
+            const auto read = stream->in.gcount();
+            if (read <= 0)
+            {
+                return false;
+            }
+            if (!sink.write(stream->buffer.data(), static_cast<std::size_t>(read)))
+            {
+                return false;
+            }
+            g_metrics.add_downloaded_bytes(static_cast<std::uint64_t>(read));
+            return true;
+        });
+}
+
+// A package bundle being streamed. The tar is a sequence of in-memory parts (headers, padding,
+// bundle.json and the trailer) and files opened up front, so a revision deleted mid-stream is
+// still sent whole. Parts are looked up by offset, which is all httplib's content provider needs.
+class BundleStream
+{
+  public:
+    void add_bytes(std::string bytes)
+    {
+        if (!bytes.empty())
+        {
+            const auto length = bytes.size();
+            parts_.push_back(Part{size_, length, std::move(bytes), nullptr});
+            size_ += length;
+        }
+    }
+
+    // Appends a tar entry holding bytes.
+    bool add_entry(const std::string& name, std::string bytes, std::int64_t mtime)
+    {
+        auto header = Tar::header(name, bytes.size(), mtime);
+        if (!header)
+        {
+            return false;
+        }
+        const auto padding = Tar::padding(bytes.size());
+        add_bytes(std::move(*header));
+        add_bytes(std::move(bytes));
+        add_bytes(std::string(padding, '\0'));
+        return true;
+    }
+
+    // Appends a tar entry streamed from file, which must hold exactly size bytes.
+    bool add_file(const std::string& name,
+                  const fs::path&    file,
+                  std::uint64_t      size,
+                  std::int64_t       mtime)
+    {
+        const fs::path  native = platform_fs_path(file);
+        auto            in     = std::make_unique<std::ifstream>(native, std::ios::binary);
+        std::error_code ec;
+        auto            header = Tar::header(name, size, mtime);
+        if (!header || !*in || fs::file_size(native, ec) != size || ec)
+        {
+            return false;
+        }
+        add_bytes(std::move(*header));
+        if (size > 0)
+        {
+            parts_.push_back(Part{size_, size, {}, std::move(in)});
+            size_ += size;
+        }
+        add_bytes(std::string(Tar::padding(size), '\0'));
+        return true;
+    }
+
+    void finish()
+    {
+        add_bytes(std::string(Tar::kTrailer, '\0'));
+        buffer_.resize(kDownloadChunkSize);
+    }
+
+    [[nodiscard]] std::uint64_t size() const
+    {
+        return size_;
+    }
+
+    bool write(std::uint64_t offset, std::size_t length, httplib::DataSink& sink)
+    {
+        const auto next = std::upper_bound(parts_.begin(),
+                                           parts_.end(),
+                                           offset,
+                                           [](std::uint64_t value, const Part& part)
+                                           { return value < part.offset; });
+        if (next == parts_.begin())
+        {
+            return false;
+        }
+        auto&      part   = *std::prev(next);
+        const auto within = offset - part.offset;
+        const auto count  = static_cast<std::size_t>(std::min<std::uint64_t>(
+            {length, part.size - std::min(within, part.size), buffer_.size()}));
+        if (count == 0)
+        {
+            return false;
+        }
+        if (!part.file)
+        {
+            return sink.write(part.bytes.data() + within, count);
+        }
+        part.file->clear();
+        part.file->seekg(static_cast<std::streamoff>(within));
+        part.file->read(buffer_.data(), static_cast<std::streamsize>(count));
+        const auto read = part.file->gcount();
+        if (read <= 0 || !sink.write(buffer_.data(), static_cast<std::size_t>(read)))
+        {
+            return false;
+        }
+        g_metrics.add_downloaded_bytes(static_cast<std::uint64_t>(read));
+        return true;
+    }
+
+  private:
+    struct Part
+    {
+        std::uint64_t                  offset = 0;
+        std::uint64_t                  size   = 0;
+        std::string                    bytes; // content of an in-memory part
+        std::unique_ptr<std::ifstream> file;  // content of a file part
+    };
+
+    std::vector<Part> parts_;
+    std::uint64_t     size_ = 0;
+    std::vector<char> buffer_;
+};
+
+// Streams a recipe revision, and optionally one of its package revisions, as one tar: first
+// bundle.json, naming the revisions and listing every file with its size and sha256, then
+// recipe/<file> and package/<file> entries. The ETag is the hash of bundle.json, so an unchanged
+// bundle is answered with 304.
+void handle_bundle_get(const PackageStorage&              storage,
+                       const RecipeRef&                   ref,
+                       const RevisionInfo&                recipe,
+                       const std::string&                 package_id,
+                       const std::optional<RevisionInfo>& package,
+                       const httplib::Request&            req,
+                       httplib::Response&                 res)
+{
+    const auto recipe_files = storage.recipe_file_list(ref, recipe.revision);
+    const auto package_files =
+        package ? storage.package_file_list(ref, recipe.revision, package_id, package->revision)
+                : ChecksumMap{};
+
+    JsonWriter manifest(256 * (recipe_files.size() + package_files.size() + 1));
+    manifest.begin_object()
+        .key("reference").value(ref_string(ref))
+        .key("revision").value(recipe.revision)
+        .key("time").value(recipe.time);
+    if (package)
+    {
+        manifest.key("package_id").value(package_id)
+            .key("package_revision").value(package->revision)
+            .key("package_time").value(package->time);
+    }
+    manifest.key("files").begin_object();
+    for (const auto* files : {&recipe_files, &package_files})
+    {
+        const std::string folder = files == &recipe_files ? "recipe/" : "package/";
+        for (const auto& [name, checksum] : *files)
+        {
+            manifest.key(folder + name)
+                .begin_object()
+                .key("size").value(checksum.size)
+                .key("sha256").value(checksum.sha256)
+                .end_object();
+        }
+    }
+    manifest.end_object().end_object();
+    auto manifest_json = manifest.take();
+
     add_capability_headers(res);
+    const std::string etag = '"' + Sha256::hex(manifest_json) + '"';
+    res.set_header("ETag", etag);
+    if (req.has_header("If-None-Match") &&
+        etag_list_matches(req.get_header_value("If-None-Match"), etag))
+    {
+        res.status = 304;
+        return;
+    }
+
+    // bundle.json carries the time of the newest file rather than the time of the request, so
+    // the bytes behind the ETag are the same on every download.
+    std::int64_t newest = 0;
+    for (const auto* files : {&recipe_files, &package_files})
+    {
+        for (const auto& [name, checksum] : *files)
+        {
+            newest = std::max(newest, checksum.modified);
+        }
+    }
+    auto stream = std::make_shared<BundleStream>();
+    bool ok     = stream->add_entry("bundle.json", std::move(manifest_json), newest);
+    const auto recipe_dir = storage.recipe_files_path(ref, recipe.revision);
+    for (const auto& [name, checksum] : recipe_files)
+    {
+        ok = ok && stream->add_file(
+                       "recipe/" + name, recipe_dir / name, checksum.size, checksum.modified);
+    }
+    if (package)
+    {
+        const auto package_dir =
+            storage.package_files_path(ref, recipe.revision, package_id, package->revision);
+        for (const auto& [name, checksum] : package_files)
+        {
+            ok = ok && stream->add_file(
+                           "package/" + name, package_dir / name, checksum.size, checksum.modified);
+        }
+    }
+    if (!ok)
+    {
+        set_plain(res, "Not Found", 404);
+        return;
+    }
+    stream->finish();
     res.status = 200;
-    res.set_content(buffer.str(), "application/octet-stream");
+    res.set_content_provider(
+        static_cast<std::size_t>(stream->size()),
+        "application/x-tar",
+        [stream](std::size_t offset, std::size_t length, httplib::DataSink& sink)
+        { return stream->write(offset, length, sink); });
 }
 
-void handle_body_upload(const fs::path&    file_path,
-                        const fs::path&    revision_dir,
-                        const std::string& body,
-                        httplib::Response& res)
+// Receives one uploaded file and hands it to commit. A request carrying "X-Checksum-Deploy: true"
+// and "X-Checksum-Sha256" instead names content the store already holds, which is copied locally;
+// 404 tells the client to send the body after all. On a full upload "X-Checksum-Sha256" is the
+// digest the body must have, and a body that arrived otherwise is dropped with 400.
+template <typename Commit>
+void handle_body_upload(const httplib::Request&       req,
+                        const PackageStorage&         storage,
+                        const fs::path&               file_path,
+                        const httplib::ContentReader& content_reader,
+                        httplib::Response&            res,
+                        Commit&&                      commit)
 {
     try
     {
-        append_debug_log("HANDLE_UPLOAD path=" + file_path.string() +
-                         " body=" + std::to_string(body.size()));
-        if (!ensure_parent_dir(file_path))
+        append_debug_log(LogLevel::Debug, "HANDLE_UPLOAD path=" + file_path.string());
+        std::optional<fs::path> deployed;
+        const std::string       expected = req.get_header_value("X-Checksum-Sha256");
+        if (req.get_header_value("X-Checksum-Deploy") == "true")
+        {
+            deployed = storage.content_path(expected);
+            if (!deployed)
+            {
+                set_plain(res, "Checksum not found", 404);
+                return;
+            }
+        }
+
+        const fs::path  temp_dir = storage.incoming_path();
+        std::error_code ec;
+        fs::create_directories(platform_fs_path(temp_dir), ec);
+        if (ec)
         {
-            append_debug_log("HANDLE_UPLOAD prepare_parent_failed");
+            append_debug_log(LogLevel::Error, "HANDLE_UPLOAD prepare_incoming_failed");
             set_plain(res, "Unable to prepare storage", 500);
             return;
         }
 
-        std::ofstream out(platform_fs_path(file_path), std::ios::binary | std::ios::trunc);
-        if (!out)
+        StagedFile staged(file_path, temp_dir);
+        if (!staged.open())
         {
-            append_debug_log("HANDLE_UPLOAD open_failed");
+            append_debug_log(LogLevel::Error, "HANDLE_UPLOAD open_failed");
             set_plain(res, "Unable to open destination file", 500);
             return;
         }
 
-        out.write(body.data(), static_cast<std::streamsize>(body.size()));
-        out.close();
-
-        if (!out.good())
+        if (deployed)
+        {
+            if (!copy_into(*deployed, staged) || staged.sha256() != expected)
+            {
+                append_debug_log(LogLevel::Warning, "HANDLE_UPLOAD deploy_failed");
+                set_plain(res, "Checksum not found", 404);
+                return;
+            }
+        }
+        else if (!content_reader([&](const char* data, std::size_t length)
+                                 { return staged.write(data, length); }) ||
+                 !staged.finish())
         {
-            append_debug_log("HANDLE_UPLOAD write_failed");
+            append_debug_log(LogLevel::Error,
+                             "HANDLE_UPLOAD write_failed body=" + std::to_string(staged.size()));
             set_plain(res, "Upload failed", 500);
             return;
         }
+        else if (!expected.empty() && staged.sha256() != expected)
+        {
+            append_debug_log(LogLevel::Warning,
+                             "HANDLE_UPLOAD checksum_mismatch sha256=" + staged.sha256());
+            set_plain(res, "Checksum mismatch", 400);
+            return;
+        }
+        append_debug_log(LogLevel::Debug,
+                         "HANDLE_UPLOAD body=" + std::to_string(staged.size()) +
+                             " sha256=" + staged.sha256() + (deployed ? " deployed" : ""));
+        if (!deployed)
+        {
+            g_metrics.add_uploaded_bytes(staged.size());
+        }
 
-        std::error_code ec;
-        fs::create_directories(platform_fs_path(revision_dir), ec);
-        if (ec)
+        if (!commit(staged))
         {
-            append_debug_log("HANDLE_UPLOAD revision_dir_failed " + ec.message());
+            append_debug_log(LogLevel::Error, "HANDLE_UPLOAD revision_commit_failed");
             set_plain(res, "Unable to prepare revision metadata", 500);
             return;
         }
-        write_revision_info(revision_dir);
-        append_debug_log("HANDLE_UPLOAD ok");
+        append_debug_log(LogLevel::Debug, "HANDLE_UPLOAD ok");
         set_json(res, "{\"status\":\"ok\"}");
     }
     catch (const std::exception& ex)
     {
-        append_debug_log(std::string("HANDLE_UPLOAD exception=") + ex.what());
+        append_debug_log(LogLevel::Error, std::string("HANDLE_UPLOAD exception=") + ex.what());
         set_plain(res, std::string("Upload exception: ") + ex.what(), 500);
     }
 }
 
-void add_recipe_routes(httplib::Server& app, PackageStorage& storage, AuthManager& auth)
+// A request matched by ConanRouter: the recipe reference that every route but the repository
+// search starts with, and the segments captured after it.
+struct ConanRoute
+{
+    RecipeRef        ref;
+    RouteTrie::Match match;
+
+    explicit ConanRoute(const RouteTrie::Match& matched) : match(matched)
+    {
+        if (match.count >= 4)
+        {
+            ref = RecipeRef{std::string(match[0]),
+                            std::string(match[1]),
+                            std::string(match[2]),
+                            std::string(match[3])};
+        }
+    }
+
+    // Capture index after the reference, in path order.
+    [[nodiscard]] std::string arg(std::size_t index) const
+    {
+        return std::string(match[4 + index]);
+    }
+};
+
+// Dispatches the /v2/conans/ family through one RouteTrie per method. httplib tries every
+// registered regex in turn, which the busiest routes pay for on each request; here httplib sees
+// one catch-all per method and the trie resolves the rest from a single split of the path. The
+// registration calls mirror httplib::Server's, with patterns written as segments and "*" and a
+// metrics label that is added to the RouteLabels along with the pattern.
+class ConanRouter
+{
+  public:
+    using Handler =
+        std::function<void(const httplib::Request&, httplib::Response&, const ConanRoute&)>;
+    using HandlerWithContentReader = std::function<void(const httplib::Request&,
+                                                        httplib::Response&,
+                                                        const httplib::ContentReader&,
+                                                        const ConanRoute&)>;
+
+    // Registers the catch-alls with app. They share the tables, so routes added afterwards are
+    // served and the router itself does not have to outlive app.
+    ConanRouter(httplib::Server& app, RouteLabels& labels)
+        : labels_(labels), tables_(std::make_shared<Tables>())
+    {
+        const std::string family = "/v2/conans/.*";
+        app.Get(family,
+                [tables = tables_](const httplib::Request& req, httplib::Response& res)
+                { dispatch(tables->get, req, res); });
+        app.Put(family,
+                [tables = tables_](const httplib::Request&       req,
+                                   httplib::Response&            res,
+                                   const httplib::ContentReader& content_reader)
+                { dispatch(tables->put, req, res, content_reader); });
+        app.Delete(family,
+                   [tables = tables_](const httplib::Request& req, httplib::Response& res)
+                   { dispatch(tables->remove, req, res); });
+    }
+
+    void Get(std::string_view pattern, std::string_view label, Handler handler)
+    {
+        labels_.add("GET", pattern, label);
+        tables_->get.add(pattern, std::move(handler));
+    }
+
+    void Put(std::string_view pattern, std::string_view label, HandlerWithContentReader handler)
+    {
+        labels_.add("PUT", pattern, label);
+        tables_->put.add(pattern, std::move(handler));
+    }
+
+    void Delete(std::string_view pattern, std::string_view label, Handler handler)
+    {
+        labels_.add("DELETE", pattern, label);
+        tables_->remove.add(pattern, std::move(handler));
+    }
+
+  private:
+    template <typename Callback>
+    struct Table
+    {
+        RouteTrie             trie;
+        std::vector<Callback> handlers; // indexed by route id
+
+        void add(std::string_view pattern, Callback handler)
+        {
+            const auto id = trie.add(pattern);
+            if (id >= handlers.size())
+            {
+                handlers.resize(id + 1);
+            }
+            handlers[id] = std::move(handler);
+        }
+    };
+
+    struct Tables
+    {
+        Table<Handler>                  get;
+        Table<HandlerWithContentReader> put;
+        Table<Handler>                  remove;
+    };
+
+    template <typename Callback, typename... Args>
+    static void dispatch(const Table<Callback>&  table,
+                         const httplib::Request& req,
+                         httplib::Response&      res,
+                         const Args&... args)
+    {
+        const auto match = table.trie.match(req.path);
+        if (!match)
+        {
+            // Left to the error handler, as for a path no route matches.
+            res.status = 404;
+            return;
+        }
+        if (!match->safe)
+        {
+            set_plain(res, "Invalid reference", 400);
+            return;
+        }
+        table.handlers[match->route](req, res, args..., ConanRoute(*match));
+    }
+
+    RouteLabels&            labels_;
+    std::shared_ptr<Tables> tables_;
+};
+
+// Handlers outlive this call, so those that consult upstream capture the pointer by value rather
+// than a reference to the parameter.
+void add_recipe_routes(httplib::Server& app,
+                       PackageStorage&  storage,
+                       AuthManager&     auth,
+                       RouteLabels&     labels,
+                       PullThrough*     upstream)
 {
+    // Registered before any other route so that httplib matches Conan API requests, the bulk of
+    // the traffic, against a single pattern.
+    ConanRouter api(app, labels);
+
+    labels.add("GET", "/v1/ping", "ping");
     app.Get("/v1/ping",
             [&](const httplib::Request&, httplib::Response& res) { set_plain(res, ""); });
+    labels.add("GET", "/v2/ping", "ping");
     app.Get("/v2/ping",
             [&](const httplib::Request&, httplib::Response& res) { set_plain(res, ""); });
 
+    labels.add("GET", "/v1/users/authenticate", "auth");
     app.Get("/v1/users/authenticate",
             [&](const httplib::Request& req, httplib::Response& res)
             {
@@ -944,6 +1671,7 @@ void add_recipe_routes(httplib::Server& app, PackageStorage& storage, AuthManage
                 }
             });
 
+    labels.add("GET", "/v2/users/authenticate", "auth");
     app.Get("/v2/users/authenticate",
             [&](const httplib::Request& req, httplib::Response& res)
             {
@@ -957,6 +1685,7 @@ void add_recipe_routes(httplib::Server& app, PackageStorage& storage, AuthManage
                 }
             });
 
+    labels.add("GET", "/v2/users/check_credentials", "auth");
     app.Get("/v2/users/check_credentials",
             [&](const httplib::Request& req, httplib::Response& res)
             {
@@ -970,6 +1699,7 @@ void add_recipe_routes(httplib::Server& app, PackageStorage& storage, AuthManage
                 }
             });
 
+    labels.add("GET", "/api/ui/login", "auth");
     app.Get("/api/ui/login",
             [&](const httplib::Request& req, httplib::Response& res)
             {
@@ -984,6 +1714,7 @@ void add_recipe_routes(httplib::Server& app, PackageStorage& storage, AuthManage
                 }
             });
 
+    labels.add("GET", "/api/ui/summary", "ui");
     app.Get(
         "/api/ui/summary",
         [&](const httplib::Request& req, httplib::Response& res)
@@ -992,64 +1723,52 @@ void add_recipe_routes(httplib::Server& app, PackageStorage& storage, AuthManage
                 auth, [&](const std::string&) { set_json(res, summary_json(storage)); }, req, res);
         });
 
-    app.Get(
-        "/api/ui/recipes",
-        [&](const httplib::Request& req, httplib::Response& res)
-        {
-            with_auth(
-                auth, [&](const std::string&) { set_json(res, recipes_json(storage)); }, req, res);
-        });
+    labels.add("GET", "/metrics", "metrics");
+    app.Get("/metrics",
+            [&](const httplib::Request&, httplib::Response& res)
+            { set_plain(res, metrics_text(storage)); });
 
-    app.Get("/v2/conans/search",
+    labels.add("GET", "/api/sync/manifest", "sync");
+    app.Get("/api/sync/manifest",
             [&](const httplib::Request& req, httplib::Response& res)
             {
                 allow_anonymous_or_auth(
                     auth,
                     [&](const std::optional<std::string>&)
-                    {
-                        const std::string query    = req.get_param_value("q");
-                        const std::string wildcard = query.empty() ? "*" : query;
-                        const std::string regex_pattern =
-                            "^" +
-                            std::regex_replace(
-                                wildcard, std::regex(R"([\.\+\-\[\]\(\)\{\}\^\$\|])"), R"(\$&)") +
-                            "$";
-                        std::string normalized = regex_pattern;
-                        std::replace(normalized.begin(), normalized.end(), '*', '.');
-                        normalized = std::regex_replace(normalized, std::regex(R"(\.)"), ".*");
-                        const std::regex   matcher(normalized, std::regex::icase);
-                        std::ostringstream out;
-                        out << "{\"results\":[";
-                        bool first = true;
-                        for (const auto& ref : storage.list_recipe_refs())
-                        {
-                            const std::string value =
-                                ref.name + "/" + ref.version + "@" + ref.user + "/" + ref.channel;
-                            if (!std::regex_match(value, matcher))
-                            {
-                                continue;
-                            }
-                            if (!first)
-                            {
-                                out << ',';
-                            }
-                            first = false;
-                            out << '"' << json_escape(value) << '"';
-                        }
-                        out << "]}";
-                        set_json(res, out.str());
-                    },
-                    req,
-                    res);
+                    { set_plain(res, manifest_text(storage)); },
+                    req);
             });
 
-    const auto recipe_prefix = R"(/v2/conans/([^/]+)/([^/]+)/([^/]+)/([^/]+))";
-    app.Get(recipe_prefix + std::string(R"(/latest)"),
+    labels.add("POST", "/api/sync/probe", "sync");
+    app.Post("/api/sync/probe",
+             [&](const httplib::Request& req, httplib::Response& res)
+             {
+                 with_auth(
+                     auth,
+                     [&](const std::string&) { set_plain(res, probe_text(storage, req.body)); },
+                     req,
+                     res);
+             });
+
+    labels.add("GET", "/api/ui/recipes", "ui");
+    app.Get(
+        "/api/ui/recipes",
+        [&](const httplib::Request& req, httplib::Response& res)
+        {
+            with_auth(
+                auth,
+                [&](const std::string&) { set_json(res, recipes_page_json(storage, req)); },
+                req,
+                res);
+        });
+
+    labels.add("GET", "/api/ui/recipes/*/*/*/*", "ui");
+    app.Get(R"(/api/ui/recipes/([^/]+)/([^/]+)/([^/]+)/([^/]+))",
             [&](const httplib::Request& req, httplib::Response& res)
             {
-                allow_anonymous_or_auth(
+                with_auth(
                     auth,
-                    [&](const std::optional<std::string>&)
+                    [&](const std::string&)
                     {
                         const auto ref = make_ref(req.matches);
                         if (!ref)
@@ -1057,81 +1776,128 @@ void add_recipe_routes(httplib::Server& app, PackageStorage& storage, AuthManage
                             set_plain(res, "Invalid reference", 400);
                             return;
                         }
-                        const auto revisions = storage.list_recipe_revisions(*ref);
-                        if (revisions.empty())
+                        if (storage.list_recipe_revisions(*ref).empty())
                         {
                             set_plain(res, "Not Found", 404);
                             return;
                         }
-                        set_json(res,
-                                 "{\"revision\":\"" + json_escape(revisions.front().revision) +
-                                     "\",\"time\":\"" + json_escape(revisions.front().time) +
-                                     "\"}");
+                        set_json(res, recipe_detail_json(storage, *ref));
                     },
                     req,
                     res);
             });
 
-    app.Get(recipe_prefix + std::string(R"(/revisions)"),
-            [&](const httplib::Request& req, httplib::Response& res)
+    api.Get("/v2/conans/search",
+            "search",
+            [&](const httplib::Request& req, httplib::Response& res, const ConanRoute&)
             {
                 allow_anonymous_or_auth(
                     auth,
                     [&](const std::optional<std::string>&)
                     {
-                        const auto ref = make_ref(req.matches);
-                        if (!ref)
+                        const std::string query = req.get_param_value("q");
+                        auto              results = std::make_shared<std::vector<std::string>>(
+                            storage.search_recipe_refs(Glob(query.empty() ? "*" : query)));
+                        // A wildcard search can match the whole repository, so the listing is
+                        // streamed in chunks instead of being rendered into one body string.
+                        add_capability_headers(res);
+                        res.set_chunked_content_provider(
+                            "application/json",
+                            [results](std::size_t, httplib::DataSink& sink)
+                            {
+                                JsonWriter out([&sink](std::string_view chunk)
+                                               { return sink.write(chunk.data(), chunk.size()); },
+                                               kJsonChunkSize);
+                                out.begin_object().key("results").begin_array();
+                                for (const auto& value : *results)
+                                {
+                                    if (!sink.is_writable())
+                                    {
+                                        return false;
+                                    }
+                                    out.value(value);
+                                }
+                                out.end_array().end_object();
+                                if (!out.flush())
+                                {
+                                    return false;
+                                }
+                                sink.done();
+                                return true;
+                            });
+                    },
+                    req,
+                    res);
+            });
+
+    const std::string recipe_prefix = "/v2/conans/*/*/*/*";
+    api.Get(recipe_prefix + "/latest",
+            "recipe_latest",
+            [&, upstream](const httplib::Request& req,
+                          httplib::Response&      res,
+                          const ConanRoute&       route)
+            {
+                allow_anonymous_or_auth(
+                    auth,
+                    [&](const std::optional<std::string>&)
+                    {
+                        auto latest = storage.latest_recipe_revision(route.ref);
+                        if (!latest && upstream != nullptr && upstream->latest_recipe(route.ref))
                         {
-                            set_plain(res, "Invalid reference", 400);
+                            latest = storage.latest_recipe_revision(route.ref);
+                        }
+                        if (!latest)
+                        {
+                            set_plain(res, "Not Found", 404);
                             return;
                         }
-                        std::ostringstream out;
-                        out << "{\"reference\":\""
-                            << json_escape(ref->name + "/" + ref->version + "@" + ref->user + "/" +
-                                           ref->channel)
-                            << "\",\"revisions\":[";
-                        bool first = true;
-                        for (const auto& revision : storage.list_recipe_revisions(*ref))
+                        set_json(res, revision_json(*latest));
+                    },
+                    req,
+                    res);
+            });
+
+    api.Get(recipe_prefix + "/revisions",
+            "recipe_revisions",
+            [&, upstream](const httplib::Request& req,
+                          httplib::Response&      res,
+                          const ConanRoute&       route)
+            {
+                allow_anonymous_or_auth(
+                    auth,
+                    [&](const std::optional<std::string>&)
+                    {
+                        const auto revisions = storage.list_recipe_revisions(route.ref);
+                        if (revisions.empty() && upstream != nullptr)
                         {
-                            if (!first)
+                            if (const auto listing = upstream->listing(req.path))
                             {
-                                out << ',';
+                                set_json(res, *listing);
+                                return;
                             }
-                            first = false;
-                            out << "{\"revision\":\"" << json_escape(revision.revision)
-                                << "\",\"time\":\"" << json_escape(revision.time) << "\"}";
                         }
-                        out << "]}";
-                        set_json(res, out.str());
+                        set_json(res, revisions_json(ref_string(route.ref), revisions));
                     },
                     req,
                     res);
             });
 
-    app.Delete(recipe_prefix + std::string(R"(/revisions/([^/]+))"),
-               [&](const httplib::Request& req, httplib::Response& res)
+    api.Delete(recipe_prefix + "/revisions/*",
+               "recipe_revision",
+               [&](const httplib::Request& req, httplib::Response& res, const ConanRoute& route)
                {
                    with_auth(
                        auth,
                        [&](const std::string&)
                        {
-                           const auto        ref      = make_ref(req.matches);
-                           const std::string revision = req.matches[5].str();
-                           if (!ref || !is_safe_path_segment(revision))
-                           {
-                               set_plain(res, "Invalid reference", 400);
-                               return;
-                           }
-                           const fs::path revision_dir =
-                               storage.recipe_revision_path(*ref, revision);
-                           if (!fs::exists(revision_dir))
+                           const auto&       ref      = route.ref;
+                           const std::string revision = route.arg(0);
+                           if (!storage.has_recipe_revision(ref, revision))
                            {
                                set_plain(res, "Not Found", 404);
                                return;
                            }
-                           std::error_code ec;
-                           fs::remove_all(revision_dir, ec);
-                           if (ec)
+                           if (!storage.remove_recipe_revision(ref, revision))
                            {
                                set_plain(res, "Delete failed", 500);
                                return;
@@ -1142,24 +1908,24 @@ void add_recipe_routes(httplib::Server& app, PackageStorage& storage, AuthManage
                        res);
                });
 
-    app.Get(recipe_prefix + std::string(R"(/revisions/([^/]+)/files)"),
-            [&](const httplib::Request& req, httplib::Response& res)
+    api.Get(recipe_prefix + "/revisions/*/files",
+            "recipe_files",
+            [&, upstream](const httplib::Request& req,
+                          httplib::Response&      res,
+                          const ConanRoute&       route)
             {
                 allow_anonymous_or_auth(
                     auth,
                     [&](const std::optional<std::string>&)
                     {
-                        const auto        ref      = make_ref(req.matches);
-                        const std::string revision = req.matches[5].str();
-                        if (!ref || !is_safe_path_segment(revision))
+                        const auto&       ref      = route.ref;
+                        const std::string revision = route.arg(0);
+                        if (upstream != nullptr && !storage.has_recipe_revision(ref, revision))
                         {
-                            set_plain(res, "Invalid reference", 400);
-                            return;
+                            upstream->recipe_revision(ref, revision);
                         }
-                        const auto files =
-                            storage.list_files(storage.recipe_files_path(*ref, revision));
-                        if (files.empty() &&
-                            !fs::exists(storage.recipe_revision_path(*ref, revision)))
+                        const auto files = file_names(storage.recipe_file_list(ref, revision));
+                        if (files.empty() && !storage.has_recipe_revision(ref, revision))
                         {
                             set_plain(res, "Not Found", 404);
                             return;
@@ -1169,260 +1935,198 @@ void add_recipe_routes(httplib::Server& app, PackageStorage& storage, AuthManage
                     req);
             });
 
-    app.Get(recipe_prefix + std::string(R"(/revisions/([^/]+)/files/([^/]+))"),
-            [&](const httplib::Request& req, httplib::Response& res)
+    api.Get(recipe_prefix + "/revisions/*/files/*",
+            "recipe_file_get",
+            [&, upstream](const httplib::Request& req,
+                          httplib::Response&      res,
+                          const ConanRoute&       route)
             {
                 allow_anonymous_or_auth(
                     auth,
                     [&](const std::optional<std::string>&)
                     {
-                        const auto        ref       = make_ref(req.matches);
-                        const std::string revision  = req.matches[5].str();
-                        const std::string file_name = req.matches[6].str();
-                        if (!ref || !is_safe_path_segment(revision) ||
-                            !is_safe_path_segment(file_name))
+                        const auto&       ref       = route.ref;
+                        const std::string revision  = route.arg(0);
+                        const std::string file_name = route.arg(1);
+                        if (upstream != nullptr && !storage.has_recipe_revision(ref, revision))
                         {
-                            set_plain(res, "Invalid reference", 400);
-                            return;
+                            upstream->recipe_revision(ref, revision);
                         }
-                        handle_file_get(storage.recipe_files_path(*ref, revision) / file_name, res);
+                        handle_file_get(storage.file_cache(),
+                                        storage.recipe_files_path(ref, revision) / file_name,
+                                        storage.recipe_file_checksum(ref, revision, file_name),
+                                        req,
+                                        res);
                     },
                     req);
             });
 
-    app.Put(recipe_prefix + std::string(R"(/revisions/([^/]+)/files/([^/]+))"),
-            [&](const httplib::Request& req, httplib::Response& res)
+    api.Put(recipe_prefix + "/revisions/*/files/*",
+            "recipe_file_put",
+            [&](const httplib::Request&       req,
+                httplib::Response&            res,
+                const httplib::ContentReader& content_reader,
+                const ConanRoute&             route)
             {
                 with_auth(
                     auth,
                     [&](const std::string&)
                     {
-                        const auto        ref       = make_ref(req.matches);
-                        const std::string revision  = req.matches[5].str();
-                        const std::string file_name = req.matches[6].str();
-                        if (!ref || !is_safe_path_segment(revision) ||
-                            !is_safe_path_segment(file_name))
-                        {
-                            set_plain(res, "Invalid reference", 400);
-                            return;
-                        }
-                        const fs::path revision_dir = storage.recipe_revision_path(*ref, revision);
-                        handle_body_upload(storage.recipe_files_path(*ref, revision) / file_name,
-                                           revision_dir,
-                                           req.body,
-                                           res);
+                        const auto&       ref       = route.ref;
+                        const std::string revision  = route.arg(0);
+                        const std::string file_name = route.arg(1);
+                        handle_body_upload(
+                            req,
+                            storage,
+                            storage.recipe_files_path(ref, revision) / file_name,
+                            content_reader,
+                            res,
+                            [&](StagedFile& staged)
+                            {
+                                return storage.store_recipe_file(
+                                    ref, revision, file_name, staged);
+                            });
                     },
                     req,
                     res);
             });
 
-    app.Get(recipe_prefix + std::string(R"(/search)"),
-            [&](const httplib::Request& req, httplib::Response& res)
+    api.Get(recipe_prefix + "/search",
+            "package_search",
+            [&, upstream](const httplib::Request& req,
+                          httplib::Response&      res,
+                          const ConanRoute&       route)
             {
                 allow_anonymous_or_auth(
                     auth,
                     [&](const std::optional<std::string>&)
                     {
-                        const auto ref = make_ref(req.matches);
-                        if (!ref)
+                        const auto recipe = storage.latest_recipe_revision(route.ref);
+                        if (!recipe && upstream != nullptr)
                         {
-                            set_plain(res, "Invalid reference", 400);
-                            return;
-                        }
-                        std::ostringstream out;
-                        out << '{';
-                        bool       first_package = true;
-                        const auto revisions     = storage.list_recipe_revisions(*ref);
-                        if (!revisions.empty())
-                        {
-                            const fs::path packages_dir = revisions.front().path / "packages";
-                            if (fs::exists(packages_dir))
+                            if (const auto listing = upstream->listing(req.path))
                             {
-                                for (const auto& package_dir : fs::directory_iterator(packages_dir))
-                                {
-                                    if (!package_dir.is_directory())
-                                    {
-                                        continue;
-                                    }
-                                    const std::string package_id =
-                                        package_dir.path().filename().string();
-                                    const auto package_revisions = storage.list_package_revisions(
-                                        *ref, revisions.front().revision, package_id);
-                                    if (package_revisions.empty())
-                                    {
-                                        continue;
-                                    }
-                                    const fs::path conaninfo =
-                                        package_revisions.front().path / "files" / "conaninfo.txt";
-                                    if (!first_package)
-                                    {
-                                        out << ',';
-                                    }
-                                    first_package = false;
-                                    out << '"' << json_escape(package_id)
-                                        << "\":" << package_search_json(conaninfo);
-                                }
+                                set_json(res, *listing);
+                                return;
                             }
                         }
-                        out << '}';
-                        set_json(res, out.str());
+                        set_json(res,
+                                 recipe ? packages_search_json(storage, route.ref, recipe->revision)
+                                        : std::string("{}"));
                     },
                     req);
             });
 
-    app.Get(recipe_prefix + std::string(R"(/revisions/([^/]+)/search)"),
-            [&](const httplib::Request& req, httplib::Response& res)
+    api.Get(recipe_prefix + "/revisions/*/search",
+            "package_search",
+            [&, upstream](const httplib::Request& req,
+                          httplib::Response&      res,
+                          const ConanRoute&       route)
             {
                 allow_anonymous_or_auth(
                     auth,
                     [&](const std::optional<std::string>&)
                     {
-                        const auto        ref             = make_ref(req.matches);
-                        const std::string recipe_revision = req.matches[5].str();
-                        if (!ref || !is_safe_path_segment(recipe_revision))
-                        {
-                            set_plain(res, "Invalid reference", 400);
-                            return;
-                        }
-                        std::ostringstream out;
-                        out << '{';
-                        bool           first_package = true;
-                        const fs::path packages_dir =
-                            storage.recipe_revision_path(*ref, recipe_revision) / "packages";
-                        if (fs::exists(packages_dir))
+                        const auto&       ref             = route.ref;
+                        const std::string recipe_revision = route.arg(0);
+                        if (upstream != nullptr &&
+                            storage.list_package_ids(ref, recipe_revision).empty())
                         {
-                            for (const auto& package_dir : fs::directory_iterator(packages_dir))
+                            if (const auto listing = upstream->listing(req.path))
                             {
-                                if (!package_dir.is_directory())
-                                {
-                                    continue;
-                                }
-                                const std::string package_id =
-                                    package_dir.path().filename().string();
-                                const auto package_revisions = storage.list_package_revisions(
-                                    *ref, recipe_revision, package_id);
-                                if (package_revisions.empty())
-                                {
-                                    continue;
-                                }
-                                const fs::path conaninfo =
-                                    package_revisions.front().path / "files" / "conaninfo.txt";
-                                if (!first_package)
-                                {
-                                    out << ',';
-                                }
-                                first_package = false;
-                                out << '"' << json_escape(package_id)
-                                    << "\":" << package_search_json(conaninfo);
+                                set_json(res, *listing);
+                                return;
                             }
                         }
-                        out << '}';
-                        set_json(res, out.str());
+                        set_json(res, packages_search_json(storage, ref, recipe_revision));
                     },
                     req);
             });
 
-    const auto package_prefix =
-        recipe_prefix + std::string(R"(/revisions/([^/]+)/packages/([^/]+))");
+    const std::string package_prefix = recipe_prefix + "/revisions/*/packages/*";
 
-    app.Get(package_prefix + std::string(R"(/latest)"),
-            [&](const httplib::Request& req, httplib::Response& res)
+    api.Get(package_prefix + "/latest",
+            "package_latest",
+            [&, upstream](const httplib::Request& req,
+                          httplib::Response&      res,
+                          const ConanRoute&       route)
             {
                 allow_anonymous_or_auth(
                     auth,
                     [&](const std::optional<std::string>&)
                     {
-                        const auto        ref             = make_ref(req.matches);
-                        const std::string recipe_revision = req.matches[5].str();
-                        const std::string package_id      = req.matches[6].str();
-                        if (!ref || !is_safe_path_segment(recipe_revision) ||
-                            !is_safe_path_segment(package_id))
+                        const auto&       ref             = route.ref;
+                        const std::string recipe_revision = route.arg(0);
+                        const std::string package_id      = route.arg(1);
+                        auto latest =
+                            storage.latest_package_revision(ref, recipe_revision, package_id);
+                        if (!latest && upstream != nullptr &&
+                            upstream->latest_package(ref, recipe_revision, package_id))
                         {
-                            set_plain(res, "Invalid reference", 400);
-                            return;
+                            latest =
+                                storage.latest_package_revision(ref, recipe_revision, package_id);
                         }
-                        const auto revisions =
-                            storage.list_package_revisions(*ref, recipe_revision, package_id);
-                        if (revisions.empty())
+                        if (!latest)
                         {
                             set_plain(res, "Not Found", 404);
                             return;
                         }
-                        set_json(res,
-                                 "{\"revision\":\"" + json_escape(revisions.front().revision) +
-                                     "\",\"time\":\"" + json_escape(revisions.front().time) +
-                                     "\"}");
+                        set_json(res, revision_json(*latest));
                     },
                     req);
             });
 
-    app.Get(package_prefix + std::string(R"(/revisions)"),
-            [&](const httplib::Request& req, httplib::Response& res)
+    api.Get(package_prefix + "/revisions",
+            "package_revisions",
+            [&, upstream](const httplib::Request& req,
+                          httplib::Response&      res,
+                          const ConanRoute&       route)
             {
                 allow_anonymous_or_auth(
                     auth,
                     [&](const std::optional<std::string>&)
                     {
-                        const auto        ref             = make_ref(req.matches);
-                        const std::string recipe_revision = req.matches[5].str();
-                        const std::string package_id      = req.matches[6].str();
-                        if (!ref || !is_safe_path_segment(recipe_revision) ||
-                            !is_safe_path_segment(package_id))
-                        {
-                            set_plain(res, "Invalid reference", 400);
-                            return;
-                        }
-                        std::ostringstream out;
-                        out << "{\"reference\":\""
-                            << json_escape(ref->name + "/" + ref->version + "@" + ref->user + "/" +
-                                           ref->channel + "#" + recipe_revision + ":" + package_id)
-                            << "\",\"revisions\":[";
-                        bool first = true;
-                        for (const auto& revision :
-                             storage.list_package_revisions(*ref, recipe_revision, package_id))
+                        const auto&       ref             = route.ref;
+                        const std::string recipe_revision = route.arg(0);
+                        const std::string package_id      = route.arg(1);
+                        const auto revisions =
+                            storage.list_package_revisions(ref, recipe_revision, package_id);
+                        if (revisions.empty() && upstream != nullptr)
                         {
-                            if (!first)
+                            if (const auto listing = upstream->listing(req.path))
                             {
-                                out << ',';
+                                set_json(res, *listing);
+                                return;
                             }
-                            first = false;
-                            out << "{\"revision\":\"" << json_escape(revision.revision)
-                                << "\",\"time\":\"" << json_escape(revision.time) << "\"}";
                         }
-                        out << "]}";
-                        set_json(res, out.str());
+                        set_json(res,
+                                 revisions_json(ref_string(ref) + "#" + recipe_revision + ":" +
+                                                    package_id,
+                                                revisions));
                     },
                     req);
             });
 
-    app.Delete(package_prefix + std::string(R"(/revisions/([^/]+))"),
-               [&](const httplib::Request& req, httplib::Response& res)
+    api.Delete(package_prefix + "/revisions/*",
+               "package_revision",
+               [&](const httplib::Request& req, httplib::Response& res, const ConanRoute& route)
                {
                    with_auth(
                        auth,
                        [&](const std::string&)
                        {
-                           const auto        ref              = make_ref(req.matches);
-                           const std::string recipe_revision  = req.matches[5].str();
-                           const std::string package_id       = req.matches[6].str();
-                           const std::string package_revision = req.matches[7].str();
-                           if (!ref || !is_safe_path_segment(recipe_revision) ||
-                               !is_safe_path_segment(package_id) ||
-                               !is_safe_path_segment(package_revision))
-                           {
-                               set_plain(res, "Invalid reference", 400);
-                               return;
-                           }
-                           const fs::path revision_dir = storage.package_revision_path(
-                               *ref, recipe_revision, package_id, package_revision);
-                           if (!fs::exists(revision_dir))
+                           const auto&       ref              = route.ref;
+                           const std::string recipe_revision  = route.arg(0);
+                           const std::string package_id       = route.arg(1);
+                           const std::string package_revision = route.arg(2);
+                           if (!storage.has_package_revision(
+                                   ref, recipe_revision, package_id, package_revision))
                            {
                                set_plain(res, "Not Found", 404);
                                return;
                            }
-                           std::error_code ec;
-                           fs::remove_all(revision_dir, ec);
-                           if (ec)
+                           if (!storage.remove_package_revision(
+                                   ref, recipe_revision, package_id, package_revision))
                            {
                                set_plain(res, "Delete failed", 500);
                                return;
@@ -1433,29 +2137,32 @@ void add_recipe_routes(httplib::Server& app, PackageStorage& storage, AuthManage
                        res);
                });
 
-    app.Get(package_prefix + std::string(R"(/revisions/([^/]+)/files)"),
-            [&](const httplib::Request& req, httplib::Response& res)
+    api.Get(package_prefix + "/revisions/*/files",
+            "package_files",
+            [&, upstream](const httplib::Request& req,
+                          httplib::Response&      res,
+                          const ConanRoute&       route)
             {
                 allow_anonymous_or_auth(
                     auth,
                     [&](const std::optional<std::string>&)
                     {
-                        const auto        ref              = make_ref(req.matches);
-                        const std::string recipe_revision  = req.matches[5].str();
-                        const std::string package_id       = req.matches[6].str();
-                        const std::string package_revision = req.matches[7].str();
-                        if (!ref || !is_safe_path_segment(recipe_revision) ||
-                            !is_safe_path_segment(package_id) ||
-                            !is_safe_path_segment(package_revision))
+                        const auto&       ref              = route.ref;
+                        const std::string recipe_revision  = route.arg(0);
+                        const std::string package_id       = route.arg(1);
+                        const std::string package_revision = route.arg(2);
+                        if (upstream != nullptr &&
+                            !storage.has_package_revision(
+                                ref, recipe_revision, package_id, package_revision))
                         {
-                            set_plain(res, "Invalid reference", 400);
-                            return;
+                            upstream->package_revision(
+                                ref, recipe_revision, package_id, package_revision);
                         }
-                        const auto files = storage.list_files(storage.package_files_path(
-                            *ref, recipe_revision, package_id, package_revision));
+                        const auto files = file_names(storage.package_file_list(
+                            ref, recipe_revision, package_id, package_revision));
                         if (files.empty() &&
-                            !fs::exists(storage.package_revision_path(
-                                *ref, recipe_revision, package_id, package_revision)))
+                            !storage.has_package_revision(
+                                ref, recipe_revision, package_id, package_revision))
                         {
                             set_plain(res, "Not Found", 404);
                             return;
@@ -1465,66 +2172,173 @@ void add_recipe_routes(httplib::Server& app, PackageStorage& storage, AuthManage
                     req);
             });
 
-    app.Get(package_prefix + std::string(R"(/revisions/([^/]+)/files/([^/]+))"),
-            [&](const httplib::Request& req, httplib::Response& res)
+    api.Get(package_prefix + "/revisions/*/files/*",
+            "package_file_get",
+            [&, upstream](const httplib::Request& req,
+                          httplib::Response&      res,
+                          const ConanRoute&       route)
             {
                 allow_anonymous_or_auth(
                     auth,
                     [&](const std::optional<std::string>&)
                     {
-                        const auto        ref              = make_ref(req.matches);
-                        const std::string recipe_revision  = req.matches[5].str();
-                        const std::string package_id       = req.matches[6].str();
-                        const std::string package_revision = req.matches[7].str();
-                        const std::string file_name        = req.matches[8].str();
-                        if (!ref || !is_safe_path_segment(recipe_revision) ||
-                            !is_safe_path_segment(package_id) ||
-                            !is_safe_path_segment(package_revision) ||
-                            !is_safe_path_segment(file_name))
+                        const auto&       ref              = route.ref;
+                        const std::string recipe_revision  = route.arg(0);
+                        const std::string package_id       = route.arg(1);
+                        const std::string package_revision = route.arg(2);
+                        const std::string file_name        = route.arg(3);
+                        if (upstream != nullptr &&
+                            !storage.has_package_revision(
+                                ref, recipe_revision, package_id, package_revision))
                         {
-                            set_plain(res, "Invalid reference", 400);
-                            return;
+                            upstream->package_revision(
+                                ref, recipe_revision, package_id, package_revision);
                         }
-                        handle_file_get(storage.package_files_path(
-                                            *ref, recipe_revision, package_id, package_revision) /
+                        handle_file_get(storage.file_cache(),
+                                        storage.package_files_path(
+                                            ref, recipe_revision, package_id, package_revision) /
                                             file_name,
+                                        storage.package_file_checksum(ref,
+                                                                      recipe_revision,
+                                                                      package_id,
+                                                                      package_revision,
+                                                                      file_name),
+                                        req,
                                         res);
                     },
                     req);
             });
 
-    app.Put(
-        package_prefix + std::string(R"(/revisions/([^/]+)/files/([^/]+))"),
-        [&](const httplib::Request& req, httplib::Response& res)
+    api.Put(package_prefix + "/revisions/*/files/*",
+            "package_file_put",
+            [&](const httplib::Request&       req,
+                httplib::Response&            res,
+                const httplib::ContentReader& content_reader,
+                const ConanRoute&             route)
+            {
+                with_auth(
+                    auth,
+                    [&](const std::string&)
+                    {
+                        const auto&       ref              = route.ref;
+                        const std::string recipe_revision  = route.arg(0);
+                        const std::string package_id       = route.arg(1);
+                        const std::string package_revision = route.arg(2);
+                        const std::string file_name        = route.arg(3);
+                        handle_body_upload(
+                            req,
+                            storage,
+                            storage.package_files_path(
+                                ref, recipe_revision, package_id, package_revision) /
+                                file_name,
+                            content_reader,
+                            res,
+                            [&](StagedFile& staged)
+                            {
+                                return storage.store_package_file(ref,
+                                                                  recipe_revision,
+                                                                  package_id,
+                                                                  package_revision,
+                                                                  file_name,
+                                                                  staged);
+                            });
+                    },
+                    req,
+                    res);
+            });
+
+    // One request for a whole recipe revision, or a package revision together with its recipe
+    // revision; either revision may be "latest".
+    const auto bundle_prefix = R"(/api/bundle/([^/]+)/([^/]+)/([^/]+)/([^/]+)/revisions/([^/]+))";
+    labels.add("GET", "/api/bundle/*/*/*/*/revisions/*", "bundle");
+    labels.add("GET", "/api/bundle/*/*/*/*/revisions/*/packages/*/revisions/*", "bundle");
+    app.Get(
+        bundle_prefix + std::string(R"((?:/packages/([^/]+)/revisions/([^/]+))?)"),
+        [&, upstream](const httplib::Request& req, httplib::Response& res)
         {
-            with_auth(
+            allow_anonymous_or_auth(
                 auth,
-                [&](const std::string&)
+                [&](const std::optional<std::string>&)
                 {
                     const auto        ref              = make_ref(req.matches);
                     const std::string recipe_revision  = req.matches[5].str();
                     const std::string package_id       = req.matches[6].str();
                     const std::string package_revision = req.matches[7].str();
-                    const std::string file_name        = req.matches[8].str();
                     if (!ref || !is_safe_path_segment(recipe_revision) ||
-                        !is_safe_path_segment(package_id) ||
-                        !is_safe_path_segment(package_revision) || !is_safe_path_segment(file_name))
+                        (req.matches[6].matched && (!is_safe_path_segment(package_id) ||
+                                                    !is_safe_path_segment(package_revision))))
                     {
                         set_plain(res, "Invalid reference", 400);
                         return;
                     }
-                    const fs::path revision_dir = storage.package_revision_path(
-                        *ref, recipe_revision, package_id, package_revision);
-                    handle_body_upload(storage.package_files_path(
-                                           *ref, recipe_revision, package_id, package_revision) /
-                                           file_name,
-                                       revision_dir,
-                                       req.body,
-                                       res);
+                    const auto recipe =
+                        resolve_recipe_revision(storage, upstream, *ref, recipe_revision);
+                    std::optional<RevisionInfo> package;
+                    if (recipe && req.matches[6].matched)
+                    {
+                        package = resolve_package_revision(storage,
+                                                           upstream,
+                                                           *ref,
+                                                           recipe->revision,
+                                                           package_id,
+                                                           package_revision);
+                    }
+                    if (!recipe || (req.matches[6].matched && !package))
+                    {
+                        set_plain(res, "Not Found", 404);
+                        return;
+                    }
+                    handle_bundle_get(storage, *ref, *recipe, package_id, package, req, res);
                 },
-                req,
-                res);
+                req);
         });
+
+    // {"requires": [<reference>...], "settings": {...}, "options": {...}} in, the resolved
+    // closure out; see closure_json().
+    labels.add("POST", "/api/closure", "closure");
+    app.Post("/api/closure",
+             [&](const httplib::Request& req, httplib::Response& res)
+             {
+                 allow_anonymous_or_auth(
+                     auth,
+                     [&](const std::optional<std::string>&)
+                     {
+                         const auto body = nlohmann::json::parse(req.body, nullptr, false);
+                         if (!body.is_object() || !body.contains("requires") ||
+                             !body["requires"].is_array())
+                         {
+                             set_plain(res, "Expected a JSON object with a requires array", 400);
+                             return;
+                         }
+                         std::vector<std::string> roots;
+                         for (const auto& root : body["requires"])
+                         {
+                             if (root.is_string())
+                             {
+                                 roots.push_back(root.get<std::string>());
+                             }
+                         }
+                         ClosureProfile profile;
+                         for (const auto& [section, entries] :
+                              {std::pair{"settings", &profile.settings},
+                               std::pair{"options", &profile.options}})
+                         {
+                             if (!body.contains(section) || !body[section].is_object())
+                             {
+                                 continue;
+                             }
+                             for (const auto& [key, value] : body[section].items())
+                             {
+                                 if (value.is_string())
+                                 {
+                                     (*entries)[key] = value.get<std::string>();
+                                 }
+                             }
+                         }
+                         set_json(res, closure_json(storage, roots, profile));
+                     },
+                     req);
+             });
 }
 
 void print_usage()
@@ -1532,16 +2346,71 @@ void print_usage()
     std::cout
         << "leafserver usage:\n"
         << "  leaf run leafserver -- [--host 0.0.0.0] [--port 9300] [--storage .leafserver-data]\n"
+        << "                          [--dedup] [--log-level debug|info|warning|error|off]\n"
+        << "                          [--threads 16] [--max-queued 256] [--max-uploads 8]\n"
+        << "                          [--max-metadata-reads 0] [--upstream <conan v2 url>]\n"
+        << "                          [--mirror <leaf-server url>] [--mirror-interval 300]\n"
+        << "                          [--sync-jobs 4] [--keep-revisions 0]\n"
+        << "                          [--package-max-age-days 0]\n"
+        << "  leaf server sync --from <leaf-server url> [--storage .leafserver-data] [--jobs 4]\n"
+        << "    one replication pass into a store whose server is not running\n"
+        << "  leaf server push --to <leaf-server url> --list <package list file> [--jobs 4]\n"
+        << "                   [--user <name>]\n"
+        << "    uploads what `conan upload --dry-run --format=json` listed, skipping content\n"
+        << "    the server already holds; the password is read from CONAN_PASSWORD\n"
+        << "  leaf server prefetch --from <leaf-server url> --graph <graph file>\n"
+        << "                       [--storage .leafserver-data] [--jobs 4] [--user <name>]\n"
+        << "    fetches every revision `conan graph info --format=json` listed, one bundle per\n"
+        << "    revision, into a store whose server is not running\n"
+        << "  leaf server prefetch --from <leaf-server url> --require <reference>...\n"
+        << "                       [--profile <conan profile>] [--storage .leafserver-data]\n"
+        << "    the same for the closure the server resolves for the references and profile\n"
         << "  Conan remote URL example: http://127.0.0.1:9300\n";
 }
 
-} // namespace
+std::string describe(const SyncStats& stats)
+{
+    return std::to_string(stats.revisions) + " revisions, " + std::to_string(stats.downloaded) +
+           " files downloaded (" + std::to_string(stats.bytes) + " bytes), " +
+           std::to_string(stats.copied) + " copied locally, " + std::to_string(stats.failed) +
+           " failed";
+}
 
-int run(int argc, char** argv)
+std::string describe(const PrefetchStats& stats)
 {
-    fs::path                   storage_root = ".leafserver-data";
-    std::optional<std::string> host_override;
-    std::optional<int>         port_override;
+    return std::to_string(stats.revisions) + " revisions fetched (" +
+           std::to_string(stats.bytes) + " bytes), " + std::to_string(stats.held) +
+           " already held, " + std::to_string(stats.failed) + " failed";
+}
+
+std::string describe(const PushStats& stats)
+{
+    return std::to_string(stats.revisions) + " revisions, " + std::to_string(stats.uploaded) +
+           " files uploaded (" + std::to_string(stats.bytes) + " bytes), " +
+           std::to_string(stats.deployed) + " already on the server, " +
+           std::to_string(stats.failed) + " failed";
+}
+
+// Reads run()'s command line on top of the store's config file. Empty when the server is not to
+// be started, with exit_code set to what run() returns then.
+std::optional<ServerConfig> parse_run_args(int argc, char** argv, int& exit_code)
+{
+    exit_code                                 = 0;
+    fs::path                     storage_root = ".leafserver-data";
+    std::optional<std::string>   host_override;
+    std::optional<int>           port_override;
+    bool                         dedup_override = false;
+    std::optional<LogLevel>      log_level_override;
+    std::optional<std::size_t>   threads_override;
+    std::optional<std::size_t>   max_queued_override;
+    std::optional<std::size_t>   max_uploads_override;
+    std::optional<std::size_t>   max_metadata_reads_override;
+    std::optional<std::string>   upstream_override;
+    std::optional<std::string>   mirror_override;
+    std::optional<std::uint64_t> mirror_interval_override;
+    std::optional<std::size_t>   sync_jobs_override;
+    std::optional<std::size_t>   keep_revisions_override;
+    std::optional<std::uint64_t> package_max_age_override;
 
     for (int i = 1; i < argc; ++i)
     {
@@ -1549,7 +2418,7 @@ int run(int argc, char** argv)
         if (arg == "--help" || arg == "-h")
         {
             print_usage();
-            return 0;
+            return std::nullopt;
         }
         if (arg == "--host" && i + 1 < argc)
         {
@@ -1566,6 +2435,72 @@ int run(int argc, char** argv)
             storage_root = argv[++i];
             continue;
         }
+        if (arg == "--dedup")
+        {
+            dedup_override = true;
+            continue;
+        }
+        if (arg == "--threads" && i + 1 < argc)
+        {
+            threads_override = std::stoul(argv[++i]);
+            continue;
+        }
+        if (arg == "--max-queued" && i + 1 < argc)
+        {
+            max_queued_override = std::stoul(argv[++i]);
+            continue;
+        }
+        if (arg == "--max-uploads" && i + 1 < argc)
+        {
+            max_uploads_override = std::stoul(argv[++i]);
+            continue;
+        }
+        if (arg == "--max-metadata-reads" && i + 1 < argc)
+        {
+            max_metadata_reads_override = std::stoul(argv[++i]);
+            continue;
+        }
+        if (arg == "--upstream" && i + 1 < argc)
+        {
+            upstream_override = argv[++i];
+            continue;
+        }
+        if (arg == "--mirror" && i + 1 < argc)
+        {
+            mirror_override = argv[++i];
+            continue;
+        }
+        if (arg == "--mirror-interval" && i + 1 < argc)
+        {
+            mirror_interval_override = std::stoull(argv[++i]);
+            continue;
+        }
+        if (arg == "--sync-jobs" && i + 1 < argc)
+        {
+            sync_jobs_override = std::stoul(argv[++i]);
+            continue;
+        }
+        if (arg == "--keep-revisions" && i + 1 < argc)
+        {
+            keep_revisions_override = std::stoul(argv[++i]);
+            continue;
+        }
+        if (arg == "--package-max-age-days" && i + 1 < argc)
+        {
+            package_max_age_override = std::stoull(argv[++i]);
+            continue;
+        }
+        if (arg == "--log-level" && i + 1 < argc)
+        {
+            log_level_override = parse_log_level(argv[++i]);
+            if (!log_level_override)
+            {
+                std::cerr << "Unknown log level: " << argv[i] << '\n';
+                exit_code = 1;
+                return std::nullopt;
+            }
+            continue;
+        }
     }
 
     ServerConfig config = load_config(storage_root);
@@ -1577,30 +2512,122 @@ int run(int argc, char** argv)
     {
         config.port = *port_override;
     }
+    if (dedup_override)
+    {
+        config.dedup = true;
+    }
+    if (log_level_override)
+    {
+        config.log_level = *log_level_override;
+    }
+    config.worker_threads = std::max<std::size_t>(
+        1, threads_override.value_or(config.worker_threads));
+    config.max_queued_requests = max_queued_override.value_or(config.max_queued_requests);
+    config.max_uploads         = max_uploads_override.value_or(config.max_uploads);
+    config.max_metadata_reads  = max_metadata_reads_override.value_or(config.max_metadata_reads);
+    config.upstream            = upstream_override.value_or(config.upstream);
+    config.mirror              = mirror_override.value_or(config.mirror);
+    config.mirror_interval     = mirror_interval_override.value_or(config.mirror_interval);
+    config.sync_jobs           = sync_jobs_override.value_or(config.sync_jobs);
+    config.keep_recipe_revisions =
+        keep_revisions_override.value_or(config.keep_recipe_revisions);
+    config.package_max_age_days = package_max_age_override.value_or(config.package_max_age_days);
+    return config;
+}
 
+// Serves until the server is stopped. on_listening, if set, is handed the server once it is
+// bound, along with its port, which is an ephemeral one when config.port is 0.
+int serve(const ServerConfig&                                     config,
+          const std::function<void(httplib::Server&, int port)>& on_listening)
+{
     PackageStorage storage(config.storage_root);
+    storage.set_dedup(config.dedup);
+    storage.set_file_cache(config.file_cache_bytes, kFileCacheMaxEntry);
+    if (!storage.lock())
+    {
+        std::cerr << "Storage " << fs::absolute(config.storage_root).string()
+                  << " is in use by another leaf-server process\n";
+        return 1;
+    }
+    if (!storage.load_index())
+    {
+        std::cerr << load_failure(storage) << '\n';
+        return 1;
+    }
+    GarbageCollector gc(storage, config);
+    gc.start();
+
     AuthManager    auth(User{config.admin_user, config.admin_password});
-    g_debug_log_path = config.storage_root / "server-debug.log";
+    std::optional<PullThrough> upstream;
+    if (!config.upstream.empty())
+    {
+        upstream.emplace(storage, config.upstream);
+    }
+    const fs::path debug_log_path = config.storage_root / "server-debug.log";
     std::error_code remove_ec;
-    fs::remove(g_debug_log_path, remove_ec);
+    fs::remove(debug_log_path, remove_ec);
+    g_debug_log.open(debug_log_path, config.log_level, config.log_max_bytes);
+
+    RequestLimiter upload_limiter(config.max_uploads);
+    RequestLimiter metadata_limiter(config.max_metadata_reads);
+    RouteLabels    labels; // filled by add_recipe_routes(), read by the pre-routing handler
 
     httplib::Server app;
 
+    // Connections beyond the queue bound are closed by httplib instead of piling up.
+    app.new_task_queue = [threads = config.worker_threads, queued = config.max_queued_requests]
+    { return new httplib::ThreadPool(threads, queued); };
+
     app.set_keep_alive_max_count(100);
     app.set_keep_alive_timeout(10);
-    app.set_read_timeout(300, 0);
+    app.set_read_timeout(static_cast<time_t>(config.read_timeout), 0);
     app.set_write_timeout(300, 0);
     app.set_payload_max_length(1024ULL * 1024ULL * 1024ULL);
     app.set_pre_request_handler([](const httplib::Request&, httplib::Response&)
                                 { return httplib::Server::HandlerResponse::Unhandled; });
     app.set_pre_routing_handler(
-        [&](const httplib::Request& req, httplib::Response&)
+        [&](const httplib::Request& req, httplib::Response& res)
         {
+            // httplib skips the logger when a client disconnects before its response is written.
+            // Such a request must not keep its slot or stay counted as in flight.
+            if (t_request)
+            {
+                release_request_slot();
+                g_metrics.request_abandoned();
+            }
+            const auto route = labels.find(req.method, req.path);
+            t_request        = RequestContext{std::chrono::steady_clock::now(), route.metric};
+            g_metrics.request_started();
+            RequestLimiter* limiter = nullptr;
             if (req.method == "PUT")
+            {
+                limiter = &upload_limiter;
+            }
+            else if (route.metadata_read)
+            {
+                limiter = &metadata_limiter;
+            }
+            if (limiter != nullptr)
+            {
+                if (!limiter->try_acquire())
+                {
+                    set_plain(res, "Server busy, retry later", 503);
+                    res.set_header("Retry-After", std::to_string(kRetryAfterSeconds));
+                    if (req.method == "PUT")
+                    {
+                        // The body was never read; on a kept-alive connection it would be parsed
+                        // as the next request, which is usually the client's retry.
+                        res.set_header("Connection", "close");
+                    }
+                    return httplib::Server::HandlerResponse::Handled;
+                }
+                t_request->slot = limiter;
+            }
+            if (req.method == "PUT" && g_debug_log.enabled(LogLevel::Info))
             {
                 append_debug_log(
-                    "PUT " + req.path + " len=" + std::to_string(req.body.size()) +
-                    " expect=" + req.get_header_value("Expect") +
+                    LogLevel::Info,
+                    "PUT " + req.path + " expect=" + req.get_header_value("Expect") +
                     " te=" + req.get_header_value("Transfer-Encoding") +
                     " cl=" + req.get_header_value("Content-Length") + " auth=" +
                     (req.has_header("Authorization") ? std::string("yes") : std::string("no")) +
@@ -1611,9 +2638,18 @@ int run(int argc, char** argv)
     app.set_logger(
         [&](const httplib::Request& req, const httplib::Response& res)
         {
+            if (t_request)
+            {
+                release_request_slot();
+                g_metrics.request_finished(t_request->route,
+                                           res.status,
+                                           std::chrono::steady_clock::now() - t_request->started);
+                t_request.reset();
+            }
             if (req.method == "PUT")
             {
-                append_debug_log("PUT_DONE " + req.path + " -> " + std::to_string(res.status));
+                append_debug_log(LogLevel::Info,
+                                 "PUT_DONE " + req.path + " -> " + std::to_string(res.status));
             }
         });
     app.set_error_logger(
@@ -1624,7 +2660,7 @@ int run(int argc, char** argv)
             {
                 line += " path=" + req->path;
             }
-            append_debug_log(line);
+            append_debug_log(LogLevel::Error, std::move(line));
         });
     app.set_exception_handler(
         [&](const httplib::Request& req, httplib::Response& res, std::exception_ptr ep)
@@ -1638,19 +2674,21 @@ int run(int argc, char** argv)
             }
             catch (const std::exception& ex)
             {
-                append_debug_log("EXCEPTION path=" + req.path + " message=" + ex.what());
+                append_debug_log(LogLevel::Error,
+                                 "EXCEPTION path=" + req.path + " message=" + ex.what());
                 set_plain(res, std::string("Exception: ") + ex.what(), 500);
                 return;
             }
             catch (...)
             {
-                append_debug_log("EXCEPTION path=" + req.path + " message=unknown");
+                append_debug_log(LogLevel::Error,
+                                 "EXCEPTION path=" + req.path + " message=unknown");
                 set_plain(res, "Exception: unknown", 500);
                 return;
             }
             set_plain(res, "Exception: unknown", 500);
         });
-    add_recipe_routes(app, storage, auth);
+    add_recipe_routes(app, storage, auth, labels, upstream ? &*upstream : nullptr);
 
     httplib::mount(app, Web::FS);
 
@@ -1664,22 +2702,437 @@ int run(int argc, char** argv)
             }
         });
 
+    int port = config.port;
+    if (port == 0)
+    {
+        port = app.bind_to_any_port(config.host);
+    }
+    else if (!app.bind_to_port(config.host, port))
+    {
+        port = -1;
+    }
+    if (port < 0)
+    {
+        std::cerr << "Failed to bind server on " << config.host << ':' << config.port << '\n';
+        g_debug_log.close();
+        return 1;
+    }
+
     std::cout << "Leaf Conan Server starting\n"
               << "  host: " << config.host << '\n'
-              << "  port: " << config.port << '\n'
+              << "  port: " << port << '\n'
               << "  storage: " << fs::absolute(config.storage_root).string() << '\n'
+              << "  dedup: " << (config.dedup ? "on" : "off") << '\n'
+              << "  log level: " << log_level_name(config.log_level) << '\n'
+              << "  upstream: " << (config.upstream.empty() ? "none" : config.upstream) << '\n'
+              << "  mirror: "
+              << (config.mirror.empty()
+                      ? std::string("none")
+                      : config.mirror + " every " + std::to_string(config.mirror_interval) + "s")
+              << '\n'
+              << "  retention: keep " << config.keep_recipe_revisions
+              << " recipe revisions, package revisions " << config.package_max_age_days
+              << " days (0 = all), gc every " << config.gc_interval << "s\n"
+              << "  workers: " << config.worker_threads << " (queue " << config.max_queued_requests
+              << ", uploads " << config.max_uploads << ", metadata reads "
+              << config.max_metadata_reads << ")\n"
               << "  admin user: " << config.admin_user << '\n'
               << "  admin password: " << config.admin_password << '\n'
               << "  remote url: http://" << (config.host == "0.0.0.0" ? "127.0.0.1" : config.host)
-              << ':' << config.port << std::endl;
+              << ':' << port << std::endl;
 
-    if (!app.listen(config.host, config.port))
+    std::jthread mirror;
+    if (!config.mirror.empty())
     {
-        std::cerr << "Failed to bind server on " << config.host << ':' << config.port << '\n';
+        mirror = std::jthread(
+            [&](std::stop_token stop)
+            {
+                Replicator                  replicator(storage, config.mirror, config.sync_jobs);
+                std::mutex                  mutex;
+                std::condition_variable_any wakeup;
+                while (!stop.stop_requested())
+                {
+                    const auto stats = replicator.pass();
+                    append_debug_log(stats ? LogLevel::Info : LogLevel::Warning,
+                                     "MIRROR " + config.mirror + ": " +
+                                         (stats ? describe(*stats) : "manifest unavailable"));
+                    std::unique_lock lock(mutex);
+                    wakeup.wait_for(lock,
+                                    stop,
+                                    std::chrono::seconds(config.mirror_interval),
+                                    [] { return false; });
+                }
+            });
+    }
+
+    if (on_listening)
+    {
+        on_listening(app, port);
+    }
+    const bool served = app.listen_after_bind();
+    g_debug_log.close();
+    return served ? 0 : 1;
+}
+
+} // namespace
+
+int run(int argc, char** argv)
+{
+    int        exit_code = 0;
+    const auto config    = parse_run_args(argc, argv, exit_code);
+    return config ? serve(*config, {}) : exit_code;
+}
+
+struct Instance::State
+{
+    std::thread             thread;
+    std::mutex              mutex;
+    std::condition_variable changed;
+    httplib::Server*        app  = nullptr;
+    int                     port = 0;
+    bool                    done = false;
+};
+
+Instance::Instance(std::vector<std::string> args) : state_(std::make_unique<State>())
+{
+    args.insert(args.begin(), "leafserver");
+    std::vector<char*> argv;
+    for (auto& arg : args)
+    {
+        argv.push_back(arg.data());
+    }
+    int  exit_code = 0;
+    auto config    = parse_run_args(static_cast<int>(argv.size()), argv.data(), exit_code);
+    if (!config)
+    {
+        return;
+    }
+    state_->thread = std::thread(
+        [state = state_.get(), config = std::move(*config)]
+        {
+            serve(config,
+                  [state](httplib::Server& app, int port)
+                  {
+                      std::lock_guard lock(state->mutex);
+                      state->app  = &app;
+                      state->port = port;
+                      state->changed.notify_all();
+                  });
+            std::lock_guard lock(state->mutex);
+            state->app  = nullptr;
+            state->port = 0;
+            state->done = true;
+            state->changed.notify_all();
+        });
+    std::unique_lock lock(state_->mutex);
+    state_->changed.wait(lock, [this] { return state_->app != nullptr || state_->done; });
+    if (state_->app != nullptr)
+    {
+        // stop() is only honoured once the server is listening.
+        state_->app->wait_until_ready();
+    }
+}
+
+Instance::~Instance()
+{
+    stop();
+}
+
+int Instance::port() const
+{
+    std::lock_guard lock(state_->mutex);
+    return state_->port;
+}
+
+void Instance::stop()
+{
+    {
+        std::lock_guard lock(state_->mutex);
+        if (state_->app != nullptr)
+        {
+            state_->app->stop();
+        }
+    }
+    if (state_->thread.joinable())
+    {
+        state_->thread.join();
+    }
+}
+
+int sync(int argc, char** argv)
+{
+    fs::path                   storage_root = ".leafserver-data";
+    std::string                from;
+    std::optional<std::size_t> jobs_override;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        const std::string arg = argv[i];
+        if (arg == "--help" || arg == "-h")
+        {
+            print_usage();
+            return 0;
+        }
+        if (arg == "--from" && i + 1 < argc)
+        {
+            from = argv[++i];
+            continue;
+        }
+        if (arg == "--storage" && i + 1 < argc)
+        {
+            storage_root = argv[++i];
+            continue;
+        }
+        if (arg == "--jobs" && i + 1 < argc)
+        {
+            jobs_override = std::stoul(argv[++i]);
+            continue;
+        }
+    }
+    if (from.empty())
+    {
+        print_usage();
+        return 1;
+    }
+
+    const ServerConfig config = load_config(storage_root);
+    PackageStorage     storage(config.storage_root);
+    storage.set_dedup(config.dedup);
+    if (!storage.lock())
+    {
+        // A running server never sees revisions written behind its back, and two writers would
+        // corrupt metadata.log. --mirror makes the server replicate on its own.
+        std::cerr << "Storage " << fs::absolute(config.storage_root).string()
+                  << " is in use by a running leaf-server; stop it first or start it with --mirror "
+                  << from << '\n';
+        return 1;
+    }
+    if (!storage.load_index())
+    {
+        std::cerr << load_failure(storage) << '\n';
+        return 1;
+    }
+
+    Replicator replicator(storage, from, jobs_override.value_or(config.sync_jobs));
+    const auto stats = replicator.pass();
+    if (!stats)
+    {
+        std::cerr << "Failed to fetch the manifest of " << from << '\n';
+        return 1;
+    }
+    std::cout << "Synced from " << from << ": " << describe(*stats) << '\n';
+    return stats->failed == 0 ? 0 : 1;
+}
+
+int push(int argc, char** argv)
+{
+    std::string to;
+    fs::path    list;
+    std::size_t jobs = 4;
+    std::string user;
+    if (const char* env_user = std::getenv("CONAN_LOGIN_USERNAME"))
+    {
+        user = env_user;
+    }
+
+    for (int i = 1; i < argc; ++i)
+    {
+        const std::string arg = argv[i];
+        if (arg == "--help" || arg == "-h")
+        {
+            print_usage();
+            return 0;
+        }
+        if (arg == "--to" && i + 1 < argc)
+        {
+            to = argv[++i];
+            continue;
+        }
+        if (arg == "--list" && i + 1 < argc)
+        {
+            list = argv[++i];
+            continue;
+        }
+        if (arg == "--jobs" && i + 1 < argc)
+        {
+            jobs = std::stoul(argv[++i]);
+            continue;
+        }
+        if (arg == "--user" && i + 1 < argc)
+        {
+            user = argv[++i];
+            continue;
+        }
+    }
+    if (to.empty() || list.empty())
+    {
+        print_usage();
         return 1;
     }
 
-    return 0;
+    const auto text      = read_small_file(list);
+    const auto revisions = text ? parse_package_list(*text) : std::nullopt;
+    if (!revisions)
+    {
+        std::cerr << "No package list found in " << list.string() << '\n';
+        return 1;
+    }
+    const char* password = std::getenv("CONAN_PASSWORD");
+    Pusher      pusher(to, user, password != nullptr ? password : "", jobs);
+    const auto  stats = pusher.push(*revisions);
+    if (!stats)
+    {
+        std::cerr << "Failed to probe " << to << '\n';
+        return 1;
+    }
+    std::cout << "Pushed to " << to << ": " << describe(*stats) << '\n';
+    if (stats->failed == 0)
+    {
+        return 0;
+    }
+    return stats->uploaded + stats->deployed == 0 ? 1 : 2;
+}
+
+int prefetch(int argc, char** argv)
+{
+    fs::path                   storage_root = ".leafserver-data";
+    std::string                from;
+    fs::path                   graph;
+    std::vector<std::string>   roots;
+    fs::path                   profile;
+    std::optional<std::size_t> jobs_override;
+    std::string                user;
+    if (const char* env_user = std::getenv("CONAN_LOGIN_USERNAME"))
+    {
+        user = env_user;
+    }
+
+    for (int i = 1; i < argc; ++i)
+    {
+        const std::string arg = argv[i];
+        if (arg == "--help" || arg == "-h")
+        {
+            print_usage();
+            return 0;
+        }
+        if (arg == "--from" && i + 1 < argc)
+        {
+            from = argv[++i];
+            continue;
+        }
+        if (arg == "--graph" && i + 1 < argc)
+        {
+            graph = argv[++i];
+            continue;
+        }
+        if (arg == "--require" && i + 1 < argc)
+        {
+            roots.emplace_back(argv[++i]);
+            continue;
+        }
+        if (arg == "--profile" && i + 1 < argc)
+        {
+            profile = argv[++i];
+            continue;
+        }
+        if (arg == "--storage" && i + 1 < argc)
+        {
+            storage_root = argv[++i];
+            continue;
+        }
+        if (arg == "--jobs" && i + 1 < argc)
+        {
+            jobs_override = std::stoul(argv[++i]);
+            continue;
+        }
+        if (arg == "--user" && i + 1 < argc)
+        {
+            user = argv[++i];
+            continue;
+        }
+    }
+    if (from.empty() || graph.empty() == roots.empty())
+    {
+        print_usage();
+        return 1;
+    }
+
+    const ServerConfig config = load_config(storage_root);
+    PackageStorage     storage(config.storage_root);
+    storage.set_dedup(config.dedup);
+    if (!storage.lock())
+    {
+        // Checked before anything is resolved or downloaded: a running server would neither see
+        // the prefetched revisions nor tolerate a second writer to its metadata.log.
+        std::cerr << "Storage " << fs::absolute(config.storage_root).string()
+                  << " is in use by a running leaf-server; stop it before prefetching\n";
+        return 1;
+    }
+    if (!storage.load_index())
+    {
+        std::cerr << load_failure(storage) << '\n';
+        return 1;
+    }
+    const char* password = std::getenv("CONAN_PASSWORD");
+    Prefetcher  prefetcher(storage,
+                          from,
+                          user,
+                          password != nullptr ? password : "",
+                          jobs_override.value_or(config.sync_jobs));
+
+    std::vector<PrefetchTarget> targets;
+    std::size_t                 unresolved = 0;
+    if (!graph.empty())
+    {
+        const auto text   = read_small_file(graph);
+        auto       parsed = text ? parse_graph(*text) : std::nullopt;
+        if (!parsed)
+        {
+            std::cerr << "No dependency graph found in " << graph.string() << '\n';
+            return 1;
+        }
+        targets = std::move(*parsed);
+    }
+    else
+    {
+        // The server resolves the closure of the roots for the profile's settings and options.
+        nlohmann::json request = {{"requires", roots},
+                                  {"settings", nlohmann::json::object()},
+                                  {"options", nlohmann::json::object()}};
+        if (!profile.empty())
+        {
+            const auto text = read_small_file(profile);
+            if (!text)
+            {
+                std::cerr << "Failed to read " << profile.string() << '\n';
+                return 1;
+            }
+            for (const auto& [section, entries] : parse_ini_sections(*text))
+            {
+                if (section == "settings" || section == "options")
+                {
+                    request[section] = entries;
+                }
+            }
+        }
+        const auto response = prefetcher.closure(request.dump());
+        auto       closure  = response ? parse_closure(*response) : std::nullopt;
+        if (!closure)
+        {
+            std::cerr << "Failed to resolve the dependency closure on " << from << '\n';
+            return 1;
+        }
+        for (const auto& requirement : closure->second)
+        {
+            std::cerr << "Unresolved " << requirement << '\n';
+        }
+        targets    = std::move(closure->first);
+        unresolved = closure->second.size();
+    }
+
+    const auto stats = prefetcher.prefetch(targets);
+    std::cout << "Prefetched from " << from << ": " << describe(stats) << '\n';
+    return stats.failed == 0 && unresolved == 0 ? 0 : 1;
 }
 
 } // namespace server
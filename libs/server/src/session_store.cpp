@@ -0,0 +1,100 @@
+#include "session_store.h"
+
+#include <functional>
+#include <utility>
+
+namespace server
+{
+
+SessionStore::~SessionStore()
+{
+    stop_sweeper();
+}
+
+void SessionStore::insert(Session session)
+{
+    auto&            shard = shard_for(session.token);
+    std::unique_lock lock(shard.mutex);
+    auto             token = session.token;
+    shard.sessions.insert_or_assign(std::move(token), std::move(session));
+}
+
+std::optional<std::string> SessionStore::find(const std::string& token,
+                                              Clock::time_point  now) const
+{
+    const auto&      shard = shard_for(token);
+    std::shared_lock lock(shard.mutex);
+    const auto       it = shard.sessions.find(token);
+    if (it == shard.sessions.end() || it->second.expires_at <= now)
+    {
+        return std::nullopt;
+    }
+    return it->second.username;
+}
+
+std::size_t SessionStore::sweep(Clock::time_point now)
+{
+    std::size_t removed = 0;
+    for (auto& shard : shards_)
+    {
+        std::unique_lock lock(shard.mutex);
+        removed += std::erase_if(shard.sessions,
+                                 [now](const auto& entry)
+                                 { return entry.second.expires_at <= now; });
+    }
+    return removed;
+}
+
+std::size_t SessionStore::size() const
+{
+    std::size_t total = 0;
+    for (const auto& shard : shards_)
+    {
+        std::shared_lock lock(shard.mutex);
+        total += shard.sessions.size();
+    }
+    return total;
+}
+
+void SessionStore::start_sweeper(std::chrono::milliseconds interval)
+{
+    stop_sweeper();
+    sweeper_stop_ = false;
+    sweeper_      = std::thread(
+        [this, interval]
+        {
+            std::unique_lock lock(sweeper_mutex_);
+            while (!sweeper_wake_.wait_for(lock, interval, [this] { return sweeper_stop_; }))
+            {
+                lock.unlock();
+                sweep();
+                lock.lock();
+            }
+        });
+}
+
+void SessionStore::stop_sweeper()
+{
+    if (!sweeper_.joinable())
+    {
+        return;
+    }
+    {
+        std::lock_guard lock(sweeper_mutex_);
+        sweeper_stop_ = true;
+    }
+    sweeper_wake_.notify_all();
+    sweeper_.join();
+}
+
+const SessionStore::Shard& SessionStore::shard_for(const std::string& token) const
+{
+    return shards_[std::hash<std::string>{}(token) % kShardCount];
+}
+
+SessionStore::Shard& SessionStore::shard_for(const std::string& token)
+{
+    return shards_[std::hash<std::string>{}(token) % kShardCount];
+}
+
+} // namespace server
@@ -0,0 +1,242 @@
+#include "tar.h"
+
+#include <algorithm>
+#include <utility>
+
+namespace server
+{
+namespace
+{
+
+// Field offsets and widths of a ustar header block.
+constexpr std::size_t kNameOffset     = 0;
+constexpr std::size_t kNameWidth      = 100;
+constexpr std::size_t kModeOffset     = 100;
+constexpr std::size_t kUidOffset      = 108;
+constexpr std::size_t kGidOffset      = 116;
+constexpr std::size_t kSizeOffset     = 124;
+constexpr std::size_t kMtimeOffset    = 136;
+constexpr std::size_t kChecksumOffset = 148;
+constexpr std::size_t kTypeOffset     = 156;
+constexpr std::size_t kMagicOffset    = 257;
+constexpr std::size_t kPrefixOffset   = 345;
+constexpr std::size_t kPrefixWidth    = 155;
+
+// Largest value an 11-digit octal field holds.
+constexpr std::uint64_t kOctalLimit = 077777777777ULL;
+
+void put_octal(std::string& block, std::size_t offset, std::size_t width, std::uint64_t value)
+{
+    // width - 1 digits followed by a NUL, as ustar writers conventionally do.
+    for (std::size_t i = width - 1; i-- > 0;)
+    {
+        block[offset + i] = static_cast<char>('0' + (value & 7U));
+        value >>= 3;
+    }
+    block[offset + width - 1] = '\0';
+}
+
+void put_size(std::string& block, std::uint64_t size)
+{
+    if (size <= kOctalLimit)
+    {
+        put_octal(block, kSizeOffset, 12, size);
+        return;
+    }
+    // GNU base-256: high bit set on the first byte, big-endian value in the rest.
+    block[kSizeOffset] = static_cast<char>(0x80);
+    for (std::size_t i = 11; i > 0; --i)
+    {
+        block[kSizeOffset + i] = static_cast<char>(size & 0xFFU);
+        size >>= 8;
+    }
+}
+
+std::uint32_t header_checksum(std::string_view block)
+{
+    // The checksum field itself counts as eight spaces.
+    std::uint32_t sum = 0;
+    for (std::size_t i = 0; i < Tar::kBlock; ++i)
+    {
+        const bool in_field = i >= kChecksumOffset && i < kChecksumOffset + 8;
+        sum += in_field ? static_cast<unsigned char>(' ') : static_cast<unsigned char>(block[i]);
+    }
+    return sum;
+}
+
+std::optional<std::uint64_t> parse_number(std::string_view field)
+{
+    if (!field.empty() && (static_cast<unsigned char>(field[0]) & 0x80U) != 0)
+    {
+        std::uint64_t value = static_cast<unsigned char>(field[0]) & 0x7FU;
+        for (std::size_t i = 1; i < field.size(); ++i)
+        {
+            if (value > (UINT64_MAX >> 8))
+            {
+                return std::nullopt;
+            }
+            value = (value << 8) | static_cast<unsigned char>(field[i]);
+        }
+        return value;
+    }
+    std::uint64_t value  = 0;
+    bool          digits = false;
+    for (const char ch : field)
+    {
+        if (ch >= '0' && ch <= '7')
+        {
+            value  = (value << 3) | static_cast<std::uint64_t>(ch - '0');
+            digits = true;
+        }
+        else if (ch == '\0' || ch == ' ')
+        {
+            if (digits)
+            {
+                break;
+            }
+        }
+        else
+        {
+            return std::nullopt;
+        }
+    }
+    return value;
+}
+
+std::string c_string(std::string_view field)
+{
+    return std::string(field.substr(0, std::min(field.find('\0'), field.size())));
+}
+
+} // namespace
+
+std::optional<std::string>
+Tar::header(std::string_view name, std::uint64_t size, std::int64_t mtime)
+{
+    std::string_view prefix;
+    if (name.size() > kNameWidth)
+    {
+        // Split at a '/' so the prefix and the remaining name each fit their field.
+        const auto split = name.rfind('/', kPrefixWidth);
+        if (split == std::string_view::npos || name.size() - split - 1 > kNameWidth ||
+            split == 0)
+        {
+            return std::nullopt;
+        }
+        prefix = name.substr(0, split);
+        name   = name.substr(split + 1);
+    }
+    if (name.empty())
+    {
+        return std::nullopt;
+    }
+
+    std::string block(kBlock, '\0');
+    std::copy(name.begin(), name.end(), block.begin() + kNameOffset);
+    std::copy(prefix.begin(), prefix.end(), block.begin() + kPrefixOffset);
+    put_octal(block, kModeOffset, 8, 0644);
+    put_octal(block, kUidOffset, 8, 0);
+    put_octal(block, kGidOffset, 8, 0);
+    put_size(block, size);
+    put_octal(
+        block, kMtimeOffset, 12, static_cast<std::uint64_t>(std::max<std::int64_t>(mtime, 0)));
+    block[kTypeOffset] = '0';
+    std::copy_n("ustar\0" "00", 8, block.begin() + kMagicOffset);
+    put_octal(block, kChecksumOffset, 7, header_checksum(block));
+    block[kChecksumOffset + 7] = ' ';
+    return block;
+}
+
+std::size_t Tar::padding(std::uint64_t size)
+{
+    return static_cast<std::size_t>((kBlock - size % kBlock) % kBlock);
+}
+
+TarReader::TarReader(Begin begin, Data data, End end)
+    : begin_(std::move(begin)), data_(std::move(data)), end_(std::move(end))
+{
+    header_.reserve(Tar::kBlock);
+}
+
+bool TarReader::feed(const char* data, std::size_t length)
+{
+    while (length > 0 && !finished_)
+    {
+        if (remaining_ > 0)
+        {
+            const auto count =
+                static_cast<std::size_t>(std::min<std::uint64_t>(remaining_, length));
+            if (regular_ && !data_(data, count))
+            {
+                return false;
+            }
+            remaining_ -= count;
+            data += count;
+            length -= count;
+            if (remaining_ == 0 && regular_ && !end_())
+            {
+                return false;
+            }
+            continue;
+        }
+        if (padding_ > 0)
+        {
+            const auto count =
+                static_cast<std::size_t>(std::min<std::uint64_t>(padding_, length));
+            padding_ -= count;
+            data += count;
+            length -= count;
+            continue;
+        }
+        const auto count = std::min(Tar::kBlock - header_.size(), length);
+        header_.append(data, count);
+        data += count;
+        length -= count;
+        if (header_.size() == Tar::kBlock)
+        {
+            if (!parse_header())
+            {
+                return false;
+            }
+            header_.clear();
+        }
+    }
+    return true;
+}
+
+bool TarReader::parse_header()
+{
+    if (std::all_of(header_.begin(), header_.end(), [](char ch) { return ch == '\0'; }))
+    {
+        finished_ = true;
+        return true;
+    }
+    const auto stored = parse_number(std::string_view(header_).substr(kChecksumOffset, 8));
+    const auto size   = parse_number(std::string_view(header_).substr(kSizeOffset, 12));
+    if (!stored || !size || *stored != header_checksum(header_))
+    {
+        return false;
+    }
+
+    std::string name   = c_string(std::string_view(header_).substr(kNameOffset, kNameWidth));
+    const auto  prefix = c_string(std::string_view(header_).substr(kPrefixOffset, kPrefixWidth));
+    if (header_.compare(kMagicOffset, 5, "ustar") == 0 && !prefix.empty())
+    {
+        name = prefix + '/' + name;
+    }
+    const char type = header_[kTypeOffset];
+    regular_        = type == '0' || type == '\0';
+    remaining_      = *size;
+    padding_        = Tar::padding(*size);
+    if (!regular_)
+    {
+        return true;
+    }
+    if (!begin_(name, *size))
+    {
+        return false;
+    }
+    return remaining_ > 0 || end_();
+}
+
+} // namespace server
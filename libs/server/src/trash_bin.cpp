@@ -0,0 +1,135 @@
+#include "trash_bin.h"
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+namespace server
+{
+
+TrashBin::TrashBin(std::filesystem::path root) : root_(std::move(root))
+{
+}
+
+bool TrashBin::discard(const std::filesystem::path& dir, Release release)
+{
+    std::error_code ec;
+    if (!std::filesystem::exists(dir, ec))
+    {
+        if (release)
+        {
+            release();
+        }
+        return !ec;
+    }
+    std::filesystem::create_directories(root_, ec);
+    const auto stamp = std::chrono::system_clock::now().time_since_epoch().count();
+    const auto target =
+        root_ / (std::to_string(stamp) + '-' + std::to_string(sequence_.fetch_add(1)));
+    std::filesystem::rename(dir, target, ec);
+    if (ec)
+    {
+        return false;
+    }
+    std::lock_guard lock(mutex_);
+    queue_.push_back({target, std::move(release)});
+    return true;
+}
+
+void TrashBin::recover(Release release)
+{
+    std::error_code                    ec;
+    std::lock_guard                    lock(mutex_);
+    std::vector<std::filesystem::path> leftovers;
+    for (std::filesystem::directory_iterator it(root_, ec), end; !ec && it != end;
+         it.increment(ec))
+    {
+        const auto queued = [&](const Entry& entry) { return entry.path == it->path(); };
+        if (std::none_of(queue_.begin(), queue_.end(), queued))
+        {
+            leftovers.push_back(it->path());
+        }
+    }
+    // The entries share one countdown so release runs after the last of them.
+    const auto remaining = std::make_shared<std::atomic<std::size_t>>(leftovers.size());
+    for (auto& path : leftovers)
+    {
+        queue_.push_back({std::move(path),
+                          [remaining, release]
+                          {
+                              if (remaining->fetch_sub(1) == 1 && release)
+                              {
+                                  release();
+                              }
+                          }});
+    }
+}
+
+std::size_t TrashBin::reclaim(std::size_t files_per_second, const Pause& pause)
+{
+    // Deletes go out in batches of a tenth of the rate, each followed by a 100 ms pause.
+    const std::size_t batch   = std::max<std::size_t>(1, files_per_second / 10);
+    std::size_t       deleted = 0;
+    while (true)
+    {
+        Entry entry;
+        {
+            std::lock_guard lock(mutex_);
+            if (queue_.empty())
+            {
+                break;
+            }
+            entry = std::move(queue_.front());
+            queue_.pop_front();
+        }
+
+        std::error_code                    ec;
+        std::vector<std::filesystem::path> files;
+        for (std::filesystem::recursive_directory_iterator it(entry.path, ec), end;
+             !ec && it != end;
+             it.increment(ec))
+        {
+            if (!it->is_directory(ec))
+            {
+                files.push_back(it->path());
+            }
+        }
+        bool interrupted = false;
+        for (const auto& file : files)
+        {
+            std::filesystem::remove(file, ec);
+            ++deleted;
+            if (files_per_second != 0 && deleted % batch == 0 &&
+                !pause(std::chrono::milliseconds(100)))
+            {
+                interrupted = true;
+                break;
+            }
+        }
+        if (interrupted)
+        {
+            std::lock_guard lock(mutex_);
+            queue_.push_front(std::move(entry));
+            break;
+        }
+        // Only directories remain, so this is cheap. Anything that still failed to go is left
+        // for recover() after the next restart.
+        std::filesystem::remove_all(entry.path, ec);
+        if (entry.release)
+        {
+            entry.release();
+        }
+    }
+    return deleted;
+}
+
+std::size_t TrashBin::pending() const
+{
+    std::lock_guard lock(mutex_);
+    return queue_.size();
+}
+
+} // namespace server
@@ -0,0 +1,74 @@
+#include "upstream.h"
+
+#include <cstddef>
+
+#include "async_log.h"
+
+namespace server
+{
+
+Upstream::Upstream(const std::string& url)
+{
+    const auto scheme_end = url.find("://");
+    const auto path_start = url.find('/', scheme_end == std::string::npos ? 0 : scheme_end + 3);
+    origin_ = url.substr(0, path_start);
+    if (path_start != std::string::npos)
+    {
+        prefix_ = url.substr(path_start);
+        while (prefix_.ends_with('/'))
+        {
+            prefix_.pop_back();
+        }
+    }
+}
+
+httplib::Client Upstream::client() const
+{
+    httplib::Client client(origin_);
+    client.set_connection_timeout(5);
+    client.set_read_timeout(60);
+    client.set_follow_location(true);
+    return client;
+}
+
+std::string Upstream::target(const std::string& path) const
+{
+    return prefix_ + path;
+}
+
+std::optional<std::string> Upstream::get(httplib::Client& client, const std::string& path) const
+{
+    const auto result = client.Get(prefix_ + path);
+    if (!result)
+    {
+        append_debug_log(LogLevel::Warning,
+                         "UPSTREAM " + path + " error=" + httplib::to_string(result.error()));
+        return std::nullopt;
+    }
+    append_debug_log(LogLevel::Debug,
+                     "UPSTREAM " + path + " status=" + std::to_string(result->status));
+    if (result->status != 200)
+    {
+        return std::nullopt;
+    }
+    return result->body;
+}
+
+bool Upstream::download(httplib::Client& client, const std::string& path, StagedFile& staged) const
+{
+    int        status = 0;
+    const auto result = client.Get(
+        prefix_ + path,
+        [&](const httplib::Response& response)
+        {
+            status = response.status;
+            return status == 200;
+        },
+        [&](const char* data, std::size_t length) { return staged.write(data, length); });
+    append_debug_log(LogLevel::Debug,
+                     "UPSTREAM " + path + " status=" + std::to_string(status) +
+                         " bytes=" + std::to_string(staged.size()));
+    return result && status == 200 && staged.finish();
+}
+
+} // namespace server
@@ -1,7 +1,10 @@
 const state = { 
   token: localStorage.getItem("leaf_token") || "",
   theme: localStorage.getItem("leaf_theme") || (window.matchMedia('(prefers-color-scheme: dark)').matches ? 'dark' : 'light'),
-  cachedRecipes: [] // to fall back to when not searching
+  // Recipe table paging; filtering and sorting happen server-side.
+  query: "",
+  sort: "name",
+  nextCursor: null
 };
 
 const dom = {
@@ -19,8 +22,11 @@ const dom = {
   countRecipes: document.getElementById("countRecipes"),
   countRevisions: document.getElementById("countRevisions"),
   countPackages: document.getElementById("countPackages"),
+  diskUsage: document.getElementById("diskUsage"),
   searchContainer: document.getElementById("searchContainer"),
   searchInput: document.getElementById("searchInput"),
+  loadMoreBtn: document.getElementById("loadMoreBtn"),
+  sortUpdated: document.getElementById("sortUpdated"),
   userContextBtn: document.getElementById("userContextBtn"),
   userModal: document.getElementById("userModal"),
   closeUserModal: document.getElementById("closeUserModal"),
@@ -128,6 +134,17 @@ async function handleLogin() {
   }
 }
 
+function formatBytes(bytes) {
+  const units = ["B", "KB", "MB", "GB", "TB"];
+  let value = bytes || 0;
+  let unit = 0;
+  while (value >= 1024 && unit < units.length - 1) {
+    value /= 1024;
+    unit++;
+  }
+  return `${unit === 0 ? value : value.toFixed(1)} ${units[unit]}`;
+}
+
 function formatTime(isoStr) {
   if (!isoStr || isoStr === "-") return "-";
   return new Date(Date.parse(isoStr)).toLocaleString(undefined, {
@@ -158,22 +175,23 @@ function expandRowContent(tr, recipeRef) {
   expandTr.appendChild(td);
   tr.after(expandTr);
 
-  // Fetch full tree via endpoint
+  // Fetch the recipe detail only when the row is expanded
   const parseRef = recipeRef.split('@'); // "name/version@user/channel"
   const nv = parseRef[0].split('/');
   const uc = parseRef[1].split('/');
-  const basePath = `/v2/conans/${encodeURIComponent(nv[0])}/${encodeURIComponent(nv[1])}/${encodeURIComponent(uc[0])}/${encodeURIComponent(uc[1])}`;
+  const refPath = [nv[0], nv[1], uc[0], uc[1]].map(encodeURIComponent).join('/');
 
-  loadExpandedContent(td.querySelector('.expanded-content'), basePath, recipeRef);
+  loadExpandedContent(td.querySelector('.expanded-content'), refPath, recipeRef);
 }
 
-async function loadExpandedContent(container, basePath, recipeRef) {
+async function loadExpandedContent(container, refPath, recipeRef) {
   try {
-    const revisionsObj = await api(`${basePath}/revisions`);
+    const detail = await api(`/api/ui/recipes/${refPath}`);
+    const basePath = `/v2/conans/${refPath}`;
     
     let html = `<div class="nested-section"><div class="nested-title">All Revisions</div>`;
     
-    for (const rev of revisionsObj.revisions) {
+    for (const rev of detail.revisions) {
       html += `<div style="padding: 12px; background: var(--bg-surface-2); border-radius: 8px; margin-bottom: 8px;">`;
       html += `<div style="display:flex; justify-content:space-between; margin-bottom: 8px;">`;
       html += `<div><span class="data-tag">${rev.revision}</span> <span class="muted" style="font-size:0.8rem;">${formatTime(rev.time)}</span></div>`;
@@ -182,25 +200,19 @@ async function loadExpandedContent(container, basePath, recipeRef) {
                 <svg xmlns="http://www.w3.org/2000/svg" width="14" height="14" viewBox="0 0 24 24" fill="none" stroke="currentColor" stroke-width="2"><polyline points="3 6 5 6 21 6"></polyline><path d="M19 6v14a2 2 0 0 1-2 2H7a2 2 0 0 1-2-2V6m3 0V4a2 2 0 0 1 2-2h4a2 2 0 0 1 2 2v2"></path></svg> Delete
                </button></div>`;
       
-      // Load files and packages in parallel
-      const [filesObj, pkgsObj] = await Promise.all([
-        api(`${basePath}/revisions/${rev.revision}/files`),
-        api(`${basePath}/revisions/${rev.revision}/search`)
-      ].map(p => p.catch(e => ({}))));
-      
-      // Files array
-      if (filesObj && filesObj.files) {
+      // Files with their sizes
+      if (rev.files && Object.keys(rev.files).length > 0) {
         html += `<div style="font-size:0.8rem; margin-top:8px;"><strong>Recipe Files: </strong>`;
-        Object.keys(filesObj.files).forEach(f => {
-          html += `<span class="data-tag" style="background:var(--bg-main); border-color:var(--border-glass);">${f}</span>`;
+        Object.entries(rev.files).forEach(([f, size]) => {
+          html += `<span class="data-tag" style="background:var(--bg-main); border-color:var(--border-glass);" title="${formatBytes(size)}">${f}</span>`;
         });
         html += `</div>`;
       }
       
       // Packages
-      if (pkgsObj && Object.keys(pkgsObj).length > 0) {
+      if (rev.packages && Object.keys(rev.packages).length > 0) {
         html += `<div style="font-size:0.8rem; margin-top:8px;"><strong>Package Binaries: </strong>`;
-        for (const [pkgId, details] of Object.entries(pkgsObj)) {
+        for (const [pkgId, details] of Object.entries(rev.packages)) {
            html += `<div style="margin-top:4px; padding:8px; border: 1px solid var(--border-light); border-radius: 6px;">
                       <span class="data-tag" style="color:var(--brand)">${pkgId}</span>`;
            if (details.settings) {
@@ -273,14 +285,13 @@ async function refreshDashboard() {
   
   try {
     const summary = await api("/api/ui/summary");
-    const recipes = await api("/api/ui/recipes");
-    state.cachedRecipes = recipes.recipes; // cache for UI
 
     animateValue(dom.countRecipes, parseInt(dom.countRecipes.textContent) || 0, summary.recipes, 800);
     animateValue(dom.countRevisions, parseInt(dom.countRevisions.textContent) || 0, summary.recipe_revisions, 800);
     animateValue(dom.countPackages, parseInt(dom.countPackages.textContent) || 0, summary.packages, 800);
+    dom.diskUsage.textContent = formatBytes(summary.disk_bytes);
 
-    renderTable(state.cachedRecipes);
+    await loadRecipes(false);
   } catch (error) {
     if (error.message.includes("401") || error.message.includes("Unauthorized")) {
       setStatus("Session expired. Please log in again.", true);
@@ -294,9 +305,20 @@ async function refreshDashboard() {
   }
 }
 
-function renderTable(recipeList) {
-  dom.recipesBody.innerHTML = "";
-  if (recipeList.length === 0) {
+// Fetches one page of the recipe table; append keeps the rows already shown.
+async function loadRecipes(append) {
+  const params = new URLSearchParams({ limit: "50", sort: state.sort });
+  if (state.query) params.set("q", state.query);
+  if (append && state.nextCursor) params.set("cursor", state.nextCursor);
+  const page = await api(`/api/ui/recipes?${params}`);
+  state.nextCursor = page.next_cursor;
+  renderTable(page.recipes || [], append);
+  dom.loadMoreBtn.classList.toggle("hidden", !state.nextCursor);
+}
+
+function renderTable(recipeList, append) {
+  if (!append) dom.recipesBody.innerHTML = "";
+  if (recipeList.length === 0 && !append) {
     dom.recipesBody.innerHTML = `<tr><td colspan="3" class="empty-state">
       <svg xmlns="http://www.w3.org/2000/svg" width="48" height="48" viewBox="0 0 24 24" fill="none" stroke="currentColor" stroke-width="1.5"><circle cx="11" cy="11" r="8"></circle><line x1="21" y1="21" x2="16.65" y2="16.65"></line></svg>
       <p style="color:var(--text-main); font-weight:600; font-family:'Space Grotesk'">No packages found</p>
@@ -304,13 +326,8 @@ function renderTable(recipeList) {
     </td></tr>`;
   } else {
     for (const recipe of recipeList) {
-      if(recipe.reference) { // came from full UI objects
-        const latest = recipe.revisions[0] || { revision: "-", time: "-" };
-        dom.recipesBody.appendChild(createTableRow(recipe.reference, recipe.revisions.length, latest.revision, latest.time));
-      } else { // came from standard search API strings
-        // Just render placeholder, user can expand to fetch
-        dom.recipesBody.appendChild(createTableRow(recipe, "?", "-", "-"));
-      }
+      const latest = recipe.latest || { revision: "-", time: "-" };
+      dom.recipesBody.appendChild(createTableRow(recipe.reference, recipe.revision_count, latest.revision, latest.time));
     }
   }
 }
@@ -321,15 +338,21 @@ dom.searchInput.addEventListener("input", (e) => {
   clearTimeout(searchTimeout);
   const q = e.target.value.trim();
   searchTimeout = setTimeout(async () => {
-    if(!q) { renderTable(state.cachedRecipes); return; }
+    state.query = q;
     try {
-      const res = await api(`/v2/conans/search?q=${encodeURIComponent(q)}*`);
-      // res.results is an array of strings e.g. ["pkg/1.0@user/stable"]
-      renderTable(res.results || []);
+      await loadRecipes(false);
     } catch(err) { setStatus(err.message, true); }
   }, 350);
 });
 
+dom.loadMoreBtn.addEventListener("click", () => loadRecipes(true).catch(err => setStatus(err.message, true)));
+
+dom.sortUpdated.addEventListener("click", () => {
+  state.sort = state.sort === "updated" ? "name" : "updated";
+  dom.sortUpdated.classList.toggle("sorted", state.sort === "updated");
+  loadRecipes(false).catch(err => setStatus(err.message, true));
+});
+
 // UI Modal Handlers
 dom.userContextBtn.addEventListener("click", async () => {
   dom.userModal.classList.add("active");
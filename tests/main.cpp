@@ -1,11 +1,35 @@
 #include <gtest/gtest.h>
+#include <httplib.h>
 #include <logger.h>
 
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cstdlib>
 #include <filesystem>
+#include <fstream>
+#include <future>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include "../libs/commands/include/commands.h"
 #include "easyproc.h"
+#include "file_cache.h"
+#include "glob.h"
+#include "json_writer.h"
+#include "metadata_log.h"
+#include "metrics.h"
+#include "route_trie.h"
+#include "server.h"
+#include "session_store.h"
+#include "sha256.h"
+#include "tar.h"
+#include "trash_bin.h"
 #include "utils.h"
 using namespace std::string_literals;
 
@@ -86,6 +110,1486 @@ TEST(RunExternalProcessTest, InvalidCommand)
     ASSERT_NE(exit_code, 0);
 }
 
+//--------------Server-----------
+
+TEST(Sha256, KnownVectors)
+{
+    ASSERT_EQ(server::Sha256::hex(""),
+              "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855");
+    ASSERT_EQ(server::Sha256::hex("abc"),
+              "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+}
+
+TEST(Sha256, IncrementalMatchesOneShot)
+{
+    const std::string data(100000, 'a');
+    server::Sha256    hasher;
+    for (std::size_t offset = 0; offset < data.size(); offset += 777)
+    {
+        hasher.update(std::string_view(data).substr(offset, 777));
+    }
+    ASSERT_EQ(hasher.hex_digest(), server::Sha256::hex(data));
+}
+
+TEST(Glob, Matching)
+{
+    ASSERT_TRUE(server::Glob("zlib*").matches("ZLib/1.3@_/_"));
+    ASSERT_TRUE(server::Glob("*").matches(""));
+    ASSERT_TRUE(server::Glob("a*bc*bc").matches("abcbc"));
+    ASSERT_TRUE(server::Glob("?lib/1.?").matches("zlib/1.3"));
+    ASSERT_FALSE(server::Glob("a*bc*bc").matches("abc"));
+    ASSERT_FALSE(server::Glob("zlib/1.0").matches("zlib/100"));
+}
+
+TEST(Glob, LiteralPrefix)
+{
+    ASSERT_EQ(server::Glob("Boost*").literal_prefix(), "boost");
+    ASSERT_EQ(server::Glob("zl?b*").literal_prefix(), "zl");
+    ASSERT_EQ(server::Glob("*zlib").literal_prefix(), "");
+}
+
+TEST(SessionStore, SweepDropsExpiredSessions)
+{
+    const auto           now = server::SessionStore::Clock::now();
+    server::SessionStore store;
+    store.insert({"alice", "live", now + std::chrono::hours(1)});
+    store.insert({"bob", "stale", now - std::chrono::seconds(1)});
+    ASSERT_EQ(store.find("live", now), "alice");
+    ASSERT_FALSE(store.find("stale", now));
+    ASSERT_EQ(store.sweep(now), 1u);
+    ASSERT_EQ(store.size(), 1u);
+}
+
+TEST(SessionStore, ConcurrentLoginAndLookup)
+{
+    constexpr int        kThreads = 8;
+    constexpr int        kLogins  = 2000;
+    server::SessionStore store;
+    store.start_sweeper(std::chrono::milliseconds(1));
+    std::atomic<int>         misses{0};
+    std::vector<std::thread> workers;
+    for (int t = 0; t < kThreads; ++t)
+    {
+        workers.emplace_back(
+            [&, t]
+            {
+                const auto expires = server::SessionStore::Clock::now() + std::chrono::hours(1);
+                for (int i = 0; i < kLogins; ++i)
+                {
+                    const auto user  = "user" + std::to_string(t);
+                    const auto token = user + "-" + std::to_string(i);
+                    store.insert({user, token, expires});
+                    if (store.find(token) != user || store.find(user + "-0") != user)
+                    {
+                        ++misses;
+                    }
+                }
+            });
+    }
+    for (auto& worker : workers)
+    {
+        worker.join();
+    }
+    store.stop_sweeper();
+    ASSERT_EQ(misses.load(), 0);
+    ASSERT_EQ(store.size(), static_cast<std::size_t>(kThreads * kLogins));
+}
+
+TEST(Metrics, RendersCountersAndHistogram)
+{
+    server::Metrics metrics({"ping", "search"});
+    ASSERT_EQ(metrics.route("search"), 1U);
+    ASSERT_EQ(metrics.route("other"), 2U);
+    metrics.request_started();
+    metrics.request_finished(1, 200, std::chrono::milliseconds(3));
+    metrics.add_uploaded_bytes(42);
+    const auto text = metrics.render({{"leafserver_index_recipes", 7},
+                                      {"leafserver_index_bytes", 1234567891.0},
+                                      {"leafserver_dedup_ratio", 0.1}},
+                                     {{"leafserver_file_cache_hits_total", 5}});
+    ASSERT_NE(text.find("leafserver_requests_total{route=\"search\",status=\"2xx\"} 1"),
+              std::string::npos);
+    ASSERT_NE(
+        text.find("leafserver_request_duration_seconds_bucket{route=\"search\",le=\"0.005\"} 1"),
+        std::string::npos);
+    ASSERT_NE(text.find("leafserver_requests_in_flight 0"), std::string::npos);
+    ASSERT_NE(text.find("leafserver_uploaded_bytes_total 42"), std::string::npos);
+    ASSERT_NE(text.find("leafserver_index_recipes 7"), std::string::npos);
+    ASSERT_NE(text.find("# TYPE leafserver_file_cache_hits_total counter\n"
+                        "leafserver_file_cache_hits_total 5\n"),
+              std::string::npos);
+    // Large integers and sums keep every digit.
+    ASSERT_NE(text.find("leafserver_index_bytes 1234567891\n"), std::string::npos);
+    ASSERT_NE(text.find("leafserver_dedup_ratio 0.1\n"), std::string::npos);
+    ASSERT_NE(text.find("leafserver_request_duration_seconds_sum{route=\"search\"} 0.003\n"),
+              std::string::npos);
+    ASSERT_EQ(text.find("route=\"ping\""), std::string::npos);
+}
+
+TEST(JsonWriter, EscapesAndSeparates)
+{
+    std::string escaped;
+    server::append_json_escaped(escaped, "plain text run \"quoted\" back\\slash\n\x01 tail");
+    ASSERT_EQ(escaped, "plain text run \\\"quoted\\\" back\\\\slash\\n\\u0001 tail");
+
+    server::JsonWriter out;
+    out.begin_object().key("list").begin_array().value("a").value(2).value(true).null();
+    out.end_array().key("ratio").value(1.5, 2).key("empty").begin_object().end_object();
+    out.end_object();
+    ASSERT_EQ(out.str(), R"({"list":["a",2,true,null],"ratio":1.50,"empty":{}})");
+}
+
+TEST(JsonWriter, FlushesChunksToSink)
+{
+    std::string        streamed;
+    std::size_t        chunks = 0;
+    server::JsonWriter out(
+        [&](std::string_view chunk)
+        {
+            streamed += chunk;
+            ++chunks;
+            return true;
+        },
+        16);
+    out.begin_array();
+    for (int i = 0; i < 20; ++i)
+    {
+        out.value("item");
+    }
+    out.end_array();
+    ASSERT_TRUE(out.flush());
+    ASSERT_GT(chunks, 1U);
+    ASSERT_EQ(streamed.front(), '[');
+    ASSERT_EQ(streamed.back(), ']');
+    ASSERT_EQ(streamed.size(), 2 + 20 * 6 + 19);
+}
+
+TEST(MetadataLog, ReplaysCompactsAndDropsTornTail)
+{
+    const auto path = std::filesystem::temp_directory_path() / "leafserver-metadata-test.log";
+    std::filesystem::remove(path);
+    using Records = std::vector<server::MetadataLog::Record>;
+    const auto collect = [](Records& into)
+    { return [&into](const server::MetadataLog::Record& record) { into.push_back(record); }; };
+    {
+        Records             replayed;
+        server::MetadataLog log;
+        ASSERT_TRUE(log.open(path, collect(replayed)));
+        ASSERT_TRUE(replayed.empty());
+        ASSERT_TRUE(log.append({"add", "tab\there", "line\nbreak"}));
+        ASSERT_TRUE(log.append({"add", "b"}));
+        ASSERT_TRUE(log.sync());
+    }
+    {
+        std::ofstream torn(path, std::ios::binary | std::ios::app);
+        torn << "add\tpartial";
+    }
+    {
+        Records             replayed;
+        server::MetadataLog log;
+        ASSERT_TRUE(log.open(path, collect(replayed)));
+        ASSERT_EQ(replayed, (Records{{"add", "tab\there", "line\nbreak"}, {"add", "b"}}));
+        ASSERT_TRUE(log.rewrite([](const server::MetadataLog::Emit& emit) { emit({"add", "b"}); }));
+        ASSERT_EQ(log.records(), 1U);
+        ASSERT_TRUE(log.append({"add", "c"}));
+    }
+    Records             replayed;
+    server::MetadataLog log;
+    ASSERT_TRUE(log.open(path, collect(replayed)));
+    ASSERT_EQ(replayed, (Records{{"add", "b"}, {"add", "c"}}));
+    log.close();
+    std::filesystem::remove(path);
+}
+
+TEST(MetadataLog, RefusesCorruptRecordBeforeTheEnd)
+{
+    const auto path = std::filesystem::temp_directory_path() / "leafserver-metadata-corrupt.log";
+    std::filesystem::remove(path);
+    using Records = std::vector<server::MetadataLog::Record>;
+    const auto collect = [](Records& into)
+    { return [&into](const server::MetadataLog::Record& record) { into.push_back(record); }; };
+    {
+        Records             replayed;
+        server::MetadataLog log;
+        ASSERT_TRUE(log.open(path, collect(replayed)));
+        ASSERT_TRUE(log.append({"add", "a"}));
+        ASSERT_TRUE(log.append({"add", "b"}));
+        ASSERT_TRUE(log.append({"add", "c"}));
+    }
+    const auto read = [&]
+    {
+        std::ifstream in(path, std::ios::binary);
+        return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    };
+    const std::string intact = read();
+
+    // A flipped bit in the middle record: nothing is replayed past it and nothing is cut off.
+    std::string damaged = intact;
+    damaged[damaged.find("add\tb") + 4] = 'x';
+    std::ofstream(path, std::ios::binary | std::ios::trunc) << damaged;
+    {
+        Records             replayed;
+        server::MetadataLog log;
+        ASSERT_FALSE(log.open(path, collect(replayed)));
+        ASSERT_NE(log.error().find("record 2"), std::string::npos);
+    }
+    ASSERT_EQ(read(), damaged);
+
+    // The same damage to the last, newline-terminated record is a torn append and is dropped.
+    damaged = intact;
+    damaged[damaged.find("add\tc") + 4] = 'x';
+    std::ofstream(path, std::ios::binary | std::ios::trunc) << damaged;
+    Records             replayed;
+    server::MetadataLog log;
+    ASSERT_TRUE(log.open(path, collect(replayed)));
+    ASSERT_EQ(replayed, (Records{{"add", "a"}, {"add", "b"}}));
+    log.close();
+    std::filesystem::remove(path);
+}
+
+TEST(TrashBin, DiscardsByRenameAndReclaimsLater)
+{
+    const auto root = std::filesystem::temp_directory_path() / "leafserver-trash-test";
+    std::filesystem::remove_all(root);
+    std::filesystem::create_directories(root / "revision" / "files");
+    for (int i = 0; i < 5; ++i)
+    {
+        std::ofstream(root / "revision" / "files" / std::to_string(i)) << i;
+    }
+
+    server::TrashBin trash(root / "trash");
+    int              released = 0;
+    ASSERT_TRUE(trash.discard(root / "revision", [&] { ++released; }));
+    ASSERT_FALSE(std::filesystem::exists(root / "revision"));
+    ASSERT_EQ(trash.pending(), 1U);
+    ASSERT_EQ(released, 0);
+
+    // A pause that gives up leaves the entry queued for the next pass.
+    ASSERT_EQ(trash.reclaim(20, [](std::chrono::milliseconds) { return false; }), 2U);
+    ASSERT_EQ(trash.pending(), 1U);
+    ASSERT_EQ(trash.reclaim(0, {}), 3U);
+    ASSERT_EQ(trash.pending(), 0U);
+    ASSERT_EQ(released, 1);
+    ASSERT_TRUE(std::filesystem::is_empty(root / "trash"));
+
+    ASSERT_TRUE(trash.discard(root / "missing", [&] { ++released; }));
+    ASSERT_EQ(released, 2);
+
+    // Leftovers of a previous process share one release, run after the last of them is gone.
+    std::filesystem::create_directories(root / "trash" / "1-0" / "files");
+    std::filesystem::create_directories(root / "trash" / "1-1");
+    std::ofstream(root / "trash" / "1-0" / "files" / "0") << 0;
+    server::TrashBin restarted(root / "trash");
+    restarted.recover([&] { ++released; });
+    ASSERT_EQ(restarted.pending(), 2U);
+    ASSERT_EQ(restarted.reclaim(0, {}), 1U);
+    ASSERT_EQ(released, 3);
+    ASSERT_TRUE(std::filesystem::is_empty(root / "trash"));
+    std::filesystem::remove_all(root);
+}
+
+TEST(Tar, RoundTripsThroughReader)
+{
+    const std::string long_name = std::string(120, 'd') + "/conan_package.tgz";
+    const std::string content(1000, 'x');
+    std::string       archive;
+    for (const auto& [name, body] : {std::pair{std::string("bundle.json"), std::string("{}")},
+                                     std::pair{long_name, content},
+                                     std::pair{std::string("empty"), std::string()}})
+    {
+        archive += *server::Tar::header(name, body.size(), 0);
+        archive += body + std::string(server::Tar::padding(body.size()), '\0');
+    }
+    archive += std::string(server::Tar::kTrailer, '\0');
+    ASSERT_EQ(archive.size() % server::Tar::kBlock, 0U);
+    ASSERT_FALSE(server::Tar::header(std::string(200, 'n'), 0, 0));
+
+    // Odd chunk sizes split headers and contents at arbitrary points.
+    std::vector<std::pair<std::string, std::string>> files;
+    server::TarReader                                reader(
+        [&](const std::string& name, std::uint64_t)
+        {
+            files.emplace_back(name, "");
+            return true;
+        },
+        [&](const char* data, std::size_t length)
+        {
+            files.back().second.append(data, length);
+            return true;
+        },
+        [] { return true; });
+    for (std::size_t offset = 0; offset < archive.size(); offset += 7)
+    {
+        const auto length = std::min<std::size_t>(7, archive.size() - offset);
+        ASSERT_TRUE(reader.feed(archive.data() + offset, length));
+    }
+    ASSERT_TRUE(reader.finished());
+    ASSERT_EQ(files.size(), 3U);
+    ASSERT_EQ(files[0], (std::pair<std::string, std::string>{"bundle.json", "{}"}));
+    ASSERT_EQ(files[1], (std::pair<std::string, std::string>{long_name, content}));
+    ASSERT_EQ(files[2].second, "");
+
+    // A corrupted header checksum is refused.
+    archive[0] = 'X';
+    server::TarReader corrupt([](const std::string&, std::uint64_t) { return true; },
+                              [](const char*, std::size_t) { return true; },
+                              [] { return true; });
+    ASSERT_FALSE(corrupt.feed(archive.data(), archive.size()));
+}
+
+TEST(RouteTrie, MatchesLiteralsBeforeCaptures)
+{
+    server::RouteTrie trie;
+    const auto        search   = trie.add("/v2/conans/search");
+    const auto        latest   = trie.add("/v2/conans/*/*/*/*/latest");
+    const auto        files    = trie.add("/v2/conans/*/*/*/*/revisions/*/files/*");
+    const auto        packages = trie.add("/v2/conans/*/*/*/*/revisions/*/packages/*/latest");
+    ASSERT_EQ(trie.add("/v2/conans/*/*/*/*/latest"), latest);
+
+    const auto found = trie.match("/v2/conans/search");
+    ASSERT_TRUE(found);
+    ASSERT_EQ(found->route, search);
+    ASSERT_EQ(found->count, 0U);
+
+    const auto file = trie.match("/v2/conans/zlib/1.3/_/_/revisions/abc/files/conanfile.py");
+    ASSERT_TRUE(file);
+    ASSERT_EQ(file->route, files);
+    ASSERT_EQ(file->count, 6U);
+    ASSERT_EQ((*file)[0], "zlib");
+    ASSERT_EQ((*file)[5], "conanfile.py");
+    ASSERT_TRUE(file->safe);
+
+    // "search" and "latest" are also valid captures where no literal continues the path.
+    const auto named = trie.match("/v2/conans/search/1.0/latest/_/latest");
+    ASSERT_TRUE(named);
+    ASSERT_EQ(named->route, latest);
+    ASSERT_EQ((*named)[2], "latest");
+    ASSERT_EQ(trie.match("/v2/conans/a/1/_/_/revisions/r/packages/p/latest")->route, packages);
+
+    const auto unsafe = trie.match("/v2/conans/zlib/../_/_/latest");
+    ASSERT_TRUE(unsafe);
+    ASSERT_FALSE(unsafe->safe);
+
+    ASSERT_FALSE(trie.match("/v2/conans/zlib/1.3/_/_/latest/"));
+    ASSERT_FALSE(trie.match("/v2/conans/zlib//_/_/latest"));
+    ASSERT_FALSE(trie.match("/v2/conans/zlib/1.3/_/_"));
+    ASSERT_FALSE(trie.match("v2/conans/search"));
+}
+
+TEST(FileCache, EvictsLeastRecentlyUsedAndValidatesChecksums)
+{
+    // Each of the 16 shards holds 100 bytes, so entries are capped at 100 and then at max_entry.
+    server::FileCache cache(16 * 100, 60);
+    const auto        contents = [](std::size_t size)
+    { return std::make_shared<const std::string>(size, 'x'); };
+    ASSERT_TRUE(cache.accepts(60));
+    ASSERT_FALSE(cache.accepts(61));
+
+    cache.insert("a/files/conanfile.py", "sha-a", contents(10));
+    ASSERT_TRUE(cache.find("a/files/conanfile.py", "sha-a"));
+    ASSERT_FALSE(cache.find("a/files/conanfile.py", "sha-b"));
+    ASSERT_FALSE(cache.find("b/files/conanfile.py", "sha-a"));
+
+    // Entries that no longer fit the shard push out the least recently used ones.
+    for (int i = 0; i < 64; ++i)
+    {
+        cache.insert("c/files/" + std::to_string(i), "sha", contents(60));
+    }
+    auto stats = cache.stats();
+    ASSERT_EQ(stats.hits, 1U);
+    ASSERT_EQ(stats.misses, 2U);
+    ASSERT_GT(stats.evictions, 0U);
+    ASSERT_LE(stats.bytes, 16U * 100U);
+    ASSERT_TRUE(cache.find("c/files/63", "sha"));
+
+    cache.erase("c/files/63");
+    ASSERT_FALSE(cache.find("c/files/63", "sha"));
+    cache.erase_prefix("c/");
+    cache.erase_prefix("a/");
+    stats = cache.stats();
+    ASSERT_EQ(stats.entries, 0U);
+    ASSERT_EQ(stats.bytes, 0U);
+}
+
+namespace
+{
+
+// A leaf-server on a free port over a fresh store in the temp directory. config lines are added
+// to leafserver.conf before the first start; restart() serves the same store again.
+class TestServer
+{
+  public:
+    explicit TestServer(const std::string& name, const std::string& config = "")
+        : root_(std::filesystem::temp_directory_path() / ("leafserver-" + name))
+    {
+        std::filesystem::remove_all(root_);
+        std::filesystem::create_directories(root_);
+        std::ofstream(root_ / "leafserver.conf")
+            << "admin_password=secret\nlog_level=off\n" << config;
+        start();
+    }
+
+    ~TestServer()
+    {
+        instance_.reset();
+        std::filesystem::remove_all(root_);
+    }
+
+    void restart()
+    {
+        stop();
+        start();
+    }
+
+    // Releases the store, e.g. for a sync pass into it; restart() serves it again.
+    void stop()
+    {
+        instance_.reset();
+    }
+
+    [[nodiscard]] int port() const
+    {
+        return instance_->port();
+    }
+
+    [[nodiscard]] const std::filesystem::path& root() const
+    {
+        return root_;
+    }
+
+    [[nodiscard]] httplib::Client client() const
+    {
+        httplib::Client client("127.0.0.1", port());
+        client.set_basic_auth("admin", "secret");
+        return client;
+    }
+
+    // Uploads one file of a recipe revision ("zlib/1.0/_/_", "r1", "conanfile.py").
+    [[nodiscard]] int put_recipe_file(const std::string& ref,
+                                      const std::string& revision,
+                                      const std::string& file,
+                                      const std::string& content) const
+    {
+        const auto result = client().Put(
+            "/v2/conans/" + ref + "/revisions/" + revision + "/files/" + file,
+            content,
+            "application/octet-stream");
+        return result ? result->status : 0;
+    }
+
+    // Uploads the files a Conan client sends for a recipe revision, the manifest last.
+    void publish_recipe(const std::string& ref, const std::string& revision) const
+    {
+        ASSERT_EQ(put_recipe_file(ref, revision, "conan_export.tgz", "export " + revision), 200);
+        ASSERT_EQ(put_recipe_file(ref, revision, "conanfile.py", "recipe " + revision), 200);
+        ASSERT_EQ(put_recipe_file(ref, revision, "conanmanifest.txt", "manifest " + revision), 200);
+    }
+
+    // DELETE path on this server; status 0 when the request failed.
+    [[nodiscard]] int remove(const std::string& path) const
+    {
+        const auto result = client().Delete(path);
+        return result ? result->status : 0;
+    }
+
+    // Uploads the files of a package revision, conaninfo.txt holding info.
+    void publish_package(const std::string& ref,
+                         const std::string& revision,
+                         const std::string& package_id,
+                         const std::string& package_revision,
+                         const std::string& info) const
+    {
+        const auto base = "/v2/conans/" + ref + "/revisions/" + revision + "/packages/" +
+                          package_id + "/revisions/" + package_revision + "/files/";
+        for (const auto& [file, content] : {std::pair<std::string, std::string>{
+                                                "conan_package.tgz", "package " + package_id},
+                                            {"conaninfo.txt", info},
+                                            {"conanmanifest.txt", "manifest " + package_id}})
+        {
+            const auto result = client().Put(base + file, content, "application/octet-stream");
+            ASSERT_TRUE(result);
+            ASSERT_EQ(result->status, 200);
+        }
+    }
+
+    // GET path on this server; status 0 when the request failed.
+    [[nodiscard]] std::pair<int, std::string> get(const std::string& path) const
+    {
+        const auto result = client().Get(path);
+        return result ? std::pair(result->status, result->body) : std::pair(0, std::string());
+    }
+
+  private:
+    void start()
+    {
+        instance_ = std::make_unique<server::Instance>(std::vector<std::string>{
+            "--host", "127.0.0.1", "--port", "0", "--storage", root_.string()});
+        ASSERT_NE(instance_->port(), 0);
+    }
+
+    std::filesystem::path             root_;
+    std::unique_ptr<server::Instance> instance_;
+};
+
+
+// Forwards GETs to a server on 127.0.0.1:target, counting them per path. Each request waits for
+// delay first; paths ending in failing() are answered with 500 instead.
+class CountingProxy
+{
+  public:
+    explicit CountingProxy(int target, std::chrono::milliseconds delay = {})
+    {
+        server_.Get(".*",
+                    [this, target, delay](const httplib::Request& req, httplib::Response& res)
+                    {
+                        std::this_thread::sleep_for(delay);
+                        {
+                            std::lock_guard lock(mutex_);
+                            ++requests_[req.path];
+                            if (!failing_.empty() && req.path.ends_with(failing_))
+                            {
+                                res.status = 500;
+                                return;
+                            }
+                        }
+                        httplib::Client client("127.0.0.1", target);
+                        const auto      result = client.Get(req.target);
+                        if (!result)
+                        {
+                            res.status = 502;
+                            return;
+                        }
+                        res.status = result->status;
+                        res.set_content(result->body, result->get_header_value("Content-Type"));
+                    });
+        port_   = server_.bind_to_any_port("127.0.0.1");
+        thread_ = std::thread([this] { server_.listen_after_bind(); });
+        server_.wait_until_ready();
+    }
+
+    ~CountingProxy()
+    {
+        server_.stop();
+        thread_.join();
+    }
+
+    [[nodiscard]] std::string url() const
+    {
+        return "http://127.0.0.1:" + std::to_string(port_);
+    }
+
+    [[nodiscard]] int requests(const std::string& path)
+    {
+        std::lock_guard lock(mutex_);
+        return requests_[path];
+    }
+
+    void fail(const std::string& suffix)
+    {
+        std::lock_guard lock(mutex_);
+        failing_ = suffix;
+    }
+
+  private:
+    httplib::Server            server_;
+    std::thread                thread_;
+    int                        port_ = 0;
+    std::mutex                 mutex_;
+    std::map<std::string, int> requests_;
+    std::string                failing_;
+};
+
+// Runs one `leaf-server sync` pass from the server on port into root. Returns the exit code and
+// the summary line it printed.
+std::pair<int, std::string> sync_pass(int port, const std::filesystem::path& root)
+{
+    std::vector<std::string> args{"leaf-server-sync",
+                                  "--from",
+                                  "http://127.0.0.1:" + std::to_string(port),
+                                  "--storage",
+                                  root.string()};
+    std::vector<char*>       argv;
+    for (auto& arg : args)
+    {
+        argv.push_back(arg.data());
+    }
+    testing::internal::CaptureStdout();
+    const int code = server::sync(static_cast<int>(argv.size()), argv.data());
+    return {code, testing::internal::GetCapturedStdout()};
+}
+
+} // namespace
+
+TEST(Server, UnpublishedRevisionStaysInvisible)
+{
+    TestServer server("unpublished");
+    const std::string base = "/v2/conans/zlib/1.0/_/_";
+    ASSERT_EQ(server.put_recipe_file("zlib/1.0/_/_", "r1", "conan_export.tgz", "export"), 200);
+    ASSERT_EQ(server.put_recipe_file("zlib/1.0/_/_", "r1", "conanfile.py", "recipe"), 200);
+
+    const auto invisible = [&]
+    {
+        ASSERT_EQ(server.get(base + "/latest").first, 404);
+        const auto [status, listing] = server.get(base + "/revisions");
+        ASSERT_EQ(listing.find("r1"), std::string::npos) << status;
+        ASSERT_EQ(server.get(base + "/revisions/r1/files").first, 404);
+        ASSERT_EQ(server.get(base + "/revisions/r1/files/conanfile.py").first, 404);
+    };
+    invisible();
+
+    ASSERT_EQ(server.put_recipe_file("zlib/1.0/_/_", "r1", "conanmanifest.txt", "manifest"), 200);
+    ASSERT_NE(server.get(base + "/latest").second.find("\"r1\""), std::string::npos);
+    ASSERT_NE(server.get(base + "/revisions").second.find("\"r1\""), std::string::npos);
+    ASSERT_NE(server.get(base + "/revisions/r1/files").second.find("conanfile.py"),
+              std::string::npos);
+    ASSERT_EQ(server.get(base + "/revisions/r1/files/conanfile.py"),
+              std::pair(200, std::string("recipe")));
+}
+
+TEST(Server, FilesNamedLikeUploadsAreStored)
+{
+    TestServer        server("upload-names");
+    const std::string files = "/v2/conans/zlib/1.0/_/_/revisions/r1/files";
+    ASSERT_EQ(server.put_recipe_file("zlib/1.0/_/_", "r1", "notes.upload-v2.txt", "notes"), 200);
+    server.publish_recipe("zlib/1.0/_/_", "r1");
+
+    // Also once the index is rebuilt from the files on disk.
+    for (const bool rebuilt : {false, true})
+    {
+        if (rebuilt)
+        {
+            server.stop();
+            std::filesystem::remove(server.root() / "metadata.log");
+            server.restart();
+        }
+        ASSERT_NE(server.get(files).second.find("\"notes.upload-v2.txt\""), std::string::npos)
+            << rebuilt;
+        ASSERT_EQ(server.get(files + "/notes.upload-v2.txt"), std::pair(200, std::string("notes")))
+            << rebuilt;
+    }
+}
+
+TEST(Server, GarbageCollectorDropsAbandonedUploads)
+{
+    // Staged files idle for four read timeouts are abandoned.
+    TestServer server("abandoned", "read_timeout=1\n");
+    ASSERT_EQ(server.put_recipe_file("zlib/1.0/_/_", "r1", "conanfile.py", "recipe"), 200);
+    const auto staging = server.root() / "staging";
+    ASSERT_FALSE(std::filesystem::is_empty(staging));
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(15);
+    while (!std::filesystem::is_empty(staging) && std::chrono::steady_clock::now() < deadline)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    ASSERT_TRUE(std::filesystem::is_empty(staging));
+
+    // The dropped conanfile.py no longer counts towards publishing r1.
+    ASSERT_EQ(server.put_recipe_file("zlib/1.0/_/_", "r1", "conanmanifest.txt", "manifest"), 200);
+    ASSERT_EQ(server.get("/v2/conans/zlib/1.0/_/_/latest").first, 404);
+}
+
+TEST(Server, PullThroughCopiesMissesFromUpstream)
+{
+    TestServer upstream("pull-upstream");
+    upstream.publish_recipe("zlib/1.0/_/_", "r1");
+    upstream.publish_recipe("fmt/1.0/_/_", "r2");
+    CountingProxy proxy(upstream.port());
+    TestServer    server("pull", "upstream=" + proxy.url() + "\n");
+
+    // A miss on /latest copies the revision; afterwards its files are served locally.
+    const std::string zlib = "/v2/conans/zlib/1.0/_/_";
+    ASSERT_NE(server.get(zlib + "/latest").second.find("\"r1\""), std::string::npos);
+    ASSERT_EQ(proxy.requests(zlib + "/latest"), 1);
+    ASSERT_EQ(proxy.requests(zlib + "/revisions/r1/files/conanfile.py"), 1);
+    ASSERT_EQ(server.get(zlib + "/revisions/r1/files/conanfile.py"),
+              std::pair(200, std::string("recipe r1")));
+    ASSERT_EQ(server.get(zlib + "/latest").first, 200);
+    ASSERT_EQ(proxy.requests(zlib + "/latest"), 1);
+    ASSERT_EQ(proxy.requests(zlib + "/revisions/r1/files/conanfile.py"), 1);
+
+    // So does a miss on one of the files.
+    const std::string fmt = "/v2/conans/fmt/1.0/_/_/revisions/r2/files/";
+    ASSERT_EQ(server.get(fmt + "conanmanifest.txt"), std::pair(200, std::string("manifest r2")));
+    ASSERT_EQ(server.get(fmt + "conanfile.py"), std::pair(200, std::string("recipe r2")));
+    ASSERT_EQ(proxy.requests(fmt + "conanfile.py"), 1);
+    ASSERT_EQ(proxy.requests(fmt + "conanmanifest.txt"), 1);
+    ASSERT_TRUE(std::filesystem::is_empty(server.root() / "staging"));
+}
+
+TEST(Server, PullThroughCoalescesConcurrentMisses)
+{
+    TestServer upstream("coalesce-upstream");
+    upstream.publish_recipe("zlib/1.0/_/_", "r1");
+    CountingProxy proxy(upstream.port(), std::chrono::milliseconds(50));
+    TestServer    server("coalesce", "upstream=" + proxy.url() + "\n");
+
+    const std::string        base = "/v2/conans/zlib/1.0/_/_";
+    std::vector<std::thread> clients;
+    std::atomic<int>         found{0};
+    for (int i = 0; i < 8; ++i)
+    {
+        clients.emplace_back(
+            [&]
+            {
+                if (server.get(base + "/latest").second.find("\"r1\"") != std::string::npos)
+                {
+                    ++found;
+                }
+            });
+    }
+    for (auto& client : clients)
+    {
+        client.join();
+    }
+    ASSERT_EQ(found, 8);
+    ASSERT_EQ(proxy.requests(base + "/latest"), 1);
+    ASSERT_EQ(proxy.requests(base + "/revisions/r1/files/conanfile.py"), 1);
+    ASSERT_EQ(proxy.requests(base + "/revisions/r1/files/conanmanifest.txt"), 1);
+}
+
+TEST(Server, PullThroughFailureLeavesNoRevision)
+{
+    TestServer upstream("broken-upstream");
+    upstream.publish_recipe("zlib/1.0/_/_", "r1");
+    CountingProxy proxy(upstream.port());
+    TestServer    server("broken", "upstream=" + proxy.url() + "\n");
+
+    const std::string base = "/v2/conans/zlib/1.0/_/_";
+    proxy.fail("/conanmanifest.txt");
+    ASSERT_EQ(server.get(base + "/latest").first, 404);
+    ASSERT_EQ(server.get(base + "/revisions/r1/files/conanfile.py").first, 404);
+    ASSERT_FALSE(std::filesystem::exists(server.root() / "recipes" / "zlib"));
+    for (const auto* dir : {"staging", "incoming"})
+    {
+        std::error_code ec;
+        ASSERT_TRUE(std::filesystem::is_empty(server.root() / dir, ec) || ec) << dir;
+    }
+
+    // Nothing of the failed copy is remembered: the next miss fetches the revision afresh.
+    proxy.fail("");
+    ASSERT_NE(server.get(base + "/latest").second.find("\"r1\""), std::string::npos);
+    ASSERT_EQ(server.get(base + "/revisions/r1/files/conanmanifest.txt"),
+              std::pair(200, std::string("manifest r1")));
+}
+
+TEST(Server, ReplicatorTransfersOnlyWhatIsMissing)
+{
+    TestServer source("sync-source");
+    source.publish_recipe("zlib/1.0/_/_", "r1");
+    source.publish_recipe("fmt/1.0/_/_", "r2");
+
+    // The local store already holds the content of zlib r1, under another recipe.
+    TestServer local("sync-local");
+    local.publish_recipe("zlib-copy/1.0/_/_", "r1");
+    local.stop();
+
+    const auto first = sync_pass(source.port(), local.root());
+    ASSERT_EQ(first.first, 0) << first.second;
+    ASSERT_NE(first.second.find(
+                  ": 2 revisions, 3 files downloaded (29 bytes), 3 copied locally, 0 failed"),
+              std::string::npos)
+        << first.second;
+
+    const auto second = sync_pass(source.port(), local.root());
+    ASSERT_EQ(second.first, 0) << second.second;
+    ASSERT_NE(second.second.find(
+                  ": 0 revisions, 0 files downloaded (0 bytes), 0 copied locally, 0 failed"),
+              std::string::npos)
+        << second.second;
+
+    local.restart();
+    ASSERT_NE(local.get("/v2/conans/zlib/1.0/_/_/latest").second.find("\"r1\""),
+              std::string::npos);
+    ASSERT_EQ(local.get("/v2/conans/fmt/1.0/_/_/revisions/r2/files/conanmanifest.txt"),
+              std::pair(200, std::string("manifest r2")));
+}
+
+TEST(Server, ReplicatorLeavesMismatchedRevisionUnpublished)
+{
+    TestServer source("mismatch-source");
+    source.publish_recipe("zlib/1.0/_/_", "r1");
+    // Same size, different content than the checksum the source advertises.
+    std::ofstream(source.root() / "recipes" / "zlib" / "1.0" / "_" / "_" / "revisions" / "r1" /
+                  "files" / "conanfile.py",
+                  std::ios::binary | std::ios::trunc)
+        << "RECIPE r1";
+
+    TestServer local("mismatch-local");
+    local.stop();
+    const auto [code, summary] = sync_pass(source.port(), local.root());
+    ASSERT_EQ(code, 1) << summary;
+    ASSERT_NE(summary.find(" 1 failed"), std::string::npos) << summary;
+
+    local.restart();
+    ASSERT_EQ(local.get("/v2/conans/zlib/1.0/_/_/latest").first, 404);
+    ASSERT_EQ(local.get("/v2/conans/zlib/1.0/_/_/revisions/r1/files/conanmanifest.txt").first,
+              404);
+}
+
+TEST(Server, IndexFollowsUploadsAndDeletes)
+{
+    TestServer server("index");
+    server.publish_recipe("zlib/1.0/_/_", "r1");
+    server.publish_recipe("zlib/1.0/_/_", "r2");
+    server.publish_recipe("fmt/1.0/_/_", "r1");
+
+    const std::string zlib = "/v2/conans/zlib/1.0/_/_";
+    const auto        check = [&]
+    {
+        ASSERT_EQ(server.get("/v2/conans/search?q=zlib*"),
+                  std::pair(200, std::string(R"({"results":["zlib/1.0@_/_"]})")));
+        ASSERT_EQ(server.get("/v2/conans/search?q=*").second,
+                  R"({"results":["zlib/1.0@_/_"]})");
+        const auto revisions = server.get(zlib + "/revisions").second;
+        ASSERT_NE(revisions.find("\"r1\""), std::string::npos) << revisions;
+        ASSERT_EQ(revisions.find("\"r2\""), std::string::npos) << revisions;
+        ASSERT_NE(server.get(zlib + "/latest").second.find("\"r1\""), std::string::npos);
+        const auto recipes = server.get("/api/ui/recipes").second;
+        ASSERT_NE(recipes.find(R"("reference":"zlib/1.0@_/_")"), std::string::npos) << recipes;
+        ASSERT_NE(recipes.find(R"("revision_count":1)"), std::string::npos) << recipes;
+        ASSERT_EQ(recipes.find("fmt"), std::string::npos) << recipes;
+    };
+
+    ASSERT_EQ(server.get("/v2/conans/search?q=*").second,
+              R"({"results":["fmt/1.0@_/_","zlib/1.0@_/_"]})");
+    ASSERT_EQ(server.remove(zlib + "/revisions/r2"), 200);
+    ASSERT_EQ(server.remove("/v2/conans/fmt/1.0/_/_/revisions/r1"), 200);
+    check();
+
+    // The index rebuilt at startup matches the one updated in place.
+    server.restart();
+    check();
+}
+
+TEST(Server, DashboardPagesRecipesInBothOrders)
+{
+    TestServer server("dashboard");
+    for (const auto* ref : {"zlib/1.0/_/_", "fmt/1.0/_/_", "boost/1.0/_/_", "Zstd/1.0/_/_"})
+    {
+        server.publish_recipe(ref, "r1");
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    server.publish_recipe("zlib/1.0/_/_", "r2");
+
+    // Follows next_cursor from the first page to the last; one vector of references per page.
+    const auto pages = [&](const std::string& query)
+    {
+        std::vector<std::vector<std::string>> result;
+        std::string                           cursor;
+        do
+        {
+            std::string target = "/api/ui/recipes?limit=2" + query;
+            if (!cursor.empty())
+            {
+                target += "&cursor=";
+                for (const unsigned char c : cursor)
+                {
+                    constexpr char kHex[] = "0123456789ABCDEF";
+                    target += std::isalnum(c) != 0 ? std::string(1, static_cast<char>(c))
+                                                   : std::string{'%', kHex[c >> 4], kHex[c & 15]};
+                }
+            }
+            const auto [status, body] = server.get(target);
+            if (status != 200)
+            {
+                return std::vector<std::vector<std::string>>{{std::to_string(status)}};
+            }
+            auto& page = result.emplace_back();
+            for (auto at = body.find("\"reference\":\""); at != std::string::npos;
+                 at      = body.find("\"reference\":\"", at + 1))
+            {
+                const auto begin = at + 13;
+                page.push_back(body.substr(begin, body.find('"', begin) - begin));
+            }
+            const auto next = body.find("\"next_cursor\":\"");
+            cursor          = next == std::string::npos
+                                  ? std::string()
+                                  : body.substr(next + 15, body.find('"', next + 15) - next - 15);
+        } while (!cursor.empty() && result.size() < 10);
+        return result;
+    };
+    using Pages = std::vector<std::vector<std::string>>;
+    ASSERT_EQ(pages(""),
+              (Pages{{"boost/1.0@_/_", "fmt/1.0@_/_"}, {"zlib/1.0@_/_", "Zstd/1.0@_/_"}}));
+    ASSERT_EQ(pages("&sort=updated"),
+              (Pages{{"zlib/1.0@_/_", "Zstd/1.0@_/_"}, {"boost/1.0@_/_", "fmt/1.0@_/_"}}));
+
+    // q is a case-insensitive substring; glob characters in it are literal.
+    ASSERT_EQ(pages("&q=Z"), (Pages{{"zlib/1.0@_/_", "Zstd/1.0@_/_"}}));
+    ASSERT_EQ(pages("&q=S&sort=updated"), (Pages{{"Zstd/1.0@_/_", "boost/1.0@_/_"}}));
+    ASSERT_EQ(pages("&q=oo"), (Pages{{"boost/1.0@_/_"}}));
+    ASSERT_EQ(pages("&q=%3F"), (Pages{{}}));
+
+    const auto detail = server.get("/api/ui/recipes/zlib/1.0/_/_");
+    ASSERT_EQ(detail.first, 200);
+    const auto r2 = detail.second.find(R"("revision":"r2")");
+    const auto r1 = detail.second.find(R"("revision":"r1")");
+    ASSERT_NE(r2, std::string::npos) << detail.second;
+    ASSERT_NE(r1, std::string::npos) << detail.second;
+    ASSERT_LT(r2, r1) << detail.second;
+    ASSERT_NE(detail.second.find(R"("conanfile.py":9)"), std::string::npos) << detail.second;
+    ASSERT_EQ(server.get("/api/ui/recipes/nope/1.0/_/_").first, 404);
+}
+
+TEST(Server, FileDownloadsRevalidateAndResume)
+{
+    TestServer server("caching");
+    server.publish_recipe("zlib/1.0/_/_", "r1");
+    const std::string path = "/v2/conans/zlib/1.0/_/_/revisions/r1/files/conan_export.tgz";
+    const std::string etag = '"' + server::Sha256::hex("export r1") + '"';
+    auto              client = server.client();
+
+    const auto full = client.Get(path);
+    ASSERT_TRUE(full);
+    ASSERT_EQ(full->status, 200);
+    ASSERT_EQ(full->body, "export r1");
+    ASSERT_EQ(full->get_header_value("ETag"), etag);
+    ASSERT_EQ(full->get_header_value("Accept-Ranges"), "bytes");
+    const auto last_modified = full->get_header_value("Last-Modified");
+    ASSERT_FALSE(last_modified.empty());
+
+    const auto get = [&](const httplib::Headers& headers)
+    {
+        const auto result = client.Get(path, headers);
+        return result ? std::pair(result->status, result->body) : std::pair(0, std::string());
+    };
+    ASSERT_EQ(get({{"If-None-Match", etag}}), std::pair(304, std::string()));
+    ASSERT_EQ(get({{"If-None-Match", "\"other\", " + etag}}).first, 304);
+    ASSERT_EQ(get({{"If-None-Match", "\"other\""}}), std::pair(200, std::string("export r1")));
+    ASSERT_EQ(get({{"If-Modified-Since", last_modified}}).first, 304);
+
+    const auto partial = client.Get(path, {{"Range", "bytes=2-"}});
+    ASSERT_TRUE(partial);
+    ASSERT_EQ(partial->status, 206);
+    ASSERT_EQ(partial->body, "port r1");
+    ASSERT_EQ(partial->get_header_value("Content-Range"), "bytes 2-8/9");
+    ASSERT_EQ(get({{"Range", "bytes=2-"}, {"If-Range", etag}}),
+              std::pair(206, std::string("port r1")));
+    ASSERT_EQ(get({{"Range", "bytes=2-"}, {"If-Range", last_modified}}).first, 206);
+    // A validator that no longer matches turns the range request into a full download.
+    ASSERT_EQ(get({{"Range", "bytes=2-"}, {"If-Range", "\"stale\""}}),
+              std::pair(200, std::string("export r1")));
+    ASSERT_EQ(get({{"Range", "bytes=20-"}}).first, 416);
+}
+
+TEST(Server, LatestRevisionSurvivesRestart)
+{
+    TestServer        server("latest");
+    const std::string base     = "/v2/conans/zlib/1.0/_/_";
+    const std::string packages = base + "/revisions/r2/packages/abc";
+    const auto        put_package_file =
+        [&](const std::string& revision, const std::string& file)
+    {
+        const auto result = server.client().Put(
+            packages + "/revisions/" + revision + "/files/" + file, revision, "text/plain");
+        ASSERT_TRUE(result);
+        ASSERT_EQ(result->status, 200);
+    };
+    // Revision times have millisecond resolution; keep them distinct.
+    for (const auto* revision : {"r2", "r1", "r3"})
+    {
+        server.publish_recipe("zlib/1.0/_/_", revision);
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    for (const auto* revision : {"p3", "p1", "p2"})
+    {
+        put_package_file(revision, "conan_package.tgz");
+        put_package_file(revision, "conaninfo.txt");
+        put_package_file(revision, "conanmanifest.txt");
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    ASSERT_EQ(server.remove(packages + "/revisions/p2"), 200);
+    ASSERT_EQ(server.remove(base + "/revisions/r3"), 200);
+
+    const auto check = [&]
+    {
+        // Deleting the newest revision falls back to the next newest by upload time, not name.
+        ASSERT_NE(server.get(base + "/latest").second.find("\"r1\""), std::string::npos);
+        const auto revisions = server.get(base + "/revisions").second;
+        const auto r1        = revisions.find("\"r1\"");
+        ASSERT_NE(r1, std::string::npos) << revisions;
+        ASSERT_LT(r1, revisions.find("\"r2\"")) << revisions;
+        ASSERT_EQ(revisions.find("\"r3\""), std::string::npos) << revisions;
+        ASSERT_NE(server.get(packages + "/latest").second.find("\"p1\""), std::string::npos);
+    };
+    check();
+    server.restart();
+    check();
+}
+
+TEST(Server, RetentionKeepsNewestRevisionsAcrossRestarts)
+{
+    TestServer server("retention",
+                      "keep_recipe_revisions=1\npackage_revision_max_age_days=30\n");
+    const std::string base     = "/v2/conans/zlib/1.0/_/_";
+    const std::string packages = base + "/revisions/r2/packages/abc/revisions";
+    // Revision times have millisecond resolution; keep them distinct.
+    for (const auto* revision : {"r1", "r2"})
+    {
+        server.publish_recipe("zlib/1.0/_/_", revision);
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    server.publish_package("zlib/1.0/_/_", "r1", "abc", "p0", "[settings]\n");
+    for (const auto* revision : {"p1", "p2", "p3"})
+    {
+        server.publish_package("zlib/1.0/_/_", "r2", "abc", revision, "[settings]\n");
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    // Retention ran when the store was still empty; back-date p1 and p2 past the age limit and
+    // let the next start apply it. p3 is the latest and is kept however old it is.
+    server.stop();
+    {
+        server::MetadataLog                   log;
+        std::vector<std::vector<std::string>> records;
+        ASSERT_TRUE(log.open(server.root() / "metadata.log",
+                             [&](const auto& record) { records.push_back(record); }));
+        for (auto& record : records)
+        {
+            // prev and ppub records: kind, reference, rrev, package id, prev, time, ...
+            if ((record[0] == "prev" || record[0] == "ppub") && record.size() >= 9 &&
+                record[7] != "p3")
+            {
+                record[8] = "2000-01-01T00:00:00.000+0000";
+            }
+        }
+        ASSERT_TRUE(log.rewrite(
+            [&](const auto& emit)
+            {
+                for (const auto& record : records)
+                {
+                    emit(record);
+                }
+            }));
+    }
+    server.restart();
+
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (server.get(base + "/revisions").second.find("\"r1\"") != std::string::npos &&
+           std::chrono::steady_clock::now() < deadline)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    const auto check = [&]
+    {
+        const auto recipes = server.get(base + "/revisions").second;
+        ASSERT_NE(recipes.find("\"r2\""), std::string::npos) << recipes;
+        ASSERT_EQ(recipes.find("\"r1\""), std::string::npos) << recipes;
+        ASSERT_EQ(server.get(base + "/revisions/r1/files/conanfile.py").first, 404);
+        const auto revisions = server.get(packages).second;
+        ASSERT_NE(revisions.find("\"p3\""), std::string::npos) << revisions;
+        ASSERT_EQ(revisions.find("\"p1\""), std::string::npos) << revisions;
+        ASSERT_EQ(revisions.find("\"p2\""), std::string::npos) << revisions;
+        ASSERT_EQ(server.get(packages + "/p1/files/conaninfo.txt").first, 404);
+        ASSERT_EQ(server.get(packages + "/p3/files/conaninfo.txt").first, 200);
+    };
+    check();
+    server.restart();
+    check();
+}
+
+TEST(Server, SaturatedUploadsAnswer503)
+{
+    TestServer        server("busy", "max_concurrent_uploads=1\n");
+    const std::string base = "/v2/conans/zlib/1.0/_/_";
+
+    // An upload whose body stalls halfway holds the only upload slot until released.
+    std::promise<void> started;
+    std::promise<void> release;
+    auto               in_flight = started.get_future();
+    const auto         released  = release.get_future().share();
+    int                held      = 0;
+    std::thread        upload(
+        [&]
+        {
+            const std::string body   = "recipe";
+            const auto        result = server.client().Put(
+                base + "/revisions/r1/files/conanfile.py",
+                {},
+                body.size(),
+                [&](std::size_t offset, std::size_t, httplib::DataSink& sink)
+                {
+                    if (offset == 0)
+                    {
+                        started.set_value();
+                    }
+                    else
+                    {
+                        released.wait();
+                    }
+                    return sink.write(body.data() + offset, 3);
+                },
+                "application/octet-stream");
+            held = result ? result->status : 0;
+        });
+
+    in_flight.wait();
+
+    std::pair<int, std::string> busy;
+    std::string                 connection;
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (busy.first != 503 && std::chrono::steady_clock::now() < deadline)
+    {
+        const auto result = server.client().Put(
+            base + "/revisions/r1/files/conan_export.tgz", "export", "application/octet-stream");
+        if (result)
+        {
+            busy       = {result->status, result->get_header_value("Retry-After")};
+            connection = result->get_header_value("Connection");
+        }
+    }
+    // Reads are limited separately and keep being served.
+    const int read = server.get(base + "/revisions").first;
+    release.set_value();
+    upload.join();
+
+    ASSERT_EQ(busy.first, 503);
+    ASSERT_FALSE(busy.second.empty());
+    // The unread body must not be taken for the next request on the connection.
+    ASSERT_EQ(connection, "close");
+    ASSERT_EQ(read, 200);
+    ASSERT_EQ(held, 200);
+    // The slot is free again once the upload finished.
+    ASSERT_EQ(server.put_recipe_file("zlib/1.0/_/_", "r1", "conanmanifest.txt", "manifest"), 200);
+}
+
+TEST(Server, AbortedUploadLeavesNoRequestInFlight)
+{
+    // One worker, so the next request is handled where the aborted one left its bookkeeping.
+    TestServer        server("aborted", "worker_threads=1\n");
+    const std::string body   = "recipe r1";
+    const auto        result = server.client().Put(
+        "/v2/conans/zlib/1.0/_/_/revisions/r1/files/conanfile.py",
+        {},
+        body.size(),
+        [&](std::size_t offset, std::size_t, httplib::DataSink& sink)
+        { return offset == 0 && sink.write(body.data(), 3); },
+        "application/octet-stream");
+    ASSERT_FALSE(result && result->status == 200);
+
+    // The scrape itself is the only request in flight.
+    const auto metrics = server.get("/metrics").second;
+    ASSERT_NE(metrics.find("leafserver_requests_in_flight 1\n"), std::string::npos) << metrics;
+}
+
+TEST(Server, SummaryCountersFollowUploadsDeletesAndRestarts)
+{
+    TestServer server("summary");
+    server.publish_recipe("zlib/1.0/_/_", "r1");
+    server.publish_recipe("zlib/1.0/_/_", "r2");
+    server.publish_recipe("fmt/1.0/_/_", "r1");
+    for (const auto* file : {"conan_package.tgz", "conaninfo.txt", "conanmanifest.txt"})
+    {
+        const auto result = server.client().Put(
+            "/v2/conans/zlib/1.0/_/_/revisions/r2/packages/abc/revisions/p1/files/" +
+                std::string(file),
+            "p1",
+            "application/octet-stream");
+        ASSERT_TRUE(result);
+        ASSERT_EQ(result->status, 200);
+    }
+
+    // The counters, up to and including the stored bytes.
+    const auto counters = [&]
+    {
+        const auto summary = server.get("/api/ui/summary").second;
+        return summary.substr(0, summary.find(",\"disk_bytes\""));
+    };
+    ASSERT_EQ(counters(),
+              R"({"recipes":2,"recipe_revisions":3,"packages":1,"package_revisions":1,"bytes":93)");
+
+    ASSERT_EQ(server.remove("/v2/conans/fmt/1.0/_/_/revisions/r1"), 200);
+    const std::string after_delete =
+        R"({"recipes":1,"recipe_revisions":2,"packages":1,"package_revisions":1,"bytes":64)";
+    ASSERT_EQ(counters(), after_delete);
+
+    server.restart();
+    ASSERT_EQ(counters(), after_delete);
+
+    // Without metadata.log the counters are rebuilt from the stored tree.
+    server.stop();
+    std::filesystem::remove(server.root() / "metadata.log");
+    server.restart();
+    ASSERT_EQ(counters(), after_delete);
+}
+
+TEST(Server, DedupStoresIdenticalFilesOnce)
+{
+    TestServer server("dedup", "dedup=true\n");
+    for (const auto* revision : {"r1", "r2"})
+    {
+        ASSERT_EQ(server.put_recipe_file("zlib/1.0/_/_", revision, "conan_sources.tgz", "sources"),
+                  200);
+        server.publish_recipe("zlib/1.0/_/_", revision);
+    }
+
+    // Blobs in the store holding content, and how many names link to each.
+    const auto blobs = [&](const std::string& content)
+    {
+        std::vector<std::uintmax_t> links;
+        for (const auto& entry :
+             std::filesystem::recursive_directory_iterator(server.root() / "blobs"))
+        {
+            if (!entry.is_regular_file())
+            {
+                continue;
+            }
+            std::ifstream in(entry.path(), std::ios::binary);
+            if (std::string(std::istreambuf_iterator<char>(in), {}) == content)
+            {
+                links.push_back(std::filesystem::hard_link_count(entry.path()));
+            }
+        }
+        return links;
+    };
+    const auto dedup = [&]
+    {
+        const auto summary = server.get("/api/ui/summary").second;
+        return summary.substr(summary.find("\"dedup\":"));
+    };
+    ASSERT_EQ(blobs("sources"), std::vector<std::uintmax_t>{3});
+    ASSERT_EQ(dedup(),
+              R"("dedup":{"enabled":true,"blobs":7,"stored_bytes":65,"logical_bytes":72,)"
+              R"("saved_bytes":7,"ratio":1.11}})");
+    const auto metrics = server.get("/metrics").second;
+    ASSERT_NE(metrics.find("leafserver_blobs 7\n"), std::string::npos) << metrics;
+    ASSERT_NE(metrics.find("leafserver_blob_stored_bytes 65\n"), std::string::npos) << metrics;
+
+    // Waits for the garbage collector to give back the blobs of deleted revisions.
+    const auto settled = [&](const std::string& expected)
+    {
+        const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(15);
+        while (dedup() != expected && std::chrono::steady_clock::now() < deadline)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+        return dedup();
+    };
+    const std::string one_revision =
+        R"("dedup":{"enabled":true,"blobs":4,"stored_bytes":36,"logical_bytes":36,)"
+        R"("saved_bytes":0,"ratio":1.00}})";
+    ASSERT_EQ(server.remove("/v2/conans/zlib/1.0/_/_/revisions/r1"), 200);
+    ASSERT_EQ(settled(one_revision), one_revision);
+    ASSERT_EQ(blobs("sources"), std::vector<std::uintmax_t>{2});
+    ASSERT_EQ(server.get("/v2/conans/zlib/1.0/_/_/revisions/r2/files/conan_sources.tgz"),
+              std::pair(200, std::string("sources")));
+
+    const std::string empty =
+        R"("dedup":{"enabled":true,"blobs":0,"stored_bytes":0,"logical_bytes":0,)"
+        R"("saved_bytes":0,"ratio":1.00}})";
+    ASSERT_EQ(server.remove("/v2/conans/zlib/1.0/_/_/revisions/r2"), 200);
+    ASSERT_EQ(settled(empty), empty);
+    ASSERT_TRUE(blobs("sources").empty());
+}
+
+TEST(Server, ProbeAndChecksumDeploySkipKnownContent)
+{
+    TestServer server("probe");
+    server.publish_recipe("zlib/1.0/_/_", "r1");
+    const auto held    = server::Sha256::hex("export r1");
+    const auto missing = server::Sha256::hex("not uploaded");
+
+    // The probe echoes the digests the store holds; CRLF and malformed lines are tolerated.
+    const auto probe = server.client().Post(
+        "/api/sync/probe", held + "\r\n" + missing + "\nshort\n", "text/plain");
+    ASSERT_TRUE(probe);
+    ASSERT_EQ(probe->status, 200);
+    ASSERT_EQ(probe->body, held + "\n");
+    const auto anonymous = httplib::Client("127.0.0.1", server.port()).Post(
+        "/api/sync/probe", held + "\n", "text/plain");
+    ASSERT_TRUE(anonymous);
+    ASSERT_EQ(anonymous->status, 401);
+
+    // A deploy names content by digest instead of sending it.
+    const std::string files  = "/v2/conans/fmt/1.0/_/_/revisions/r1/files/";
+    const auto        deploy = [&](const std::string& file, const std::string& sha256)
+    {
+        const auto result = server.client().Put(
+            files + file,
+            {{"X-Checksum-Deploy", "true"}, {"X-Checksum-Sha256", sha256}},
+            "",
+            "application/octet-stream");
+        return result ? result->status : 0;
+    };
+    ASSERT_EQ(deploy("conan_export.tgz", held), 200);
+    // An unknown digest is refused, so the client sends the body after all.
+    ASSERT_EQ(deploy("conan_sources.tgz", missing), 404);
+    // A full upload with a digest is only stored when its body has that digest.
+    const auto upload = [&](const std::string& file, const std::string& body)
+    {
+        const auto result = server.client().Put(files + file,
+                                                {{"X-Checksum-Sha256", missing}},
+                                                body,
+                                                "application/octet-stream");
+        return result ? result->status : 0;
+    };
+    ASSERT_EQ(upload("conan_sources.tgz", "not upload"), 400);
+    ASSERT_EQ(upload("conandata.yml", "not uploaded"), 200);
+    ASSERT_EQ(server.put_recipe_file("fmt/1.0/_/_", "r1", "conanfile.py", "recipe"), 200);
+    ASSERT_EQ(server.put_recipe_file("fmt/1.0/_/_", "r1", "conanmanifest.txt", "manifest"), 200);
+
+    ASSERT_EQ(server.get(files + "conan_export.tgz"), std::pair(200, std::string("export r1")));
+    ASSERT_EQ(server.get(files + "conandata.yml"), std::pair(200, std::string("not uploaded")));
+    ASSERT_EQ(server.get(files + "conan_sources.tgz").first, 404);
+    const auto listing = server.get("/v2/conans/fmt/1.0/_/_/revisions/r1/files").second;
+    ASSERT_EQ(listing.find("conan_sources.tgz"), std::string::npos) << listing;
+}
+
+TEST(Server, ClosureResolvesSemverRangesForTheProfile)
+{
+    TestServer server("closure");
+    server.publish_recipe("app/1.0/_/_", "r1");
+    const auto app_info = [](const std::string& os, const std::string& shared)
+    {
+        return "[settings]\nos=" + os + "\n[options]\nshared=" + shared +
+               "\n[requires]\nzlib/1.Y.Z\nmissing/1.0\n";
+    };
+    server.publish_package("app/1.0/_/_", "r1", "linux", "p1", app_info("Linux", "False"));
+    server.publish_package("app/1.0/_/_", "r1", "linux-shared", "p1", app_info("Linux", "True"));
+    server.publish_package("app/1.0/_/_", "r1", "windows", "p1", app_info("Windows", "True"));
+    // 1.10.0 is the newest 1.x; 2.0.0 is out of the range.
+    for (const auto* version : {"1.3.0", "1.10.0", "2.0.0"})
+    {
+        const auto ref = "zlib/" + std::string(version) + "/_/_";
+        server.publish_recipe(ref, "r1");
+        for (const auto* os : {"Linux", "Windows"})
+        {
+            server.publish_package(ref,
+                                   "r1",
+                                   os == std::string("Linux") ? "zlin" : "zwin",
+                                   "p1",
+                                   "[settings]\nos=" + std::string(os) +
+                                       "\n[options]\nshared=False\n");
+        }
+    }
+
+    const auto closure = [&](const std::string& request)
+    {
+        const auto result = server.client().Post("/api/closure", request, "application/json");
+        return result && result->status == 200 ? result->body : std::string();
+    };
+    const auto has = [](const std::string& body, const std::string& text)
+    { return body.find(text) != std::string::npos; };
+
+    // Plain options only apply to the roots, so zlib's shared=False does not rule it out.
+    const auto for_linux = closure(R"({"requires":["app/1.0"],"settings":{"os":"Linux"},)"
+                                   R"("options":{"shared":"True"}})");
+    ASSERT_TRUE(has(for_linux, R"({"reference":"app/1.0@_/_","revision":"r1",)")) << for_linux;
+    ASSERT_TRUE(has(for_linux, R"("package_id":"linux-shared","package_revision":"p1")"))
+        << for_linux;
+    ASSERT_TRUE(has(for_linux, R"({"reference":"zlib/1.10.0@_/_","revision":"r1",)"))
+        << for_linux;
+    ASSERT_TRUE(has(for_linux, R"("package_id":"zlin")")) << for_linux;
+    ASSERT_TRUE(has(for_linux,
+                    "/v2/conans/zlib/1.10.0/_/_/revisions/r1/packages/zlin/revisions/p1/files/"
+                    "conan_package.tgz"))
+        << for_linux;
+    ASSERT_FALSE(has(for_linux, "zlib/1.3.0") || has(for_linux, "zlib/2.0.0")) << for_linux;
+    ASSERT_TRUE(has(for_linux,
+                    R"("missing":[{"requirement":"missing/1.0",)"
+                    R"("reason":"no matching recipe revision"}])"))
+        << for_linux;
+
+    const auto for_windows =
+        closure(R"({"requires":["app/1.0"],"settings":{"os":"Windows"}})");
+    ASSERT_TRUE(has(for_windows, R"("package_id":"windows")")) << for_windows;
+    ASSERT_TRUE(has(for_windows, R"("package_id":"zwin")")) << for_windows;
+
+    // Without a package for the profile the root is reported and its requires are not walked.
+    const auto for_macos = closure(R"({"requires":["app/1.0"],"settings":{"os":"Macos"}})");
+    ASSERT_TRUE(has(for_macos,
+                    R"("missing":[{"requirement":"app/1.0",)"
+                    R"("reason":"no package matching the profile"}])"))
+        << for_macos;
+    ASSERT_FALSE(has(for_macos, "zlib")) << for_macos;
+}
+
+TEST(Server, BundleBytesMatchTheirETag)
+{
+    TestServer server("bundle");
+    server.publish_recipe("zlib/1.0/_/_", "r1");
+    const std::string path = "/api/bundle/zlib/1.0/_/_/revisions/r1";
+    auto              client = server.client();
+
+    const auto first = client.Get(path);
+    ASSERT_TRUE(first);
+    ASSERT_EQ(first->status, 200);
+    // Tar headers carry whole seconds; a later download must not differ in them.
+    std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+    const auto second = client.Get(path);
+    ASSERT_TRUE(second);
+    ASSERT_EQ(second->get_header_value("ETag"), first->get_header_value("ETag"));
+    ASSERT_EQ(second->body, first->body);
+}
+
+#ifndef _WIN32
+TEST(Server, PrefetchedRevisionsAreServedByStart)
+{
+    // `leaf server` keeps its store under the user config home; point that at a scratch folder.
+    const auto home = std::filesystem::temp_directory_path() / "leafserver-config-home";
+    std::filesystem::remove_all(home);
+    setenv("XDG_CONFIG_HOME", home.c_str(), 1);
+
+    class ServerCommand : public Leaf::CLI
+    {
+      public:
+        explicit ServerCommand(std::vector<std::string> args) : Leaf::CLI(std::move(args))
+        {
+        }
+        using Leaf::CLI::serverArgs;
+    };
+
+    TestServer remote("prefetch-remote");
+    remote.publish_recipe("zlib/1.0/_/_", "r1");
+    remote.publish_package("zlib/1.0/_/_", "r1", "abc", "p1", "[settings]\n");
+    ServerCommand prefetch({"leaf",
+                            "server",
+                            "prefetch",
+                            "zlib/1.0",
+                            "--from",
+                            "http://127.0.0.1:" + std::to_string(remote.port())});
+    ASSERT_EQ(prefetch.exec(), 0);
+
+    // What `leaf server start` runs the server with; run() itself would block.
+    ServerCommand    start({"leaf", "server", "start", "--port", "0"});
+    server::Instance local(start.serverArgs());
+    ASSERT_NE(local.port(), 0);
+    httplib::Client client("127.0.0.1", local.port());
+    const auto      latest = client.Get("/v2/conans/zlib/1.0/_/_/latest");
+    ASSERT_TRUE(latest);
+    ASSERT_EQ(latest->status, 200);
+    ASSERT_NE(latest->body.find("\"r1\""), std::string::npos);
+    const auto package =
+        client.Get("/v2/conans/zlib/1.0/_/_/revisions/r1/packages/abc/revisions/p1/files/"
+                   "conaninfo.txt");
+    ASSERT_TRUE(package);
+    ASSERT_EQ(package->status, 200);
+
+    local.stop();
+    unsetenv("XDG_CONFIG_HOME");
+    std::filesystem::remove_all(home);
+}
+#endif
+
+TEST(Server, MetricsLabelRequestsByTheirRoute)
+{
+    TestServer server("labels");
+    server.publish_recipe("zlib/1.0/_/_", "r1");
+    const std::string base = "/v2/conans/zlib/1.0/_/_";
+    ASSERT_EQ(server.get(base + "/latest").first, 200);
+    ASSERT_EQ(server.get(base + "/revisions/r1/files/conanfile.py").first, 200);
+    ASSERT_EQ(server.get(base + "/revisions/r1/unknown").first, 404);
+    ASSERT_EQ(server.get("/v2/ping").first, 200);
+
+    const auto text = server.get("/metrics").second;
+    for (const auto* route :
+         {"recipe_file_put", "recipe_latest", "recipe_file_get", "other", "ping"})
+    {
+        ASSERT_NE(text.find("leafserver_requests_total{route=\"" + std::string(route) + "\""),
+                  std::string::npos)
+            << route;
+    }
+}
+
 //--------------Profile Gen-----------
 
 TEST(CMakeToConanProfile, Generation)